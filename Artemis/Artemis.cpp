@@ -3,24 +3,223 @@
 #include <fstream>
 #include "parser.h"
 #include "codegen.h"
+#include "options.h"
+#include "inliner.h"
+#include "unroll.h"
+#include "dce.h"
+#include "cse.h"
+#include "globals.h"
+#include "profile.h"
+#include "layout.h"
+#include "generics.h"
+#include "trace.h"
+#include "assembler.h"
+#include "elf.h"
+#include "jit.h"
+#include <format>
+#include <algorithm>
 
-int main(int argc, char* argv[])
+static void optimize(std::shared_ptr<AST>& ast, const CompilerOptions& options, Profile& profile)
 {
-    std::string source;
-    if (argc > 1) {
-        std::ifstream file(argv[1]);
-        
-        std::string line;
+    GlobalOptimizer global_optimizer(ast, options);         // Before inlining, so inlined copies see the propagated values
+    global_optimizer.run();
+    Inliner inliner(ast, options, &profile);
+    inliner.run();
+    LoopUnroller loop_unroller(ast, options, &profile);
+    loop_unroller.run();
+    DeadCodeEliminator dead_code_eliminator(ast, options);
+    dead_code_eliminator.run();
+    CommonSubexpressionEliminator common_subexpression_eliminator(ast, options);
+    common_subexpression_eliminator.run();
+}
 
-        while (getline(file, line))
-            source += line + '\n';
-        source.pop_back();
-        file.close();
+// Compiles source straight into the session. Functions and globals the session holds already are only declared,
+// so source may repeat the declarations of earlier inputs. Error lines count from the end of line first_line.
+static bool compile_into(JitSession& session, const std::string& source, int first_line, const std::string& file_name, const CompilerOptions& options)
+{
+    ErrorHandler error_handler(source);
+    Lexer lexer(source, &error_handler);
+    lexer.analyze();
+    std::shared_ptr<AST> ast;
+    if (!error_handler.has_error()) {
+        Parser parser(lexer.out, &error_handler);
+        ast = parser.parse();
     }
-    else {
+    if (!error_handler.has_error()) {
+        Monomorphizer monomorphizer(ast, &error_handler);
+        monomorphizer.run();
+    }
+    Profile profile;
+    if (!error_handler.has_error() && !options.profile_use.empty()) {
+        number_profile_sites(ast);
+        if (!profile.load(options.profile_use))
+            error_handler.report_error("Could not read profile " + options.profile_use, Token());
+    }
+    if (!error_handler.has_error()) {
+        optimize(ast, options, profile);
+        CodeGenerator code_gen(ast, &error_handler, options, &profile);
+        code_gen.source_file = file_name;
+        for (auto& [name, address] : session.symbols)
+            code_gen.imported.insert(name);
+        code_gen.generate_asm();
+        if (!error_handler.has_error()) {
+            Assembler assembler(&error_handler);
+            ObjectFile object = assembler.assemble(code_gen.assembly_out);
+            std::string error;
+            if (!error_handler.has_error() && !session.load(object, error))
+                error_handler.report_error(error, Token());
+        }
+    }
+    for (Error& error : error_handler.errors) {
+        if (error.token.line > first_line)
+            error.token.line -= first_line;
+    }
+    error_handler.output_errors();
+    return !error_handler.has_error();
+}
+
+static bool read_input(std::string& input)                  // Reads lines until the braces balance, false at the end of input
+{
+    input = "";
+    int depth = 0;
+    std::string line;
+    std::cout << "> ";
+    while (std::getline(std::cin, line)) {
+        input += line + '\n';
+        bool in_string = false;
+        for (size_t i = 0; i < line.size(); i++) {
+            if (in_string && line[i] == '\\')
+                i++;
+            else if (line[i] == '"')
+                in_string = !in_string;
+            else if (!in_string && line[i] == '{')
+                depth++;
+            else if (!in_string && line[i] == '}')
+                depth--;
+        }
+        if (depth > 0) {
+            std::cout << "... ";
+            continue;
+        }
+        if (input.find_first_not_of(" \t\n") != std::string::npos)
+            return true;
+        input = "";
         std::cout << "> ";
-        std::getline(std::cin, source);
     }
+    return false;
+}
+
+// Declarations are kept and every later input is compiled after them, expressions are evaluated and printed and
+// other statements are run, both from a function of their own. What each input defines is linked into memory
+// that stays valid for the whole session.
+static int run_repl(CompilerOptions options)
+{
+    options.incremental = true;
+    JitSession session;
+    std::string declarations = "";
+    int declaration_lines = 0;
+    int entries = 0;
+    std::string input;
+    while (read_input(input)) {
+        size_t word_end = input.find_first_of(" \t\n({;<", input.find_first_not_of(" \t\n"));
+        std::string first_word = input.substr(input.find_first_not_of(" \t\n"), word_end - input.find_first_not_of(" \t\n"));
+        const std::vector<std::string> declaration_keywords = { "fn", "extern", "let", "const", "struct" };
+        const std::vector<std::string> statement_keywords = { "return", "if", "while", "do", "for", "break", "continue", "match", "asm" };
+        bool is_declaration = std::find(declaration_keywords.begin(), declaration_keywords.end(), first_word) != declaration_keywords.end();
+        bool is_expression = !is_declaration && first_word[0] != '{'
+            && std::find(statement_keywords.begin(), statement_keywords.end(), first_word) == statement_keywords.end();
+
+        std::string entry = std::format("_repl{0}", entries++);
+        std::string source = declarations + input;
+        int first_line = declaration_lines;
+        if (is_expression) {
+            std::string expression = input.substr(0, input.find_last_not_of(" \t\n;") + 1);
+            source = declarations + std::format("fn {0}() -> isize {{\nreturn {1};\n}}\n", entry, expression);
+            first_line++;
+        }
+        else if (!is_declaration) {
+            source = declarations + std::format("fn {0}() {{\n{1}}}\n", entry, input);
+            first_line++;
+        }
+        if (!compile_into(session, source, first_line, "", options))
+            continue;
+
+        if (is_declaration) {
+            declarations += input;
+            declaration_lines += (int)std::count(input.begin(), input.end(), '\n');
+            continue;
+        }
+        long long result = ((long long (*)())session.address(entry))();
+        if (is_expression)
+            std::cout << result << '\n';
+    }
+    std::cout << '\n';
+    return 0;
+}
+
+static int run_file(const std::string& source, const std::string& file_name, const CompilerOptions& options)
+{
+    JitSession session;
+    if (!compile_into(session, source, 0, file_name, options))
+        return 1;
+    void* entry = session.address("main");
+    if (!entry) {
+        std::cout << "No main function in " << file_name << '\n';
+        return 1;
+    }
+    return (int)((long long (*)())entry)();                 // Its result is the exit code, as if the program ran on its own
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc >= 3 && std::string(argv[1]) == "--trace-json") {  // Artemis --trace-json trace.bin [trace.json]
+        std::ofstream json_file;
+        if (argc >= 4)
+            json_file.open(argv[3]);
+        if (!trace_to_json(argv[2], argc >= 4 ? json_file : std::cout)) {
+            std::cout << "Could not read trace " << argv[2] << '\n';
+            return 1;
+        }
+        return 0;
+    }
+
+    CompilerOptions options;
+    std::string file_name;
+    for (int i = 1; i < argc; i++) {
+        std::string argument = argv[i];
+        if (options.parse_argument(argument)) {
+            if (!options.invalid_option.empty()) {
+                std::cout << "Invalid value for option " << options.invalid_option << '\n';
+                return 1;
+            }
+            continue;
+        }
+        if (argument.size() > 1 && argument[0] == '-') {
+            std::cout << "Unknown option " << argument << '\n';
+            return 1;
+        }
+        file_name = argument;
+    }
+    if (!options.profile_generate.empty())
+        options.instrument_for_profile();
+    if ((options.run || file_name.empty()) && (!options.profile_generate.empty() || !options.trace.empty())) {
+        std::cout << "-fprofile-generate and -ftrace write their results when a linked program exits, they can't be used with the JIT\n";
+        return 1;
+    }
+    if (file_name.empty())
+        return run_repl(options);
+
+    std::string source;
+    std::ifstream file(file_name);
+    std::string line;
+
+    while (getline(file, line))
+        source += line + '\n';
+    source.pop_back();
+    file.close();
+    if (options.run)
+        return run_file(source, file_name, options);
+
     ErrorHandler error_handler(source);
     Lexer lexer(source, &error_handler);
     lexer.analyze();
@@ -39,17 +238,53 @@ int main(int argc, char* argv[])
             error_handler.output_errors();
         }
         else {
+            Monomorphizer monomorphizer(ast, &error_handler);   // Before anything else, the passes only know concrete functions
+            monomorphizer.run();
+            if (error_handler.has_error()) {
+                error_handler.output_errors();
+                return 1;
+            }
             //parser.print_ast();
-            CodeGenerator code_gen(ast, &error_handler);
+            if (options.dump_record_layouts) {
+                for (std::shared_ptr<Statement>& stmt : ast->statements) {
+                    if (stmt && stmt->type == STRUCT_DECL)
+                        std::cout << describe_layout(*std::dynamic_pointer_cast<StructDeclaration>(stmt));
+                }
+            }
+            number_profile_sites(ast);
+            Profile profile;
+            if (!options.profile_use.empty() && !profile.load(options.profile_use)) {
+                std::cout << "Could not read profile " << options.profile_use << '\n';
+                return 1;
+            }
+
+            optimize(ast, options, profile);
+
+            CodeGenerator code_gen(ast, &error_handler, options, &profile);
+            code_gen.source_file = file_name;
             code_gen.generate_asm();
             if (error_handler.has_error()) {
                 error_handler.output_errors();
             }
+            else if (options.emit_object) {
+                Assembler assembler(&error_handler);            // Straight from the generated text to machine code, no .s file in between
+                ObjectFile object = assembler.assemble(code_gen.assembly_out);
+                if (error_handler.has_error()) {
+                    error_handler.output_errors();
+                    return 1;
+                }
+                if (!file_name.empty()) {
+                    std::ofstream file(file_name + ".o", std::ios::binary);
+
+                    file << elf_object(object);
+                    file.close();
+                }
+            }
             else {
                 std::cout << code_gen.assembly_out;
 
-                if (argc > 1) {
-                    std::ofstream file(std::string(argv[1]) + ".s");
+                if (!file_name.empty()) {
+                    std::ofstream file(file_name + ".s");
 
                     file << code_gen.assembly_out;
                     file.close();
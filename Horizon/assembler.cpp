@@ -0,0 +1,1065 @@
+#include "pch.h"
+#include "assembler.h"
+#include <format>
+#include <sstream>
+
+static std::string trim(const std::string& text) {
+	size_t start = text.find_first_not_of(" \t\r");
+	if (start == std::string::npos)
+		return "";
+	size_t end = text.find_last_not_of(" \t\r");
+	return text.substr(start, end - start + 1);
+}
+
+static std::vector<std::string> split_arguments(const std::string& text) {		// At commas outside of parentheses and strings
+	std::vector<std::string> arguments;
+	std::string current;
+	int depth = 0;
+	bool quoted = false;
+	for (size_t i = 0; i < text.size(); i++) {
+		char character = text[i];
+		if (quoted && character == '\\' && i + 1 < text.size()) {
+			current += character;
+			current += text[++i];
+			continue;
+		}
+		if (character == '"')
+			quoted = !quoted;
+		else if (!quoted && character == '(')
+			depth++;
+		else if (!quoted && character == ')')
+			depth--;
+		else if (!quoted && depth == 0 && character == ',') {
+			arguments.push_back(trim(current));
+			current.clear();
+			continue;
+		}
+		current += character;
+	}
+	if (!trim(current).empty() || !arguments.empty())
+		arguments.push_back(trim(current));
+	return arguments;
+}
+
+static bool is_symbol_start(char character) { return isalpha((unsigned char)character) || character == '_' || character == '.' || character == '$'; }
+static bool is_symbol_character(char character) { return isalnum((unsigned char)character) || character == '_' || character == '.' || character == '$'; }
+
+ObjectFile Assembler::assemble(const std::string& assembly) {
+	switch_section(".text");
+	std::istringstream input(assembly);
+	std::string line;
+	while (std::getline(input, line)) {
+		line_number++;
+		parse_line(line);
+	}
+	if (in_frame)
+		make_error("Missing .cfi_endproc");
+	for (const LocalReference& reference : forward_references) {
+		if (symbols[reference.label].section < 0) {
+			line_number = reference.line;
+			statement_text = reference.statement;
+			make_error("No local label follows the forward reference");
+		}
+	}
+	if (error_handler->has_error())
+		return object;
+	for (Section& section : sections)
+		layout(section);
+	build_object();
+	return object;
+}
+
+// PARSING
+
+void Assembler::parse_line(const std::string& line) {							// Statements end at ; and comments start at #, both outside of strings
+	std::string statement;
+	bool quoted = false;
+	for (size_t i = 0; i < line.size(); i++) {
+		char character = line[i];
+		if (quoted && character == '\\' && i + 1 < line.size()) {
+			statement += character;
+			statement += line[++i];
+			continue;
+		}
+		if (character == '"')
+			quoted = !quoted;
+		if (!quoted && character == '#')
+			break;
+		if (!quoted && character == ';') {
+			parse_statement(statement);
+			statement.clear();
+			continue;
+		}
+		statement += character;
+	}
+	parse_statement(statement);
+}
+
+void Assembler::parse_statement(std::string text) {
+	text = trim(text);
+	statement_text = text;
+	while (!text.empty() && (is_symbol_start(text[0]) || isdigit((unsigned char)text[0]))) {	// Leading labels, digits alone make a local label
+		bool numeric = isdigit((unsigned char)text[0]);
+		size_t end = 1;
+		while (end < text.size() && (numeric ? isdigit((unsigned char)text[end]) : is_symbol_character(text[end])))
+			end++;
+		if (end >= text.size() || text[end] != ':')
+			break;
+		if (numeric) {
+			std::string number = text.substr(0, end);
+			define_label(numeric_label(number, true));
+			numeric_labels[number]++;
+		}
+		else
+			define_label(text.substr(0, end));
+		text = trim(text.substr(end + 1));
+	}
+	if (text.empty())
+		return;
+	size_t space = text.find_first_of(" \t");
+	std::string name = text.substr(0, space);
+	std::string rest = space == std::string::npos ? "" : trim(text.substr(space));
+	if (name[0] == '.')
+		parse_directive(name, rest);
+	else
+		parse_instruction(name, rest, {});
+}
+
+void Assembler::parse_directive(const std::string& name, const std::string& arguments) {
+	std::vector<std::string> list = split_arguments(arguments);
+	Section& section = sections[current_section];
+
+	if (name == ".text" || name == ".data" || name == ".bss")
+		switch_section(name);
+	else if (name == ".section") {
+		if (list.empty()) {
+			make_error("Missing section name");
+			return;
+		}
+		std::string flags;
+		if (list.size() >= 2 && !parse_string(list[1], flags))
+			return;
+		switch_section(list[0], flags, list.size() >= 3 ? list[2] : "");
+	}
+	else if (name == ".globl" || name == ".global") {
+		for (const std::string& symbol_name : list)
+			symbol(symbol_name).global = true;
+	}
+	else if (name == ".type") {
+		if (list.size() == 2 && (list[1] == "@function" || list[1] == "%function"))
+			symbol(list[0]).function = true;
+	}
+	else if (name == ".size" || name == ".set" || name == ".equ") {
+		MachineValue value;
+		if (list.size() != 2) {
+			make_error("Expected a symbol and a value");
+			return;
+		}
+		if (!parse_value(list[1], value))
+			return;
+		Symbol& target = symbol(list[0]);
+		if (name == ".size") {
+			target.has_size = true;
+			target.size = value;
+		}
+		else {
+			target.is_alias = true;
+			target.alias = value;
+		}
+	}
+	else if (name == ".align" || name == ".balign" || name == ".p2align") {
+		Fragment padding;
+		padding.kind = FRAGMENT_ALIGN;
+		int64_t amount = list.empty() || list[0].empty() ? 0 : std::stoll(list[0], nullptr, 0);
+		padding.alignment = name == ".p2align" ? (uint64_t)1 << amount : (uint64_t)amount;
+		if (list.size() >= 3 && !list[2].empty())
+			padding.max_skip = std::stoull(list[2], nullptr, 0);
+		if (padding.alignment == 0 || (padding.alignment & (padding.alignment - 1))) {
+			make_error("Alignment must be a power of two");
+			return;
+		}
+		section.alignment = std::max(section.alignment, padding.alignment);
+		append(padding);
+	}
+	else if (name == ".zero" || name == ".skip" || name == ".space") {
+		Fragment zeros;
+		zeros.kind = FRAGMENT_ZERO;
+		zeros.size = list.empty() ? 0 : std::stoull(list[0], nullptr, 0);
+		append(zeros);
+	}
+	else if (name == ".ascii" || name == ".string" || name == ".asciz") {
+		Fragment data;
+		for (const std::string& argument : list) {
+			std::string value;
+			if (!parse_string(argument, value))
+				return;
+			data.encoding.bytes.insert(data.encoding.bytes.end(), value.begin(), value.end());
+			if (name != ".ascii")
+				data.encoding.bytes.push_back(0);
+		}
+		append(data);
+	}
+	else if (name == ".byte" || name == ".short" || name == ".word" || name == ".value" || name == ".long" || name == ".int" || name == ".quad") {
+		int size = name == ".byte" ? 1 : name == ".quad" ? 8 : name == ".long" || name == ".int" ? 4 : 2;
+		Fragment data;
+		for (const std::string& argument : list) {
+			Fixup fixup;
+			if (!parse_value(argument, fixup.value))
+				return;
+			fixup.offset = data.encoding.bytes.size();
+			fixup.size = size;
+			fixup.sign_extended = false;
+			data.encoding.fixups.push_back(fixup);
+			data.encoding.bytes.insert(data.encoding.bytes.end(), size, 0);
+		}
+		append(data);
+	}
+	else if (name == ".file") {
+		if (!arguments.empty() && arguments[0] == '"')
+			return;																// The name of the assembly file, not a line table entry
+		std::string number = list.empty() ? "" : list[0].substr(0, list[0].find_first_of(" \t"));
+		std::string file_name = list.empty() ? "" : trim(list[0].substr(number.size()));
+		if (number != "1" || !parse_string(file_name, source_file))
+			make_error("Only file 1 of the line table is supported");
+	}
+	else if (name == ".loc") {
+		std::istringstream fields(arguments);
+		int file = 0;
+		LineEntry entry;
+		entry.section = current_section;
+		entry.fragment = section.fragments.size();
+		if (!(fields >> file >> entry.line) || file != 1) {
+			make_error("Expected file 1 and a line");
+			return;
+		}
+		fields >> entry.column;
+		lines.push_back(entry);
+	}
+	else if (name.starts_with(".cfi_")) {
+		std::string directive = name.substr(5);
+		if (directive == "startproc") {
+			if (in_frame)
+				make_error("Nested .cfi_startproc");
+			in_frame = true;
+			frame = Frame();
+			frame.section = current_section;
+			frame.start = section.fragments.size();
+			return;
+		}
+		if (!in_frame) {
+			make_error("CFI directive outside of .cfi_startproc");
+			return;
+		}
+		if (directive == "endproc") {
+			in_frame = false;
+			frame.end = section.fragments.size();
+			frames.push_back(frame);
+			return;
+		}
+		FrameInstruction instruction;
+		instruction.directive = directive;
+		instruction.fragment = section.fragments.size();
+		for (const std::string& argument : list) {
+			int reg = dwarf_register(argument);
+			MachineValue value;
+			if (reg < 0 && (!parse_value(argument, value) || !value.symbol.empty()))
+				return;
+			instruction.arguments.push_back(reg >= 0 ? reg : value.constant);
+		}
+		frame.instructions.push_back(instruction);
+	}
+	else if (name == ".ident" || name == ".att_syntax")
+		return;
+	else
+		make_error("Unsupported directive " + name);
+}
+
+void Assembler::parse_instruction(const std::string& mnemonic, const std::string& operands, std::vector<uint8_t> prefixes) {
+	static const std::unordered_map<std::string, uint8_t> prefix_bytes = {
+		{ "rep", 0xF3 }, { "repe", 0xF3 }, { "repz", 0xF3 }, { "repne", 0xF2 }, { "repnz", 0xF2 }, { "lock", 0xF0 } };
+	auto prefix = prefix_bytes.find(mnemonic);
+	if (prefix != prefix_bytes.end()) {
+		prefixes.push_back(prefix->second);
+		size_t space = operands.find_first_of(" \t");
+		parse_instruction(operands.substr(0, space), space == std::string::npos ? "" : trim(operands.substr(space)), prefixes);
+		return;
+	}
+
+	MachineInstruction instruction;
+	instruction.mnemonic = mnemonic;
+	for (const std::string& text : split_arguments(operands)) {
+		MachineOperand operand;
+		if (!parse_operand(text, operand))
+			return;
+		instruction.operands.push_back(operand);
+	}
+
+	int condition = mnemonic == "jmp" ? -1 : mnemonic[0] == 'j' ? condition_code(mnemonic.substr(1)) : -2;
+	if (condition >= -1 && instruction.operands.size() == 1 && prefixes.empty()) {
+		const MachineOperand& target = instruction.operands[0];
+		if (target.kind == OPERAND_MEMORY && !target.indirect && target.base < 0 && target.index < 0 && !target.rip_relative && !target.segment) {
+			Fragment branch;
+			branch.kind = FRAGMENT_BRANCH;
+			branch.condition = condition;
+			branch.target = target.value;
+			append(branch);
+			return;
+		}
+	}
+
+	Fragment fragment;
+	fragment.encoding.bytes = prefixes;
+	std::string error;
+	if (!encode_instruction(instruction, fragment.encoding, error)) {
+		make_error(error);
+		return;
+	}
+	for (Fixup& fixup : fragment.encoding.fixups)
+		fixup.offset += prefixes.size();
+	append(fragment);
+}
+
+bool Assembler::parse_operand(std::string text, MachineOperand& operand) {
+	operand = MachineOperand();
+	text = trim(text);
+	bool indirect = !text.empty() && text[0] == '*';
+	if (indirect)
+		text = trim(text.substr(1));
+	if (text.empty()) {
+		make_error("Missing operand");
+		return false;
+	}
+	if (text[0] == '$') {
+		operand.kind = OPERAND_IMMEDIATE;
+		return parse_value(text.substr(1), operand.value);
+	}
+	uint8_t segment = 0;
+	if (text.starts_with("%fs:") || text.starts_with("%gs:")) {
+		segment = text[1] == 'f' ? 0x64 : 0x65;
+		text = trim(text.substr(4));
+	}
+	else if (text[0] == '%') {
+		if (!parse_register(text.substr(1), operand)) {
+			make_error("Unknown register " + text);
+			return false;
+		}
+		operand.indirect = indirect;
+		return true;
+	}
+
+	operand.kind = OPERAND_MEMORY;
+	operand.indirect = indirect;
+	operand.segment = segment;
+	size_t open = text.find('(');
+	if (!parse_value(trim(text.substr(0, open)), operand.value))
+		return false;
+	if (open == std::string::npos)
+		return true;
+	size_t close = text.find(')', open);
+	if (close == std::string::npos) {
+		make_error("Missing ) in " + text);
+		return false;
+	}
+	std::vector<std::string> parts = split_arguments(text.substr(open + 1, close - open - 1));
+	for (size_t i = 0; i < parts.size() && i < 2; i++) {
+		if (parts[i].empty())
+			continue;
+		MachineOperand reg;
+		if (i == 0 && parts[i] == "%rip") {
+			operand.rip_relative = true;
+			continue;
+		}
+		if (parts[i][0] != '%' || !parse_register(parts[i].substr(1), reg) || reg.register_class != REGISTER_GENERAL || reg.size != 8) {
+			make_error("Bad address register " + parts[i]);
+			return false;
+		}
+		(i == 0 ? operand.base : operand.index) = reg.reg;
+	}
+	if (parts.size() >= 3 && !parts[2].empty()) {
+		operand.scale = std::stoi(parts[2]);
+		if (operand.scale != 1 && operand.scale != 2 && operand.scale != 4 && operand.scale != 8) {
+			make_error("Scale must be 1, 2, 4 or 8");
+			return false;
+		}
+	}
+	if (operand.index == 4) {
+		make_error("%rsp can't be an index");
+		return false;
+	}
+	return true;
+}
+
+bool Assembler::parse_value(const std::string& text, MachineValue& value) {
+	value = MachineValue();
+	size_t i = 0;
+	bool has_term = false;
+	while (true) {
+		while (i < text.size() && isspace((unsigned char)text[i]))
+			i++;
+		if (i >= text.size())
+			break;
+		bool negative = false;
+		if (has_term || text[i] == '-' || text[i] == '+') {
+			if (text[i] != '+' && text[i] != '-') {
+				make_error("Bad expression " + text);
+				return false;
+			}
+			negative = text[i++] == '-';
+			while (i < text.size() && isspace((unsigned char)text[i]))
+				i++;
+		}
+		if (i >= text.size()) {
+			make_error("Bad expression " + text);
+			return false;
+		}
+		size_t digits = i;
+		while (digits < text.size() && isdigit((unsigned char)text[digits]))
+			digits++;
+		bool local_label = digits > i && digits < text.size() && (text[digits] == 'b' || text[digits] == 'f')
+			&& (digits + 1 >= text.size() || !is_symbol_character(text[digits + 1]));	// 1b or 1f, but not 0b101
+		if (isdigit((unsigned char)text[i]) && !local_label) {
+			size_t length = 0;
+			bool binary = text[i] == '0' && digits == i + 1 && digits + 1 < text.size() && tolower((unsigned char)text[digits]) == 'b'
+				&& (text[digits + 1] == '0' || text[digits + 1] == '1');		// stoull only knows the 0x and 0 prefixes
+			int64_t number = (int64_t)std::stoull(text.substr(binary ? i + 2 : i), &length, binary ? 2 : 0);
+			value.constant += negative ? -number : number;
+			i += binary ? length + 2 : length;
+		}
+		else if (local_label || is_symbol_start(text[i])) {
+			std::string name;
+			if (local_label) {
+				std::string number = text.substr(i, digits - i);
+				bool forward = text[digits] == 'f';
+				if (!forward && numeric_labels[number] == 0) {
+					make_error("Local label " + number + " is not defined before " + text);
+					return false;
+				}
+				name = numeric_label(number, forward);
+				if (forward)
+					forward_references.push_back({ name, line_number, statement_text });
+				i = digits + 1;
+			}
+			else {
+				size_t end = i + 1;
+				while (end < text.size() && is_symbol_character(text[end]))
+					end++;
+				name = text.substr(i, end - i);
+				i = end;
+			}
+			if (name == ".")
+				name = temporary_label();
+			if (text.compare(i, 6, "@tpoff") == 0) {
+				value.thread_pointer_offset = true;
+				i += 6;
+			}
+			std::string& slot = negative ? value.minus : value.symbol;
+			if (!slot.empty()) {
+				make_error("Too many symbols in " + text);
+				return false;
+			}
+			slot = name;
+		}
+		else {
+			make_error("Bad expression " + text);
+			return false;
+		}
+		has_term = true;
+	}
+	return true;
+}
+
+bool Assembler::parse_string(const std::string& text, std::string& value) {
+	value.clear();
+	if (text.size() < 2 || text.front() != '"' || text.back() != '"') {
+		make_error("Expected a string");
+		return false;
+	}
+	for (size_t i = 1; i + 1 < text.size(); i++) {
+		if (text[i] != '\\') {
+			value += text[i];
+			continue;
+		}
+		char escape = text[++i];
+		if (escape >= '0' && escape <= '7') {
+			int code = 0;
+			for (int digits = 0; digits < 3 && text[i] >= '0' && text[i] <= '7'; digits++)
+				code = code * 8 + (text[i++] - '0');
+			i--;
+			value += (char)code;
+		}
+		else if (escape == 'x') {
+			int code = 0;
+			while (isxdigit((unsigned char)text[i + 1]))
+				code = code * 16 + std::stoi(std::string(1, text[++i]), nullptr, 16);
+			value += (char)code;
+		}
+		else
+			value += escape == 'n' ? '\n' : escape == 't' ? '\t' : escape == 'r' ? '\r' : escape == 'b' ? '\b' : escape == 'f' ? '\f' : escape;
+	}
+	return true;
+}
+
+int Assembler::dwarf_register(const std::string& text) {
+	static const int numbers[] = { 0, 2, 1, 3, 7, 6, 4, 5, 8, 9, 10, 11, 12, 13, 14, 15 };	// DWARF counts rax, rdx, rcx, rbx, rsi, rdi, rbp, rsp
+	MachineOperand reg;
+	if (text.empty() || text[0] != '%' || !parse_register(text.substr(1), reg) || reg.register_class != REGISTER_GENERAL)
+		return -1;
+	return numbers[reg.reg];
+}
+
+// SECTIONS
+
+void Assembler::switch_section(const std::string& name, const std::string& flags, const std::string& type) {
+	for (size_t i = 0; i < sections.size(); i++) {
+		if (sections[i].name == name) {
+			current_section = (int)i;
+			return;
+		}
+	}
+	Section section;
+	section.name = name;
+	if (!flags.empty()) {
+		for (char flag : flags)
+			section.flags |= flag == 'a' ? SECTION_ALLOC : flag == 'w' ? SECTION_WRITE : flag == 'x' ? SECTION_EXECUTE : flag == 'T' ? SECTION_TLS : 0;
+	}
+	else if (name.starts_with(".text"))
+		section.flags = SECTION_ALLOC | SECTION_EXECUTE;
+	else if (name.starts_with(".data") || name.starts_with(".bss"))
+		section.flags = SECTION_ALLOC | SECTION_WRITE;
+	else if (name.starts_with(".tdata") || name.starts_with(".tbss"))
+		section.flags = SECTION_ALLOC | SECTION_WRITE | SECTION_TLS;
+	else if (name.starts_with(".rodata"))
+		section.flags = SECTION_ALLOC;
+	if (type == "@nobits" || (type.empty() && (name.starts_with(".bss") || name.starts_with(".tbss"))))
+		section.type = SECTION_NOBITS;
+	sections.push_back(section);
+	current_section = (int)sections.size() - 1;
+}
+
+Assembler::Symbol& Assembler::symbol(const std::string& name) {
+	auto found = symbols.find(name);
+	if (found != symbols.end())
+		return found->second;
+	symbol_order.push_back(name);
+	return symbols[name];
+}
+
+void Assembler::define_label(const std::string& name) {
+	Symbol& label = symbol(name);
+	if (label.section >= 0 || label.is_alias) {
+		make_error("Label " + name + " is defined twice");
+		return;
+	}
+	label.section = current_section;
+	label.fragment = sections[current_section].fragments.size();
+}
+
+std::string Assembler::temporary_label() {
+	std::string name = std::format(".L.here{0}", temporary_labels++);
+	define_label(name);
+	return name;
+}
+
+std::string Assembler::numeric_label(const std::string& number, bool forward) {
+	int defined = numeric_labels[number];
+	return std::format(".L.local{0}.{1}", number, forward ? defined : defined - 1);
+}
+
+void Assembler::append(const Fragment& fragment) {
+	Section& section = sections[current_section];
+	if (section.type == SECTION_NOBITS && fragment.kind != FRAGMENT_ZERO && fragment.kind != FRAGMENT_ALIGN) {
+		make_error("Only zeros can go into " + section.name);
+		return;
+	}
+	section.fragments.push_back(fragment);
+}
+
+// LAYOUT
+
+void Assembler::layout(Section& section) {
+	int index = (int)(&section - sections.data());
+	bool changed = true;
+	while (changed) {															// Branches only ever grow, so this ends
+		uint64_t offset = 0;
+		for (Fragment& fragment : section.fragments) {
+			fragment.offset = offset;
+			if (fragment.kind == FRAGMENT_BYTES)
+				fragment.size = fragment.encoding.bytes.size();
+			else if (fragment.kind == FRAGMENT_BRANCH)
+				fragment.size = fragment.is_short ? 2 : fragment.condition < 0 ? 5 : 6;
+			else if (fragment.kind == FRAGMENT_ALIGN) {
+				fragment.size = (fragment.alignment - offset % fragment.alignment) % fragment.alignment;
+				if (fragment.max_skip && fragment.size > fragment.max_skip)
+					fragment.size = 0;
+			}
+			offset += fragment.size;
+		}
+		section.size = offset;
+
+		changed = false;
+		for (Fragment& fragment : section.fragments) {
+			if (fragment.kind != FRAGMENT_BRANCH || !fragment.is_short)
+				continue;
+			Location target = fragment.target.minus.empty() ? locate(fragment.target.symbol) : Location();
+			int64_t displacement = (int64_t)target.offset + fragment.target.constant - (int64_t)(fragment.offset + 2);
+			if (target.section != index || displacement < -128 || displacement > 127) {
+				fragment.is_short = false;
+				changed = true;
+			}
+		}
+	}
+}
+
+Assembler::Location Assembler::locate(const std::string& name, int depth) {
+	Location location;
+	auto found = symbols.find(name);
+	if (found == symbols.end() || depth > 16)
+		return location;
+	const Symbol& symbol = found->second;
+	if (symbol.is_alias) {
+		int64_t constant = 0;
+		if (symbol.alias.minus.empty() && !symbol.alias.symbol.empty()) {
+			location = locate(symbol.alias.symbol, depth + 1);
+			location.offset += symbol.alias.constant;
+		}
+		else if (evaluate(symbol.alias, constant)) {
+			location.section = -2;
+			location.offset = (uint64_t)constant;
+		}
+		return location;
+	}
+	if (symbol.section >= 0) {
+		location.section = symbol.section;
+		location.offset = position(symbol.section, symbol.fragment);
+	}
+	return location;
+}
+
+uint64_t Assembler::position(int section, size_t fragment) {
+	const Section& container = sections[section];
+	return fragment < container.fragments.size() ? container.fragments[fragment].offset : container.size;
+}
+
+bool Assembler::evaluate(const MachineValue& value, int64_t& result) {
+	result = value.constant;
+	if (value.symbol.empty() && value.minus.empty())
+		return true;
+	Location plus = value.symbol.empty() ? Location{ -2, 0 } : locate(value.symbol);
+	Location minus = value.minus.empty() ? Location{ -2, 0 } : locate(value.minus);
+	if (plus.section == -1 || minus.section == -1 || (plus.section != minus.section && minus.section != -2))
+		return false;
+	result += (int64_t)plus.offset - (int64_t)minus.offset;
+	return plus.section == minus.section;
+}
+
+// OBJECT
+
+void Assembler::build_object() {
+	for (const Section& section : sections) {
+		ObjectSection output;
+		output.name = section.name;
+		output.type = section.type;
+		output.flags = section.flags;
+		output.alignment = section.alignment;
+		output.size = section.size;
+		object.sections.push_back(output);
+		ObjectSymbol section_symbol;
+		section_symbol.section = (int)object.sections.size() - 1;				// The symbol of section i is symbol i
+		section_symbol.section_symbol = true;
+		object.symbols.push_back(section_symbol);
+	}
+	for (const std::string& name : symbol_order) {								// Defined symbols, in the order they were first seen
+		const Symbol& symbol = symbols[name];
+		Location location = locate(name);
+		if (location.section < 0 || name.starts_with(".L"))
+			continue;
+		ObjectSymbol output;
+		output.name = name;
+		output.section = location.section;
+		output.value = location.offset;
+		output.global = symbol.global;
+		output.function = symbol.function;
+		int64_t size = 0;
+		if (symbol.has_size && evaluate(symbol.size, size))
+			output.size = (uint64_t)size;
+		object_symbols[name] = (int)object.symbols.size();
+		object.symbols.push_back(output);
+	}
+
+	for (size_t index = 0; index < sections.size(); index++) {
+		const Section& section = sections[index];
+		ObjectSection& output = object.sections[index];
+		if (section.type == SECTION_NOBITS)
+			continue;
+		output.bytes.reserve(section.size);
+		for (const Fragment& fragment : section.fragments) {
+			Encoding encoding = fragment.encoding;
+			if (fragment.kind == FRAGMENT_BRANCH)
+				encode_branch(fragment.condition, fragment.is_short, fragment.target, encoding);
+			else if (fragment.kind == FRAGMENT_ALIGN && (section.flags & SECTION_EXECUTE))
+				encoding.bytes = nop_padding(fragment.size);
+			else if (fragment.kind != FRAGMENT_BYTES)
+				encoding.bytes.assign(fragment.size, 0);
+			output.bytes.insert(output.bytes.end(), encoding.bytes.begin(), encoding.bytes.end());
+			for (const Fixup& fixup : encoding.fixups)
+				resolve((int)index, fragment.offset + fixup.offset, fragment.offset + encoding.bytes.size(), fixup);
+		}
+	}
+	build_frames();
+	if (!lines.empty())
+		build_line_table();
+
+	ObjectSection stack_note;													// The stack needs no execute permission
+	stack_note.name = ".note.GNU-stack";
+	object.sections.push_back(stack_note);
+}
+
+int Assembler::object_symbol(const std::string& name) {
+	auto found = object_symbols.find(name);
+	if (found != object_symbols.end())
+		return found->second;
+	ObjectSymbol undefined;
+	undefined.name = name;
+	undefined.global = true;
+	object_symbols[name] = (int)object.symbols.size();
+	object.symbols.push_back(undefined);
+	return (int)object.symbols.size() - 1;
+}
+
+void Assembler::resolve(int section, uint64_t field, uint64_t end, const Fixup& fixup) {
+	ObjectSection& output = object.sections[section];
+	MachineValue value = fixup.value;
+	int64_t addend = value.constant;
+	bool pc_relative = fixup.pc_relative;
+	if (pc_relative)
+		addend -= (int64_t)(end - field);										// The CPU adds to the address after the instruction, relocations to the field
+	Location target = value.symbol.empty() ? Location{ -2, 0 } : locate(value.symbol);
+	if (!value.minus.empty()) {
+		Location minus = locate(value.minus);
+		if (target.section != -1 && target.section == minus.section) {
+			addend += (int64_t)target.offset - (int64_t)minus.offset;
+			value.symbol.clear();
+			target = Location{ -2, 0 };
+		}
+		else if (minus.section == section && !pc_relative) {					// symbol - label becomes symbol - field + (field - label)
+			pc_relative = true;
+			addend += (int64_t)field - (int64_t)minus.offset;
+		}
+		else {
+			make_error(std::format("Can't subtract {0} from {1}", value.minus, value.symbol));
+			return;
+		}
+	}
+
+	if (target.section == -2) {
+		if (pc_relative) {
+			make_error("Can't refer to a plain number relative to the instruction");
+			return;
+		}
+		write_field(output, field, addend + (int64_t)target.offset, fixup.size);
+		return;
+	}
+	if (pc_relative && target.section == section && !value.thread_pointer_offset) {
+		write_field(output, field, (int64_t)target.offset + addend - (int64_t)field, fixup.size);
+		return;
+	}
+	if (fixup.size == 1) {
+		make_error("Branch target " + value.symbol + " is out of reach");
+		return;
+	}
+
+	Relocation relocation;
+	relocation.offset = field;
+	relocation.addend = addend;
+	bool is_global = target.section < 0 || symbols[value.symbol].global;
+	if (value.thread_pointer_offset) {
+		relocation.type = RELOCATION_TPOFF32;
+		relocation.symbol = object_symbol(value.symbol);
+	}
+	else {
+		relocation.type = pc_relative ? (fixup.plt && is_global ? RELOCATION_PLT32 : RELOCATION_PC32)
+			: fixup.size == 8 ? RELOCATION_64 : fixup.sign_extended ? RELOCATION_32S : RELOCATION_32;
+		if (is_global)
+			relocation.symbol = object_symbol(value.symbol);
+		else {																	// Local labels are referred to through their section
+			relocation.symbol = target.section;
+			relocation.addend += (int64_t)target.offset;
+		}
+	}
+	if (fixup.size != 4 && fixup.size != 8) {
+		make_error("Relocated fields must be 4 or 8 bytes");
+		return;
+	}
+	output.relocations.push_back(relocation);
+}
+
+void Assembler::write_field(ObjectSection& section, uint64_t offset, int64_t value, int size) {
+	if (size < 8) {
+		int64_t limit = (int64_t)1 << (8 * size);
+		if (value < -limit / 2 || value >= limit) {
+			make_error(std::format("Value {0} doesn't fit in {1} bytes", value, size));
+			return;
+		}
+	}
+	for (int i = 0; i < size; i++)
+		section.bytes[offset + i] = (uint8_t)((uint64_t)value >> (8 * i));
+}
+
+static void append_uleb(std::vector<uint8_t>& bytes, uint64_t value) {
+	do {
+		uint8_t byte = value & 0x7F;
+		value >>= 7;
+		bytes.push_back(value ? byte | 0x80 : byte);
+	} while (value);
+}
+
+static void append_sleb(std::vector<uint8_t>& bytes, int64_t value) {
+	while (true) {
+		uint8_t byte = value & 0x7F;
+		value >>= 7;
+		bool done = (value == 0 && !(byte & 0x40)) || (value == -1 && (byte & 0x40));
+		bytes.push_back(done ? byte : byte | 0x80);
+		if (done)
+			return;
+	}
+}
+
+static void append_integer(std::vector<uint8_t>& bytes, uint64_t value, int size) {
+	for (int i = 0; i < size; i++)
+		bytes.push_back((uint8_t)(value >> (8 * i)));
+}
+
+static void patch_integer(std::vector<uint8_t>& bytes, size_t offset, uint64_t value, int size) {
+	for (int i = 0; i < size; i++)
+		bytes[offset + i] = (uint8_t)(value >> (8 * i));
+}
+
+void Assembler::build_frames() {
+	if (frames.empty())
+		return;
+	ObjectSection eh_frame;
+	eh_frame.name = ".eh_frame";
+	eh_frame.type = SECTION_UNWIND;
+	eh_frame.flags = SECTION_ALLOC;
+	eh_frame.alignment = 8;
+	std::vector<uint8_t>& bytes = eh_frame.bytes;
+	auto pad = [&](size_t start) {												// Entries are padded with DW_CFA_nop to 8 bytes and get their length
+		while ((bytes.size() - start) % 8)
+			bytes.push_back(0);
+		patch_integer(bytes, start, bytes.size() - start - 4, 4);
+	};
+
+	append_integer(bytes, 0, 4);												// The CIE: version 1, "zR", code alignment 1, data alignment -8,
+	append_integer(bytes, 0, 4);												// return address in column 16, pc relative FDE addresses and
+	bytes.insert(bytes.end(), { 1, 'z', 'R', 0, 1, 0x78, 16, 1, 0x1B });		// the CFA at %rsp + 8 with the return address on top
+	bytes.insert(bytes.end(), { 0x0C, 7, 8, 0x90, 1 });
+	pad(0);
+
+	for (const Frame& frame : frames) {
+		size_t start = bytes.size();
+		uint64_t begin = position(frame.section, frame.start);
+		uint64_t end = position(frame.section, frame.end);
+		append_integer(bytes, 0, 4);
+		append_integer(bytes, bytes.size(), 4);									// Distance back to the CIE
+		Relocation relocation;
+		relocation.offset = bytes.size();
+		relocation.symbol = frame.section;
+		relocation.type = RELOCATION_PC32;
+		relocation.addend = (int64_t)begin;
+		eh_frame.relocations.push_back(relocation);
+		append_integer(bytes, 0, 4);
+		append_integer(bytes, end - begin, 4);
+		bytes.push_back(0);														// No augmentation data
+
+		uint64_t location = begin;
+		int64_t cfa_offset = 8;
+		std::vector<int64_t> saved_offsets;
+		for (const FrameInstruction& instruction : frame.instructions) {
+			uint64_t at = position(frame.section, instruction.fragment);
+			if (at > location) {
+				uint64_t delta = at - location;
+				if (delta < 64)
+					bytes.push_back((uint8_t)(0x40 | delta));
+				else if (delta < 256)
+					bytes.insert(bytes.end(), { 0x02, (uint8_t)delta });
+				else if (delta < 65536) {
+					bytes.push_back(0x03);
+					append_integer(bytes, delta, 2);
+				}
+				else {
+					bytes.push_back(0x04);
+					append_integer(bytes, delta, 4);
+				}
+				location = at;
+			}
+			const std::string& directive = instruction.directive;
+			const std::vector<int64_t>& arguments = instruction.arguments;
+			size_t expected = directive == "def_cfa" || directive == "offset" ? 2 : directive == "remember_state" || directive == "restore_state" ? 0 : 1;
+			if (arguments.size() != expected) {
+				make_error("Wrong number of arguments for .cfi_" + directive);
+				return;
+			}
+			if (directive == "def_cfa_offset" || directive == "adjust_cfa_offset") {
+				cfa_offset = directive == "def_cfa_offset" ? arguments[0] : cfa_offset + arguments[0];
+				bytes.push_back(0x0E);
+				append_uleb(bytes, (uint64_t)cfa_offset);
+			}
+			else if (directive == "def_cfa") {
+				cfa_offset = arguments[1];
+				bytes.push_back(0x0C);
+				append_uleb(bytes, (uint64_t)arguments[0]);
+				append_uleb(bytes, (uint64_t)cfa_offset);
+			}
+			else if (directive == "def_cfa_register") {
+				bytes.push_back(0x0D);
+				append_uleb(bytes, (uint64_t)arguments[0]);
+			}
+			else if (directive == "offset") {
+				bytes.push_back((uint8_t)(0x80 | arguments[0]));
+				append_uleb(bytes, (uint64_t)(-arguments[1] / 8));
+			}
+			else if (directive == "restore")
+				bytes.push_back((uint8_t)(0xC0 | arguments[0]));
+			else if (directive == "remember_state") {
+				saved_offsets.push_back(cfa_offset);
+				bytes.push_back(0x0A);
+			}
+			else if (directive == "restore_state" && !saved_offsets.empty()) {
+				cfa_offset = saved_offsets.back();
+				saved_offsets.pop_back();
+				bytes.push_back(0x0B);
+			}
+			else {
+				make_error("Unsupported directive .cfi_" + directive);
+				return;
+			}
+		}
+		pad(start);
+	}
+	eh_frame.size = bytes.size();
+	object.sections.push_back(eh_frame);
+}
+
+void Assembler::build_line_table() {
+	auto debug_section = [](const std::string& name) {
+		ObjectSection section;
+		section.name = name;
+		return section;
+	};
+	ObjectSection line_table = debug_section(".debug_line");
+	ObjectSection info = debug_section(".debug_info");
+	ObjectSection abbreviations = debug_section(".debug_abbrev");
+	ObjectSection ranges = debug_section(".debug_ranges");
+	int line_index = (int)object.sections.size();
+	for (int i = 0; i < 4; i++) {												// Their section symbols, the CU refers to the others through them
+		ObjectSymbol section_symbol;
+		section_symbol.section = line_index + i;
+		section_symbol.section_symbol = true;
+		object.symbols.push_back(section_symbol);
+	}
+	int first_debug_symbol = (int)object.symbols.size() - 4;
+
+	std::vector<uint8_t>& bytes = line_table.bytes;								// DWARF 3 header: line_base -5, line_range 14, opcode_base 13
+	append_integer(bytes, 0, 4);
+	append_integer(bytes, 3, 2);
+	append_integer(bytes, 0, 4);
+	size_t header_start = bytes.size();
+	bytes.insert(bytes.end(), { 1, 1, (uint8_t)-5, 14, 13, 0, 1, 1, 1, 1, 0, 0, 0, 1, 0, 0, 1 });
+	bytes.push_back(0);															// No include directories
+	std::string file_name = source_file.empty() ? "<stdin>" : source_file;
+	bytes.insert(bytes.end(), file_name.begin(), file_name.end());
+	bytes.insert(bytes.end(), { 0, 0, 0, 0, 0 });
+	patch_integer(bytes, 6, bytes.size() - header_start, 4);
+
+	for (size_t section = 0; section < sections.size(); section++) {			// A sequence for every section with lines
+		bool started = false;
+		uint64_t address = 0;
+		int line = 1;
+		for (const LineEntry& entry : lines) {
+			if (entry.section != (int)section)
+				continue;
+			uint64_t at = position(entry.section, entry.fragment);
+			if (!started) {
+				bytes.insert(bytes.end(), { 0, 9, 2 });							// DW_LNE_set_address
+				Relocation relocation;
+				relocation.offset = bytes.size();
+				relocation.symbol = (int)section;
+				relocation.type = RELOCATION_64;
+				relocation.addend = (int64_t)at;
+				line_table.relocations.push_back(relocation);
+				append_integer(bytes, 0, 8);
+				address = at;
+				started = true;
+			}
+			if (entry.line != line) {
+				bytes.push_back(0x03);											// DW_LNS_advance_line
+				append_sleb(bytes, entry.line - line);
+				line = entry.line;
+			}
+			bytes.push_back(0x05);												// DW_LNS_set_column
+			append_uleb(bytes, (uint64_t)entry.column);
+			if (at > address) {
+				bytes.push_back(0x02);											// DW_LNS_advance_pc
+				append_uleb(bytes, at - address);
+				address = at;
+			}
+			bytes.push_back(0x01);												// DW_LNS_copy
+		}
+		if (!started)
+			continue;
+		if (sections[section].size > address) {
+			bytes.push_back(0x02);
+			append_uleb(bytes, sections[section].size - address);
+		}
+		bytes.insert(bytes.end(), { 0, 1, 1 });									// DW_LNE_end_sequence
+
+		for (uint64_t bound : { (uint64_t)0, sections[section].size }) {
+			Relocation relocation;
+			relocation.offset = ranges.bytes.size();
+			relocation.symbol = (int)section;
+			relocation.type = RELOCATION_64;
+			relocation.addend = (int64_t)bound;
+			ranges.relocations.push_back(relocation);
+			append_integer(ranges.bytes, 0, 8);
+		}
+	}
+	append_integer(ranges.bytes, 0, 16);
+	patch_integer(bytes, 0, bytes.size() - 4, 4);
+
+	abbreviations.bytes = { 1, 0x11, 0,											// A compile unit without children with
+		0x03, 0x08, 0x25, 0x08, 0x10, 0x06, 0x11, 0x01, 0x55, 0x06, 0, 0, 0 };	// name, producer, stmt_list, low_pc and ranges
+
+	std::vector<uint8_t>& unit = info.bytes;
+	append_integer(unit, 0, 4);
+	append_integer(unit, 3, 2);
+	auto section_offset = [&](int symbol) {										// Offsets into other debug sections are relocated
+		Relocation relocation;
+		relocation.offset = unit.size();
+		relocation.symbol = symbol;
+		relocation.type = RELOCATION_32;
+		info.relocations.push_back(relocation);
+		append_integer(unit, 0, 4);
+	};
+	section_offset(first_debug_symbol + 2);
+	unit.push_back(8);
+	unit.push_back(1);
+	unit.insert(unit.end(), file_name.begin(), file_name.end());
+	unit.push_back(0);
+	for (char character : std::string("Artemis"))
+		unit.push_back((uint8_t)character);
+	unit.push_back(0);
+	section_offset(first_debug_symbol);
+	append_integer(unit, 0, 8);
+	section_offset(first_debug_symbol + 3);
+	patch_integer(unit, 0, unit.size() - 4, 4);
+
+	for (ObjectSection* section : { &line_table, &info, &abbreviations, &ranges }) {
+		section->size = section->bytes.size();
+		object.sections.push_back(*section);
+	}
+}
+
+void Assembler::make_error(const std::string& message) {
+	Token default_tok = Token();
+	error_handler->report_error(std::format("{0} at line {1} of the assembly: {2}", message, line_number, statement_text), default_tok);
+}
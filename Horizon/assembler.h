@@ -0,0 +1,139 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "encoder.h"
+#include "object.h"
+#include "error.h"
+
+// The built-in assembler. It reads the assembly the code generator keeps in memory and makes a relocatable
+// object of it, with no external assembler and no .s file in between. Jumps start in their two byte form and
+// are relaxed to rel32 until every displacement fits. .cfi directives become .eh_frame, .loc directives a line
+// table in .debug_line. References that can't be resolved here become relocations for the linker.
+
+class Assembler {
+public:
+	Assembler(ErrorHandler* error_handler) : error_handler(error_handler) {}
+
+	ObjectFile assemble(const std::string& assembly);							// Incomplete if an error was reported
+private:
+	ErrorHandler* error_handler;
+
+	enum FragmentKind { FRAGMENT_BYTES, FRAGMENT_BRANCH, FRAGMENT_ALIGN, FRAGMENT_ZERO };
+	class Fragment {															// A piece of a section, only branches and padding change size during layout
+	public:
+		FragmentKind kind = FRAGMENT_BYTES;
+		Encoding encoding;														// Of bytes
+		int condition = -1;														// Of a branch, -1 for jmp
+		bool is_short = true;
+		MachineValue target;
+		uint64_t alignment = 1;													// Of padding
+		uint64_t max_skip = 0;													// Padding that would be longer is left out, 0 for no limit
+		uint64_t size = 0;														// Of zeros, and of any fragment once laid out
+		uint64_t offset = 0;
+	};
+	class Section {
+	public:
+		std::string name;
+		SectionType type = SECTION_PROGBITS;
+		uint64_t flags = 0;
+		uint64_t alignment = 1;
+		uint64_t size = 0;
+		std::vector<Fragment> fragments;
+	};
+	class Symbol {
+	public:
+		int section = -1;														// -1 while undefined
+		size_t fragment = 0;													// Defined right before this fragment
+		bool global = false;
+		bool function = false;
+		bool is_alias = false;													// Set to an expression by .set
+		MachineValue alias;
+		bool has_size = false;
+		MachineValue size;
+	};
+	class Location {
+	public:
+		int section = -1;														// -1 if undefined, -2 for a plain number
+		uint64_t offset = 0;
+	};
+	class FrameInstruction {
+	public:
+		std::string directive;													// Without .cfi_
+		std::vector<int64_t> arguments;											// DWARF register numbers and offsets
+		size_t fragment = 0;
+	};
+	class Frame {																// From .cfi_startproc to .cfi_endproc
+	public:
+		int section = 0;
+		size_t start = 0;
+		size_t end = 0;
+		std::vector<FrameInstruction> instructions;
+	};
+	class LocalReference {														// A 1f, the label it names has to be defined later
+	public:
+		std::string label;
+		int line = 0;
+		std::string statement;
+	};
+	class LineEntry {
+	public:
+		int section = 0;
+		size_t fragment = 0;
+		int line = 0;
+		int column = 0;
+	};
+
+	std::vector<Section> sections;
+	int current_section = 0;
+	std::unordered_map<std::string, Symbol> symbols;
+	std::vector<std::string> symbol_order;										// In the order they were first seen
+	int temporary_labels = 0;
+	std::unordered_map<std::string, int> numeric_labels;						// Definitions so far of each local label like 1:
+	std::vector<LocalReference> forward_references;
+	bool in_frame = false;
+	Frame frame;
+	std::vector<Frame> frames;
+	std::string source_file = "";
+	std::vector<LineEntry> lines;
+
+	int line_number = 0;
+	std::string statement_text = "";
+
+	ObjectFile object;
+	std::unordered_map<std::string, int> object_symbols;						// Name to index in object.symbols
+
+	// PARSING
+	void parse_line(const std::string& line);
+	void parse_statement(std::string text);
+	void parse_directive(const std::string& name, const std::string& arguments);
+	void parse_instruction(const std::string& mnemonic, const std::string& operands, std::vector<uint8_t> prefixes);
+	bool parse_operand(std::string text, MachineOperand& operand);
+	bool parse_value(const std::string& text, MachineValue& value);				// symbol - symbol + number, . is the current position
+	bool parse_string(const std::string& text, std::string& value);
+	int dwarf_register(const std::string& text);								// -1 if not a register
+
+	// SECTIONS
+	void switch_section(const std::string& name, const std::string& flags = "", const std::string& type = "");
+	Symbol& symbol(const std::string& name);
+	void define_label(const std::string& name);
+	std::string temporary_label();												// A label at the current position, kept out of the symbol table
+	std::string numeric_label(const std::string& number, bool forward);			// The definition of a local label 1b or 1f refers to
+	void append(const Fragment& fragment);
+
+	// LAYOUT
+	void layout(Section& section);												// Offsets of all fragments, with branches relaxed
+	Location locate(const std::string& name, int depth = 0);
+	uint64_t position(int section, size_t fragment);
+	bool evaluate(const MachineValue& value, int64_t& result);					// False unless the value is a number
+
+	// OBJECT
+	void build_object();
+	int object_symbol(const std::string& name);									// Index of a symbol in the object, undefined ones are added
+	void resolve(int section, uint64_t field, uint64_t end, const Fixup& fixup);	// Stores the field or a relocation for it
+	void write_field(ObjectSection& section, uint64_t offset, int64_t value, int size);
+	void build_frames();														// .eh_frame
+	void build_line_table();													// .debug_line, .debug_info, .debug_abbrev and .debug_ranges
+
+	void make_error(const std::string& message);
+};
@@ -0,0 +1,750 @@
+#include "pch.h"
+#include "ast_util.h"
+#include "intrinsics.h"
+#include <limits>
+
+using std::shared_ptr, std::make_shared, std::dynamic_pointer_cast;
+
+static bool is_lowered_call(const shared_ptr<Call>& call) {					// Conversions and intrinsics become instructions in place, nothing is called
+	int size;
+	bool is_signed;
+	return conversion_type(call, size, is_signed) || intrinsic_named(call->name) != INTRINSIC_NONE;
+}
+
+shared_ptr<Compound> clone_compound(const shared_ptr<Compound>& compound) {
+	if (!compound)
+		return nullptr;
+	shared_ptr<Compound> copy = make_shared<Compound>();
+	for (const shared_ptr<Statement>& stmt : compound->statements)
+		copy->statements.push_back(clone_statement(stmt));
+	return copy;
+}
+
+shared_ptr<Statement> clone_statement(const shared_ptr<Statement>& statement) {
+	if (!statement)
+		return nullptr;
+	switch (statement->type)
+	{
+	case FUNCTION_STM: {
+		shared_ptr<Function> function = dynamic_pointer_cast<Function>(statement);
+		shared_ptr<Function> copy = make_shared<Function>(*function);
+		copy->statement = clone_compound(function->statement);
+		copy->parameters.clear();
+		for (shared_ptr<Name>& param : function->parameters)
+			copy->parameters.push_back(make_shared<Name>(param->name));
+		return copy;
+	}
+	case RETURN_STM: {
+		shared_ptr<Return> copy = make_shared<Return>(*dynamic_pointer_cast<Return>(statement));
+		copy->expression = clone_expression(copy->expression);
+		return copy;
+	}
+	case COMPOUND_STM:
+		return clone_compound(dynamic_pointer_cast<Compound>(statement));
+	case EXPR_STM: {
+		shared_ptr<ExpressionStatement> copy = make_shared<ExpressionStatement>(*dynamic_pointer_cast<ExpressionStatement>(statement));
+		copy->expression = clone_expression(copy->expression);
+		return copy;
+	}
+	case VARIABLE_DECL: {
+		shared_ptr<VariableDeclaration> copy = make_shared<VariableDeclaration>(*dynamic_pointer_cast<VariableDeclaration>(statement));
+		copy->optional_to_assign = clone_expression(copy->optional_to_assign);
+		return copy;
+	}
+	case IF_STATEMENT: {
+		shared_ptr<IfStatement> copy = make_shared<IfStatement>(*dynamic_pointer_cast<IfStatement>(statement));
+		copy->condition = clone_expression(copy->condition);
+		copy->body = clone_statement(copy->body);
+		copy->else_body = clone_statement(copy->else_body);
+		return copy;
+	}
+	case WHILE_STM:
+	case DO_WHILE_STM: {
+		shared_ptr<WhileStatement> copy = make_shared<WhileStatement>(*dynamic_pointer_cast<WhileStatement>(statement));
+		copy->condition = clone_expression(copy->condition);
+		copy->body = clone_statement(copy->body);
+		return copy;
+	}
+	case FOR_STM: {
+		shared_ptr<ForStatement> copy = make_shared<ForStatement>(*dynamic_pointer_cast<ForStatement>(statement));
+		copy->initializer = clone_statement(copy->initializer);
+		copy->condition = clone_expression(copy->condition);
+		copy->post = clone_expression(copy->post);
+		copy->body = clone_statement(copy->body);
+		return copy;
+	}
+	case MATCH_STM: {
+		shared_ptr<MatchStatement> copy = make_shared<MatchStatement>(*dynamic_pointer_cast<MatchStatement>(statement));
+		copy->expression = clone_expression(copy->expression);
+		for (MatchArm& arm : copy->arms)
+			arm.body = clone_statement(arm.body);
+		copy->default_body = clone_statement(copy->default_body);
+		return copy;
+	}
+	case ASM_STM: {
+		shared_ptr<AsmStatement> copy = make_shared<AsmStatement>(*dynamic_pointer_cast<AsmStatement>(statement));
+		for (AsmOperand& operand : copy->outputs)
+			operand.expression = clone_expression(operand.expression);
+		for (AsmOperand& operand : copy->inputs)
+			operand.expression = clone_expression(operand.expression);
+		return copy;
+	}
+	case CONTINUE_STM:
+		return make_shared<ContinueStatement>();
+	case BREAK_STM:
+		return make_shared<BreakStatement>();
+	case EMPTY_STM:
+		return make_shared<EmptyStatement>();
+	default:
+		break;
+	}
+	return statement;
+}
+
+shared_ptr<Expression> clone_expression(const shared_ptr<Expression>& expression) {
+	if (!expression)
+		return nullptr;
+	switch (expression->type)
+	{
+	case CONSTANT_EXPR:
+		return make_shared<Constant>(*dynamic_pointer_cast<Constant>(expression));
+	case NAME:
+		return make_shared<Name>(*dynamic_pointer_cast<Name>(expression));
+	case STRING_EXPR:
+		return make_shared<StringLiteral>(*dynamic_pointer_cast<StringLiteral>(expression));
+	case UNARY_EXPR: {
+		shared_ptr<UnaryExpression> unary = dynamic_pointer_cast<UnaryExpression>(expression);
+		return make_shared<UnaryExpression>(unary->operator_type, clone_expression(unary->expression));
+	}
+	case BINARY_EXPR: {
+		shared_ptr<BinaryExpression> binary = dynamic_pointer_cast<BinaryExpression>(expression);
+		return make_shared<BinaryExpression>(clone_expression(binary->expression_a), binary->operator_type, clone_expression(binary->expression_b));
+	}
+	case VARIABLE_ASSIGN: {
+		shared_ptr<VariableAssignment> copy = make_shared<VariableAssignment>(*dynamic_pointer_cast<VariableAssignment>(expression));
+		copy->index = clone_expression(copy->index);
+		copy->to_assign = clone_expression(copy->to_assign);
+		return copy;
+	}
+	case INDEX_EXPR: {
+		shared_ptr<IndexExpression> element = dynamic_pointer_cast<IndexExpression>(expression);
+		return make_shared<IndexExpression>(element->array_name, clone_expression(element->index));
+	}
+	case FIELD_EXPR: {
+		shared_ptr<FieldExpression> access = dynamic_pointer_cast<FieldExpression>(expression);
+		return make_shared<FieldExpression>(clone_expression(access->object), access->field);
+	}
+	case CALL_EXPR: {
+		shared_ptr<Call> copy = make_shared<Call>(*dynamic_pointer_cast<Call>(expression));
+		for (shared_ptr<Expression>& argument : copy->arguments)
+			argument = clone_expression(argument);
+		return copy;
+	}
+	case INLINED_CALL_EXPR: {
+		shared_ptr<InlinedCall> copy = make_shared<InlinedCall>(*dynamic_pointer_cast<InlinedCall>(expression));
+		for (shared_ptr<Expression>& argument : copy->arguments)
+			argument = clone_expression(argument);
+		copy->body = clone_compound(copy->body);
+		return copy;
+	}
+	default:
+		break;
+	}
+	return expression;
+}
+
+int statement_size(const shared_ptr<Statement>& statement) {
+	if (!statement)
+		return 0;
+	switch (statement->type)
+	{
+	case FUNCTION_STM:
+		return statement_size(dynamic_pointer_cast<Function>(statement)->statement);
+	case RETURN_STM:
+		return 1 + expression_size(dynamic_pointer_cast<Return>(statement)->expression);
+	case COMPOUND_STM: {
+		int size = 0;
+		for (shared_ptr<Statement>& stmt : dynamic_pointer_cast<Compound>(statement)->statements)
+			size += statement_size(stmt);
+		return size;
+	}
+	case EXPR_STM:
+		return expression_size(dynamic_pointer_cast<ExpressionStatement>(statement)->expression);
+	case VARIABLE_DECL:
+		return 1 + expression_size(dynamic_pointer_cast<VariableDeclaration>(statement)->optional_to_assign);
+	case IF_STATEMENT: {
+		shared_ptr<IfStatement> if_stmt = dynamic_pointer_cast<IfStatement>(statement);
+		return 2 + expression_size(if_stmt->condition) + statement_size(if_stmt->body) + statement_size(if_stmt->else_body);
+	}
+	case WHILE_STM:
+	case DO_WHILE_STM: {
+		shared_ptr<WhileStatement> while_stmt = dynamic_pointer_cast<WhileStatement>(statement);
+		return 2 + expression_size(while_stmt->condition) + statement_size(while_stmt->body);
+	}
+	case FOR_STM: {
+		shared_ptr<ForStatement> for_stmt = dynamic_pointer_cast<ForStatement>(statement);
+		return 2 + statement_size(for_stmt->initializer) + expression_size(for_stmt->condition)
+			+ expression_size(for_stmt->post) + statement_size(for_stmt->body);
+	}
+	case MATCH_STM: {
+		shared_ptr<MatchStatement> match_stmt = dynamic_pointer_cast<MatchStatement>(statement);
+		int size = 2 + expression_size(match_stmt->expression) + statement_size(match_stmt->default_body);
+		for (MatchArm& arm : match_stmt->arms)
+			size += (int)arm.ranges.size() + statement_size(arm.body);
+		return size;
+	}
+	case ASM_STM: {																// Every line of the template is at least one instruction
+		shared_ptr<AsmStatement> asm_stmt = dynamic_pointer_cast<AsmStatement>(statement);
+		int size = 1 + (int)std::count(asm_stmt->assembly.begin(), asm_stmt->assembly.end(), '\n');
+		for (AsmOperand& operand : asm_stmt->outputs)
+			size += expression_size(operand.expression);
+		for (AsmOperand& operand : asm_stmt->inputs)
+			size += expression_size(operand.expression);
+		return size;
+	}
+	case CONTINUE_STM:
+	case BREAK_STM:
+		return 1;
+	default:
+		break;
+	}
+	return 0;
+}
+
+int expression_size(const shared_ptr<Expression>& expression) {
+	if (!expression)
+		return 0;
+	switch (expression->type)
+	{
+	case UNARY_EXPR:
+		return 1 + expression_size(dynamic_pointer_cast<UnaryExpression>(expression)->expression);
+	case BINARY_EXPR: {
+		shared_ptr<BinaryExpression> binary = dynamic_pointer_cast<BinaryExpression>(expression);
+		return 1 + expression_size(binary->expression_a) + expression_size(binary->expression_b);
+	}
+	case VARIABLE_ASSIGN: {
+		shared_ptr<VariableAssignment> assignment = dynamic_pointer_cast<VariableAssignment>(expression);
+		return 1 + expression_size(assignment->index) + expression_size(assignment->to_assign);
+	}
+	case INDEX_EXPR:
+		return 1 + expression_size(dynamic_pointer_cast<IndexExpression>(expression)->index);
+	case FIELD_EXPR:
+		return expression_size(dynamic_pointer_cast<FieldExpression>(expression)->object);
+	case CALL_EXPR: {
+		shared_ptr<Call> call = dynamic_pointer_cast<Call>(expression);
+		bool is_lowered = is_lowered_call(call);
+		int size = is_lowered ? 1 : 3;											// Argument setup, call and cleanup
+		for (shared_ptr<Expression>& argument : call->arguments)
+			size += (is_lowered ? 0 : 1) + expression_size(argument);				// Lowered calls take their arguments in registers
+		return size;
+	}
+	case INLINED_CALL_EXPR: {
+		shared_ptr<InlinedCall> inlined = dynamic_pointer_cast<InlinedCall>(expression);
+		int size = statement_size(inlined->body);
+		for (shared_ptr<Expression>& argument : inlined->arguments)
+			size += 1 + expression_size(argument);
+		return size;
+	}
+	default:
+		break;
+	}
+	return 1;
+}
+
+bool has_side_effects(const shared_ptr<Expression>& expression) {
+	if (!expression)
+		return false;
+	switch (expression->type)
+	{
+	case UNARY_EXPR:
+		return has_side_effects(dynamic_pointer_cast<UnaryExpression>(expression)->expression);
+	case BINARY_EXPR: {
+		shared_ptr<BinaryExpression> binary = dynamic_pointer_cast<BinaryExpression>(expression);
+		return has_side_effects(binary->expression_a) || has_side_effects(binary->expression_b);
+	}
+	case INDEX_EXPR:
+		return has_side_effects(dynamic_pointer_cast<IndexExpression>(expression)->index);
+	case FIELD_EXPR:
+		return has_side_effects(dynamic_pointer_cast<FieldExpression>(expression)->object);
+	case CALL_EXPR: {
+		shared_ptr<Call> call = dynamic_pointer_cast<Call>(expression);
+		long long length;
+		if (intrinsic_named(call->name) == INTRINSIC_PREFETCH)					// Kept for its effect on the cache
+			return true;
+		if (is_lowered_call(call))
+			return std::any_of(call->arguments.begin(), call->arguments.end(), [](const shared_ptr<Expression>& argument) { return has_side_effects(argument); });
+		return !evaluate_length(call, length);
+	}
+	case VARIABLE_ASSIGN:
+	case INLINED_CALL_EXPR:
+		return true;
+	default:
+		break;
+	}
+	return false;
+}
+
+bool evaluate_length(const shared_ptr<Call>& call, long long& length) {
+	if (call->name != "len" || call->arguments.size() != 1 || !call->arguments[0] || call->arguments[0]->type != STRING_EXPR)
+		return false;
+	length = dynamic_pointer_cast<StringLiteral>(call->arguments[0])->value.size();
+	return true;
+}
+
+bool conversion_type(const shared_ptr<Call>& call, int& size, bool& is_signed) {
+	return call->arguments.size() == 1 && call->arguments[0] && integer_type_named(call->name, size, is_signed);
+}
+
+long long convert_integer(long long value, int size, bool is_signed) {
+	if (size >= 8)
+		return value;
+	uint64_t bits = (uint64_t)value & ((1ULL << (8 * size)) - 1);
+	if (is_signed && (bits >> (8 * size - 1)))
+		bits |= ~((1ULL << (8 * size)) - 1);									// Sign extends
+	return (long long)bits;
+}
+
+bool evaluate_constant(const shared_ptr<Expression>& expression, long long& value) {
+	if (!expression)
+		return false;
+	switch (expression->type)
+	{
+	case CONSTANT_EXPR:
+		value = dynamic_pointer_cast<Constant>(expression)->value;
+		return true;
+	case UNARY_EXPR: {
+		shared_ptr<UnaryExpression> unary = dynamic_pointer_cast<UnaryExpression>(expression);
+		long long operand;
+		if (!evaluate_constant(unary->expression, operand))
+			return false;
+		switch (unary->operator_type)
+		{
+		case TOKEN_MINUS:
+			value = (long long)(0 - (uint64_t)operand);							// Wraps like neg does
+			return true;
+		case TOKEN_BANG:
+			value = !operand;
+			return true;
+		case TOKEN_TILDE:
+			value = ~operand;
+			return true;
+		default:
+			break;
+		}
+		return false;
+	}
+	case BINARY_EXPR: {
+		shared_ptr<BinaryExpression> binary = dynamic_pointer_cast<BinaryExpression>(expression);
+		long long a, b;
+		if (!evaluate_constant(binary->expression_a, a) || !evaluate_constant(binary->expression_b, b))
+			return false;
+		switch (binary->operator_type)
+		{
+		case TOKEN_PLUS:			value = (long long)((uint64_t)a + (uint64_t)b); return true;	// Wraps like the add, sub and imul instructions
+		case TOKEN_MINUS:			value = (long long)((uint64_t)a - (uint64_t)b); return true;
+		case TOKEN_STAR:			value = (long long)((uint64_t)a * (uint64_t)b); return true;
+		case TOKEN_SLASH:
+			if (b == 0 || (a == std::numeric_limits<long long>::min() && b == -1))
+				return false;													// Left for the program to trap at run time
+			value = a / b;
+			return true;
+		case TOKEN_PERCENT:
+			if (b == 0 || (a == std::numeric_limits<long long>::min() && b == -1))
+				return false;
+			value = a % b;
+			return true;
+		case TOKEN_EQUAL_EQUAL:		value = a == b; return true;
+		case TOKEN_BANG_EQUAL:		value = a != b; return true;
+		case TOKEN_GREATER_EQUAL:	value = a >= b; return true;
+		case TOKEN_LESS_EQUAL:		value = a <= b; return true;
+		case TOKEN_GREATER:			value = a > b; return true;
+		case TOKEN_LESS:			value = a < b; return true;
+		case TOKEN_OR:				value = a || b; return true;
+		case TOKEN_AND:				value = a && b; return true;
+		default:
+			break;
+		}
+		return false;
+	}
+	case CALL_EXPR: {
+		shared_ptr<Call> call = dynamic_pointer_cast<Call>(expression);
+		int size;
+		bool is_signed;
+		if (conversion_type(call, size, is_signed) && evaluate_constant(call->arguments[0], value)) {
+			value = convert_integer(value, size, is_signed);
+			return true;
+		}
+		Intrinsic intrinsic = intrinsic_named(call->name);
+		if (intrinsic != INTRINSIC_NONE) {
+			std::vector<long long> arguments(call->arguments.size());
+			for (size_t i = 0; i < call->arguments.size(); i++) {
+				if (!evaluate_constant(call->arguments[i], arguments[i]))
+					return false;
+			}
+			return fold_intrinsic(intrinsic, arguments, value);
+		}
+		return evaluate_length(call, value);
+	}
+	default:
+		break;
+	}
+	return false;
+}
+
+bool contains_call(const shared_ptr<Statement>& statement) {
+	if (!statement)
+		return false;
+	switch (statement->type)
+	{
+	case RETURN_STM:
+		return contains_call(dynamic_pointer_cast<Return>(statement)->expression);
+	case COMPOUND_STM:
+		for (shared_ptr<Statement>& stmt : dynamic_pointer_cast<Compound>(statement)->statements) {
+			if (contains_call(stmt))
+				return true;
+		}
+		return false;
+	case EXPR_STM:
+		return contains_call(dynamic_pointer_cast<ExpressionStatement>(statement)->expression);
+	case VARIABLE_DECL:
+		return contains_call(dynamic_pointer_cast<VariableDeclaration>(statement)->optional_to_assign);
+	case IF_STATEMENT: {
+		shared_ptr<IfStatement> if_stmt = dynamic_pointer_cast<IfStatement>(statement);
+		return contains_call(if_stmt->condition) || contains_call(if_stmt->body) || contains_call(if_stmt->else_body);
+	}
+	case WHILE_STM:
+	case DO_WHILE_STM: {
+		shared_ptr<WhileStatement> while_stmt = dynamic_pointer_cast<WhileStatement>(statement);
+		return contains_call(while_stmt->condition) || contains_call(while_stmt->body);
+	}
+	case FOR_STM: {
+		shared_ptr<ForStatement> for_stmt = dynamic_pointer_cast<ForStatement>(statement);
+		return contains_call(for_stmt->initializer) || contains_call(for_stmt->condition)
+			|| contains_call(for_stmt->post) || contains_call(for_stmt->body);
+	}
+	case MATCH_STM: {
+		shared_ptr<MatchStatement> match_stmt = dynamic_pointer_cast<MatchStatement>(statement);
+		if (contains_call(match_stmt->expression) || contains_call(match_stmt->default_body))
+			return true;
+		return std::any_of(match_stmt->arms.begin(), match_stmt->arms.end(), [](MatchArm& arm) { return contains_call(arm.body); });
+	}
+	case ASM_STM: {																// The template itself may call, but it says so with a clobber
+		shared_ptr<AsmStatement> asm_stmt = dynamic_pointer_cast<AsmStatement>(statement);
+		auto has_call = [](const AsmOperand& operand) { return contains_call(operand.expression); };
+		return std::any_of(asm_stmt->outputs.begin(), asm_stmt->outputs.end(), has_call)
+			|| std::any_of(asm_stmt->inputs.begin(), asm_stmt->inputs.end(), has_call);
+	}
+	default:
+		break;
+	}
+	return false;
+}
+
+bool contains_call(const shared_ptr<Expression>& expression) {
+	if (!expression)
+		return false;
+	switch (expression->type)
+	{
+	case UNARY_EXPR:
+		return contains_call(dynamic_pointer_cast<UnaryExpression>(expression)->expression);
+	case BINARY_EXPR: {
+		shared_ptr<BinaryExpression> binary = dynamic_pointer_cast<BinaryExpression>(expression);
+		return contains_call(binary->expression_a) || contains_call(binary->expression_b);
+	}
+	case VARIABLE_ASSIGN: {
+		shared_ptr<VariableAssignment> assignment = dynamic_pointer_cast<VariableAssignment>(expression);
+		return contains_call(assignment->index) || contains_call(assignment->to_assign);
+	}
+	case INDEX_EXPR:
+		return contains_call(dynamic_pointer_cast<IndexExpression>(expression)->index);
+	case FIELD_EXPR:
+		return contains_call(dynamic_pointer_cast<FieldExpression>(expression)->object);
+	case CALL_EXPR: {
+		shared_ptr<Call> call = dynamic_pointer_cast<Call>(expression);
+		long long length;
+		if (is_lowered_call(call))
+			return std::any_of(call->arguments.begin(), call->arguments.end(), [](const shared_ptr<Expression>& argument) { return contains_call(argument); });
+		return !evaluate_length(call, length);									// len of a literal is folded, nothing is called
+	}
+	case INLINED_CALL_EXPR: {
+		shared_ptr<InlinedCall> inlined = dynamic_pointer_cast<InlinedCall>(expression);
+		for (shared_ptr<Expression>& argument : inlined->arguments) {
+			if (contains_call(argument))
+				return true;
+		}
+		return contains_call(inlined->body);
+	}
+	default:
+		break;
+	}
+	return false;
+}
+
+bool exits_loop(const shared_ptr<Statement>& statement) {
+	if (!statement)
+		return false;
+	switch (statement->type)
+	{
+	case BREAK_STM:
+	case CONTINUE_STM:
+		return true;
+	case COMPOUND_STM:
+		for (shared_ptr<Statement>& stmt : dynamic_pointer_cast<Compound>(statement)->statements) {
+			if (exits_loop(stmt))
+				return true;
+		}
+		return false;
+	case IF_STATEMENT: {
+		shared_ptr<IfStatement> if_stmt = dynamic_pointer_cast<IfStatement>(statement);
+		return exits_loop(if_stmt->body) || exits_loop(if_stmt->else_body);
+	}
+	case MATCH_STM: {
+		shared_ptr<MatchStatement> match_stmt = dynamic_pointer_cast<MatchStatement>(statement);
+		if (exits_loop(match_stmt->default_body))
+			return true;
+		return std::any_of(match_stmt->arms.begin(), match_stmt->arms.end(), [](MatchArm& arm) { return exits_loop(arm.body); });
+	}
+	default:
+		break;																	// Inner loops own their breaks and continues
+	}
+	return false;
+}
+
+bool writes_name(const shared_ptr<Statement>& statement, const std::string& name) {
+	if (!statement)
+		return false;
+	switch (statement->type)
+	{
+	case RETURN_STM:
+		return writes_name(dynamic_pointer_cast<Return>(statement)->expression, name);
+	case COMPOUND_STM:
+		for (shared_ptr<Statement>& stmt : dynamic_pointer_cast<Compound>(statement)->statements) {
+			if (writes_name(stmt, name))
+				return true;
+		}
+		return false;
+	case EXPR_STM:
+		return writes_name(dynamic_pointer_cast<ExpressionStatement>(statement)->expression, name);
+	case VARIABLE_DECL: {
+		shared_ptr<VariableDeclaration> decl = dynamic_pointer_cast<VariableDeclaration>(statement);
+		return decl->variable_name == name || writes_name(decl->optional_to_assign, name);
+	}
+	case IF_STATEMENT: {
+		shared_ptr<IfStatement> if_stmt = dynamic_pointer_cast<IfStatement>(statement);
+		return writes_name(if_stmt->condition, name) || writes_name(if_stmt->body, name) || writes_name(if_stmt->else_body, name);
+	}
+	case WHILE_STM:
+	case DO_WHILE_STM: {
+		shared_ptr<WhileStatement> while_stmt = dynamic_pointer_cast<WhileStatement>(statement);
+		return writes_name(while_stmt->condition, name) || writes_name(while_stmt->body, name);
+	}
+	case FOR_STM: {
+		shared_ptr<ForStatement> for_stmt = dynamic_pointer_cast<ForStatement>(statement);
+		return writes_name(for_stmt->initializer, name) || writes_name(for_stmt->condition, name)
+			|| writes_name(for_stmt->post, name) || writes_name(for_stmt->body, name);
+	}
+	case MATCH_STM: {
+		shared_ptr<MatchStatement> match_stmt = dynamic_pointer_cast<MatchStatement>(statement);
+		if (writes_name(match_stmt->expression, name) || writes_name(match_stmt->default_body, name))
+			return true;
+		return std::any_of(match_stmt->arms.begin(), match_stmt->arms.end(), [&](MatchArm& arm) { return writes_name(arm.body, name); });
+	}
+	case ASM_STM: {
+		shared_ptr<AsmStatement> asm_stmt = dynamic_pointer_cast<AsmStatement>(statement);
+		for (AsmOperand& operand : asm_stmt->outputs) {
+			if (operand_variable(operand.expression) == name)
+				return true;
+		}
+		std::vector<std::string> symbols = assembly_symbols(asm_stmt->assembly);	// A template may store to a global by its symbol
+		return std::find(symbols.begin(), symbols.end(), name) != symbols.end();
+	}
+	default:
+		break;
+	}
+	return false;
+}
+
+bool writes_name(const shared_ptr<Expression>& expression, const std::string& name) {
+	if (!expression)
+		return false;
+	switch (expression->type)
+	{
+	case UNARY_EXPR:
+		return writes_name(dynamic_pointer_cast<UnaryExpression>(expression)->expression, name);
+	case BINARY_EXPR: {
+		shared_ptr<BinaryExpression> binary = dynamic_pointer_cast<BinaryExpression>(expression);
+		return writes_name(binary->expression_a, name) || writes_name(binary->expression_b, name);
+	}
+	case VARIABLE_ASSIGN: {
+		shared_ptr<VariableAssignment> assignment = dynamic_pointer_cast<VariableAssignment>(expression);
+		return assignment->variable_name == name || writes_name(assignment->index, name) || writes_name(assignment->to_assign, name);
+	}
+	case INDEX_EXPR:
+		return writes_name(dynamic_pointer_cast<IndexExpression>(expression)->index, name);
+	case FIELD_EXPR:
+		return writes_name(dynamic_pointer_cast<FieldExpression>(expression)->object, name);
+	case CALL_EXPR:
+		for (shared_ptr<Expression>& argument : dynamic_pointer_cast<Call>(expression)->arguments) {
+			if (writes_name(argument, name))
+				return true;
+		}
+		return false;
+	case INLINED_CALL_EXPR: {
+		shared_ptr<InlinedCall> inlined = dynamic_pointer_cast<InlinedCall>(expression);
+		for (shared_ptr<Expression>& argument : inlined->arguments) {
+			if (writes_name(argument, name))
+				return true;
+		}
+		return writes_name(inlined->body, name);
+	}
+	default:
+		break;
+	}
+	return false;
+}
+
+void replace_name(shared_ptr<Statement>& statement, const std::string& name, const shared_ptr<Expression>& value) {
+	if (!statement)
+		return;
+	switch (statement->type)
+	{
+	case RETURN_STM:
+		replace_name(dynamic_pointer_cast<Return>(statement)->expression, name, value);
+		break;
+	case COMPOUND_STM:
+		for (shared_ptr<Statement>& stmt : dynamic_pointer_cast<Compound>(statement)->statements)
+			replace_name(stmt, name, value);
+		break;
+	case EXPR_STM:
+		replace_name(dynamic_pointer_cast<ExpressionStatement>(statement)->expression, name, value);
+		break;
+	case VARIABLE_DECL:
+		replace_name(dynamic_pointer_cast<VariableDeclaration>(statement)->optional_to_assign, name, value);
+		break;
+	case IF_STATEMENT: {
+		shared_ptr<IfStatement> if_stmt = dynamic_pointer_cast<IfStatement>(statement);
+		replace_name(if_stmt->condition, name, value);
+		replace_name(if_stmt->body, name, value);
+		replace_name(if_stmt->else_body, name, value);
+		break;
+	}
+	case WHILE_STM:
+	case DO_WHILE_STM: {
+		shared_ptr<WhileStatement> while_stmt = dynamic_pointer_cast<WhileStatement>(statement);
+		replace_name(while_stmt->condition, name, value);
+		replace_name(while_stmt->body, name, value);
+		break;
+	}
+	case FOR_STM: {
+		shared_ptr<ForStatement> for_stmt = dynamic_pointer_cast<ForStatement>(statement);
+		replace_name(for_stmt->initializer, name, value);
+		replace_name(for_stmt->condition, name, value);
+		replace_name(for_stmt->post, name, value);
+		replace_name(for_stmt->body, name, value);
+		break;
+	}
+	case MATCH_STM: {
+		shared_ptr<MatchStatement> match_stmt = dynamic_pointer_cast<MatchStatement>(statement);
+		replace_name(match_stmt->expression, name, value);
+		for (MatchArm& arm : match_stmt->arms)
+			replace_name(arm.body, name, value);
+		replace_name(match_stmt->default_body, name, value);
+		break;
+	}
+	case ASM_STM: {																// Outputs are stored to, only their indices are read
+		shared_ptr<AsmStatement> asm_stmt = dynamic_pointer_cast<AsmStatement>(statement);
+		for (AsmOperand& operand : asm_stmt->outputs) {
+			if (operand.expression && operand.expression->type != NAME)
+				replace_name(operand.expression, name, value);
+		}
+		for (AsmOperand& operand : asm_stmt->inputs)
+			replace_name(operand.expression, name, value);
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+void replace_name(shared_ptr<Expression>& expression, const std::string& name, const shared_ptr<Expression>& value) {
+	if (!expression)
+		return;
+	switch (expression->type)
+	{
+	case NAME:
+		if (dynamic_pointer_cast<Name>(expression)->name == name)
+			expression = clone_expression(value);
+		break;
+	case UNARY_EXPR:
+		replace_name(dynamic_pointer_cast<UnaryExpression>(expression)->expression, name, value);
+		break;
+	case BINARY_EXPR: {
+		shared_ptr<BinaryExpression> binary = dynamic_pointer_cast<BinaryExpression>(expression);
+		replace_name(binary->expression_a, name, value);
+		replace_name(binary->expression_b, name, value);
+		break;
+	}
+	case VARIABLE_ASSIGN: {
+		shared_ptr<VariableAssignment> assignment = dynamic_pointer_cast<VariableAssignment>(expression);
+		replace_name(assignment->index, name, value);
+		replace_name(assignment->to_assign, name, value);
+		break;
+	}
+	case INDEX_EXPR:
+		replace_name(dynamic_pointer_cast<IndexExpression>(expression)->index, name, value);
+		break;
+	case FIELD_EXPR:															// The struct itself has no value to substitute, only an index does
+		if (dynamic_pointer_cast<FieldExpression>(expression)->object->type == INDEX_EXPR)
+			replace_name(dynamic_pointer_cast<FieldExpression>(expression)->object, name, value);
+		break;
+	case CALL_EXPR:
+		for (shared_ptr<Expression>& argument : dynamic_pointer_cast<Call>(expression)->arguments)
+			replace_name(argument, name, value);
+		break;
+	case INLINED_CALL_EXPR: {
+		shared_ptr<InlinedCall> inlined = dynamic_pointer_cast<InlinedCall>(expression);
+		for (shared_ptr<Expression>& argument : inlined->arguments)
+			replace_name(argument, name, value);
+		if (std::find(inlined->parameters.begin(), inlined->parameters.end(), name) == inlined->parameters.end()) {
+			shared_ptr<Statement> body = inlined->body;							// The body sees the caller's variables unless a parameter hides them
+			replace_name(body, name, value);
+		}
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+std::string operand_variable(const shared_ptr<Expression>& expression) {
+	if (!expression)
+		return "";
+	switch (expression->type)
+	{
+	case NAME:
+		return dynamic_pointer_cast<Name>(expression)->name;
+	case INDEX_EXPR:
+		return dynamic_pointer_cast<IndexExpression>(expression)->array_name;
+	case FIELD_EXPR:
+		return operand_variable(dynamic_pointer_cast<FieldExpression>(expression)->object);
+	default:
+		break;
+	}
+	return "";
+}
+
+std::vector<std::string> assembly_symbols(const std::string& assembly) {
+	std::vector<std::string> symbols;
+	for (size_t i = 0; i < assembly.size();) {
+		if (!std::isalpha((unsigned char)assembly[i]) && assembly[i] != '_') {
+			i++;
+			continue;
+		}
+		size_t start = i;
+		while (i < assembly.size() && (std::isalnum((unsigned char)assembly[i]) || assembly[i] == '_'))
+			i++;
+		if (start == 0 || (assembly[start - 1] != '%' && !std::isdigit((unsigned char)assembly[start - 1])))	// Registers and the digits of numbers such as 0x10
+			symbols.push_back(assembly.substr(start, i - start));
+	}
+	return symbols;
+}
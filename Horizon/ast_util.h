@@ -0,0 +1,29 @@
+#pragma once
+#include <memory>
+#include <string>
+#include <vector>
+#include "parser.h"
+
+// Helpers shared by the AST optimization passes
+
+std::shared_ptr<Statement> clone_statement(const std::shared_ptr<Statement>& statement);		// Deep copies a statement
+std::shared_ptr<Expression> clone_expression(const std::shared_ptr<Expression>& expression);	// Deep copies an expression
+std::shared_ptr<Compound> clone_compound(const std::shared_ptr<Compound>& compound);
+
+int statement_size(const std::shared_ptr<Statement>& statement);								// Counts the nodes of a statement, used as a code size estimate
+int expression_size(const std::shared_ptr<Expression>& expression);
+
+bool contains_call(const std::shared_ptr<Statement>& statement);							// True if a call is left in the statement
+bool contains_call(const std::shared_ptr<Expression>& expression);
+bool exits_loop(const std::shared_ptr<Statement>& statement);								// True if the statement breaks or continues the enclosing loop
+bool writes_name(const std::shared_ptr<Statement>& statement, const std::string& name);	// True if the name is assigned or declared in the statement
+bool writes_name(const std::shared_ptr<Expression>& expression, const std::string& name);
+void replace_name(std::shared_ptr<Statement>& statement, const std::string& name, const std::shared_ptr<Expression>& value);	// Substitutes a copy of value for every read of the name
+void replace_name(std::shared_ptr<Expression>& expression, const std::string& name, const std::shared_ptr<Expression>& value);
+bool has_side_effects(const std::shared_ptr<Expression>& expression);						// True if the expression assigns or calls
+bool evaluate_constant(const std::shared_ptr<Expression>& expression, long long& value);	// Folds an expression made only of constants, false if it isn't one
+bool evaluate_length(const std::shared_ptr<Call>& call, long long& length);				// Folds len of a string literal, the only form len accepts
+bool conversion_type(const std::shared_ptr<Call>& call, int& size, bool& is_signed);		// True for a conversion such as i32(x), a call of an integer type name
+long long convert_integer(long long value, int size, bool is_signed);						// Wraps a value to an integer type of size bytes
+std::string operand_variable(const std::shared_ptr<Expression>& expression);				// Variable an asm operand names, empty if it isn't a variable, an element or a field
+std::vector<std::string> assembly_symbols(const std::string& assembly);						// Identifiers in an asm template other than registers, which may be globals or functions
@@ -1,18 +1,54 @@
 #include "pch.h"
 #include "codegen.h"
+#include "ast_util.h"
+#include "layout.h"
+#include "intrinsics.h"
+#include "targets.h"
+#include "trace.h"
 #include <string>
 #include <format>
+#include <bit>
+#include <cstdint>
+#include <limits>
 
-using std::shared_ptr, std::dynamic_pointer_cast;
+using std::shared_ptr, std::make_shared, std::dynamic_pointer_cast;
+
+static const std::array<std::string, 6> argument_registers = { "%rdi", "%rsi", "%rdx", "%rcx", "%r8", "%r9" };	// System V integer argument registers
+static const std::array<std::string, 14> asm_registers = { "%rax", "%rcx", "%rdx", "%rsi", "%rdi", "%r8", "%r9", "%r10", "%r11",	// Given to r operands in order,
+	"%rbx", "%r12", "%r13", "%r14", "%r15" };																						// callee saved ones last
 
 void CodeGenerator::generate_asm() {
+	for (shared_ptr<Statement>& stmt : ast->statements) {								// Calls may come before the declaration of their callee
+		if (stmt && stmt->type == FUNCTION_STM)
+			functions[dynamic_pointer_cast<Function>(stmt)->name] = dynamic_pointer_cast<Function>(stmt);
+	}
 	for (shared_ptr<Statement>& stmt : ast->statements) {								// For every statement in the AST, generate assembly instructions
 		generate_statement(stmt);
 	}
-	assembly_out = headers + ".text\n" + text;
+	generate_global_section(".data", data_globals);
+	generate_global_section(".bss", bss_globals);
+	if (!options.profile_generate.empty())
+		generate_profile_writer();
+	if (!options.trace.empty()) {
+		headers += trace_data(traced_functions, options.trace, options.trace_buffer_entries);
+		text += trace_routines(options.trace_buffer_entries);
+	}
+	if (!dispatch_pointers.empty())
+		headers += ".data\n.align 8\n" + dispatch_pointers;
+	if (uses_cpu_features)
+		text += cpu_features_routine();
+	rodata += string_pool.emit();
+	assembly_out = headers;
+	if (options.debug_info)
+		assembly_out = std::format(".file 1 \"{0}\"\n", source_file.empty() ? "<stdin>" : source_file) + assembly_out;
+	if (!rodata.empty())
+		assembly_out += ".section .rodata\n" + rodata;
+	assembly_out += ".text\n" + text;
+	if (!cold_text.empty())															// Rarely run blocks are kept away from the hot code
+		assembly_out += ".section .text.unlikely,\"ax\",@progbits\n" + cold_text;
 }
 
-int CodeGenerator::do_operation(shared_ptr<Expression> expression) {
+long long CodeGenerator::do_operation(shared_ptr<Expression> expression) {
 	switch (expression->type)																								// to_where is the register to set a value
 	{
 	case CONSTANT_EXPR:
@@ -23,7 +59,7 @@ int CodeGenerator::do_operation(shared_ptr<Expression> expression) {
 		switch (unary->operator_type)
 		{
 		case TOKEN_MINUS:
-			return -do_operation(unary->expression);
+			return (long long)(0 - (uint64_t)do_operation(unary->expression));		// Wraps like neg does
 		case TOKEN_BANG:															// In NOT operation 0 becomes true and anything else false
 			return !do_operation(unary->expression);
 		case TOKEN_TILDE:
@@ -38,16 +74,26 @@ int CodeGenerator::do_operation(shared_ptr<Expression> expression) {
 		shared_ptr<BinaryExpression> binary = dynamic_pointer_cast<BinaryExpression>(expression);
 		switch (binary->operator_type)
 		{
-		case TOKEN_PLUS:
-			return do_operation(binary->expression_a) + do_operation(binary->expression_b);
+		case TOKEN_PLUS:															// Wraps like the add, sub and imul instructions
+			return (long long)((uint64_t)do_operation(binary->expression_a) + (uint64_t)do_operation(binary->expression_b));
 		case TOKEN_STAR:
-			return do_operation(binary->expression_a) * do_operation(binary->expression_b);
+			return (long long)((uint64_t)do_operation(binary->expression_a) * (uint64_t)do_operation(binary->expression_b));
 		case TOKEN_MINUS:
-			return do_operation(binary->expression_a) - do_operation(binary->expression_b);
+			return (long long)((uint64_t)do_operation(binary->expression_a) - (uint64_t)do_operation(binary->expression_b));
 		case TOKEN_SLASH:
-			return do_operation(binary->expression_a) / do_operation(binary->expression_b);
-		case TOKEN_PERCENT:
-			return do_operation(binary->expression_a) % do_operation(binary->expression_b);
+		case TOKEN_PERCENT: {
+			long long a = do_operation(binary->expression_a);
+			long long b = do_operation(binary->expression_b);
+			if (b == 0) {
+				make_error("Division by zero in constant");
+				return 0;
+			}
+			if (a == std::numeric_limits<long long>::min() && b == -1) {			// idiv would trap, there is no program yet to trap in
+				make_error("Division overflows in constant");
+				return 0;
+			}
+			return binary->operator_type == TOKEN_SLASH ? a / b : a % b;
+		}
 		case TOKEN_EQUAL_EQUAL:
 			return do_operation(binary->expression_a) == do_operation(binary->expression_b);
 		case TOKEN_BANG_EQUAL:
@@ -69,17 +115,23 @@ int CodeGenerator::do_operation(shared_ptr<Expression> expression) {
 		}
 		break;
 	}
+	case STRING_EXPR:															// Addresses are only known to the linker, see simplify
 	case NAME:
 	default:
-		op_error = true;
-		return 0;
 		break;
 	}
+	op_error = true;
+	return 0;
 }
 
 
 std::string CodeGenerator::simplify(shared_ptr<Expression> expression) {
-	int to_ret = do_operation(expression);
+	if (expression->type == STRING_EXPR)										// The linker fills in the address of the pooled string
+		return string_pool.label(dynamic_pointer_cast<StringLiteral>(expression)->value);
+	long long length;
+	if (expression->type == CALL_EXPR && evaluate_length(dynamic_pointer_cast<Call>(expression), length))
+		return std::to_string(length);
+	long long to_ret = do_operation(expression);
 	if (op_error)
 		make_error("Cannot assign non constant");
 	op_error = false;
@@ -93,41 +145,439 @@ void CodeGenerator::generate_function_decl(const shared_ptr<Function>& function)
 	else {
 		global_variables.push_back(function->name);
 	}
+	if (function->is_extern || imported.contains(function->name))						// Defined elsewhere, only its name is needed for calls
+		return;
+	headers += std::format(".globl {0}\n", function->name);
+	long long entries;
+	bool is_cold = options.split_cold_code && profile && profile->function_entries(function->name, entries) && entries == 0;
+	std::string hot_text;
+	if (is_cold) {																		// Functions that never ran are kept away from the hot code
+		hot_text = std::move(text);
+		text = "";
+		in_cold_code = true;
+	}
+	if (!function->targets.empty())
+		generate_multiversioned_function(function);
+	else
+		generate_function_body(function, function->name);
+	if (is_cold) {
+		in_cold_code = false;
+		cold_text += text;
+		text = std::move(hot_text);
+	}
+}
+
+void CodeGenerator::generate_function_body(const shared_ptr<Function>& function, const std::string& label) {
 	new_scope();
-	int param_index = 16;
+	stack_index = 0;																	// Locals are addressed from this function's own frame
+	local_array_lengths.clear();
+	local_vector_types.clear();
+	local_structs.clear();
 	// Parameters:
-	for (shared_ptr<Name>& i : function->parameters) {
-		if (local_variables[local_variables.size() - 1].find(i->name) != local_variables[local_variables.size() - 1].end()) {
-			make_error("Already declared variable " + i->name + " in this scope");
+	for (size_t i = 0; i < function->parameters.size(); i++) {
+		const std::string& parameter = function->parameters[i]->name;
+		if (local_variables[local_variables.size() - 1].find(parameter) != local_variables[local_variables.size() - 1].end()) {
+			make_error("Already declared variable " + parameter + " in this scope");
 		}
 
-		local_variables[local_variables.size() - 1][i->name] = param_index;
-		param_index += 8;
+		local_variables[local_variables.size() - 1][parameter] = parameter_offset(i);
 	}
+	int register_parameters = std::min(function->parameters.size(), argument_registers.size());
+	stack_index = -8 * register_parameters;											// Register parameters are spilled below the frame base
 
+	current_function = function;
+	int max_depth = 0;																	// Lay out the frame before emitting anything, slots of
+	measure_frame(function->statement, -stack_index, max_depth);						// disjoint scopes share the same offsets
+	max_depth = std::max(max_depth, -stack_index);
+	frame_size = (max_depth + 15) / 16 * 16;											// Keeps %rsp 16 byte aligned
+	bool starts_runtime = function->name == "main" && (!options.profile_generate.empty() || !options.trace.empty());	// main calls into the runtime first
+	has_frame_pointer = !(options.omit_leaf_frame_pointer && !contains_call(function->statement) && !starts_runtime);
+	push_depth = 0;
 
-	headers += std::format(".globl {0}\n", function->name);						
-	generate_label(function->name);														
-	generate_instruction("push %rbp");													// } Function prologue, save stack frame
-	generate_instruction("mov %rsp, %rbp");												// }
+	generate_header(std::format(".type {0}, @function", label));					// Symbol sizes let profilers attribute samples
+	generate_label(label);
+	generate_cfi(".cfi_startproc");
+	generate_line(function);
+	generate_prologue();
+	for (int i = 0; i < register_parameters; i++)
+		generate_instruction(std::format("mov {0}, {1}", argument_registers[i], stack_slot(parameter_offset(i))));
+	if (starts_runtime && !options.profile_generate.empty()) {
+		generate_instruction("lea _profile_write(%rip), %rdi");
+		generate_instruction("call atexit");
+	}
+	if (starts_runtime && !options.trace.empty())
+		generate_instruction("call _trace_start");
+	generate_trace_hook(false);
+	function_start_label = ++jump_label_counter;
+	generate_label(std::format("_function_start{0}", function_start_label));			// Self tail calls loop back here
+	count_profile_event("function " + function->name, 0, 1);
 	generate_compound(function->statement);
-	generate_instruction("mov $0, %rax");												// Return 0 at end, if there is a return statement this is skipped
-	generate_instruction("mov %rbp, %rsp");												// } Function epilogue, revert stack frame
-	generate_instruction("pop %rbp");													// }
-	generate_instruction("ret");
+	generate_instruction(load_constant(0, "%rax"));										// Return 0 at end, if there is a return statement this is skipped
+	generate_epilogue();
+	generate_cfi(".cfi_endproc");
+	generate_instruction(std::format(".size {0}, .-{0}", label));
 	// Generates declaration and statements inside the function
 	pop_scope();
 }
 
+void CodeGenerator::generate_multiversioned_function(const shared_ptr<Function>& function) {	// Calls go through a pointer that starts at the resolver
+	std::vector<std::string> targets = function->targets;
+	std::sort(targets.begin(), targets.end(), [](const std::string& a, const std::string& b) { return target_rank(a) < target_rank(b); });
+	CompilerOptions baseline = options;
+	generate_function_body(function, target_symbol(function->name, ""));
+	for (const std::string& target : targets) {
+		enable_target(target, options);
+		generate_function_body(function, target_symbol(function->name, target));
+		options = baseline;
+	}
+
+	std::string dispatch = function->name + ".dispatch";
+	generate_label(function->name);
+	generate_cfi(".cfi_startproc");
+	generate_instruction(std::format("jmp *{0}(%rip)", dispatch));
+
+	generate_label(function->name + ".resolve");										// Runs once, on the first call
+	for (const std::string& reg : argument_registers) {
+		generate_instruction("push " + reg);
+		generate_cfi(".cfi_adjust_cfa_offset 8");
+	}
+	generate_instruction("sub $8, %rsp");												// Aligns the stack for the call
+	generate_cfi(".cfi_adjust_cfa_offset 8");
+	generate_instruction("call _cpu_features");
+	generate_instruction("add $8, %rsp");
+	generate_cfi(".cfi_adjust_cfa_offset -8");
+	generate_instruction(std::format("lea {0}(%rip), %rcx", target_symbol(function->name, "")));
+	for (const std::string& target : targets) {											// The best level the CPU runs wins
+		generate_instruction(std::format("lea {0}(%rip), %rdx", target_symbol(function->name, target)));
+		generate_instruction(std::format("test ${0}, %eax", 1 << (target_rank(target) - 1)));
+		generate_instruction("cmovnz %rdx, %rcx");
+	}
+	generate_instruction(std::format("mov %rcx, {0}(%rip)", dispatch));
+	for (auto reg = argument_registers.rbegin(); reg != argument_registers.rend(); reg++) {
+		generate_instruction("pop " + *reg);
+		generate_cfi(".cfi_adjust_cfa_offset -8");
+	}
+	generate_instruction(std::format("jmp *{0}(%rip)", dispatch));
+	generate_cfi(".cfi_endproc");
+
+	dispatch_pointers += std::format("{0}:\n\t.quad {1}.resolve\n", dispatch, function->name);
+	uses_cpu_features = true;
+}
+
+void CodeGenerator::count_profile_event(const std::string& record, int counter, int counters) {
+	if (options.profile_generate.empty())
+		return;
+	auto found = profile_counters.find(record);
+	if (found == profile_counters.end()) {											// Copies of a site share its counters
+		found = profile_counters.emplace(record, profile_counter_count).first;
+		profile_records.push_back({ record, profile_counter_count, counters });
+		profile_counter_count += counters;
+	}
+	generate_instruction(std::format("incq _profile_counters+{0}(%rip)", 8 * (found->second + counter)));
+}
+
+void CodeGenerator::count_site_event(const std::string& kind, const ProfileSite& site, int counter, int counters) {
+	if (site.index >= 0)
+		count_profile_event(site_record(kind, site), counter, counters);
+}
+
+void CodeGenerator::generate_profile_writer() {									// Appends a line per record, a branch is counted when reached and when taken
+	headers += std::format(".bss\n.align 8\n_profile_counters:\n\t.zero {0}\n", 8 * std::max(1, profile_counter_count));
+	generate_label("_profile_write");
+	generate_instruction("push %rbx");												// Also aligns the stack for the calls
+	generate_instruction(std::format("lea {0}(%rip), %rdi", string_pool.label(options.profile_generate)));
+	generate_instruction(std::format("lea {0}(%rip), %rsi", string_pool.label("a")));
+	generate_instruction("call fopen");
+	generate_instruction("test %rax, %rax");
+	generate_instruction("jz _profile_write_done");
+	generate_instruction("mov %rax, %rbx");
+	for (const ProfileRecord& record : profile_records) {
+		generate_instruction("mov %rbx, %rdi");
+		generate_instruction(std::format("lea {0}(%rip), %rsi", string_pool.label(record.line + (record.counters == 2 ? " %ld %ld\n" : " %ld\n"))));
+		generate_instruction(std::format("mov _profile_counters+{0}(%rip), %rdx", 8 * record.counter));
+		if (record.counters == 2)
+			generate_instruction(std::format("mov _profile_counters+{0}(%rip), %rcx", 8 * (record.counter + 1)));
+		if (record.line.starts_with("branch "))										// Not taken is reached minus taken
+			generate_instruction("sub %rdx, %rcx");
+		generate_instruction("xor %eax, %eax");
+		generate_instruction("call fprintf");
+	}
+	generate_instruction("mov %rbx, %rdi");
+	generate_instruction("call fclose");
+	generate_label("_profile_write_done");
+	generate_instruction("pop %rbx");
+	generate_instruction("ret");
+}
+
+void CodeGenerator::generate_trace_hook(bool is_exit) {
+	if (options.trace.empty())
+		return;
+	auto found = trace_ids.find(current_function->name);
+	if (found == trace_ids.end()) {
+		found = trace_ids.emplace(current_function->name, (int)traced_functions.size()).first;
+		traced_functions.push_back(current_function->name);
+	}
+	for (const std::string& instruction : trace_hook(found->second, is_exit, options.trace_buffer_entries))
+		generate_instruction(instruction);
+}
+
+void CodeGenerator::generate_prologue() {
+	if (has_frame_pointer) {
+		generate_instruction("push %rbp");												// } Function prologue, save stack frame
+		generate_cfi(".cfi_def_cfa_offset 16");
+		generate_cfi(".cfi_offset %rbp, -16");
+		generate_instruction("mov %rsp, %rbp");											// }
+		generate_cfi(".cfi_def_cfa %rbp, 16");
+		if (frame_size > 0)
+			generate_instruction(std::format("sub ${0}, %rsp", frame_size));			// Allocate every local at once
+	}
+	else if (frame_size > 0) {
+		generate_instruction(std::format("sub ${0}, %rsp", frame_size + 8));			// Also covers the slot %rbp would take, keeping the alignment
+		generate_cfi(std::format(".cfi_def_cfa_offset {0}", frame_size + 16));
+	}
+}
+
+void CodeGenerator::generate_frame_teardown() {
+	generate_cfi(".cfi_remember_state");											// Code after the ret or jump still has the frame
+	if (has_frame_pointer) {
+		generate_instruction("mov %rbp, %rsp");											// } Function epilogue, revert stack frame
+		generate_instruction("pop %rbp");												// }
+		generate_cfi(".cfi_def_cfa %rsp, 8");
+	}
+	else if (frame_size > 0) {
+		generate_instruction(std::format("add ${0}, %rsp", frame_size + 8));
+		generate_cfi(".cfi_def_cfa_offset 8");
+	}
+}
+
+void CodeGenerator::generate_epilogue() {
+	generate_trace_hook(true);
+	generate_frame_teardown();
+	generate_instruction("ret");
+	generate_cfi(".cfi_restore_state");
+}
+
+void CodeGenerator::generate_cfi(const std::string& directive) {
+	if (options.unwind_tables)
+		generate_instruction(directive);
+}
+
+void CodeGenerator::generate_frame_state() {
+	if (has_frame_pointer) {
+		generate_cfi(".cfi_def_cfa %rbp, 16");
+		generate_cfi(".cfi_offset %rbp, -16");
+	}
+	else
+		generate_cfi(std::format(".cfi_def_cfa_offset {0}", (frame_size > 0 ? frame_size + 16 : 8) + push_depth));
+}
+
+void CodeGenerator::generate_line(const shared_ptr<Statement>& statement) {
+	if (options.debug_info && statement->line > 0 && statement->type != COMPOUND_STM)
+		generate_instruction(std::format(".loc 1 {0} {1}", statement->line, statement->column));
+}
+
+int CodeGenerator::parameter_offset(size_t index) {								// The first six parameters are spilled into the frame, the rest are above the return address
+	if (index < argument_registers.size())
+		return -8 * (int)(index + 1);
+	return 16 + 8 * (int)(index - argument_registers.size());
+}
+
+std::string CodeGenerator::stack_slot(int offset) {								// Address of a local (negative offset) or parameter (positive offset)
+	if (has_frame_pointer)
+		return std::format("{0}(%rbp)", offset);
+	int frame_base = (frame_size > 0 ? frame_size + 8 : 0) - 8 + push_depth;	// Distance from %rsp to where %rbp would point
+	return std::format("{0}(%rsp)", offset + frame_base);
+}
+
+void CodeGenerator::push(const std::string& operand) {
+	generate_instruction("push " + operand);
+	adjust_push_depth(8);
+}
+
+void CodeGenerator::pop(const std::string& operand) {
+	generate_instruction("pop " + operand);
+	adjust_push_depth(-8);
+}
+
+void CodeGenerator::adjust_push_depth(int bytes) {
+	push_depth += bytes;
+	if (!has_frame_pointer)															// The frame is found from %rsp
+		generate_cfi(std::format(".cfi_adjust_cfa_offset {0}", bytes));
+}
+
+int CodeGenerator::measure_frame(const shared_ptr<Statement>& statement, int depth, int& max_depth) {	// Returns the bytes in use after the statement
+	if (!statement)
+		return depth;
+	switch (statement->type)
+	{
+	case COMPOUND_STM: {
+		int inner_depth = depth;
+		for (shared_ptr<Statement>& stmt : dynamic_pointer_cast<Compound>(statement)->statements)
+			inner_depth = measure_frame(stmt, inner_depth, max_depth);
+		return depth;															// Slots are released at the end of the block
+	}
+	case VARIABLE_DECL: {
+		shared_ptr<VariableDeclaration> decl = dynamic_pointer_cast<VariableDeclaration>(statement);
+		measure_frame(decl->optional_to_assign, depth, max_depth);
+		if (decl->vector_type.lanes > 0)
+			depth = (depth + decl->vector_type.bytes() + 15) / 16 * 16;			// Vector slots are 16 byte aligned
+		else if (decl->struct_type) {
+			int alignment = std::min(16, variable_alignment(*decl));				// The frame base is only 16 byte aligned
+			depth = (depth + variable_size(*decl) + alignment - 1) / alignment * alignment;
+		}
+		else
+			depth += 8 * std::max(1, decl->array_length);
+		max_depth = std::max(max_depth, depth);
+		return depth;
+	}
+	case RETURN_STM:
+		measure_frame(dynamic_pointer_cast<Return>(statement)->expression, depth, max_depth);
+		return depth;
+	case EXPR_STM:
+		measure_frame(dynamic_pointer_cast<ExpressionStatement>(statement)->expression, depth, max_depth);
+		return depth;
+	case IF_STATEMENT: {
+		shared_ptr<IfStatement> if_stmt = dynamic_pointer_cast<IfStatement>(statement);
+		measure_frame(if_stmt->condition, depth, max_depth);
+		measure_frame(if_stmt->body, depth, max_depth);
+		measure_frame(if_stmt->else_body, depth, max_depth);
+		return depth;
+	}
+	case WHILE_STM:
+	case DO_WHILE_STM: {
+		shared_ptr<WhileStatement> while_stmt = dynamic_pointer_cast<WhileStatement>(statement);
+		measure_frame(while_stmt->condition, depth, max_depth);
+		measure_frame(while_stmt->body, depth, max_depth);
+		return depth;
+	}
+	case FOR_STM: {
+		shared_ptr<ForStatement> for_stmt = dynamic_pointer_cast<ForStatement>(statement);
+		int inner_depth = measure_frame(for_stmt->initializer, depth, max_depth);
+		measure_frame(for_stmt->condition, inner_depth, max_depth);
+		measure_frame(for_stmt->post, inner_depth, max_depth);
+		measure_frame(for_stmt->body, inner_depth, max_depth);
+		return depth;
+	}
+	case MATCH_STM: {
+		shared_ptr<MatchStatement> match_stmt = dynamic_pointer_cast<MatchStatement>(statement);
+		measure_frame(match_stmt->expression, depth, max_depth);
+		for (MatchArm& arm : match_stmt->arms)
+			measure_frame(arm.body, depth, max_depth);
+		measure_frame(match_stmt->default_body, depth, max_depth);
+		return depth;
+	}
+	default:
+		break;
+	}
+	return depth;
+}
+
+void CodeGenerator::measure_frame(const shared_ptr<Expression>& expression, int depth, int& max_depth) {
+	if (!expression)
+		return;
+	switch (expression->type)
+	{
+	case UNARY_EXPR:
+		measure_frame(dynamic_pointer_cast<UnaryExpression>(expression)->expression, depth, max_depth);
+		break;
+	case BINARY_EXPR: {
+		shared_ptr<BinaryExpression> binary = dynamic_pointer_cast<BinaryExpression>(expression);
+		measure_frame(binary->expression_a, depth, max_depth);
+		measure_frame(binary->expression_b, depth, max_depth);
+		break;
+	}
+	case VARIABLE_ASSIGN:
+		measure_frame(dynamic_pointer_cast<VariableAssignment>(expression)->to_assign, depth, max_depth);
+		measure_frame(dynamic_pointer_cast<VariableAssignment>(expression)->index, depth, max_depth);
+		break;
+	case INDEX_EXPR:
+		measure_frame(dynamic_pointer_cast<IndexExpression>(expression)->index, depth, max_depth);
+		break;
+	case FIELD_EXPR:
+		measure_frame(dynamic_pointer_cast<FieldExpression>(expression)->object, depth, max_depth);
+		break;
+	case CALL_EXPR:
+		for (shared_ptr<Expression>& argument : dynamic_pointer_cast<Call>(expression)->arguments)
+			measure_frame(argument, depth, max_depth);
+		break;
+	case INLINED_CALL_EXPR: {													// Parameters of an inlined body take a slot each, followed by its locals
+		shared_ptr<InlinedCall> inlined = dynamic_pointer_cast<InlinedCall>(expression);
+		for (int i = inlined->arguments.size() - 1; i >= 0; i--) {				// Same order as generate_inlined_call binds them
+			measure_frame(inlined->arguments[i], depth, max_depth);
+			depth += 8;
+		}
+		max_depth = std::max(max_depth, depth);
+		measure_frame(inlined->body, depth, max_depth);
+		break;
+	}
+	default:
+		break;
+	}
+}
+
 void CodeGenerator::generate_return(const shared_ptr<Return>& return_stmt) {			// Emits return
+	if (!return_stmt->is_empty && return_stmt->expression->type == CALL_EXPR && !is_builtin(dynamic_pointer_cast<Call>(return_stmt->expression)->name)
+		&& inline_returns.size() == 0 && options.tail_calls) {
+		if (generate_tail_call(dynamic_pointer_cast<Call>(return_stmt->expression)))
+			return;
+	}
 	if(!return_stmt->is_empty)
 		generate_expression(return_stmt->expression, "%rax");
-	generate_instruction("mov %rbp, %rsp");												// } Function epilogue, revert stack frame
-	generate_instruction("pop %rbp");													// }
-	generate_instruction("ret");
+	if (inline_returns.size() > 0) {													// Inside an inlined body, return to the end of the inlined call
+		generate_instruction(std::format("jmp _inline_end{0}", inline_returns[inline_returns.size() - 1]));
+		return;
+	}
+	generate_epilogue();
+}
+
+bool CodeGenerator::generate_tail_call(const shared_ptr<Call>& call_expression) {		// Emits a call in tail position as a jump that reuses the current frame
+	size_t argument_count = call_expression->arguments.size();
+	size_t register_count = std::min(argument_count, argument_registers.size());
+	bool is_self_call = call_expression->name == current_function->name;
+	size_t incoming_stack_parameters = current_function->parameters.size() - std::min(current_function->parameters.size(), argument_registers.size());
+	if (argument_count - register_count > incoming_stack_parameters)				// Stack arguments are written over our own incoming ones,
+		return false;																// which our caller pops, so they must fit in that area
+	if (is_self_call && argument_count != current_function->parameters.size())
+		return false;
+	count_site_event("call", call_expression->site, 0, 1);
+
+	for (int i = argument_count - 1; i >= 0; i--) {									// Evaluate every argument before any parameter is overwritten
+		generate_expression(call_expression->arguments[i], "%rax");
+		push("%rax");
+	}
+
+	if (is_self_call) {																// Direct self recursion becomes a loop
+		for (size_t i = 0; i < argument_count; i++) {
+			pop("%rax");
+			generate_instruction(std::format("mov %rax, {0}", stack_slot(parameter_offset(i))));
+		}
+		generate_instruction(std::format("jmp _function_start{0}", function_start_label));
+	}
+	else {
+		generate_trace_hook(true);														// While the arguments are still on the stack
+		for (size_t i = 0; i < register_count; i++)
+			pop(argument_registers[i]);
+		for (size_t i = register_count; i < argument_count; i++) {
+			pop("%rax");
+			generate_instruction(std::format("mov %rax, {0}", stack_slot(16 + 8 * (i - register_count))));
+		}
+		generate_frame_teardown();													// The callee returns straight to our caller
+		if (is_extern_call(call_expression))
+			generate_instruction("xor %eax, %eax");
+		generate_instruction("jmp " + call_expression->name);
+		generate_cfi(".cfi_restore_state");
+	}
+	return true;
 }
 
 void CodeGenerator::generate_statement(const shared_ptr<Statement>& statement) {		// Handles all statements
+	int saved_line = error_line, saved_column = error_column;
+	if (statement->line > 0) {														// Statements made by the passes keep the position of the one they came from
+		error_line = statement->line;
+		error_column = statement->column;
+	}
+	if (local_variables.size() != 0)													// Top level declarations emit no code
+		generate_line(statement);
 	switch (statement->type)
 	{
 	case FUNCTION_STM:
@@ -161,10 +611,18 @@ void CodeGenerator::generate_statement(const shared_ptr<Statement>& statement) {
 	case FOR_STM:
 		generate_for_statement(dynamic_pointer_cast<ForStatement>(statement));
 		break;
+	case MATCH_STM:
+		generate_match_statement(dynamic_pointer_cast<MatchStatement>(statement));
+		break;
+	case ASM_STM:
+		generate_asm_statement(dynamic_pointer_cast<AsmStatement>(statement));
+		break;
 	case EMPTY_STM:
 	default:
 		break;
 	}
+	error_line = saved_line;
+	error_column = saved_column;
 }
 
 void CodeGenerator::loop_flow_statement(const std::shared_ptr<BreakStatement> break_statement) {
@@ -188,39 +646,567 @@ void CodeGenerator::loop_flow_statement(const std::shared_ptr<ContinueStatement>
 		make_error("Continue statement outside of loop body");
 }
 
-void CodeGenerator::call(const std::shared_ptr<Call> call_expression) {
-	for (int i = call_expression->arguments.size() - 1; i >= 0; i--) {
-		generate_expression(call_expression->arguments[i], "%rax");
-		generate_instruction("push %rax");
+bool CodeGenerator::is_extern_call(const std::shared_ptr<Call>& call_expression) {
+	auto callee = functions.find(call_expression->name);
+	return callee != functions.end() && callee->second->is_extern;
+}
+
+void CodeGenerator::call(const std::shared_ptr<Call> call_expression) {			// System V AMD64 calling convention
+	count_site_event("call", call_expression->site, 0, 1);
+	std::vector<shared_ptr<Expression>>& arguments = call_expression->arguments;
+	int register_count = std::min(arguments.size(), argument_registers.size());
+	int stack_count = arguments.size() - register_count;
+	int padding = (push_depth + 8 * stack_count) % 16;							// %rsp must be 16 byte aligned at the call instruction
+	if (padding > 0) {
+		generate_instruction("sub $8, %rsp");
+		adjust_push_depth(8);
+	}
+
+	bool any_side_effects = false;												// Names and constants can be loaded straight into their register
+	for (shared_ptr<Expression>& argument : arguments)							// unless another argument could change them
+		any_side_effects = any_side_effects || has_side_effects(argument);
+	auto is_direct = [&](int i) {
+		return i < register_count && !any_side_effects && (arguments[i]->type == NAME || arguments[i]->type == CONSTANT_EXPR);
+	};
+
+	for (int i = arguments.size() - 1; i >= 0; i--) {								// Stack arguments end up in order above the return address
+		if (is_direct(i))
+			continue;
+		generate_expression(arguments[i], "%rax");
+		push("%rax");
+	}
+	for (int i = 0; i < register_count; i++) {
+		if (!is_direct(i))
+			pop(argument_registers[i]);
 	}
+	for (int i = 0; i < register_count; i++) {
+		if (!is_direct(i))
+			continue;
+		generate_expression(arguments[i], argument_registers[i]);
+	}
+
+	if (is_extern_call(call_expression))											// Variadic C functions read the number of vector arguments from %al
+		generate_instruction("xor %eax, %eax");
 	generate_instruction("call " + call_expression->name);
-	int stack_cleanup = 8 * call_expression->arguments.size();
-	generate_instruction(std::format("add ${0}, %rsp", stack_cleanup));
+	int stack_cleanup = 8 * stack_count + padding;
+	if (stack_cleanup > 0) {
+		generate_instruction(std::format("add ${0}, %rsp", stack_cleanup));
+		adjust_push_depth(-stack_cleanup);
+	}
+}
+
+void CodeGenerator::generate_inlined_call(const std::shared_ptr<InlinedCall> inlined) {
+	int current_inline = ++jump_label_counter;										// Labels inside the body are numbered as they are emitted, so every copy gets its own
+	int saved_stack_index = stack_index;
+
+	std::unordered_map<std::string, int> parameters;
+	for (int i = inlined->arguments.size() - 1; i >= 0; i--) {					// Arguments are evaluated in the caller scope, right to left like call() does,
+		generate_expression(inlined->arguments[i], "%rax");
+		stack_index -= 8;
+		generate_instruction(std::format("mov %rax, {0}", stack_slot(stack_index)));	// and stored straight into the parameter slots
+		local_array_lengths.erase(stack_index);
+		local_vector_types.erase(stack_index);
+		local_structs.erase(stack_index);
+		parameters[inlined->parameters[i]] = stack_index;
+	}
+	local_variables.push_back(parameters);										// The callee only sees its parameters and the globals
+	inline_returns.push_back(current_inline);
+
+	std::vector<shared_ptr<Statement>>& statements = inlined->body->statements;
+	bool ends_in_return = statements.size() > 0 && statements[statements.size() - 1] && statements[statements.size() - 1]->type == RETURN_STM;
+	new_scope();
+	for (size_t i = 0; i < statements.size(); i++) {
+		if (ends_in_return && i == statements.size() - 1) {						// The final return falls through to the end label
+			shared_ptr<Return> return_stmt = dynamic_pointer_cast<Return>(statements[i]);
+			if (!return_stmt->is_empty)
+				generate_expression(return_stmt->expression, "%rax");
+		}
+		else
+			generate_statement(statements[i]);
+	}
+	pop_scope();
+	if (!ends_in_return)
+		generate_instruction(load_constant(0, "%rax"));								// Same result as falling off the end of the function
+
+	generate_label(std::format("_inline_end{0}", current_inline));
+	stack_index = saved_stack_index;													// Release the slots of the parameters and the callee locals
+	inline_returns.pop_back();
+	pop_scope();
+}
+
+void CodeGenerator::generate_intrinsic(const shared_ptr<Call>& call_expression) {
+	Intrinsic intrinsic = intrinsic_named(call_expression->name);
+	std::vector<shared_ptr<Expression>>& arguments = call_expression->arguments;
+	int arity = intrinsic_arity(intrinsic);
+	if ((int)arguments.size() != arity) {
+		make_error(std::format("{0} expects {1} argument{2}", call_expression->name, arity, arity == 1 ? "" : "s"));
+		return;
+	}
+	long long constant;
+	if (evaluate_constant(call_expression, constant)) {
+		generate_instruction(load_constant(constant, "%rax"));
+		return;
+	}
+	std::string operand;
+	switch (intrinsic)
+	{
+	case INTRINSIC_POPCOUNT:
+		if (!options.popcnt) {
+			generate_expression(arguments[0], "%rax");
+			generate_bit_count();
+		}
+		else if (simple_operand(arguments[0], nullptr, operand) && operand[0] != '$')	// Counts straight from memory
+			generate_instruction(std::format("popcnt {0}, %rax", operand));
+		else {
+			generate_expression(arguments[0], "%rax");
+			generate_instruction("popcnt %rax, %rax");
+		}
+		break;
+	case INTRINSIC_CLZ:
+	case INTRINSIC_CTZ: {
+		bool is_clz = intrinsic == INTRINSIC_CLZ;
+		if (!simple_operand(arguments[0], nullptr, operand) || operand[0] == '$') {
+			generate_expression(arguments[0], "%rax");
+			operand = "%rax";
+		}
+		if (is_clz ? options.lzcnt : options.bmi) {
+			generate_instruction(std::format("{0} {1}, %rax", is_clz ? "lzcnt" : "tzcnt", operand));
+			break;
+		}
+		generate_instruction(std::format("{0} {1}, %rax", is_clz ? "bsr" : "bsf", operand));	// Bit index, undefined and ZF set for 0
+		generate_instruction(std::format("mov ${0}, %ecx", is_clz ? 127 : 64));	// mov leaves the flags alone
+		generate_instruction("cmovz %rcx, %rax");
+		if (is_clz)
+			generate_instruction("xor $63, %rax");								// 63 - index, and 127 becomes 64
+		break;
+	}
+	case INTRINSIC_BSWAP:
+		generate_expression(arguments[0], "%rax");
+		generate_instruction("bswap %rax");
+		break;
+	case INTRINSIC_ROTL:
+	case INTRINSIC_ROTR: {
+		std::string mnemonic = intrinsic == INTRINSIC_ROTL ? "rol" : "ror";
+		if (evaluate_constant(arguments[1], constant)) {
+			generate_expression(arguments[0], "%rax");
+			if (constant & 63)
+				generate_instruction(std::format("{0} ${1}, %rax", mnemonic, constant & 63));
+			break;
+		}
+		if (simple_operand(arguments[1], arguments[0], operand)) {
+			generate_expression(arguments[0], "%rax");
+			generate_instruction(std::format("mov {0}, %rcx", operand));
+		}
+		else {
+			generate_expression(arguments[1], "%rax");							// The count goes in %cl
+			push("%rax");
+			generate_expression(arguments[0], "%rax");
+			pop("%rcx");
+		}
+		generate_instruction(mnemonic + " %cl, %rax");
+		break;
+	}
+	case INTRINSIC_MULHI:
+		if (simple_operand(arguments[1], arguments[0], operand) && operand[0] != '$') {
+			generate_expression(arguments[0], "%rax");
+			generate_instruction("mulq " + operand);
+		}
+		else {
+			generate_expression(arguments[0], "%rax");
+			push("%rax");
+			generate_expression(arguments[1], "%rax");
+			pop("%rcx");
+			generate_instruction("mul %rcx");									// %rdx:%rax = %rax * %rcx
+		}
+		generate_instruction("mov %rdx, %rax");
+		break;
+	case INTRINSIC_PREFETCH:
+		operand = address_operand(arguments[0]);
+		if (!operand.empty())
+			generate_instruction("prefetcht0 " + operand);
+		generate_instruction(load_constant(0, "%rax"));
+		break;
+	case INTRINSIC_LIKELY:
+	case INTRINSIC_UNLIKELY:
+		generate_expression(arguments[0], "%rax");								// Branches read the hint, see branch_probability
+		break;
+	default:
+		break;
+	}
+}
+
+void CodeGenerator::generate_bit_count() {									// Sums bits in pairs, nibbles and bytes, then adds up the bytes with a multiply
+	generate_instruction("mov %rax, %rcx");
+	generate_instruction("shr $1, %rcx");
+	generate_instruction(load_constant(0x5555555555555555, "%rdx"));
+	generate_instruction("and %rdx, %rcx");
+	generate_instruction("sub %rcx, %rax");
+	generate_instruction(load_constant(0x3333333333333333, "%rdx"));
+	generate_instruction("mov %rax, %rcx");
+	generate_instruction("shr $2, %rax");
+	generate_instruction("and %rdx, %rcx");
+	generate_instruction("and %rdx, %rax");
+	generate_instruction("add %rcx, %rax");
+	generate_instruction("mov %rax, %rcx");
+	generate_instruction("shr $4, %rcx");
+	generate_instruction("add %rcx, %rax");
+	generate_instruction(load_constant(0x0F0F0F0F0F0F0F0F, "%rdx"));
+	generate_instruction("and %rdx, %rax");
+	generate_instruction(load_constant(0x0101010101010101, "%rdx"));
+	generate_instruction("imul %rdx, %rax");
+	generate_instruction("shr $56, %rax");
+}
+
+std::string CodeGenerator::address_operand(const shared_ptr<Expression>& expression) {
+	long long displacement;
+	switch (expression->type)
+	{
+	case NAME:																	// Arrays and structs from their start
+		return variable_access(dynamic_pointer_cast<Name>(expression)->name);
+	case INDEX_EXPR: {
+		shared_ptr<IndexExpression> element = dynamic_pointer_cast<IndexExpression>(expression);
+		bool indexed = generate_element_index(element->array_name, element->index, displacement);
+		return element_access(element->array_name, displacement, indexed);
+	}
+	case FIELD_EXPR: {
+		shared_ptr<FieldExpression> access = dynamic_pointer_cast<FieldExpression>(expression);
+		shared_ptr<Expression> index;
+		std::string name = access->object->type == INDEX_EXPR ? dynamic_pointer_cast<IndexExpression>(access->object)->array_name
+			: dynamic_pointer_cast<Name>(access->object)->name;
+		if (access->object->type == INDEX_EXPR)
+			index = dynamic_pointer_cast<IndexExpression>(access->object)->index;
+		const StructField* field = resolve_field(name, index, access->field);
+		if (!field)
+			return "";
+		bool indexed = generate_field_index(name, index, *field, displacement);
+		return field_access(name, *field, displacement, indexed);
+	}
+	default:
+		break;
+	}
+	make_error("Expected an element, a field or a variable");
+	return "";
+}
+
+static bool is_callee_saved(const std::string& reg) {
+	return reg == "%rbx" || reg == "%r12" || reg == "%r13" || reg == "%r14" || reg == "%r15";
+}
+
+static bool has_fixed_address(const shared_ptr<Expression>& expression) {		// Variables and elements at constant indices need no address register
+	long long index;
+	switch (expression->type)
+	{
+	case NAME:
+		return true;
+	case INDEX_EXPR:
+		return evaluate_constant(dynamic_pointer_cast<IndexExpression>(expression)->index, index);
+	case FIELD_EXPR:
+		return has_fixed_address(dynamic_pointer_cast<FieldExpression>(expression)->object);
+	default:
+		break;
+	}
+	return false;
+}
+
+// Operands are evaluated into %rax and pushed, then popped into the registers they are bound to, so that evaluating one
+// never overwrites another. Callee saved registers that the statement uses are saved around it, and values that an m
+// constraint needs in memory are spilled to the stack and addressed from %rsp.
+void CodeGenerator::generate_asm_statement(const shared_ptr<AsmStatement>& asm_statement) {
+	std::vector<AsmBinding> bindings;
+	for (const AsmOperand& operand : asm_statement->outputs) {
+		AsmBinding binding;
+		binding.operand = &operand;
+		binding.is_output = true;
+		binding.is_loaded = operand.constraint[0] == '+';
+		bindings.push_back(binding);
+	}
+	for (const AsmOperand& operand : asm_statement->inputs) {
+		AsmBinding binding;
+		binding.operand = &operand;
+		binding.is_loaded = true;
+		bindings.push_back(binding);
+	}
+
+	std::unordered_set<std::string> taken;										// Clobbered or bound to an operand
+	for (const std::string& clobber : asm_statement->clobbers) {
+		if (clobber == "cc" || clobber == "memory" || clobber.starts_with("xmm") || clobber.starts_with("ymm"))
+			continue;															// Nothing is kept in flags, vector registers or registers across statements
+		std::string reg = clobber[0] == '%' ? clobber : "%" + clobber;
+		if (reg == "%rsp" || reg == "%rbp")
+			make_error("asm can't clobber " + reg);
+		else if (std::find(asm_registers.begin(), asm_registers.end(), reg) == asm_registers.end())
+			make_error("Unknown clobber " + clobber);
+		taken.insert(reg);
+	}
+	bool bound = true;
+	for (size_t i = 0; i < bindings.size(); i++) {								// Registers named by the constraint are taken before any is picked
+		if (bindings[i].operand->constraint.find_first_of("abcdSD") != std::string::npos)
+			bound = bind_asm_operand(bindings[i], i, taken) && bound;
+	}
+	for (size_t i = 0; i < bindings.size(); i++) {
+		if (bindings[i].operand->constraint.find_first_of("abcdSD") == std::string::npos)
+			bound = bind_asm_operand(bindings[i], i, taken) && bound;
+	}
+	if (!bound)
+		return;
+
+	std::vector<std::string> saved;
+	for (const std::string& reg : asm_registers) {
+		if (is_callee_saved(reg) && taken.contains(reg)) {
+			push(reg);
+			saved.push_back(reg);
+		}
+	}
+	int spilled_bytes = 0;
+	for (AsmBinding& binding : bindings) {
+		if (!binding.is_spilled)
+			continue;
+		generate_expression(binding.operand->expression, "%rax");
+		push("%rax");
+		binding.spill_depth = push_depth;
+		spilled_bytes += 8;
+	}
+	std::vector<AsmBinding*> loads;
+	for (AsmBinding& binding : bindings) {
+		if (binding.reg.empty() || (!binding.is_memory && !binding.is_loaded))
+			continue;
+		if (!loads.empty())
+			push("%rax");
+		if (binding.is_memory)
+			generate_instruction(std::format("lea {0}, %rax", address_operand(binding.operand->expression)));
+		else
+			generate_expression(binding.operand->expression, "%rax");
+		loads.push_back(&binding);
+	}
+	if (!loads.empty() && loads.back()->reg != "%rax")						// The last value is still in %rax
+		generate_instruction(std::format("mov %rax, {0}", loads.back()->reg));
+	for (auto load = loads.rbegin() + (loads.empty() ? 0 : 1); load != loads.rend(); load++)
+		pop((*load)->reg);
+
+	for (AsmBinding& binding : bindings) {										// Frame slots may be addressed from %rsp, so only now are they final
+		if (binding.is_spilled)
+			binding.text = std::format("{0}(%rsp)", push_depth - binding.spill_depth);
+		else if (binding.is_memory && binding.reg.empty())
+			binding.text = address_operand(binding.operand->expression);
+		else if (binding.is_memory)
+			binding.text = "(" + binding.reg + ")";
+		else if (binding.text.empty())
+			binding.text = binding.reg;
+	}
+	std::string assembly = expand_assembly(asm_statement->assembly, bindings);
+	size_t start = 0;
+	while (start <= assembly.size()) {
+		size_t end = std::min(assembly.find('\n', start), assembly.size());
+		size_t first = assembly.find_first_not_of(" \t", start);
+		if (first < end)
+			generate_instruction(assembly.substr(first, end - first));
+		start = end + 1;
+	}
+
+	for (AsmBinding& binding : bindings) {
+		if (binding.is_output && !binding.is_memory)
+			generate_instruction(std::format("mov {0}, {1}", binding.reg, variable_access(dynamic_pointer_cast<Name>(binding.operand->expression)->name)));
+	}
+	if (spilled_bytes > 0) {
+		generate_instruction(std::format("add ${0}, %rsp", spilled_bytes));
+		adjust_push_depth(-spilled_bytes);
+	}
+	for (auto reg = saved.rbegin(); reg != saved.rend(); reg++)
+		pop(*reg);
+}
+
+bool CodeGenerator::bind_asm_operand(AsmBinding& binding, size_t number, std::unordered_set<std::string>& taken) {
+	const std::string& constraint = binding.operand->constraint;
+	const shared_ptr<Expression>& expression = binding.operand->expression;
+	std::string name = operand_variable(expression);
+	long long value;
+	if (!binding.is_output && constraint.find_first_of("ig") != std::string::npos && evaluate_constant(expression, value)) {
+		binding.text = std::format("${0}", value);
+		binding.is_loaded = false;
+		return true;
+	}
+	if (binding.is_output && constant_globals.contains(name) && variable_access(name).ends_with("(%rip)")) {
+		make_error("Cannot assign to constant " + name);
+		return false;
+	}
+	bool is_variable = expression->type == NAME || expression->type == INDEX_EXPR || expression->type == FIELD_EXPR;
+	size_t fixed = constraint.find_first_of("abcdSD");
+	bool in_memory = constraint.find_first_of("mg") != std::string::npos && is_variable && has_fixed_address(expression);	// rm takes it where it is
+	bool wants_register = fixed != std::string::npos || (constraint.find('r') != std::string::npos && !in_memory)
+		|| (constraint.find('g') != std::string::npos && !is_variable);
+	if (!wants_register) {
+		if (constraint.find_first_of("mg") == std::string::npos) {
+			make_error(std::format("Operand {0} of asm needs a constant for an i constraint", number));
+			return false;
+		}
+		binding.is_memory = is_variable;
+		binding.is_spilled = !is_variable;
+		binding.is_loaded = false;
+		if (!is_variable || has_fixed_address(expression))
+			return true;
+	}
+	else if (binding.is_output && (expression->type != NAME || array_length(name) > 0 || struct_variable(name)	// Stored with a full 64 bit move
+		|| is_vector_expression(expression))) {
+		make_error(std::format("Operand {0} of asm is stored to an element, a field or a vector, only an m constraint can bind it", number));
+		return false;
+	}
+	if (fixed != std::string::npos) {
+		static const std::unordered_map<char, std::string> letters = { { 'a', "%rax" }, { 'b', "%rbx" }, { 'c', "%rcx" }, { 'd', "%rdx" },
+			{ 'S', "%rsi" }, { 'D', "%rdi" } };
+		binding.reg = letters.at(constraint[fixed]);
+		if (!taken.insert(binding.reg).second) {
+			make_error(std::format("Operand {0} of asm needs {1}, which is clobbered or bound to another operand", number, binding.reg));
+			return false;
+		}
+		return true;
+	}
+	for (const std::string& reg : asm_registers) {								// A register of the pool, or the address of a memory operand
+		if (taken.insert(reg).second) {
+			binding.reg = reg;
+			return true;
+		}
+	}
+	make_error("asm needs more registers than are left free by its clobbers");
+	return false;
+}
+
+std::string CodeGenerator::expand_assembly(const std::string& assembly, const std::vector<AsmBinding>& bindings) {
+	std::string expanded;
+	int unique = ++jump_label_counter;											// Labels written as name%= differ between copies of the statement
+	for (size_t i = 0; i < assembly.size(); i++) {
+		if (assembly[i] != '%' || i + 1 == assembly.size()) {
+			expanded += assembly[i];
+			continue;
+		}
+		char next = assembly[i + 1];
+		if (next == '%' || next == '=') {
+			expanded += next == '%' ? "%" : std::to_string(unique);
+			i++;
+		}
+		else if (std::isdigit((unsigned char)next)) {
+			size_t end = i + 1;
+			while (end < assembly.size() && std::isdigit((unsigned char)assembly[end]))
+				end++;
+			size_t number = std::stoul(assembly.substr(i + 1, end - i - 1));
+			if (number < bindings.size())
+				expanded += bindings[number].text;
+			else
+				make_error(std::format("asm has no operand %{0}", number));
+			i = end - 1;
+		}
+		else
+			expanded += '%';													// A register, as in %rax
+	}
+	return expanded;
+}
+
+int CodeGenerator::branch_probability(const std::shared_ptr<IfStatement>& if_statement) {
+	long long taken, not_taken;
+	if (profile && profile->branch_weights(if_statement->site, taken, not_taken))
+		return (int)(taken * 100 / (taken + not_taken));
+	return estimate_branch_probability(if_statement);
 }
 
 void CodeGenerator::make_if_statement(const std::shared_ptr<IfStatement> if_statement) {
 	int current_jump_label = ++jump_label_counter;
-	generate_expression(if_statement->condition, "%rax");
-	generate_instruction("cmp $0, %rax");
-	
+	int probability = options.reorder_blocks ? branch_probability(if_statement) : 50;
+	bool split = options.split_cold_code && !in_cold_code;
+
+	if (split && probability <= options.cold_branch_percent) {						// The body is moved out of line, the hot path falls through
+		generate_branch(if_statement->condition, true, std::format("_cold{0}", current_jump_label));
+		if (if_statement->has_else)
+			generate_scoped_statement(if_statement->else_body);
+		generate_label(std::format("_continue{0}", current_jump_label));
+		generate_cold_block(if_statement->body, current_jump_label);
+		return;
+	}
+	if (split && if_statement->has_else && probability >= 100 - options.cold_branch_percent) {
+		generate_branch(if_statement->condition, false, std::format("_cold{0}", current_jump_label));
+		generate_scoped_statement(if_statement->body);
+		generate_label(std::format("_continue{0}", current_jump_label));
+		generate_cold_block(if_statement->else_body, current_jump_label);
+		return;
+	}
+	if (if_statement->has_else && probability < 50) {								// The likelier else body becomes the fall through path
+		generate_branch(if_statement->condition, true, std::format("_then_body{0}", current_jump_label));
+		generate_scoped_statement(if_statement->else_body);
+		generate_instruction(std::format("jmp _continue{0}", current_jump_label));
+		generate_label(std::format("_then_body{0}", current_jump_label));
+		generate_scoped_statement(if_statement->body);
+		generate_label(std::format("_continue{0}", current_jump_label));
+		return;
+	}
+
+	count_site_event("branch", if_statement->site, 1, 2);								// Instrumented builds don't reorder, so only this layout is counted
 	if (if_statement->has_else)
-		generate_instruction(std::format("je _else_body{0}", current_jump_label));
+		generate_branch(if_statement->condition, false, std::format("_else_body{0}", current_jump_label));
 	else
-		generate_instruction(std::format("je _continue{0}", current_jump_label));
-	generate_statement(if_statement->body);
-	generate_instruction(std::format("jmp _continue{0}", current_jump_label));
+		generate_branch(if_statement->condition, false, std::format("_continue{0}", current_jump_label));
+	count_site_event("branch", if_statement->site, 0, 2);
+	generate_scoped_statement(if_statement->body);
 	if (if_statement->has_else) {
+		generate_instruction(std::format("jmp _continue{0}", current_jump_label));
 		generate_label(std::format("_else_body{0}", current_jump_label));
-		generate_statement(if_statement->else_body);
+		generate_scoped_statement(if_statement->else_body);
 	}
 	generate_label(std::format("_continue{0}", current_jump_label));
 }
 
+void CodeGenerator::generate_cold_block(const std::shared_ptr<Statement>& statement, int jump_label) {	// Emits a branch body into .text.unlikely
+	std::string hot_text = std::move(text);
+	text = "";
+	in_cold_code = true;
+	generate_label(std::format("_cold{0}", jump_label));
+	generate_cfi(".cfi_startproc");													// A part of the function of its own for unwinders
+	generate_frame_state();
+	generate_scoped_statement(statement);
+	generate_instruction(std::format("jmp _continue{0}", jump_label));
+	generate_cfi(".cfi_endproc");
+	in_cold_code = false;
+	cold_text += text;
+	text = std::move(hot_text);
+}
+
+void CodeGenerator::align_loop_header() {
+	if (options.align_loops && !in_cold_code)
+		generate_instruction(".p2align 4,,10");									// Align to 16 bytes unless that takes more than 10 bytes of padding
+}
+
+static bool is_index_scale(int stride) {
+	return stride == 1 || stride == 2 || stride == 4 || stride == 8;
+}
+
+static std::string field_register(int size) {									// Part of %rax as wide as a field
+	switch (size)
+	{
+	case 1:		return "%al";
+	case 2:		return "%ax";
+	case 4:		return "%eax";
+	default:	return "%rax";
+	}
+}
+
+static std::string load_extended(int size, bool is_signed, const std::string& source) {	// Sign or zero extends a value, in memory or in %rax, into %rax
+	switch (size)
+	{
+	case 1:		return is_signed ? "movsbq " + source + ", %rax" : "movzbl " + source + ", %eax";
+	case 2:		return is_signed ? "movswq " + source + ", %rax" : "movzwl " + source + ", %eax";
+	case 4:		return is_signed ? "movslq " + source + ", %rax" : "mov " + source + ", %eax";
+	default:	return "mov " + source + ", %rax";
+	}
+}
+
 void CodeGenerator::generate_expression(const std::shared_ptr<Expression>& expression, const std::string& to_where) {		// Handles expressions
+	long long constant_operand;
+	std::string operand;
+	shared_ptr<Expression> index;
+	int scale;
+	int size;
+	bool is_signed;
 	switch (expression->type)																								// to_where is the register to set a value
 	{
 	case CONSTANT_EXPR:
-		generate_instruction(std::format("mov ${0}, {1}", dynamic_pointer_cast<Constant>(expression)->value, to_where));	// Constants are just passed to a register
+		generate_instruction(load_constant(dynamic_pointer_cast<Constant>(expression)->value, to_where));	// Constants are just passed to a register
 		break;
 	case UNARY_EXPR:
 	{
@@ -233,9 +1219,9 @@ void CodeGenerator::generate_expression(const std::shared_ptr<Expression>& expre
 			break;
 		case TOKEN_BANG:															// In NOT operation 0 becomes true and anything else false
 			generate_expression(unary->expression, to_where);
-			generate_instruction(std::format("cmp $0, {0}", to_where));
-			generate_instruction(std::format("mov $0, {0}", to_where));
+			generate_instruction(std::format("test {0}, {0}", to_where));
 			generate_instruction("sete %al");
+			generate_instruction("movzbl %al, %eax");
 			break;
 		case TOKEN_TILDE:
 			generate_expression(unary->expression, to_where);
@@ -252,97 +1238,131 @@ void CodeGenerator::generate_expression(const std::shared_ptr<Expression>& expre
 		switch (binary->operator_type)
 		{
 		case TOKEN_PLUS:
-			generate_expression(binary->expression_a, to_where);					// Handle left expression
-			generate_instruction("push " + to_where);								// Push the result to the stack in order to save it	
-			generate_expression(binary->expression_b, to_where);					// Handle right expression
-			generate_instruction("pop %rcx");										// Pop and get the top of the stack to retrieve the result from left expression
-			generate_instruction("add %rcx, " + to_where);							// Add the two expressions
+			if (scaled_operand(binary->expression_b, index, scale) || scaled_operand(binary->expression_a, index, scale)) {
+				bool scaled_is_b = scaled_operand(binary->expression_b, index, scale);
+				shared_ptr<Expression> base = scaled_is_b ? binary->expression_a : binary->expression_b;
+				if (evaluate_constant(base, constant_operand) && fits_immediate(constant_operand)) {	// c + x * s is a single lea
+					generate_expression(index, to_where);
+					generate_cheapest({
+						{ std::format("lea {0}(,%rax,{1}), %rax", constant_operand, scale) },
+						{ std::format("shl ${0}, %rax", std::countr_zero((unsigned)scale)), std::format("add ${0}, %rax", constant_operand) } });
+					break;
+				}
+				if (scaled_is_b) {
+					generate_expression(base, to_where);
+					push(to_where);
+					generate_expression(index, to_where);
+					pop("%rcx");
+				}
+				else {																// Keeps the left to right evaluation order
+					generate_expression(index, to_where);
+					push(to_where);
+					generate_expression(base, to_where);
+					generate_instruction("mov %rax, %rcx");
+					pop("%rax");
+				}
+				generate_cheapest({
+					{ std::format("lea (%rcx,%rax,{0}), %rax", scale) },
+					{ std::format("shl ${0}, %rax", std::countr_zero((unsigned)scale)), "add %rcx, %rax" } });
+				break;
+			}
+			if (simple_operand(binary->expression_b, binary->expression_a, operand)) {	// Immediates and variables are folded into the add
+				generate_expression(binary->expression_a, to_where);
+				generate_instruction(std::format("add {0}, {1}", operand, to_where));
+				break;
+			}
+			if (simple_operand(binary->expression_a, binary->expression_b, operand)) {
+				generate_expression(binary->expression_b, to_where);
+				generate_instruction(std::format("add {0}, {1}", operand, to_where));
+				break;
+			}
+			generate_expression(binary->expression_a, to_where);					// Handle left expression
+			push(to_where);								// Push the result to the stack in order to save it	
+			generate_expression(binary->expression_b, to_where);					// Handle right expression
+			pop("%rcx");										// Pop and get the top of the stack to retrieve the result from left expression
+			generate_instruction("add %rcx, " + to_where);							// Add the two expressions
 			break;
 		case TOKEN_STAR:															
+			if (evaluate_constant(binary->expression_b, constant_operand)) {		// Multiplication by a constant uses shifts and lea where possible
+				generate_expression(binary->expression_a, to_where);
+				generate_multiplication_by_constant(constant_operand);
+				break;
+			}
+			if (evaluate_constant(binary->expression_a, constant_operand)) {
+				generate_expression(binary->expression_b, to_where);
+				generate_multiplication_by_constant(constant_operand);
+				break;
+			}
+			if (simple_operand(binary->expression_b, binary->expression_a, operand)) {
+				generate_expression(binary->expression_a, to_where);
+				generate_instruction(std::format("imul {0}, {1}", operand, to_where));
+				break;
+			}
+			if (simple_operand(binary->expression_a, binary->expression_b, operand)) {
+				generate_expression(binary->expression_b, to_where);
+				generate_instruction(std::format("imul {0}, {1}", operand, to_where));
+				break;
+			}
 			generate_expression(binary->expression_a, to_where);					// Handle left expression
-			generate_instruction("push " + to_where);								// Push the result to the stack in order to save it	
+			push(to_where);								// Push the result to the stack in order to save it	
 			generate_expression(binary->expression_b, to_where);					// Handle right expression
-			generate_instruction("pop %rcx");										// Pop and get the top of the stack to retrieve the result from left expression
+			pop("%rcx");										// Pop and get the top of the stack to retrieve the result from left expression
 			generate_instruction("imul %rcx, " + to_where);							// Multiply the two expressions
 			break;
 		case TOKEN_MINUS:
+			if (simple_operand(binary->expression_b, binary->expression_a, operand)) {
+				generate_expression(binary->expression_a, to_where);
+				generate_instruction(std::format("sub {0}, {1}", operand, to_where));
+				break;
+			}
 			generate_expression(binary->expression_b, to_where);					// Handle left expression
-			generate_instruction("push " + to_where);								// Push the result to the stack in order to save it	
+			push(to_where);								// Push the result to the stack in order to save it	
 			generate_expression(binary->expression_a, to_where);					// Handle right expression
-			generate_instruction("pop %rcx");										// Pop and get the top of the stack to retrieve the result from left expression
+			pop("%rcx");										// Pop and get the top of the stack to retrieve the result from left expression
 			generate_instruction("sub %rcx, " + to_where);							// Subtract expression_b from expression_a and set the result to %rax
 			break;
 		case TOKEN_SLASH:
-			generate_expression(binary->expression_b, to_where);					// Handle left expression
-			generate_instruction("push " + to_where);								// Push the result to the stack in order to save it	
-			generate_expression(binary->expression_a, to_where);					// Handle right expression
-			generate_instruction("pop %rcx");										// Pop and get the top of the stack to retrieve the result from left expression
-			generate_instruction("cdq");
-			generate_instruction("idivq %rcx");										// Divide the two expressions
-			break;
-		case TOKEN_PERCENT:
-			generate_expression(binary->expression_b, to_where);					// Handle left expression
-			generate_instruction("push " + to_where);								// Push the result to the stack in order to save it	
-			generate_expression(binary->expression_a, to_where);					// Handle right expression
-			generate_instruction("pop %rcx");										// Pop and get the top of the stack to retrieve the result from left expression
-			generate_instruction("cdq");
-			generate_instruction("idivq %rcx");										// Divide the two expressions
-			generate_instruction("mov %rdx, " + to_where);
+		case TOKEN_PERCENT: {
+			bool is_modulo = binary->operator_type == TOKEN_PERCENT;
+			if (evaluate_constant(binary->expression_b, constant_operand) && constant_operand != 0) {
+				generate_expression(binary->expression_a, to_where);
+				generate_division_by_constant(constant_operand, is_modulo);
+				break;
+			}
+			if (binary->expression_b->type == NAME && simple_operand(binary->expression_b, binary->expression_a, operand)) {
+				generate_expression(binary->expression_a, to_where);				// idiv takes the divisor straight from memory
+				generate_instruction("cqo");
+				generate_instruction("idivq " + operand);
+			}
+			else {
+				generate_expression(binary->expression_b, to_where);				// Handle left expression
+				push(to_where);							// Push the result to the stack in order to save it	
+				generate_expression(binary->expression_a, to_where);				// Handle right expression
+				pop("%rcx");									// Pop and get the top of the stack to retrieve the result from left expression
+				generate_instruction("cqo");										// Sign extend %rax into %rdx
+				generate_instruction("idivq %rcx");									// Divide the two expressions
+			}
+			if (is_modulo)
+				generate_instruction("mov %rdx, " + to_where);
 			break;
+		}
 		case TOKEN_EQUAL_EQUAL:
-			generate_comparison(binary, to_where);
-			generate_instruction("sete %al");
-			break;
 		case TOKEN_BANG_EQUAL:
-			generate_comparison(binary, to_where);
-			generate_instruction("setne %al");
-			break;
 		case TOKEN_GREATER_EQUAL:
-			generate_comparison(binary, to_where);
-			generate_instruction("setge %al");
-			break;
 		case TOKEN_LESS_EQUAL:
-			generate_comparison(binary, to_where);
-			generate_instruction("setle %al");
-			break;
 		case TOKEN_GREATER:
-			generate_comparison(binary, to_where);
-			generate_instruction("setg %al");
-			break;
 		case TOKEN_LESS:
-			generate_comparison(binary, to_where);
-			generate_instruction("setl %al");
+			generate_instruction("set" + generate_compare(binary) + " %al");
+			generate_instruction("movzbl %al, %eax");								// Zeroing after the compare would clobber the flags
 			break;
-		case TOKEN_OR: {
-			generate_expression(binary->expression_a, to_where);
-			generate_instruction("cmp $0, " + to_where);
-			int current_jump_label = ++jump_label_counter;
-			generate_instruction("je _clause" + std::to_string(current_jump_label));
-			generate_instruction("mov $1, " + to_where);
-			generate_instruction("jmp _end" + std::to_string(current_jump_label));
-
-			generate_label("_clause" + std::to_string(current_jump_label));
-			generate_expression(binary->expression_b, to_where);
-			generate_instruction("cmp $0, " + to_where);
-			generate_instruction("mov $0, " + to_where);
-			generate_instruction("setne %al");
-
-			generate_label("_end" + std::to_string(current_jump_label));
-			break;
-		}
+		case TOKEN_OR:
 		case TOKEN_AND: {
-			generate_expression(binary->expression_a, to_where);
-			generate_instruction("cmp $0, " + to_where);
 			int current_jump_label = ++jump_label_counter;
-			generate_instruction("jne _clause" + std::to_string(current_jump_label));
+			generate_branch(expression, false, "_clause" + std::to_string(current_jump_label));
+			generate_instruction("mov $1, %eax");
 			generate_instruction("jmp _end" + std::to_string(current_jump_label));
-
 			generate_label("_clause" + std::to_string(current_jump_label));
-			generate_expression(binary->expression_b, to_where);
-			generate_instruction("cmp $0, " + to_where);
-			generate_instruction("mov $0, " + to_where);
-			generate_instruction("setne %al");
-
+			generate_instruction(load_constant(0, "%rax"));
 			generate_label("_end" + std::to_string(current_jump_label));
 			break;
 		}
@@ -352,20 +1372,27 @@ void CodeGenerator::generate_expression(const std::shared_ptr<Expression>& expre
 		break;
 	}
 	case VARIABLE_ASSIGN: {
-		bool is_global = false;
 		shared_ptr<VariableAssignment> assignment = dynamic_pointer_cast<VariableAssignment>(expression);
-		if (local_variables[local_variables.size()-1].find(assignment->variable_name) == local_variables[local_variables.size() - 1].end()) {
-			if (std::find(global_variables.begin(), global_variables.end(), assignment->variable_name) == global_variables.end()) {
-				make_error("Variable " + assignment->variable_name + " is not declared in this scope");
-			}
-			else
-				is_global = true;
+		if (!assignment->field.empty()) {
+			generate_field_assignment(assignment);
+			break;
 		}
-		int stack_offset;
-		if(!is_global)
-			stack_offset = local_variables[local_variables.size() - 1][assignment->variable_name];
-
-		std::string access = is_global ? assignment->variable_name + "(%rip)" : std::format("{0}(%rbp)", stack_offset);
+		if (assignment->index) {
+			generate_element_assignment(assignment);
+			break;
+		}
+		VectorType target_type;
+		if (vector_type(assignment->variable_name, target_type)) {
+			generate_vector_assignment(assignment, target_type);
+			break;
+		}
+		std::string access = variable_access(assignment->variable_name);
+		if (access.ends_with("(%rip)") && constant_globals.contains(assignment->variable_name))
+			make_error("Cannot assign to constant " + assignment->variable_name);
+		if (array_length(assignment->variable_name) > 0)
+			make_error("Cannot assign to array " + assignment->variable_name);
+		else if (struct_variable(assignment->variable_name))
+			make_error("Cannot assign to struct " + assignment->variable_name + ", assign its fields");
 
 		if (!assignment->is_compound) {
 			generate_expression(assignment->to_assign, "%rax");
@@ -374,42 +1401,53 @@ void CodeGenerator::generate_expression(const std::shared_ptr<Expression>& expre
 		else {
 			switch (assignment->compound_type) {
 			case INCREMENT:
-				generate_instruction("add $1, " + access);
+				generate_instruction("addq $1, " + access);					// Memory operands with an immediate need a size suffix
 				generate_instruction("mov " + access + ", %rax");
 				break;
 			case DECREMENT:
-				generate_instruction("sub $1, " + access);
-				generate_instruction("mov " + access + ", % rax");
-				break;
-			case ADDITION:
-				generate_expression(assignment->to_assign, "%rax");
-				generate_instruction("add %rax, " + access);
+				generate_instruction("subq $1, " + access);
 				generate_instruction("mov " + access + ", %rax");
 				break;
-			case SUBTRACTION:
+			case ADDITION:
+			case SUBTRACTION: {
+				std::string mnemonic = assignment->compound_type == ADDITION ? "add" : "sub";
+				if (evaluate_constant(assignment->to_assign, constant_operand) && fits_immediate(constant_operand)) {	// Updated in place
+					generate_instruction(std::format("{0}q ${1}, {2}", mnemonic, constant_operand, access));
+					generate_instruction("mov " + access + ", %rax");
+					break;
+				}
 				generate_expression(assignment->to_assign, "%rax");
-				generate_instruction("sub %rax, " + access);
+				generate_instruction(mnemonic + " %rax, " + access);
 				generate_instruction("mov " + access + ", %rax");
 				break;
+			}
 			case MULTIPLICATION:
+				if (evaluate_constant(assignment->to_assign, constant_operand)) {
+					generate_instruction("mov " + access + ", %rax");
+					generate_multiplication_by_constant(constant_operand);
+					generate_instruction("mov %rax, " + access);
+					break;
+				}
 				generate_expression(assignment->to_assign, "%rax");
 				generate_instruction("imul " + access + ", %rax");
-				generate_instruction("mov " + access + ", %rax");
-				break;
-			case DIVISION:
-				generate_expression(assignment->to_assign, "%rcx");
-				generate_instruction("mov " + access + ", %rax");
-				generate_instruction("cdq");
-				generate_instruction("idivq %rcx");										// Divide the two expressions
 				generate_instruction("mov %rax, " + access);
 				break;
+			case DIVISION:
 			case MOD:
-				generate_expression(assignment->to_assign, "%rcx");
+				if (evaluate_constant(assignment->to_assign, constant_operand) && constant_operand != 0) {
+					generate_instruction("mov " + access + ", %rax");
+					generate_division_by_constant(constant_operand, assignment->compound_type == MOD);
+					generate_instruction("mov %rax, " + access);
+					break;
+				}
+				generate_expression(assignment->to_assign, "%rax");
+				generate_instruction("mov %rax, %rcx");
 				generate_instruction("mov " + access + ", %rax");
-				generate_instruction("cdq");
+				generate_instruction("cqo");
 				generate_instruction("idivq %rcx");										// Divide the two expressions
-				generate_instruction("mov %rdx, " + access);
-				generate_instruction("mov " + access + ", %rax");
+				if (assignment->compound_type == MOD)
+					generate_instruction("mov %rdx, %rax");
+				generate_instruction("mov %rax, " + access);
 				break;
 			default:
 				break;
@@ -421,60 +1459,559 @@ void CodeGenerator::generate_expression(const std::shared_ptr<Expression>& expre
 		break;
 	}
 	case NAME: {
-		bool is_global = false;
-		shared_ptr<Name> name = dynamic_pointer_cast<Name>(expression);
-		if (local_variables[local_variables.size() - 1].find(name->name) == local_variables[local_variables.size() - 1].end()) {
-			if (std::find(global_variables.begin(), global_variables.end(), name->name) == global_variables.end()) {
-				make_error("Variable " + name->name + " is not declared in this scope");
-			}
-			else
-				is_global = true;
+		const std::string& name = dynamic_pointer_cast<Name>(expression)->name;
+		VectorType type;
+		if (vector_type(name, type))
+			make_error("Vector " + name + " can't be used as a scalar, use extract or a reduction");
+		if (array_length(name) > 0 || struct_variable(name))						// Arrays and structs are passed around as their address
+			generate_instruction(std::format("lea {0}, {1}", variable_access(name), to_where));
+		else
+			generate_instruction(std::format("mov {0}, {1}", variable_access(name), to_where));
+		break;
+	}
+	case INDEX_EXPR: {
+		shared_ptr<IndexExpression> element = dynamic_pointer_cast<IndexExpression>(expression);
+		bool indexed = generate_element_index(element->array_name, element->index, constant_operand);
+		generate_instruction(std::format("mov {0}, {1}", element_access(element->array_name, constant_operand, indexed), to_where));
+		break;
+	}
+	case FIELD_EXPR: {
+		shared_ptr<FieldExpression> access = dynamic_pointer_cast<FieldExpression>(expression);
+		shared_ptr<Expression> index;												// The parser only puts a name or an element before the dot
+		std::string name = access->object->type == INDEX_EXPR ? dynamic_pointer_cast<IndexExpression>(access->object)->array_name
+			: dynamic_pointer_cast<Name>(access->object)->name;
+		if (access->object->type == INDEX_EXPR)
+			index = dynamic_pointer_cast<IndexExpression>(access->object)->index;
+		const StructField* field = resolve_field(name, index, access->field);
+		if (!field)
+			break;
+		bool indexed = generate_field_index(name, index, *field, constant_operand);
+		generate_instruction(load_extended(field->size, field->is_signed, field_access(name, *field, constant_operand, indexed)));
+		if (to_where != "%rax")
+			generate_instruction(std::format("mov %rax, {0}", to_where));
+		break;
+	}
+	case STRING_EXPR:
+		generate_instruction(std::format("lea {0}(%rip), {1}", string_pool.label(dynamic_pointer_cast<StringLiteral>(expression)->value), to_where));
+		break;
+	case CALL_EXPR:
+		if (dynamic_pointer_cast<Call>(expression)->name == "len") {				// Built in, the length is known at compile time
+			if (!evaluate_length(dynamic_pointer_cast<Call>(expression), constant_operand))
+				make_error("len expects a string literal or a constant string");
+			generate_instruction(load_constant(constant_operand, to_where));
+			break;
 		}
-		if (is_global) {
-			generate_instruction("mov " + name->name + "(%rip), %rax");
+		if (conversion_type(dynamic_pointer_cast<Call>(expression), size, is_signed)) {
+			generate_expression(dynamic_pointer_cast<Call>(expression)->arguments[0], "%rax");
+			if (size < 8)
+				generate_instruction(load_extended(size, is_signed, field_register(size)));
+			if (to_where != "%rax")
+				generate_instruction(std::format("mov %rax, {0}", to_where));
+			break;
 		}
-		else {
-			int stack_offset = local_variables[local_variables.size() - 1][name->name];
-			generate_instruction(std::format("mov {0}(%rbp), %rax", stack_offset));
+		if (intrinsic_named(dynamic_pointer_cast<Call>(expression)->name) != INTRINSIC_NONE) {
+			generate_intrinsic(dynamic_pointer_cast<Call>(expression));
+			if (to_where != "%rax")
+				generate_instruction(std::format("mov %rax, {0}", to_where));
+			break;
 		}
-		
+		if (is_builtin(dynamic_pointer_cast<Call>(expression)->name)) {
+			generate_lane_builtin(dynamic_pointer_cast<Call>(expression));
+			if (to_where != "%rax")
+				generate_instruction(std::format("mov %rax, {0}", to_where));
+			break;
+		}
+		call(dynamic_pointer_cast<Call>(expression));
+		break;
+	case INLINED_CALL_EXPR:
+		generate_inlined_call(dynamic_pointer_cast<InlinedCall>(expression));
+		break;
+	default:
 		break;
 	}
-	case CALL_EXPR:
-		call(dynamic_pointer_cast<Call>(expression));
+}
+
+int CodeGenerator::array_length(const std::string& name) {
+	auto local = local_variables[local_variables.size() - 1].find(name);
+	if (local != local_variables[local_variables.size() - 1].end()) {
+		auto found = local_array_lengths.find(local->second);
+		return found == local_array_lengths.end() ? 0 : found->second;
+	}
+	auto found = global_array_lengths.find(name);
+	return found == global_array_lengths.end() ? 0 : found->second;
+}
+
+std::string CodeGenerator::memory_operand(const std::string& name, long long displacement, int scale) {
+	std::string base = variable_access(name);
+	if (base.ends_with("(%rip)")) {
+		if (scale == 0)
+			return std::format("{0}+{1}(%rip)", name, displacement);
+		generate_instruction(std::format("lea {0}, %rsi", base));				// RIP relative operands can't have an index register
+		return std::format("{0}(%rsi,%rcx,{1})", displacement, scale);
+	}
+	size_t open = base.find('(');												// A slot of the frame, the displacement moves into it
+	std::string slot = std::format("{0}{1}", std::stoll(base.substr(0, open)) + displacement, base.substr(open));
+	if (scale != 0)
+		slot.insert(slot.size() - 1, std::format(",%rcx,{0}", scale));
+	return slot;
+}
+
+std::string CodeGenerator::element_access(const std::string& name, long long element, bool indexed) {
+	return memory_operand(name, 8 * element, indexed ? 8 : 0);
+}
+
+bool CodeGenerator::generate_element_index(const std::string& name, const shared_ptr<Expression>& index, long long& displacement, int stride) {
+	if (stride == 0) {
+		if (struct_variable(name))
+			make_error("Elements of " + name + " are structs, only their fields can be accessed");
+		stride = 8;
+	}
+	int length = array_length(name);
+	if (length == 0)
+		make_error(name + " is not an array");
+	if (evaluate_constant(index, displacement)) {
+		if (displacement < 0 || displacement >= length)
+			make_error(std::format("Index {0} is out of bounds of array {1}", displacement, name));
+		return false;
+	}
+	displacement = 0;															// a[i + c] folds c into the operand
+	shared_ptr<Expression> variable = index;
+	if (index->type == BINARY_EXPR) {
+		shared_ptr<BinaryExpression> binary = dynamic_pointer_cast<BinaryExpression>(index);
+		if (binary->operator_type == TOKEN_PLUS && evaluate_constant(binary->expression_b, displacement))
+			variable = binary->expression_a;
+		else if (binary->operator_type == TOKEN_PLUS && evaluate_constant(binary->expression_a, displacement))
+			variable = binary->expression_b;
+		else if (binary->operator_type == TOKEN_MINUS && evaluate_constant(binary->expression_b, displacement)) {
+			variable = binary->expression_a;
+			displacement = -displacement;
+		}
+		if (!fits_immediate(stride * displacement)) {
+			variable = index;
+			displacement = 0;
+		}
+	}
+	generate_expression(variable, "%rax");
+	generate_instruction("mov %rax, %rcx");
+	return true;
+}
+
+void CodeGenerator::generate_element_assignment(const shared_ptr<VariableAssignment>& assignment) {	// Leaves the stored value in %rax
+	bool has_value = assignment->to_assign != nullptr;
+	if (has_value) {															// The value first, an inlined body in it needs nothing pushed
+		generate_expression(assignment->to_assign, "%rax");
+		push("%rax");
+	}
+	long long displacement;
+	bool indexed = generate_element_index(assignment->variable_name, assignment->index, displacement);
+	if (has_value)
+		pop("%rax");															// Before the operand is made, slots addressed from %rsp move with pushes
+	std::string element = element_access(assignment->variable_name, displacement, indexed);
+	if (!assignment->is_compound) {
+		generate_instruction("mov %rax, " + element);
+		return;
+	}
+	switch (assignment->compound_type) {
+	case INCREMENT:
+	case DECREMENT:
+		generate_instruction((assignment->compound_type == INCREMENT ? "addq $1, " : "subq $1, ") + element);
+		generate_instruction("mov " + element + ", %rax");
+		break;
+	case ADDITION:
+	case SUBTRACTION:
+		generate_instruction((assignment->compound_type == ADDITION ? "add %rax, " : "sub %rax, ") + element);
+		generate_instruction("mov " + element + ", %rax");
+		break;
+	case MULTIPLICATION:
+		generate_instruction("imul " + element + ", %rax");
+		generate_instruction("mov %rax, " + element);
+		break;
+	case DIVISION:
+	case MOD:
+		generate_instruction("mov %rax, %r8");
+		generate_instruction("mov " + element + ", %rax");
+		generate_instruction("cqo");
+		generate_instruction("idiv %r8");
+		if (assignment->compound_type == MOD)
+			generate_instruction("mov %rdx, %rax");
+		generate_instruction("mov %rax, " + element);
 		break;
 	default:
 		break;
 	}
 }
 
-void CodeGenerator::generate_comparison(shared_ptr<BinaryExpression> binary, const std::string& to_where) {
-	generate_expression(binary->expression_a, to_where);					// Handle left expression
-	generate_instruction("push " + to_where);								// Push the result to the stack in order to save it	
-	generate_expression(binary->expression_b, to_where);					// Handle right expression
-	generate_instruction("pop %rcx");										// Pop and get the top of the stack to retrieve the result from left expression
+void CodeGenerator::zero_slots(int offset, int quadwords) {
+	if (quadwords <= 8) {
+		for (int i = 0; i < quadwords; i++)
+			generate_instruction(std::format("movq $0, {0}", stack_slot(offset + 8 * i)));
+		return;
+	}
+	generate_instruction(std::format("lea {0}, %rdi", stack_slot(offset)));	// Larger blocks are cleared with a string store
+	generate_instruction(std::format("mov ${0}, %ecx", quadwords));
+	generate_instruction("xor %eax, %eax");
+	generate_instruction("rep stosq");
+}
+
+shared_ptr<VariableDeclaration> CodeGenerator::struct_variable(const std::string& name) {
+	auto local = local_variables[local_variables.size() - 1].find(name);
+	if (local != local_variables[local_variables.size() - 1].end()) {
+		auto found = local_structs.find(local->second);
+		return found == local_structs.end() ? nullptr : found->second;
+	}
+	auto found = global_structs.find(name);
+	return found == global_structs.end() ? nullptr : found->second;
+}
+
+const StructField* CodeGenerator::resolve_field(const std::string& name, const shared_ptr<Expression>& index, const std::string& field_name) {
+	shared_ptr<VariableDeclaration> decl = struct_variable(name);
+	if (!decl) {
+		variable_access(name);													// Reports undeclared names
+		make_error(name + " is not a struct");
+		return nullptr;
+	}
+	if (!index && decl->array_length > 0) {
+		make_error(name + " is an array of structs, index it before accessing a field");
+		return nullptr;
+	}
+	const StructField* field = find_field(*decl->struct_type, field_name);
+	if (!field)
+		make_error(std::format("Struct {0} has no field {1}", decl->struct_type->name, field_name));
+	return field;
+}
+
+int CodeGenerator::field_stride(const std::string& name, const StructField& field) {
+	shared_ptr<VariableDeclaration> decl = struct_variable(name);
+	return decl->is_soa ? field.size : decl->struct_type->size;
+}
+
+bool CodeGenerator::generate_field_index(const std::string& name, const shared_ptr<Expression>& index, const StructField& field, long long& element) {
+	if (!index) {
+		element = 0;
+		return false;
+	}
+	int stride = field_stride(name, field);
+	bool indexed = generate_element_index(name, index, element, stride);
+	if (indexed && !is_index_scale(stride))
+		generate_instruction(std::format("imul ${0}, %rcx, %rcx", stride));
+	return indexed;
+}
+
+std::string CodeGenerator::field_access(const std::string& name, const StructField& field, long long element, bool indexed) {
+	shared_ptr<VariableDeclaration> decl = struct_variable(name);
+	int stride = field_stride(name, field);
+	long long start = decl->is_soa ? soa_field_offset(*decl->struct_type, field, decl->array_length) : field.offset;
+	int scale = !indexed ? 0 : is_index_scale(stride) ? stride : 1;
+	return memory_operand(name, start + element * stride, scale);
+}
+
+void CodeGenerator::generate_field_assignment(const shared_ptr<VariableAssignment>& assignment) {
+	const StructField* field = resolve_field(assignment->variable_name, assignment->index, assignment->field);
+	if (!field)
+		return;
+	bool has_value = assignment->to_assign != nullptr;
+	if (has_value) {
+		generate_expression(assignment->to_assign, "%rax");
+		push("%rax");
+	}
+	long long element;
+	bool indexed = generate_field_index(assignment->variable_name, assignment->index, *field, element);
+	if (has_value)
+		pop("%rax");
+	std::string operand = field_access(assignment->variable_name, *field, element, indexed);
+	if (assignment->is_compound) {												// Computed at full width, stored truncated
+		if (has_value)
+			generate_instruction("mov %rax, %r8");
+		generate_instruction(load_extended(field->size, field->is_signed, operand));
+		switch (assignment->compound_type) {
+		case INCREMENT:			generate_instruction("add $1, %rax"); break;
+		case DECREMENT:			generate_instruction("sub $1, %rax"); break;
+		case ADDITION:			generate_instruction("add %r8, %rax"); break;
+		case SUBTRACTION:		generate_instruction("sub %r8, %rax"); break;
+		case MULTIPLICATION:	generate_instruction("imul %r8, %rax"); break;
+		case DIVISION:
+		case MOD:
+			generate_instruction("cqo");
+			generate_instruction("idiv %r8");
+			if (assignment->compound_type == MOD)
+				generate_instruction("mov %rdx, %rax");
+			break;
+		default:
+			break;
+		}
+	}
+	generate_instruction(std::format("mov {0}, {1}", field_register(field->size), operand));
+	if (field->size < 8)
+		generate_instruction(load_extended(field->size, field->is_signed, field_register(field->size)));	// The assignment evaluates to what the field now holds
+}
+
+std::string CodeGenerator::variable_access(const std::string& name) {
+	auto local = local_variables[local_variables.size() - 1].find(name);
+	if (local != local_variables[local_variables.size() - 1].end())
+		return stack_slot(local->second);
+	if (std::find(global_variables.begin(), global_variables.end(), name) == global_variables.end())
+		make_error("Variable " + name + " is not declared in this scope");
+	return name + "(%rip)";
+}
+
+bool CodeGenerator::simple_operand(const shared_ptr<Expression>& expression, const shared_ptr<Expression>& other, std::string& operand) {	// Operand that an instruction can take in place of a register
+	long long value;
+	if (evaluate_constant(expression, value)) {
+		if (!fits_immediate(value))
+			return false;
+		operand = std::format("${0}", value);
+		return true;
+	}
+	if (expression->type != NAME || has_side_effects(other) || is_vector_expression(expression)	// The variable is read after the other operand is evaluated
+		|| struct_variable(dynamic_pointer_cast<Name>(expression)->name))		// A struct is used as its address
+		return false;
+	operand = variable_access(dynamic_pointer_cast<Name>(expression)->name);
+	return true;
+}
+
+bool CodeGenerator::scaled_operand(const shared_ptr<Expression>& expression, shared_ptr<Expression>& index, int& scale) {
+	if (expression->type != BINARY_EXPR || dynamic_pointer_cast<BinaryExpression>(expression)->operator_type != TOKEN_STAR)
+		return false;
+	shared_ptr<BinaryExpression> product = dynamic_pointer_cast<BinaryExpression>(expression);
+	long long factor;
+	if (evaluate_constant(product->expression_b, factor))
+		index = product->expression_a;
+	else if (evaluate_constant(product->expression_a, factor))
+		index = product->expression_b;
+	else
+		return false;
+	scale = (int)factor;
+	return factor == 2 || factor == 4 || factor == 8;
+}
+
+void CodeGenerator::generate_cheapest(const std::vector<std::vector<std::string>>& candidates) {	// Ties go to the earlier candidate
+	size_t best = 0;
+	for (size_t i = 1; i < candidates.size(); i++) {
+		if (sequence_cost(candidates[i]) < sequence_cost(candidates[best]))
+			best = i;
+	}
+	for (const std::string& instruction : candidates[best])
+		generate_instruction(instruction);
+}
+
+// Magic numbers for signed division by a constant, from Hacker's Delight (10-1), for 64 bit words.
+// Returns the multiplier and sets shift, so that n / divisor == (high 64 bits of n * multiplier (+ n)) >> shift
+static long long division_magic(long long divisor, int& shift) {
+	const unsigned long long two63 = 1ULL << 63;
+	unsigned long long absolute = divisor < 0 ? 0 - (unsigned long long)divisor : divisor;
+	unsigned long long t = two63 + ((unsigned long long)divisor >> 63);
+	unsigned long long anc = t - 1 - t % absolute;								// Absolute value of nc
+	int p = 63;
+	unsigned long long q1 = two63 / anc, r1 = two63 - q1 * anc;
+	unsigned long long q2 = two63 / absolute, r2 = two63 - q2 * absolute;
+	unsigned long long delta;
+	do {
+		p++;
+		q1 = 2 * q1; r1 = 2 * r1;
+		if (r1 >= anc) { q1++; r1 -= anc; }
+		q2 = 2 * q2; r2 = 2 * r2;
+		if (r2 >= absolute) { q2++; r2 -= absolute; }
+		delta = absolute - r2;
+	} while (q1 < delta || (q1 == delta && r1 == 0));
+	shift = p - 64;
+	long long magic = (long long)(q2 + 1);
+	return divisor < 0 ? -magic : magic;
+}
+
+void CodeGenerator::generate_division_by_constant(long long divisor, bool is_modulo) {	// Divides %rax by a non zero constant without idiv
+	unsigned long long absolute = divisor < 0 ? 0 - (unsigned long long)divisor : divisor;
+	if (absolute == 1) {
+		if (is_modulo)
+			generate_instruction(load_constant(0, "%rax"));
+		else if (divisor < 0)
+			generate_instruction("neg %rax");
+		return;
+	}
+
+	if ((absolute & (absolute - 1)) == 0) {										// Powers of two are shifts, rounding towards zero for negative numbers
+		int k = std::countr_zero(absolute);
+		generate_instruction("mov %rax, %rdx");
+		generate_instruction("sar $63, %rdx");
+		generate_instruction(std::format("shr ${0}, %rdx", 64 - k));				// %rdx = n < 0 ? 2^k - 1 : 0
+		if (is_modulo) {															// n % 2^k == n - ((n + bias) & -2^k)
+			generate_instruction("lea (%rax,%rdx), %rcx");
+			long long mask = -(long long)absolute;
+			if (fits_immediate(mask))
+				generate_instruction(std::format("and ${0}, %rcx", mask));
+			else {
+				generate_instruction(std::format("movabs ${0}, %rdx", mask));
+				generate_instruction("and %rdx, %rcx");
+			}
+			generate_instruction("sub %rcx, %rax");
+		}
+		else {
+			generate_instruction("add %rdx, %rax");
+			generate_instruction(std::format("sar ${0}, %rax", k));
+			if (divisor < 0)
+				generate_instruction("neg %rax");
+		}
+		return;
+	}
+
+	int shift;
+	long long magic = division_magic(divisor, shift);
+	generate_instruction("mov %rax, %rcx");										// Keep the dividend
+	generate_instruction(std::format("movabs ${0}, %rdx", magic));
+	generate_instruction("imul %rdx");											// %rdx = high half of n * magic
+	if (divisor > 0 && magic < 0)
+		generate_instruction("add %rcx, %rdx");
+	else if (divisor < 0 && magic > 0)
+		generate_instruction("sub %rcx, %rdx");
+	if (shift > 0)
+		generate_instruction(std::format("sar ${0}, %rdx", shift));
+	generate_instruction("mov %rdx, %rax");
+	generate_instruction("shr $63, %rax");
+	generate_instruction("add %rdx, %rax");										// Add one if the quotient is negative
+	if (is_modulo) {																// n % d == n - (n / d) * d
+		if (fits_immediate(divisor))
+			generate_instruction(std::format("imul ${0}, %rax, %rax", divisor));
+		else {
+			generate_instruction(std::format("movabs ${0}, %rdx", divisor));
+			generate_instruction("imul %rdx, %rax");
+		}
+		generate_instruction("sub %rax, %rcx");
+		generate_instruction("mov %rcx, %rax");
+	}
+}
+
+void CodeGenerator::generate_multiplication_by_constant(long long factor) {		// Multiplies %rax by a constant, using shifts and lea when cheaper than imul
+	if (factor == 0) {
+		generate_instruction(load_constant(0, "%rax"));
+		return;
+	}
+	std::vector<std::vector<std::string>> candidates;
+	if (fits_immediate(factor))
+		candidates.push_back({ std::format("imul ${0}, %rax, %rax", factor) });
+	else
+		candidates.push_back({ std::format("movabs ${0}, %rcx", factor), "imul %rcx, %rax" });
+
+	bool negative = factor < 0;
+	unsigned long long absolute = negative ? 0 - (unsigned long long)factor : factor;
+	int shift = std::countr_zero(absolute);
+	unsigned long long odd = absolute >> shift;
+	std::vector<std::string> sequence;
+	auto finish = [&](std::vector<std::string> sequence) {						// Adds the shift and sign shared by every decomposition
+		if (shift > 0)
+			sequence.push_back(std::format("shl ${0}, %rax", shift));
+		if (negative)
+			sequence.push_back("neg %rax");
+		candidates.push_back(sequence);
+	};
+	for (unsigned long long first : { 1, 3, 5, 9 }) {							// One or two lea by 3, 5 or 9
+		for (unsigned long long second : { 1, 3, 5, 9 }) {
+			if (first * second != odd || (first == 1 && second != 1))
+				continue;
+			sequence.clear();
+			if (first != 1)
+				sequence.push_back(std::format("lea (%rax,%rax,{0}), %rax", first - 1));
+			if (second != 1)
+				sequence.push_back(std::format("lea (%rax,%rax,{0}), %rax", second - 1));
+			finish(sequence);
+		}
+	}
+	if (std::has_single_bit(odd + 1) && odd > 1) {								// 2^k - 1
+		finish({ "mov %rax, %rcx", std::format("shl ${0}, %rax", std::countr_zero(odd + 1)), "sub %rcx, %rax" });
+	}
+	if (std::has_single_bit(odd - 1) && odd > 9) {								// 2^k + 1
+		finish({ "mov %rax, %rcx", std::format("shl ${0}, %rax", std::countr_zero(odd - 1)), "add %rcx, %rax" });
+	}
+	generate_cheapest(candidates);
+}
+
+std::string CodeGenerator::generate_compare(const shared_ptr<BinaryExpression>& binary) {
+	std::string condition = condition_code(binary->operator_type);
+	std::string operand;
+	long long constant;
+	if (evaluate_constant(binary->expression_b, constant) && constant == 0) {		// test is shorter than a compare with zero
+		generate_expression(binary->expression_a, "%rax");
+		generate_instruction("test %rax, %rax");
+		return condition;
+	}
+	if (simple_operand(binary->expression_b, binary->expression_a, operand)) {
+		generate_expression(binary->expression_a, "%rax");
+		generate_instruction(std::format("cmp {0}, %rax", operand));
+		return condition;
+	}
+	if (simple_operand(binary->expression_a, binary->expression_b, operand)) {		// Compared the other way around
+		generate_expression(binary->expression_b, "%rax");
+		generate_instruction(std::format("cmp {0}, %rax", operand));
+		return swap_condition(condition);
+	}
+	generate_expression(binary->expression_a, "%rax");					// Handle left expression
+	push("%rax");								// Push the result to the stack in order to save it	
+	generate_expression(binary->expression_b, "%rax");					// Handle right expression
+	pop("%rcx");										// Pop and get the top of the stack to retrieve the result from left expression
 	generate_instruction("cmp %rax, %rcx");
-	generate_instruction("mov $0, %rax");
+	return condition;
+}
+
+void CodeGenerator::generate_branch(const shared_ptr<Expression>& condition, bool jump_if, const std::string& label) {	// Compares and jumps without making a boolean
+	long long constant;
+	if (evaluate_constant(condition, constant)) {
+		if ((constant != 0) == jump_if)
+			generate_instruction("jmp " + label);
+		return;
+	}
+	if (condition->type == UNARY_EXPR && dynamic_pointer_cast<UnaryExpression>(condition)->operator_type == TOKEN_BANG) {
+		generate_branch(dynamic_pointer_cast<UnaryExpression>(condition)->expression, !jump_if, label);
+		return;
+	}
+	if (condition->type == CALL_EXPR && dynamic_pointer_cast<Call>(condition)->arguments.size() == 1) {	// The hint only decides the block layout
+		Intrinsic intrinsic = intrinsic_named(dynamic_pointer_cast<Call>(condition)->name);
+		if (intrinsic == INTRINSIC_LIKELY || intrinsic == INTRINSIC_UNLIKELY) {
+			generate_branch(dynamic_pointer_cast<Call>(condition)->arguments[0], jump_if, label);
+			return;
+		}
+	}
+	if (condition->type == BINARY_EXPR) {
+		shared_ptr<BinaryExpression> binary = dynamic_pointer_cast<BinaryExpression>(condition);
+		if (binary->operator_type == TOKEN_AND || binary->operator_type == TOKEN_OR) {	// Short circuits straight to the targets
+			bool is_or = binary->operator_type == TOKEN_OR;
+			if (jump_if == is_or) {												// Either operand decides the jump
+				generate_branch(binary->expression_a, jump_if, label);
+				generate_branch(binary->expression_b, jump_if, label);
+				return;
+			}
+			std::string skip = std::format("_skip{0}", ++jump_label_counter);
+			generate_branch(binary->expression_a, !jump_if, skip);
+			generate_branch(binary->expression_b, jump_if, label);
+			generate_label(skip);
+			return;
+		}
+		if (!condition_code(binary->operator_type).empty()) {
+			std::string code = generate_compare(binary);
+			generate_instruction(std::format("j{0} {1}", jump_if ? code : negate_condition(code), label));
+			return;
+		}
+	}
+	generate_expression(condition, "%rax");
+	generate_instruction("test %rax, %rax");
+	generate_instruction((jump_if ? "jne " : "je ") + label);
 }
 
 void CodeGenerator::generate_while_statement(const std::shared_ptr<WhileStatement> while_statement) {
 	
 	int current_jump = ++jump_label_counter;
 	loop_positions.push_back(std::make_pair(WHILE_STM, current_jump));
+	count_site_event("loop", while_statement->site, 0, 2);
+	align_loop_header();
 	if (while_statement->type == DO_WHILE_STM) {
 		generate_label(std::format("_while_start{0}", current_jump));
-		generate_statement(while_statement->body);
-		generate_expression(while_statement->condition, "%rax");
-		generate_instruction("cmp $0, %rax");
-		generate_instruction(std::format("jne _while_start{0}", current_jump));
+		count_site_event("loop", while_statement->site, 1, 2);
+		generate_scoped_statement(while_statement->body);
+		generate_branch(while_statement->condition, true, std::format("_while_start{0}", current_jump));
 		generate_label(std::format("_while_end{0}", current_jump));
 	}
 	else {
 		generate_label(std::format("_while_start{0}", current_jump));
-		generate_expression(while_statement->condition, "%rax");
-		generate_instruction("cmp $0, %rax");
-		generate_instruction(std::format("je _while_end{0}", current_jump));
-		generate_statement(while_statement->body);
+		generate_branch(while_statement->condition, false, std::format("_while_end{0}", current_jump));
+		count_site_event("loop", while_statement->site, 1, 2);
+		generate_scoped_statement(while_statement->body);
 		generate_instruction(std::format("jmp _while_start{0}", current_jump));
 		generate_label(std::format("_while_end{0}", current_jump));
 	}
@@ -485,33 +2022,959 @@ void CodeGenerator::generate_for_statement(const std::shared_ptr<ForStatement> f
 	int current_jump = ++jump_label_counter;
 	loop_positions.push_back(std::make_pair(FOR_STM, current_jump));
 	new_scope();
+	int saved_stack_index = stack_index;
 	generate_statement(for_statement->initializer);
+	VectorLoop vector_loop;
+	if (plan_vector_loop(for_statement, options, vector_loop))					// The scalar loop then runs the iterations that don't fill a vector
+		generate_vector_loop(vector_loop, current_jump);
+	count_site_event("loop", for_statement->site, 0, 2);
+	align_loop_header();
 	generate_label(std::format("_while_start{0}", current_jump));
-	generate_expression(for_statement->condition, "%rax");
-	generate_instruction("cmp $0, %rax");
-	generate_instruction(std::format("je _while_end{0}", current_jump));
-	generate_statement(for_statement->body);
+	generate_branch(for_statement->condition, false, std::format("_while_end{0}", current_jump));
+	count_site_event("loop", for_statement->site, 1, 2);
+	generate_scoped_statement(for_statement->body);
 	generate_label(std::format("_for_closing_expr{0}", current_jump));
 	generate_expression(for_statement->post, "%rax");
 	generate_instruction(std::format("jmp _while_start{0}", current_jump));
 	generate_label(std::format("_while_end{0}", current_jump));
+	stack_index = saved_stack_index;
 	pop_scope();
 	loop_positions.pop_back();
 }
 
+std::string CodeGenerator::vector_register(int number, bool full_width) {
+	return std::format("%{0}mm{1}", options.avx2 && full_width ? "y" : "x", number);
+}
+
+void CodeGenerator::vector_instruction(const std::string& mnemonic, const std::string& source, const std::string& operand, const std::string& destination) {
+	if (options.avx2) {															// VEX encoded forms don't overwrite their operands
+		generate_instruction(std::format("v{0} {1}, {2}, {3}", mnemonic, source, operand, destination));
+		return;
+	}
+	if (operand != destination)
+		generate_instruction(std::format("movdqa {0}, {1}", operand, destination));
+	generate_instruction(std::format("{0} {1}, {2}", mnemonic, source, destination));
+}
+
+void CodeGenerator::vector_shift(const std::string& mnemonic, int count, const std::string& operand, const std::string& destination) {
+	if (options.avx2) {
+		generate_instruction(std::format("v{0} ${1}, {2}, {3}", mnemonic, count, operand, destination));
+		return;
+	}
+	if (operand != destination)
+		generate_instruction(std::format("movdqa {0}, {1}", operand, destination));
+	generate_instruction(std::format("{0} ${1}, {2}", mnemonic, count, destination));
+}
+
+static std::string invariant_key(const shared_ptr<Expression>& expression) {	// Constants and names are broadcast once, before the loop
+	if (expression->type == CONSTANT_EXPR)
+		return std::format("#{0}", dynamic_pointer_cast<Constant>(expression)->value);
+	return dynamic_pointer_cast<Name>(expression)->name;
+}
+
+void CodeGenerator::collect_lane_invariants(const shared_ptr<Expression>& expression, std::vector<shared_ptr<Expression>>& invariants) {
+	switch (expression->type)
+	{
+	case CONSTANT_EXPR:
+	case NAME:
+		invariants.push_back(expression);
+		break;
+	case UNARY_EXPR:
+		collect_lane_invariants(dynamic_pointer_cast<UnaryExpression>(expression)->expression, invariants);
+		break;
+	case BINARY_EXPR:
+		collect_lane_invariants(dynamic_pointer_cast<BinaryExpression>(expression)->expression_a, invariants);
+		collect_lane_invariants(dynamic_pointer_cast<BinaryExpression>(expression)->expression_b, invariants);
+		break;
+	default:
+		break;
+	}
+}
+
+int CodeGenerator::lane_registers(const shared_ptr<Expression>& expression, int depth) {	// The value of an expression goes in register depth, its operands above it
+	switch (expression->type)
+	{
+	case INDEX_EXPR:
+		return depth;
+	case UNARY_EXPR:
+		return std::max(lane_registers(dynamic_pointer_cast<UnaryExpression>(expression)->expression, depth), depth + 1);
+	case BINARY_EXPR: {
+		shared_ptr<BinaryExpression> binary = dynamic_pointer_cast<BinaryExpression>(expression);
+		int highest = std::max({ lane_registers(binary->expression_a, depth), lane_registers(binary->expression_b, depth + 1), depth });
+		return binary->operator_type == TOKEN_STAR ? std::max(highest, depth + 3) : highest;
+	}
+	default:
+		break;
+	}
+	return -1;
+}
+
+std::string CodeGenerator::generate_lane_value(const shared_ptr<Expression>& expression, int depth, const std::unordered_map<std::string, std::string>& invariants) {
+	std::string result = vector_register(depth);
+	switch (expression->type)
+	{
+	case INDEX_EXPR: {
+		shared_ptr<IndexExpression> element = dynamic_pointer_cast<IndexExpression>(expression);
+		long long offset;
+		element_offset(element->index, vector_induction, offset);
+		if (struct_variable(element->array_name))
+			make_error("Elements of " + element->array_name + " are structs, only their fields can be accessed");
+		generate_instruction(std::format("{0}movdqu {1}, {2}", options.avx2 ? "v" : "", element_access(element->array_name, offset, true), result));
+		return result;
+	}
+	case UNARY_EXPR: {															// Negation, 0 - x
+		std::string operand = generate_lane_value(dynamic_pointer_cast<UnaryExpression>(expression)->expression, depth, invariants);
+		std::string zero = vector_register(depth + 1);
+		vector_instruction("pxor", zero, zero, zero);
+		vector_instruction("psubq", operand, zero, zero);
+		generate_instruction(std::format("{0}movdqa {1}, {2}", options.avx2 ? "v" : "", zero, result));
+		return result;
+	}
+	case BINARY_EXPR: {
+		shared_ptr<BinaryExpression> binary = dynamic_pointer_cast<BinaryExpression>(expression);
+		std::string a = generate_lane_value(binary->expression_a, depth, invariants);
+		std::string b = generate_lane_value(binary->expression_b, depth + 1, invariants);
+		if (binary->operator_type != TOKEN_STAR) {
+			vector_instruction(binary->operator_type == TOKEN_PLUS ? "paddq" : "psubq", b, a, result);
+			return result;
+		}
+		vector_multiply(64, a, b, result, depth + 2, true);
+		return result;
+	}
+	default:
+		break;
+	}
+	return invariants.at(invariant_key(expression));
+}
+
+bool CodeGenerator::generate_vector_loop(const VectorLoop& plan, int loop_label) {
+	int lanes = options.avx2 ? 4 : 2;
+	int next_register = 15;														// Accumulators and broadcast values take the registers from the top
+	std::vector<int> accumulators;
+	std::vector<shared_ptr<Expression>> leaves;
+	int temporaries = -1;
+	for (const VectorOperation& operation : plan.operations) {
+		accumulators.push_back(operation.kind == VECTOR_STORE ? -1 : next_register--);
+		collect_lane_invariants(operation.value, leaves);
+		temporaries = std::max(temporaries, lane_registers(operation.value, 0));
+		if (operation.kind == VECTOR_MIN || operation.kind == VECTOR_MAX)
+			temporaries = std::max(temporaries, 1);								// Holds the compare mask
+		VectorType type;
+		if ((operation.kind == VECTOR_STORE) != (array_length(operation.target) > 0) || vector_type(operation.target, type)
+			|| struct_variable(operation.target))
+			return false;
+	}
+	std::unordered_map<std::string, std::string> invariants;
+	std::vector<shared_ptr<Expression>> broadcasts;
+	for (shared_ptr<Expression>& leaf : leaves) {
+		VectorType type;
+		if (leaf->type == NAME && (array_length(invariant_key(leaf)) > 0 || vector_type(invariant_key(leaf), type) || struct_variable(invariant_key(leaf))))
+			return false;
+		if (!invariants.contains(invariant_key(leaf))) {
+			invariants[invariant_key(leaf)] = vector_register(next_register--);
+			broadcasts.push_back(leaf);
+		}
+	}
+	if (temporaries > next_register)
+		return false;
+
+	vector_induction = plan.induction;
+	std::string v = options.avx2 ? "v" : "";
+	for (size_t i = 0; i < plan.operations.size(); i++) {
+		if (accumulators[i] < 0)
+			continue;
+		std::string accumulator = vector_register(accumulators[i]);
+		if (plan.operations[i].kind == VECTOR_SUM) {							// Partial sums start at zero and are added to the variable at the end
+			vector_instruction("pxor", accumulator, accumulator, accumulator);
+			continue;
+		}
+		generate_instruction(std::format("mov {0}, %rax", variable_access(plan.operations[i].target)));	// Minimum and maximum start from the current value
+		generate_instruction(std::format("vmovq %rax, {0}", vector_register(accumulators[i], false)));
+		generate_instruction(std::format("vpbroadcastq {0}, {1}", vector_register(accumulators[i], false), accumulator));
+	}
+	for (shared_ptr<Expression>& leaf : broadcasts) {
+		std::string target = invariants[invariant_key(leaf)];
+		std::string low = target.substr(0, 1) + "x" + target.substr(2);
+		generate_expression(leaf, "%rax");
+		generate_instruction(std::format("{0}movq %rax, {1}", v, low));
+		if (options.avx2)
+			generate_instruction(std::format("vpbroadcastq {0}, {1}", low, target));
+		else
+			generate_instruction(std::format("punpcklqdq {0}, {0}", low));
+	}
+
+	std::string start_label = std::format("_vector_start{0}", loop_label);
+	std::string end_label = std::format("_vector_end{0}", loop_label);
+	align_loop_header();
+	generate_label(start_label);
+	generate_expression(plan.bound, "%rax");									// Runs while the last lane is still an iteration of the loop
+	generate_instruction(std::format("mov {0}, %rcx", variable_access(plan.induction)));
+	generate_instruction(std::format("add ${0}, %rcx", lanes - 1));
+	generate_instruction("cmp %rax, %rcx");
+	generate_instruction(std::format("{0} {1}", plan.comparison == TOKEN_LESS ? "jge" : "jg", end_label));
+	generate_instruction(std::format("mov {0}, %rcx", variable_access(plan.induction)));
+	for (size_t i = 0; i < plan.operations.size(); i++) {
+		const VectorOperation& operation = plan.operations[i];
+		std::string value = generate_lane_value(operation.value, 0, invariants);
+		std::string accumulator = accumulators[i] < 0 ? "" : vector_register(accumulators[i]);
+		switch (operation.kind)
+		{
+		case VECTOR_STORE:
+			generate_instruction(std::format("{0}movdqu {1}, {2}", v, value, element_access(operation.target, 0, true)));
+			break;
+		case VECTOR_SUM:
+			vector_instruction(operation.subtract ? "psubq" : "paddq", value, accumulator, accumulator);
+			break;
+		case VECTOR_MIN:
+		case VECTOR_MAX:
+			vector_min_max(operation.kind == VECTOR_MIN, 64, value, accumulator, 1, true);
+			break;
+		}
+	}
+	generate_instruction(std::format("addq ${0}, {1}", lanes, variable_access(plan.induction)));
+	generate_instruction("jmp " + start_label);
+	generate_label(end_label);
+	for (size_t i = 0; i < plan.operations.size(); i++) {
+		if (accumulators[i] >= 0)
+			generate_horizontal_reduction(plan.operations[i], accumulators[i]);
+	}
+	if (options.avx2)
+		generate_instruction("vzeroupper");										// Avoids the penalty of mixing in legacy SSE code, in callees too
+	return true;
+}
+
+void CodeGenerator::vector_multiply(int lane_bits, const std::string& a, const std::string& b, const std::string& result, int scratch, bool full_width) {
+	std::string low = vector_register(scratch, full_width);
+	std::string high = vector_register(scratch + 1, full_width);
+	if (lane_bits == 32 && options.avx2) {
+		generate_instruction(std::format("vpmulld {0}, {1}, {2}", b, a, result));
+		return;
+	}
+	if (lane_bits == 32) {														// pmulld is SSE4.1, multiply the even and the odd lanes as 64 bit products
+		vector_instruction("pmuludq", b, a, low);
+		vector_shift("psrlq", 32, a, high);
+		vector_shift("psrlq", 32, b, result);
+		vector_instruction("pmuludq", result, high, high);
+		generate_instruction(std::format("pshufd $0x08, {0}, {1}", low, result));	// Low halves of the products, interleaved back
+		generate_instruction(std::format("pshufd $0x08, {0}, {0}", high));
+		vector_instruction("punpckldq", high, result, result);
+		return;
+	}
+	vector_shift("psrlq", 32, a, low);											// No 64 bit multiply below AVX-512, built from 32 bit halves:
+	vector_instruction("pmuludq", b, low, low);									// lo(a) * lo(b) + ((hi(a) * lo(b) + lo(a) * hi(b)) << 32)
+	vector_shift("psrlq", 32, b, high);
+	vector_instruction("pmuludq", a, high, high);
+	vector_instruction("paddq", high, low, low);
+	vector_shift("psllq", 32, low, low);
+	vector_instruction("pmuludq", b, a, result);
+	vector_instruction("paddq", low, result, result);
+}
+
+void CodeGenerator::vector_min_max(bool is_min, int lane_bits, const std::string& value, const std::string& accumulator, int scratch, bool full_width) {
+	std::string mask = vector_register(scratch, full_width);
+	if (lane_bits == 32 && options.avx2) {
+		generate_instruction(std::format("vp{0}sd {1}, {2}, {2}", is_min ? "min" : "max", value, accumulator));
+		return;
+	}
+	std::string compare = lane_bits == 64 ? "pcmpgtq" : "pcmpgtd";				// Lanes where the value wins get a mask of ones
+	if (is_min)
+		vector_instruction(compare, value, accumulator, mask);
+	else
+		vector_instruction(compare, accumulator, value, mask);
+	if (options.avx2) {
+		generate_instruction(std::format("vpblendvb {0}, {1}, {2}, {2}", mask, value, accumulator));
+		return;
+	}
+	std::string kept = vector_register(scratch + 1, full_width);				// SSE2 has no blend, (value & mask) | (accumulator & ~mask)
+	vector_instruction("pandn", accumulator, mask, kept);
+	vector_instruction("pand", value, mask, mask);
+	vector_instruction("por", kept, mask, accumulator);
+}
+
+void CodeGenerator::reduce_lanes(VectorOperationKind kind, int lane_bits, int accumulator, bool full_width, int scratch) {
+	std::string lanes = vector_register(accumulator, false);
+	std::string other = vector_register(scratch, false);
+	std::string v = options.avx2 ? "v" : "";
+	auto combine = [&]() {
+		if (kind == VECTOR_SUM)
+			vector_instruction(lane_bits == 64 ? "paddq" : "paddd", other, lanes, lanes);
+		else
+			vector_min_max(kind == VECTOR_MIN, lane_bits, other, lanes, scratch + 1, false);
+	};
+	if (full_width) {															// Upper half onto the lower one
+		generate_instruction(std::format("vextracti128 $1, {0}, {1}", vector_register(accumulator), other));
+		combine();
+	}
+	generate_instruction(std::format("{0}pshufd $0x4e, {1}, {2}", v, lanes, other));	// Then the two quadwords
+	combine();
+	if (lane_bits == 64) {
+		generate_instruction(std::format("{0}movq {1}, %rax", v, lanes));
+		return;
+	}
+	generate_instruction(std::format("{0}pshufd $0xb1, {1}, {2}", v, lanes, other));	// And the two doublewords
+	combine();
+	generate_instruction(std::format("{0}movd {1}, %eax", v, lanes));
+	generate_instruction("movslq %eax, %rax");
+}
+
+void CodeGenerator::generate_horizontal_reduction(const VectorOperation& operation, int accumulator) {
+	reduce_lanes(operation.kind, 64, accumulator, options.avx2, 0);
+	if (operation.kind == VECTOR_SUM)
+		generate_instruction(std::format("add %rax, {0}", variable_access(operation.target)));
+	else
+		generate_instruction(std::format("mov %rax, {0}", variable_access(operation.target)));
+}
+
+static const std::unordered_set<std::string> vector_builtins = { "vload", "insert", "shuffle", "vmin", "vmax" };	// Give a vector
+static const std::unordered_set<std::string> lane_builtins = { "extract", "reduce_add", "reduce_min", "reduce_max", "vstore" };	// Take one
+
+bool CodeGenerator::vector_type(const std::string& name, VectorType& type) {
+	if (local_variables.empty())
+		return false;
+	auto local = local_variables[local_variables.size() - 1].find(name);
+	if (local == local_variables[local_variables.size() - 1].end())
+		return false;
+	auto found = local_vector_types.find(local->second);
+	if (found == local_vector_types.end())
+		return false;
+	type = found->second;
+	return true;
+}
+
+bool CodeGenerator::is_builtin(const std::string& name) {
+	int size;
+	bool is_signed;
+	if (name == "len" || integer_type_named(name, size, is_signed) || intrinsic_named(name) != INTRINSIC_NONE)	// Reserved names
+		return true;
+	return (vector_builtins.contains(name) || lane_builtins.contains(name)) && !functions.contains(name);
+}
+
+bool CodeGenerator::is_vector_expression(const shared_ptr<Expression>& expression) {
+	VectorType type;
+	switch (expression->type)
+	{
+	case NAME:
+		return vector_type(dynamic_pointer_cast<Name>(expression)->name, type);
+	case UNARY_EXPR:
+		return is_vector_expression(dynamic_pointer_cast<UnaryExpression>(expression)->expression);
+	case BINARY_EXPR:
+		return is_vector_expression(dynamic_pointer_cast<BinaryExpression>(expression)->expression_a)
+			|| is_vector_expression(dynamic_pointer_cast<BinaryExpression>(expression)->expression_b);
+	case CALL_EXPR: {
+		const std::string& name = dynamic_pointer_cast<Call>(expression)->name;
+		return is_builtin(name) && vector_builtins.contains(name);
+	}
+	default:
+		break;
+	}
+	return false;
+}
+
+bool CodeGenerator::infer_vector_type(const shared_ptr<Expression>& expression, VectorType& type) {	// From the variables in it, vload alone can't tell
+	switch (expression->type)
+	{
+	case NAME:
+		return vector_type(dynamic_pointer_cast<Name>(expression)->name, type);
+	case UNARY_EXPR:
+		return infer_vector_type(dynamic_pointer_cast<UnaryExpression>(expression)->expression, type);
+	case BINARY_EXPR:
+		return infer_vector_type(dynamic_pointer_cast<BinaryExpression>(expression)->expression_a, type)
+			|| infer_vector_type(dynamic_pointer_cast<BinaryExpression>(expression)->expression_b, type);
+	case CALL_EXPR: {
+		shared_ptr<Call> call_expression = dynamic_pointer_cast<Call>(expression);
+		if (!is_vector_expression(expression) || call_expression->name == "vload")
+			return false;
+		for (shared_ptr<Expression>& argument : call_expression->arguments) {
+			if (infer_vector_type(argument, type))
+				return true;
+		}
+		return false;
+	}
+	default:
+		break;
+	}
+	return false;
+}
+
+std::string CodeGenerator::vector_move(const VectorType& type) {				// Slots are 16 byte aligned, the ABI doesn't align the frame to 32
+	if (type.bytes() == 32)
+		return "vmovdqu";
+	return options.avx2 ? "vmovdqa" : "movdqa";
+}
+
+void CodeGenerator::generate_vector_expression(const shared_ptr<Expression>& expression, const VectorType& type, int depth) {
+	if (depth > 12) {															// Leaves room for the scratch registers of the deepest operation
+		make_error("Vector expression is too deeply nested");
+		return;
+	}
+	bool full_width = type.bytes() == 32;
+	std::string result = vector_register(depth, full_width);
+	std::string suffix = type.lane_bits == 64 ? "q" : "d";
+	if (!is_vector_expression(expression)) {									// Scalars are broadcast to every lane
+		long long value;
+		if (evaluate_constant(expression, value) && value == 0) {
+			vector_instruction("pxor", result, result, result);
+			return;
+		}
+		std::string low = vector_register(depth, false);
+		std::string v = options.avx2 ? "v" : "";
+		generate_vector_scalar(expression, depth);
+		if (type.lane_bits == 64)
+			generate_instruction(std::format("{0}movq %rax, {1}", v, low));
+		else
+			generate_instruction(std::format("{0}movd %eax, {1}", v, low));
+		if (options.avx2)
+			generate_instruction(std::format("vpbroadcast{0} {1}, {2}", suffix, low, result));
+		else if (type.lane_bits == 64)
+			generate_instruction(std::format("punpcklqdq {0}, {0}", low));
+		else
+			generate_instruction(std::format("pshufd $0, {0}, {0}", low));
+		return;
+	}
+	switch (expression->type)
+	{
+	case NAME: {
+		const std::string& name = dynamic_pointer_cast<Name>(expression)->name;
+		VectorType name_type;
+		vector_type(name, name_type);
+		if (name_type != type)
+			make_error(std::format("Expected a value of type {0}, {1} is {2}", type.name(), name, name_type.name()));
+		generate_instruction(std::format("{0} {1}, {2}", vector_move(type), variable_access(name), result));
+		break;
+	}
+	case UNARY_EXPR: {
+		shared_ptr<UnaryExpression> unary = dynamic_pointer_cast<UnaryExpression>(expression);
+		if (unary->operator_type != TOKEN_MINUS) {
+			make_error("Operator isn't supported on vector types");
+			break;
+		}
+		generate_vector_expression(unary->expression, type, depth);
+		std::string zero = vector_register(depth + 1, full_width);
+		vector_instruction("pxor", zero, zero, zero);
+		vector_instruction("psub" + suffix, result, zero, zero);
+		generate_instruction(std::format("{0}movdqa {1}, {2}", options.avx2 ? "v" : "", zero, result));
+		break;
+	}
+	case BINARY_EXPR: {
+		shared_ptr<BinaryExpression> binary = dynamic_pointer_cast<BinaryExpression>(expression);
+		if (binary->operator_type != TOKEN_PLUS && binary->operator_type != TOKEN_MINUS && binary->operator_type != TOKEN_STAR) {
+			make_error("Operator isn't supported on vector types");
+			break;
+		}
+		generate_vector_expression(binary->expression_a, type, depth);			// Lanes are independent, no operand order to keep
+		generate_vector_expression(binary->expression_b, type, depth + 1);
+		std::string other = vector_register(depth + 1, full_width);
+		if (binary->operator_type == TOKEN_STAR)
+			vector_multiply(type.lane_bits, result, other, result, depth + 2, full_width);
+		else
+			vector_instruction((binary->operator_type == TOKEN_PLUS ? "padd" : "psub") + suffix, other, result, result);
+		break;
+	}
+	case CALL_EXPR:
+		generate_vector_builtin(dynamic_pointer_cast<Call>(expression), type, depth);
+		break;
+	default:
+		break;
+	}
+}
+
+void CodeGenerator::generate_vector_builtin(const shared_ptr<Call>& call_expression, const VectorType& type, int depth) {
+	const std::string& name = call_expression->name;
+	std::vector<shared_ptr<Expression>>& arguments = call_expression->arguments;
+	if (name == "vload") {
+		if (arguments.size() != 2 || arguments[0]->type != NAME) {
+			make_error("vload expects an array and an index");
+			return;
+		}
+		generate_vector_load(dynamic_pointer_cast<Name>(arguments[0])->name, arguments[1], type, depth);
+	}
+	else if (name == "insert") {
+		long long lane;
+		if (arguments.size() != 3 || !evaluate_constant(arguments[1], lane) || lane < 0 || lane >= type.lanes) {
+			make_error(std::format("insert expects a {0}, a constant lane below {1} and a value", type.name(), type.lanes));
+			return;
+		}
+		generate_vector_expression(arguments[0], type, depth);
+		generate_vector_scalar(arguments[2], depth + 1);
+		generate_lane_insert(type, depth, lane);
+	}
+	else if (name == "shuffle") {
+		std::vector<long long> lanes(type.lanes);
+		bool valid = arguments.size() == lanes.size() + 1;
+		for (size_t i = 0; valid && i < lanes.size(); i++)
+			valid = evaluate_constant(arguments[i + 1], lanes[i]) && lanes[i] >= 0 && lanes[i] < type.lanes;
+		if (!valid) {
+			make_error(std::format("shuffle expects a {0} and {1} constant lanes", type.name(), type.lanes));
+			return;
+		}
+		generate_vector_expression(arguments[0], type, depth);
+		generate_vector_shuffle(type, depth, lanes);
+	}
+	else {																		// vmin and vmax
+		if (arguments.size() != 2) {
+			make_error(name + " expects two vectors");
+			return;
+		}
+		if (type.lane_bits == 64 && !options.avx2)
+			make_error(name + " of 64 bit lanes needs -mavx2");					// pcmpgtq is SSE4.2
+		bool full_width = type.bytes() == 32;
+		generate_vector_expression(arguments[0], type, depth);
+		generate_vector_expression(arguments[1], type, depth + 1);
+		vector_min_max(name == "vmin", type.lane_bits, vector_register(depth + 1, full_width), vector_register(depth, full_width), depth + 2, full_width);
+	}
+}
+
+void CodeGenerator::generate_lane_builtin(const shared_ptr<Call>& call_expression) {
+	const std::string& name = call_expression->name;
+	std::vector<shared_ptr<Expression>>& arguments = call_expression->arguments;
+	if (vector_builtins.contains(name)) {
+		make_error(name + " gives a vector, use extract or a reduction to get a scalar");
+		return;
+	}
+	size_t vector_argument = name == "vstore" ? 2 : 0;
+	size_t expected = name == "vstore" ? 3 : (name == "extract" ? 2 : 1);
+	VectorType type;
+	if (arguments.size() != expected || !infer_vector_type(arguments[vector_argument], type)) {
+		make_error(name + " expects a vector variable or an expression using one");
+		return;
+	}
+	int depth = vector_depth;
+	if (name == "vstore") {
+		generate_vector_store(call_expression, type, depth);
+		return;
+	}
+	generate_vector_expression(arguments[0], type, depth);
+	if (name == "extract") {
+		long long lane;
+		if (!evaluate_constant(arguments[1], lane) || lane < 0 || lane >= type.lanes) {
+			make_error(std::format("extract expects a constant lane below {0}", type.lanes));
+			return;
+		}
+		generate_lane_extract(type, depth, lane);
+		return;
+	}
+	VectorOperationKind kind = name == "reduce_add" ? VECTOR_SUM : (name == "reduce_min" ? VECTOR_MIN : VECTOR_MAX);
+	if (kind != VECTOR_SUM && type.lane_bits == 64 && !options.avx2)
+		make_error(name + " of 64 bit lanes needs -mavx2");
+	reduce_lanes(kind, type.lane_bits, depth, type.bytes() == 32, depth + 1);
+}
+
+void CodeGenerator::generate_vector_assignment(const shared_ptr<VariableAssignment>& assignment, const VectorType& type) {
+	const std::string& name = assignment->variable_name;
+	shared_ptr<Expression> value = assignment->to_assign;
+	if (assignment->is_compound) {												// v += e is v = v + e, v++ adds one to every lane
+		switch (assignment->compound_type)
+		{
+		case ADDITION:			value = make_shared<BinaryExpression>(make_shared<Name>(name), TOKEN_PLUS, value); break;
+		case SUBTRACTION:		value = make_shared<BinaryExpression>(make_shared<Name>(name), TOKEN_MINUS, value); break;
+		case MULTIPLICATION:	value = make_shared<BinaryExpression>(make_shared<Name>(name), TOKEN_STAR, value); break;
+		case INCREMENT:			value = make_shared<BinaryExpression>(make_shared<Name>(name), TOKEN_PLUS, make_shared<Constant>(1)); break;
+		case DECREMENT:			value = make_shared<BinaryExpression>(make_shared<Name>(name), TOKEN_MINUS, make_shared<Constant>(1)); break;
+		default:
+			make_error("Operator isn't supported on vector types");
+			return;
+		}
+	}
+	long long lane;
+	if (value->type == CALL_EXPR && dynamic_pointer_cast<Call>(value)->name == "insert" && is_builtin("insert")) {
+		std::vector<shared_ptr<Expression>>& arguments = dynamic_pointer_cast<Call>(value)->arguments;
+		if (arguments.size() == 3 && arguments[0]->type == NAME && dynamic_pointer_cast<Name>(arguments[0])->name == name
+			&& evaluate_constant(arguments[1], lane) && lane >= 0 && lane < type.lanes) {	// v = insert(v, k, x) only writes the lane in the slot
+			generate_vector_scalar(arguments[2], vector_depth);
+			int offset = local_variables[local_variables.size() - 1][name] + (int)lane * type.lane_bits / 8;
+			generate_instruction(std::format("mov {0}, {1}", type.lane_bits == 64 ? "%rax" : "%eax", stack_slot(offset)));
+			return;
+		}
+	}
+	generate_vector_expression(value, type, vector_depth);
+	generate_instruction(std::format("{0} {1}, {2}", vector_move(type), vector_register(vector_depth, type.bytes() == 32), variable_access(name)));
+}
+
+void CodeGenerator::generate_vector_scalar(const shared_ptr<Expression>& expression, int depth) {
+	int saved_depth = vector_depth;
+	vector_depth = depth;														// Vector code inside the scalar, such as an extract, starts above the live registers
+	int spilled = spill_vectors(expression, depth);
+	generate_expression(expression, "%rax");
+	reload_vectors(depth, spilled);
+	vector_depth = saved_depth;
+}
+
+int CodeGenerator::spill_vectors(const shared_ptr<Expression>& expression, int depth) {
+	if (depth == 0 || !contains_call(expression))
+		return 0;
+	int width = options.avx2 ? 32 : 16;
+	int bytes = width * depth;
+	generate_instruction(std::format("sub ${0}, %rsp", bytes));
+	adjust_push_depth(bytes);
+	for (int i = 0; i < depth; i++)
+		generate_instruction(std::format("{0}movdqu {1}, {2}(%rsp)", options.avx2 ? "v" : "", vector_register(i), width * i));
+	return bytes;
+}
+
+void CodeGenerator::reload_vectors(int depth, int bytes) {
+	if (bytes == 0)
+		return;
+	int width = bytes / depth;
+	for (int i = 0; i < depth; i++)
+		generate_instruction(std::format("{0}movdqu {1}(%rsp), {2}", options.avx2 ? "v" : "", width * i, vector_register(i)));
+	generate_instruction(std::format("add ${0}, %rsp", bytes));
+	adjust_push_depth(-bytes);
+}
+
+bool CodeGenerator::generate_vector_index(const std::string& name, const shared_ptr<Expression>& index, const VectorType& type, int depth, long long& displacement) {
+	int saved_depth = vector_depth;
+	vector_depth = depth;
+	int spilled = spill_vectors(index, depth);
+	bool indexed = generate_element_index(name, index, displacement);
+	reload_vectors(depth, spilled);
+	vector_depth = saved_depth;
+	if (!indexed && displacement + type.lanes > array_length(name))			// Every lane is an element
+		make_error(std::format("Index {0} is out of bounds of array {1}", displacement + type.lanes - 1, name));
+	return indexed;
+}
+
+void CodeGenerator::generate_vector_load(const std::string& name, const shared_ptr<Expression>& index, const VectorType& type, int depth) {
+	long long displacement;
+	bool indexed = generate_vector_index(name, index, type, depth, displacement);
+	std::string result = vector_register(depth, type.bytes() == 32);
+	if (type.lane_bits == 64) {
+		generate_instruction(std::format("{0}movdqu {1}, {2}", options.avx2 ? "v" : "", element_access(name, displacement, indexed), result));
+		return;
+	}
+	if (!options.avx2) {														// 32 bit lanes keep the low half of every element
+		std::string high = vector_register(depth + 1, false);
+		generate_instruction(std::format("movdqu {0}, {1}", element_access(name, displacement, indexed), result));
+		generate_instruction(std::format("movdqu {0}, {1}", element_access(name, displacement + 2, indexed), high));
+		generate_instruction(std::format("pshufd $0x08, {0}, {0}", result));
+		generate_instruction(std::format("pshufd $0x08, {0}, {0}", high));
+		vector_instruction("punpcklqdq", high, result, result);
+		return;
+	}
+	for (int half = 0; half < type.lanes / 4; half++) {						// Four elements give the low 128 bits of a register
+		std::string part = vector_register(depth + half);
+		generate_instruction(std::format("vmovdqu {0}, {1}", element_access(name, displacement + 4 * half, indexed), part));
+		generate_instruction(std::format("vpshufd $0x08, {0}, {0}", part));
+		generate_instruction(std::format("vpermq $0x08, {0}, {0}", part));
+	}
+	if (type.lanes == 8)
+		generate_instruction(std::format("vinserti128 $1, {0}, {1}, {1}", vector_register(depth + 1, false), result));
+}
+
+void CodeGenerator::generate_vector_store(const shared_ptr<Call>& call_expression, const VectorType& type, int depth) {
+	std::vector<shared_ptr<Expression>>& arguments = call_expression->arguments;
+	if (arguments[0]->type != NAME) {
+		make_error("vstore expects an array, an index and a vector");
+		return;
+	}
+	const std::string& name = dynamic_pointer_cast<Name>(arguments[0])->name;
+	generate_vector_expression(arguments[2], type, depth);						// The value first, like stores to elements
+	long long displacement;
+	bool indexed = generate_vector_index(name, arguments[1], type, depth + 1, displacement);
+	std::string value = vector_register(depth, type.bytes() == 32);
+	if (type.lane_bits == 64) {
+		generate_instruction(std::format("{0}movdqu {1}, {2}", options.avx2 ? "v" : "", value, element_access(name, displacement, indexed)));
+		return;
+	}
+	if (!options.avx2) {														// 32 bit lanes are sign extended to whole elements
+		std::string sign = vector_register(depth + 1, false);
+		std::string low = vector_register(depth + 2, false);
+		vector_shift("psrad", 31, value, sign);
+		vector_instruction("punpckldq", sign, value, low);
+		vector_instruction("punpckhdq", sign, value, value);
+		generate_instruction(std::format("movdqu {0}, {1}", low, element_access(name, displacement, indexed)));
+		generate_instruction(std::format("movdqu {0}, {1}", value, element_access(name, displacement + 2, indexed)));
+		return;
+	}
+	if (type.lanes == 8)
+		generate_instruction(std::format("vextracti128 $1, {0}, {1}", value, vector_register(depth + 1, false)));
+	for (int half = 0; half < type.lanes / 4; half++) {
+		generate_instruction(std::format("vpmovsxdq {0}, {1}", vector_register(depth + half, false), vector_register(depth + half)));
+		generate_instruction(std::format("vmovdqu {0}, {1}", vector_register(depth + half), element_access(name, displacement + 4 * half, indexed)));
+	}
+}
+
+void CodeGenerator::generate_lane_insert(const VectorType& type, int depth, long long lane) {
+	std::string low = vector_register(depth, false);
+	std::string source = type.lane_bits == 64 ? "%rax" : "%eax";
+	if (options.avx2) {
+		std::string mnemonic = type.lane_bits == 64 ? "vpinsrq" : "vpinsrd";
+		if (type.bytes() == 16) {
+			generate_instruction(std::format("{0} ${1}, {2}, {3}, {3}", mnemonic, lane, source, low));
+			return;
+		}
+		int half_lanes = type.lanes / 2;										// Lanes are inserted into 128 bit halves
+		std::string part = vector_register(depth + 1, false);
+		generate_instruction(std::format("vextracti128 ${0}, {1}, {2}", lane / half_lanes, vector_register(depth), part));
+		generate_instruction(std::format("{0} ${1}, {2}, {3}, {3}", mnemonic, lane % half_lanes, source, part));
+		generate_instruction(std::format("vinserti128 ${0}, {1}, {2}, {2}", lane / half_lanes, part, vector_register(depth)));
+		return;
+	}
+	if (type.lane_bits == 32) {													// pinsrd is SSE4.1, two word inserts instead
+		generate_instruction(std::format("pinsrw ${0}, %eax, {1}", 2 * lane, low));
+		generate_instruction("shr $16, %eax");
+		generate_instruction(std::format("pinsrw ${0}, %eax, {1}", 2 * lane + 1, low));
+		return;
+	}
+	std::string part = vector_register(depth + 1, false);
+	generate_instruction(std::format("movq %rax, {0}", part));
+	generate_instruction(std::format("{0} {1}, {2}", lane == 0 ? "movsd" : "punpcklqdq", part, low));
+}
+
+void CodeGenerator::generate_lane_extract(const VectorType& type, int depth, long long lane) {
+	std::string low = vector_register(depth, false);
+	std::string v = options.avx2 ? "v" : "";
+	if (type.bytes() == 32 && lane >= type.lanes / 2) {
+		generate_instruction(std::format("vextracti128 $1, {0}, {1}", vector_register(depth), low));
+		lane -= type.lanes / 2;
+	}
+	if (type.lane_bits == 64) {
+		if (lane == 1)
+			generate_instruction(std::format("{0}pshufd $0x4e, {1}, {1}", v, low));
+		generate_instruction(std::format("{0}movq {1}, %rax", v, low));
+		return;
+	}
+	if (lane > 0)
+		generate_instruction(std::format("{0}pshufd ${1}, {2}, {2}", v, lane, low));
+	generate_instruction(std::format("{0}movd {1}, %eax", v, low));
+	generate_instruction("movslq %eax, %rax");
+}
+
+void CodeGenerator::generate_vector_shuffle(const VectorType& type, int depth, const std::vector<long long>& lanes) {
+	std::string result = vector_register(depth, type.bytes() == 32);
+	int control = 0;
+	if (type.lanes == 8) {														// vpermd takes its lane indices from a register
+		std::string label = std::format("_shuffle{0}", ++jump_label_counter);
+		rodata += ".align 32\n" + label + ":\n\t.long ";
+		for (size_t i = 0; i < lanes.size(); i++)
+			rodata += std::format("{0}{1}", i > 0 ? ", " : "", lanes[i]);
+		rodata += "\n";
+		std::string indices = vector_register(depth + 1);
+		generate_instruction(std::format("vmovdqu {0}(%rip), {1}", label, indices));
+		generate_instruction(std::format("vpermd {0}, {1}, {0}", result, indices));
+		return;
+	}
+	if (type.lane_bits == 64 && type.lanes == 2) {								// Quadword k is doublewords 2k and 2k + 1
+		for (size_t i = 0; i < 2; i++)
+			control |= (int)((2 * lanes[i]) | ((2 * lanes[i] + 1) << 2)) << (4 * i);
+		generate_instruction(std::format("{0}pshufd ${1}, {2}, {2}", options.avx2 ? "v" : "", control, result));
+		return;
+	}
+	for (size_t i = 0; i < lanes.size(); i++)
+		control |= (int)lanes[i] << (2 * i);
+	if (type.lane_bits == 64)
+		generate_instruction(std::format("vpermq ${0}, {1}, {1}", control, result));
+	else
+		generate_instruction(std::format("{0}pshufd ${1}, {2}, {2}", options.avx2 ? "v" : "", control, result));
+}
+
+void CodeGenerator::generate_match_statement(const std::shared_ptr<MatchStatement> match_statement) {
+	int current_match = ++jump_label_counter;
+	std::string end_label = std::format("_match_end{0}", current_match);
+	std::string default_label = match_statement->has_default ? std::format("_match_default{0}", current_match) : end_label;
+	std::vector<MatchCase> cases;
+	for (size_t i = 0; i < match_statement->arms.size(); i++) {
+		for (const std::pair<long long, long long>& range : match_statement->arms[i].ranges)
+			cases.push_back({ range.first, range.second, i });
+	}
+	std::sort(cases.begin(), cases.end(), [](const MatchCase& a, const MatchCase& b) { return a.low < b.low; });
+
+	generate_expression(match_statement->expression, "%rax");
+	if (cases.empty())
+		generate_instruction("jmp " + default_label);
+	else if (!generate_bit_tests(cases, current_match, default_label) && !generate_jump_table(cases, current_match, default_label))
+		generate_case_search(cases, 0, cases.size() - 1, current_match, default_label);
+
+	for (size_t i = 0; i < match_statement->arms.size(); i++) {
+		generate_label(std::format("_match{0}_arm{1}", current_match, i));
+		generate_scoped_statement(match_statement->arms[i].body);
+		if (i + 1 < match_statement->arms.size() || match_statement->has_default)
+			generate_instruction("jmp " + end_label);								// Arms don't fall through into each other
+	}
+	if (match_statement->has_default) {
+		generate_label(default_label);
+		generate_scoped_statement(match_statement->default_body);
+	}
+	generate_label(end_label);
+}
+
+bool CodeGenerator::generate_bit_tests(const std::vector<MatchCase>& cases, int match_label, const std::string& default_label) {	// One mask per arm, bit n set if the lowest case + n selects it
+	if (!options.bit_tests)
+		return false;
+	unsigned long long extent = (unsigned long long)cases.back().high - (unsigned long long)cases.front().low;
+	if (extent >= 64)
+		return false;
+	std::vector<size_t> arms;
+	std::vector<unsigned long long> masks;
+	int comparisons = 0;
+	for (const MatchCase& match_case : cases) {
+		comparisons += match_case.low == match_case.high ? 1 : 2;
+		size_t index = std::find(arms.begin(), arms.end(), match_case.arm) - arms.begin();
+		if (index == arms.size()) {
+			arms.push_back(match_case.arm);
+			masks.push_back(0);
+		}
+		unsigned long long first = (unsigned long long)match_case.low - (unsigned long long)cases.front().low;
+		unsigned long long last = (unsigned long long)match_case.high - (unsigned long long)cases.front().low;
+		for (unsigned long long bit = first; bit <= last; bit++)
+			masks[index] |= 1ULL << bit;
+	}
+	if (!((arms.size() == 1 && comparisons >= 3) || (arms.size() == 2 && comparisons >= 5) || (arms.size() == 3 && comparisons >= 6)))
+		return false;																// Compares are as cheap for fewer cases
+
+	generate_case_offset(cases.front().low);
+	generate_instruction(std::format("cmp ${0}, %rax", extent));
+	generate_instruction("ja " + default_label);									// Unsigned, so values below the lowest case are out of range too
+	for (size_t i = 0; i < arms.size(); i++) {
+		generate_instruction(load_constant((long long)masks[i], "%rcx"));
+		generate_instruction("bt %rax, %rcx");
+		generate_instruction(std::format("jc _match{0}_arm{1}", match_label, arms[i]));
+	}
+	generate_instruction("jmp " + default_label);
+	return true;
+}
+
+bool CodeGenerator::generate_jump_table(const std::vector<MatchCase>& cases, int match_label, const std::string& default_label) {
+	if (!options.jump_tables)
+		return false;
+	unsigned long long extent = (unsigned long long)cases.back().high - (unsigned long long)cases.front().low;
+	if (extent >= 65536)															// Keeps tables of sparse sets from taking up megabytes
+		return false;
+	unsigned long long values = 0;
+	for (const MatchCase& match_case : cases)
+		values += (unsigned long long)match_case.high - (unsigned long long)match_case.low + 1;
+	if (values < (unsigned long long)options.jump_table_min_cases || values * 100 < (extent + 1) * options.jump_table_density)
+		return false;
+
+	std::string table = std::format("_match_table{0}", match_label);
+	generate_case_offset(cases.front().low);
+	generate_instruction(std::format("cmp ${0}, %rax", extent));
+	generate_instruction("ja " + default_label);
+	generate_instruction(std::format("lea {0}(%rip), %rcx", table));
+	generate_instruction("movslq (%rcx,%rax,4), %rax");							// Entries are offsets from the table, so it needs no relocations at load time
+	generate_instruction("add %rcx, %rax");
+	generate_instruction("jmp *%rax");
+
+	rodata += ".align 4\n" + table + ":\n";
+	unsigned long long next = 0;
+	for (const MatchCase& match_case : cases) {
+		unsigned long long first = (unsigned long long)match_case.low - (unsigned long long)cases.front().low;
+		unsigned long long last = (unsigned long long)match_case.high - (unsigned long long)cases.front().low;
+		for (; next < first; next++)												// Gaps go to the default arm
+			rodata += std::format("\t.long {0} - {1}\n", default_label, table);
+		for (; next <= last; next++)
+			rodata += std::format("\t.long _match{0}_arm{1} - {2}\n", match_label, match_case.arm, table);
+	}
+	return true;
+}
+
+void CodeGenerator::generate_case_search(const std::vector<MatchCase>& cases, size_t first, size_t last, int match_label, const std::string& default_label) {	// Balanced binary search over the sorted cases
+	if (last - first < 3) {															// The last few cases are compared one after another
+		for (size_t i = first; i <= last; i++) {
+			const MatchCase& match_case = cases[i];
+			std::string arm_label = std::format("_match{0}_arm{1}", match_label, match_case.arm);
+			unsigned long long extent = (unsigned long long)match_case.high - (unsigned long long)match_case.low;
+			if (extent == 0) {
+				generate_case_compare(match_case.low);
+				generate_instruction("je " + arm_label);
+			}
+			else if (match_case.low > INT32_MIN && match_case.low <= INT32_MAX && extent <= INT32_MAX) {	// One unsigned compare checks both bounds
+				generate_instruction(std::format("lea {0}(%rax), %rcx", -match_case.low));
+				generate_instruction(std::format("cmp ${0}, %rcx", extent));
+				generate_instruction("jbe " + arm_label);
+			}
+			else {
+				std::string skip = std::format("_match{0}_skip{1}", match_label, ++jump_label_counter);
+				generate_case_compare(match_case.low);
+				generate_instruction("jl " + skip);
+				generate_case_compare(match_case.high);
+				generate_instruction("jle " + arm_label);
+				generate_label(skip);
+			}
+		}
+		generate_instruction("jmp " + default_label);
+		return;
+	}
+	size_t middle = (first + last + 1) / 2;
+	std::string lower = std::format("_match{0}_below{1}", match_label, ++jump_label_counter);
+	generate_case_compare(cases[middle].low);
+	generate_instruction("jl " + lower);
+	generate_case_search(cases, middle, last, match_label, default_label);
+	generate_label(lower);
+	generate_case_search(cases, first, middle - 1, match_label, default_label);
+}
+
+void CodeGenerator::generate_case_compare(long long value) {
+	if (fits_immediate(value))
+		generate_instruction(std::format("cmp ${0}, %rax", value));
+	else {
+		generate_instruction(std::format("movabs ${0}, %rcx", value));
+		generate_instruction("cmp %rcx, %rax");
+	}
+}
+
+void CodeGenerator::generate_case_offset(long long low) {
+	if (low == 0)
+		return;
+	if (fits_immediate(low))
+		generate_instruction(std::format("sub ${0}, %rax", low));
+	else {
+		generate_instruction(std::format("movabs ${0}, %rcx", low));
+		generate_instruction("sub %rcx, %rax");
+	}
+}
+
 void CodeGenerator::generate_var_declaration(std::shared_ptr<VariableDeclaration> decl) {
 	if (local_variables.size() != 0) {
-		stack_index -= 8;
 		if (local_variables[local_variables.size() - 1].find(decl->variable_name) != local_variables[local_variables.size() - 1].end()) {
 			make_error("Already declared variable " + decl->variable_name + " in this scope");
 		}
+		if (decl->is_const)
+			make_error("Constant " + decl->variable_name + " must be declared globally");
 
-		if (!decl->is_init)
-			generate_instruction("push $0");
+		if (decl->struct_type) {
+			int alignment = variable_alignment(*decl);
+			if (alignment > 16)
+				make_error(std::format("Struct {0} is aligned to {1} bytes, locals can only be aligned to 16", decl->struct_type->name, alignment));
+			alignment = std::min(alignment, 16);
+			stack_index = -((-stack_index + variable_size(*decl) + alignment - 1) / alignment * alignment);
+			zero_slots(stack_index, variable_size(*decl) / 8);
+			local_structs[stack_index] = decl;
+			if (decl->array_length > 0)
+				local_array_lengths[stack_index] = decl->array_length;
+		}
+		else if (decl->array_length > 0) {
+			stack_index -= 8 * decl->array_length;
+			zero_slots(stack_index, decl->array_length);
+			local_array_lengths[stack_index] = decl->array_length;
+		}
+		else if (decl->vector_type.lanes > 0) {
+			const VectorType& type = decl->vector_type;
+			if (type.bytes() == 32 && !options.avx2)
+				make_error(std::format("Type {0} needs -mavx2", type.name()));
+			std::string value = vector_register(vector_depth, type.bytes() == 32);
+			if (decl->is_init)
+				generate_vector_expression(decl->optional_to_assign, type, vector_depth);
+			else
+				vector_instruction("pxor", value, value, value);
+			stack_index = -((-stack_index + type.bytes() + 15) / 16 * 16);
+			generate_instruction(std::format("{0} {1}, {2}", vector_move(type), value, stack_slot(stack_index)));
+			local_vector_types[stack_index] = type;
+		}
+		else if (!decl->is_init) {
+			stack_index -= 8;
+			generate_instruction(std::format("movq $0, {0}", stack_slot(stack_index)));
+		}
 		else {
-			generate_expression(decl->optional_to_assign, "%rax");
-			generate_instruction("push %rax");
+			generate_expression(decl->optional_to_assign, "%rax");				// Evaluated before the slot is taken, inlined calls use the slots below it
+			stack_index -= 8;
+			generate_instruction(std::format("mov %rax, {0}", stack_slot(stack_index)));
 		}
+		if (decl->array_length == 0)
+			local_array_lengths.erase(stack_index);									// The slot may have been part of an array of an earlier block
+		if (decl->vector_type.lanes == 0)
+			local_vector_types.erase(stack_index);
+		if (!decl->struct_type)
+			local_structs.erase(stack_index);
 		local_variables[local_variables.size() - 1][decl->variable_name] = stack_index;
 	}
 	else {
@@ -519,25 +2982,50 @@ void CodeGenerator::generate_var_declaration(std::shared_ptr<VariableDeclaration
 			make_error("Already declared global variable " + decl->variable_name);
 		}
 		global_variables.push_back(decl->variable_name);
+		if (decl->vector_type.lanes > 0)
+			make_error("Vector " + decl->variable_name + " must be declared locally");
+		if (decl->is_const)
+			constant_globals.insert(decl->variable_name);
+		if (decl->array_length > 0)
+			global_array_lengths[decl->variable_name] = decl->array_length;
+		if (decl->struct_type)
+			global_structs[decl->variable_name] = decl;
+		if (imported.contains(decl->variable_name))								// Its storage is already loaded
+			return;
 		generate_header(".globl " + decl->variable_name);
-		if (decl->is_init) {
-			generate_header(".data");
-			generate_header(".align 4");
-			generate_header(decl->variable_name + ":");
-			generate_header("\t.long " + simplify(decl->optional_to_assign));
-		}
-		else {
-			generate_header(".bss");
-			generate_header(".align 4");
-			generate_header(decl->variable_name + ":");
-			generate_header("\t.zero 4");
+		if (decl->is_const) {														// Constants share pages with other read only data
+			rodata += ".align 8\n" + decl->variable_name + ":\n";
+			rodata += "\t.quad " + simplify(decl->optional_to_assign) + "\n";
 		}
+		else
+			(decl->is_init ? data_globals : bss_globals).push_back(decl);			// Emitted once all are known, in layout order
+	}
+}
+
+void CodeGenerator::generate_global_section(const std::string& section, std::vector<shared_ptr<VariableDeclaration>>& globals) {
+	if (globals.empty())
+		return;
+	std::stable_sort(globals.begin(), globals.end(), [](const shared_ptr<VariableDeclaration>& a, const shared_ptr<VariableDeclaration>& b) {
+		return a->layout_rank < b->layout_rank;
+	});
+	generate_header(section);
+	generate_header(options.reorder_globals ? ".align 64" : ".align 8");		// Line boundaries of the layout are relative to the section start
+	for (shared_ptr<VariableDeclaration>& decl : globals) {
+		error_line = decl->line;													// Initializers are checked here, after every statement was generated
+		error_column = decl->column;
+		int alignment = std::max(variable_alignment(*decl), decl->starts_cache_line ? 64 : 8);
+		if (alignment > 8)
+			generate_header(std::format(".align {0}", alignment));
+		generate_header(decl->variable_name + ":");
+		generate_header(decl->is_init ? "\t.quad " + simplify(decl->optional_to_assign) : std::format("\t.zero {0}", variable_size(*decl)));
 	}
 }
 
 void CodeGenerator::make_error(const std::string& message) {
-	Token default_tok = Token();
-	error_handler->report_error(message, default_tok);
+	Token position = Token();
+	position.line = error_line;
+	position.column = error_column;
+	error_handler->report_error(message, position);
 }
 
 inline void CodeGenerator::generate_instruction(const std::string& instruction) {	// Outputs instruction
@@ -554,10 +3042,18 @@ void CodeGenerator::generate_label(const std::string& name) {
 
 void CodeGenerator::generate_compound(std::shared_ptr<Compound> compound) {
 	new_scope();
+	int saved_stack_index = stack_index;
 	for (shared_ptr<Statement>& stmt : compound->statements) {
 		generate_statement(stmt);
 	}
-	//int vars = local_variables[local_variables.size() - 1].size();
-	//generate_instruction(std::format("add {0}, %rsp", 8 * vars));
+	stack_index = saved_stack_index;												// Later blocks reuse the slots of this one
+	pop_scope();
+}
+
+void CodeGenerator::generate_scoped_statement(const shared_ptr<Statement>& statement) {	// Bodies of if and loop statements get their own scope
+	new_scope();
+	int saved_stack_index = stack_index;
+	generate_statement(statement);
+	stack_index = saved_stack_index;
 	pop_scope();
 }
\ No newline at end of file
@@ -3,46 +3,221 @@
 #include "parser.h"
 #include <vector>
 #include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <array>
+#include "options.h"
+#include "profile.h"
+#include "isel.h"
+#include "string_pool.h"
+#include "vectorize.h"
 
 class CodeGenerator {
 public:
-	CodeGenerator(const std::shared_ptr<AST>& ast, ErrorHandler* error_handler) : ast(ast), error_handler(error_handler) {}
+	CodeGenerator(const std::shared_ptr<AST>& ast, ErrorHandler* error_handler, const CompilerOptions& options = CompilerOptions(),
+		const Profile* profile = nullptr) :
+		ast(ast), error_handler(error_handler), options(options), profile(profile) {}
 
 	const std::shared_ptr<AST>& ast;
 	std::string headers = "";
 	std::string text = "";
+	std::string cold_text = "";													// Code of unlikely blocks, placed in .text.unlikely
+	std::string rodata = "";													// Read only data such as jump tables, placed in .rodata
 	std::string assembly_out = "";
+	std::string source_file = "";												// Named by the line table
+	std::unordered_set<std::string> imported;									// Functions and globals an earlier JIT input defined, they are only declared
 	void generate_asm();														// Outputs target assembly code
 private:
 	std::vector<std::unordered_map<std::string, int>> local_variables;			// Holds variable name and offset from base stack pointer
 	std::vector<std::string> global_variables;
+	StringPool string_pool;														// String literals, emitted at the end of .rodata
+	std::unordered_set<std::string> constant_globals;							// Globals declared const, they live in .rodata
+	std::vector<std::shared_ptr<VariableDeclaration>> data_globals;
+	std::vector<std::shared_ptr<VariableDeclaration>> bss_globals;
+	void generate_global_section(const std::string& section, std::vector<std::shared_ptr<VariableDeclaration>>& globals);	// Emits globals sorted by their layout rank
 	int stack_index = 0;														// Stores index of stack for local variables
+
+	// FRAME LAYOUT
+	int frame_size = 0;															// Bytes reserved for locals by the prologue, a multiple of 16
+	bool has_frame_pointer = true;												// False for leaf functions that address their slots from %rsp
+	int push_depth = 0;															// Bytes pushed as temporaries since the prologue
+	int measure_frame(const std::shared_ptr<Statement>& statement, int depth, int& max_depth);
+	void measure_frame(const std::shared_ptr<Expression>& expression, int depth, int& max_depth);
+	std::string stack_slot(int offset);											// Operand for a slot at an offset from the frame base
+	int parameter_offset(size_t index);											// Frame offset of a parameter of the current function
+	void push(const std::string& operand);
+	void pop(const std::string& operand);
+	void adjust_push_depth(int bytes);											// Tracks %rsp moving down by bytes, or up for negative bytes
 	void generate_label(const std::string& label);
 	void generate_function_decl(const std::shared_ptr<Function>& function);		// Function declarations
 	void generate_return(const std::shared_ptr<Return>& return_stmt);			// Return statements
+	void generate_prologue();
+	void generate_epilogue();
+	void generate_frame_teardown();												// Epilogue without the ret, used before sibling calls
+	bool generate_tail_call(const std::shared_ptr<Call>& call_expression);		// Returns false if the call can't reuse the frame
 	void generate_statement(const std::shared_ptr<Statement>& statement);		// Statements
 	void generate_expression(const std::shared_ptr<Expression>& expression, const std::string& to_where);	// Expressions
 	void generate_instruction(const std::string& instruction);					// Instruction
 	void generate_header(const std::string& instruction);						// Instruction
-	void generate_comparison(std::shared_ptr<BinaryExpression> binary, const std::string& to_where);
+	std::string generate_compare(const std::shared_ptr<BinaryExpression>& binary);	// Sets the flags for a comparison and returns its condition code
+	void generate_branch(const std::shared_ptr<Expression>& condition, bool jump_if, const std::string& label);	// Jumps to label if the condition is jump_if
+	bool simple_operand(const std::shared_ptr<Expression>& expression, const std::shared_ptr<Expression>& other, std::string& operand);
+	bool scaled_operand(const std::shared_ptr<Expression>& expression, std::shared_ptr<Expression>& index, int& scale);	// index * 2, 4 or 8
+	void generate_cheapest(const std::vector<std::vector<std::string>>& candidates);	// Emits the candidate sequence with the lowest cost
+	std::string variable_access(const std::string& name);						// Operand of a local slot or a global
+
+	// ARRAYS
+	std::unordered_map<int, int> local_array_lengths;							// Elements of the local arrays, by the offset of their first slot
+	std::unordered_map<std::string, int> global_array_lengths;
+	int array_length(const std::string& name);									// Elements of the array a name refers to, 0 for scalars
+	std::string memory_operand(const std::string& name, long long displacement, int scale);	// Operand displacement bytes into a variable, plus %rcx times scale unless it is 0
+	std::string element_access(const std::string& name, long long element, bool indexed);	// Operand of an element, plus %rcx elements if indexed
+	bool generate_element_index(const std::string& name, const std::shared_ptr<Expression>& index, long long& displacement, int stride = 0);	// Puts a variable index in %rcx, the constant part in displacement
+	void generate_element_assignment(const std::shared_ptr<VariableAssignment>& assignment);
+	void zero_slots(int offset, int quadwords);									// Clears a block of the frame
+
+	// STRUCTS
+	std::unordered_map<int, std::shared_ptr<VariableDeclaration>> local_structs;	// Declarations of the struct locals, by the offset of their first slot
+	std::unordered_map<std::string, std::shared_ptr<VariableDeclaration>> global_structs;
+	std::shared_ptr<VariableDeclaration> struct_variable(const std::string& name);	// Declaration of a struct or array of structs, null for other variables
+	const StructField* resolve_field(const std::string& name, const std::shared_ptr<Expression>& index, const std::string& field_name);	// Null, with an error, if there is no such field
+	int field_stride(const std::string& name, const StructField& field);		// Bytes between the field of consecutive elements
+	bool generate_field_index(const std::string& name, const std::shared_ptr<Expression>& index, const StructField& field, long long& element);	// Like generate_element_index, %rcx is premultiplied for strides that aren't an index scale
+	std::string field_access(const std::string& name, const StructField& field, long long element, bool indexed);
+	void generate_field_assignment(const std::shared_ptr<VariableAssignment>& assignment);	// Leaves the stored value in %rax, extended like a load
+	void generate_division_by_constant(long long divisor, bool is_modulo);		// Quotient or remainder of %rax by a constant, into %rax
+	void generate_multiplication_by_constant(long long factor);				// %rax times a constant, into %rax
 	void generate_compound(std::shared_ptr<Compound> compound);
 	void generate_var_declaration(std::shared_ptr<VariableDeclaration> decl);
 	void make_error(const std::string& message);
 	void make_if_statement(const std::shared_ptr<IfStatement> if_statement);
+	int branch_probability(const std::shared_ptr<IfStatement>& if_statement);	// Percent chance that the body runs, from the profile if there is one
+	void generate_cold_block(const std::shared_ptr<Statement>& statement, int jump_label);
+	void align_loop_header();
+	bool in_cold_code = false;
 	void generate_while_statement(const std::shared_ptr<WhileStatement> while_statement);
 	void generate_for_statement(const std::shared_ptr<ForStatement> for_statement);
+
+	// VECTORIZATION
+	std::string vector_induction;												// Induction variable of the vector loop being emitted, held in %rcx
+	std::string vector_register(int number, bool full_width = true);			// %ymm with AVX2 and full_width, %xmm otherwise
+	bool generate_vector_loop(const VectorLoop& plan, int loop_label);			// False, with nothing emitted, if the loop doesn't fit in the registers
+	void collect_lane_invariants(const std::shared_ptr<Expression>& expression, std::vector<std::shared_ptr<Expression>>& invariants);
+	int lane_registers(const std::shared_ptr<Expression>& expression, int depth);	// Highest temporary register a lane value needs, -1 for none
+	std::string generate_lane_value(const std::shared_ptr<Expression>& expression, int depth, const std::unordered_map<std::string, std::string>& invariants);
+	void vector_instruction(const std::string& mnemonic, const std::string& source, const std::string& operand, const std::string& destination);	// destination = operand <op> source
+	void vector_shift(const std::string& mnemonic, int count, const std::string& operand, const std::string& destination);
+	void generate_horizontal_reduction(const VectorOperation& operation, int accumulator);	// Folds the lanes into the scalar variable
+	void vector_multiply(int lane_bits, const std::string& a, const std::string& b, const std::string& result, int scratch, bool full_width);	// Uses two scratch registers
+	void vector_min_max(bool is_min, int lane_bits, const std::string& value, const std::string& accumulator, int scratch, bool full_width);	// Uses up to two scratch registers
+	void reduce_lanes(VectorOperationKind kind, int lane_bits, int accumulator, bool full_width, int scratch);	// Folds the lanes of a register into %rax, uses three scratch registers
+
+	// SIMD TYPES
+	std::unordered_map<int, VectorType> local_vector_types;						// Types of the vector locals, by the offset of their slot
+	int vector_depth = 0;														// Lowest vector register free of the values of enclosing vector expressions
+	bool vector_type(const std::string& name, VectorType& type);				// False for scalars and arrays
+	bool is_builtin(const std::string& name);									// len, conversions, intrinsics and the SIMD built ins, the last unless a function of the file has the name
+	bool is_vector_expression(const std::shared_ptr<Expression>& expression);	// Everything else is a scalar, broadcast when a vector is expected
+	bool infer_vector_type(const std::shared_ptr<Expression>& expression, VectorType& type);	// False if the expression doesn't name a vector type
+	std::string vector_move(const VectorType& type);							// Moves between a register and the slot of a variable
+	void generate_vector_expression(const std::shared_ptr<Expression>& expression, const VectorType& type, int depth);	// Value in vector register depth, the ones above are scratch
+	void generate_vector_builtin(const std::shared_ptr<Call>& call_expression, const VectorType& type, int depth);
+	void generate_lane_builtin(const std::shared_ptr<Call>& call_expression);	// extract, reductions and vstore, scalar result in %rax
+	void generate_vector_assignment(const std::shared_ptr<VariableAssignment>& assignment, const VectorType& type);
+	void generate_vector_scalar(const std::shared_ptr<Expression>& expression, int depth);	// Scalar into %rax, keeping the vector registers below depth
+	bool generate_vector_index(const std::string& name, const std::shared_ptr<Expression>& index, const VectorType& type, int depth, long long& displacement);
+	void generate_vector_load(const std::string& name, const std::shared_ptr<Expression>& index, const VectorType& type, int depth);
+	void generate_vector_store(const std::shared_ptr<Call>& call_expression, const VectorType& type, int depth);
+	void generate_lane_insert(const VectorType& type, int depth, long long lane);	// Puts %rax in a lane of register depth
+	void generate_lane_extract(const VectorType& type, int depth, long long lane);	// Sign extends a lane of register depth into %rax
+	void generate_vector_shuffle(const VectorType& type, int depth, const std::vector<long long>& lanes);
+	int spill_vectors(const std::shared_ptr<Expression>& expression, int depth);	// Calls clobber every vector register, returns the bytes saved
+	void reload_vectors(int depth, int bytes);
 	void loop_flow_statement(const std::shared_ptr<BreakStatement> break_statement);
 	void loop_flow_statement(const std::shared_ptr<ContinueStatement> continue_statement);
+	void generate_scoped_statement(const std::shared_ptr<Statement>& statement);
+
+	// INTRINSICS
+	void generate_intrinsic(const std::shared_ptr<Call>& call_expression);		// Result in %rax, %rcx and %rdx are scratch
+	void generate_bit_count();													// popcount of %rax with baseline instructions
+	std::string address_operand(const std::shared_ptr<Expression>& expression);	// Memory operand of an element, a field or a variable, index code is emitted first
+
+	// INLINE ASSEMBLY
+	class AsmBinding {															// Where an operand of an asm statement lives while the template runs
+	public:
+		const AsmOperand* operand;
+		bool is_output = false;
+		bool is_loaded = false;													// Inputs and + outputs are in place before the template
+		bool is_memory = false;
+		bool is_spilled = false;												// A value that m needs in memory, copied to the stack
+		std::string reg;														// Holds the value, or the address of a memory operand with a variable index
+		std::string text;														// What %N expands to
+		int spill_depth = 0;
+	};
+	void generate_asm_statement(const std::shared_ptr<AsmStatement>& asm_statement);
+	bool bind_asm_operand(AsmBinding& binding, size_t number, std::unordered_set<std::string>& taken);	// Picks the kind of operand, false on errors
+	std::string expand_assembly(const std::string& assembly, const std::vector<AsmBinding>& bindings);	// Substitutes %0, %% and %=
+
+	// MULTIVERSIONING
+	std::string dispatch_pointers = "";											// Where each multiversioned function jumps, patched by its resolver
+	bool uses_cpu_features = false;
+	void generate_function_body(const std::shared_ptr<Function>& function, const std::string& label);
+	void generate_multiversioned_function(const std::shared_ptr<Function>& function);	// Variants, a dispatch stub and its resolver
+
+	// PROFILE INSTRUMENTATION
+	class ProfileRecord {														// A line of the profile and the counters it prints
+	public:
+		std::string line;														// Kind and site, as in loop main 2
+		int counter;															// First of its counters in _profile_counters
+		int counters;
+	};
+	std::vector<ProfileRecord> profile_records;								// In the order they are written out
+	std::unordered_map<std::string, int> profile_counters;						// First counter of each record, by its line
+	int profile_counter_count = 0;
+	void count_profile_event(const std::string& record, int counter, int counters);	// Emits an increment of a counter, only with -fprofile-generate
+	void count_site_event(const std::string& kind, const ProfileSite& site, int counter, int counters);	// Sites made by the passes aren't counted
+	void generate_profile_writer();												// Registered with atexit by main
+
+	// UNWIND AND LINE INFO
+	void generate_cfi(const std::string& directive);							// Only with unwind tables
+	void generate_frame_state();												// Directives that describe the frame as it is at this point, for code in another section
+	void generate_line(const std::shared_ptr<Statement>& statement);
+	int error_line = 0;															// Position of the statement being generated, reported by make_error
+	int error_column = 0;
+
+	// TRACING
+	std::vector<std::string> traced_functions;									// Names by trace id
+	std::unordered_map<std::string, int> trace_ids;
+	void generate_trace_hook(bool is_exit);										// Records entry to or exit from the current function, only with -ftrace
+
+	// MATCH DISPATCH
+	class MatchCase {															// Values low to high select the arm with this index
+	public:
+		long long low;
+		long long high;
+		size_t arm;
+	};
+	void generate_match_statement(const std::shared_ptr<MatchStatement> match_statement);
+	bool generate_bit_tests(const std::vector<MatchCase>& cases, int match_label, const std::string& default_label);
+	bool generate_jump_table(const std::vector<MatchCase>& cases, int match_label, const std::string& default_label);
+	void generate_case_search(const std::vector<MatchCase>& cases, size_t first, size_t last, int match_label, const std::string& default_label);
+	void generate_case_compare(long long value);								// Compares %rax with a constant of any size
+	void generate_case_offset(long long low);									// Subtracts the lowest case value from %rax
 	void call(const std::shared_ptr<Call> call_expression);
+	bool is_extern_call(const std::shared_ptr<Call>& call_expression);
+	void generate_inlined_call(const std::shared_ptr<InlinedCall> inlined);		// Emits an inlined callee body in place of a call
 
-	int do_operation(std::shared_ptr<Expression> expression);
+	long long do_operation(std::shared_ptr<Expression> expression);
 	bool op_error = false;
 	std::string simplify(std::shared_ptr<Expression> expression);
 
 	std::string current_indentation = "";
 	ErrorHandler* error_handler;
+	CompilerOptions options;
+	const Profile* profile;
+	std::shared_ptr<Function> current_function;
+	std::unordered_map<std::string, std::shared_ptr<Function>> functions;		// Every function declared in the file, by name
+	int function_start_label = 0;
 
 	void new_scope() {
 		if (local_variables.size() > 0) {
@@ -58,4 +233,5 @@ private:
 	// COUNTERS
 	int jump_label_counter = -1;
 	std::vector<std::pair<NodeType, int>> loop_positions;
+	std::vector<int> inline_returns;												// Labels that returns inside inlined bodies jump to
 };
\ No newline at end of file
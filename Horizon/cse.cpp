@@ -0,0 +1,456 @@
+#include "pch.h"
+#include "cse.h"
+#include "ast_util.h"
+#include "intrinsics.h"
+#include <algorithm>
+#include <format>
+
+using std::shared_ptr, std::make_shared, std::dynamic_pointer_cast;
+
+void CommonSubexpressionEliminator::run() {
+	if (!options.eliminate_common_subexpressions)
+		return;
+	for (shared_ptr<Statement>& stmt : ast->statements) {
+		if (stmt && stmt->type == VARIABLE_DECL)
+			globals.insert(dynamic_pointer_cast<VariableDeclaration>(stmt)->variable_name);
+	}
+	for (shared_ptr<Statement>& stmt : ast->statements) {
+		if (!stmt || stmt->type != FUNCTION_STM || !dynamic_pointer_cast<Function>(stmt)->statement)
+			continue;
+		versions.clear();
+		value_numbers.clear();
+		temporary_values.clear();
+		vector_names.clear();
+		hoist_target_valid = true;
+		process_compound(dynamic_pointer_cast<Function>(stmt)->statement, ValueTable());
+	}
+}
+
+void CommonSubexpressionEliminator::process_compound(const shared_ptr<Compound>& compound, ValueTable available) {
+	std::vector<shared_ptr<Statement>>& statements = compound->statements;
+	for (size_t i = 0; i < statements.size(); i++) {
+		shared_ptr<Statement> statement = statements[i];
+		current_block = compound;
+		current_statement = statement;
+		process_statement(statement, available);
+		i = std::find(statements.begin(), statements.end(), statement) - statements.begin();	// Temporaries may have been declared before it
+	}
+}
+
+void CommonSubexpressionEliminator::process_nested(const shared_ptr<Statement>& statement, const ValueTable& available) {
+	if (!statement)
+		return;
+	shared_ptr<Compound> saved_block = current_block;
+	shared_ptr<Statement> saved_statement = current_statement;
+	bool saved_hoist_target = hoist_target_valid;
+	ValueTable nested = options.global_value_numbering ? available : ValueTable();	// Values computed before the block dominate it
+	if (statement->type == COMPOUND_STM) {
+		hoist_target_valid = true;
+		process_compound(dynamic_pointer_cast<Compound>(statement), nested);
+	}
+	else {																		// A single statement body has no block to declare temporaries in
+		hoist_target_valid = false;
+		process_statement(statement, nested);
+	}
+	hoist_target_valid = saved_hoist_target;
+	current_block = saved_block;
+	current_statement = saved_statement;
+	invalidate(statement);														// Values of names declared or written inside don't reach past the block
+}
+
+void CommonSubexpressionEliminator::process_statement(const shared_ptr<Statement>& statement, ValueTable& available) {
+	if (!statement)
+		return;
+	switch (statement->type)
+	{
+	case COMPOUND_STM:
+		process_nested(statement, available);
+		break;
+	case VARIABLE_DECL: {
+		shared_ptr<VariableDeclaration> decl = dynamic_pointer_cast<VariableDeclaration>(statement);
+		process_root(decl->optional_to_assign, available, true);
+		write(decl->variable_name);
+		if (decl->vector_type.lanes > 0)
+			vector_names.insert(decl->variable_name);
+		break;
+	}
+	case RETURN_STM:
+		process_root(dynamic_pointer_cast<Return>(statement)->expression, available, true);
+		break;
+	case EXPR_STM:
+		process_root(dynamic_pointer_cast<ExpressionStatement>(statement)->expression, available, true);
+		break;
+	case IF_STATEMENT: {
+		shared_ptr<IfStatement> if_stmt = dynamic_pointer_cast<IfStatement>(statement);
+		process_root(if_stmt->condition, available, true);						// The condition runs once, before either arm
+		process_nested(if_stmt->body, available);
+		process_nested(if_stmt->else_body, available);
+		break;
+	}
+	case WHILE_STM: {
+		shared_ptr<WhileStatement> while_stmt = dynamic_pointer_cast<WhileStatement>(statement);
+		invalidate(statement);													// Only values the loop doesn't change are available in it
+		process_root(while_stmt->condition, available, false);
+		process_nested(while_stmt->body, available);
+		break;
+	}
+	case DO_WHILE_STM: {
+		shared_ptr<WhileStatement> while_stmt = dynamic_pointer_cast<WhileStatement>(statement);
+		invalidate(statement);
+		process_nested(while_stmt->body, available);
+		process_root(while_stmt->condition, available, false);
+		break;
+	}
+	case FOR_STM: {
+		shared_ptr<ForStatement> for_stmt = dynamic_pointer_cast<ForStatement>(statement);
+		ValueTable loop = available;											// The initializer is scoped to the loop
+		process_statement(for_stmt->initializer, loop);
+		invalidate(statement);
+		process_root(for_stmt->condition, loop, false);
+		process_root(for_stmt->post, loop, false);
+		process_nested(for_stmt->body, loop);
+		invalidate(statement);
+		break;
+	}
+	case MATCH_STM: {
+		shared_ptr<MatchStatement> match_stmt = dynamic_pointer_cast<MatchStatement>(statement);
+		process_root(match_stmt->expression, available, true);
+		for (MatchArm& arm : match_stmt->arms)
+			process_nested(arm.body, available);
+		process_nested(match_stmt->default_body, available);
+		break;
+	}
+	case ASM_STM:																// Outputs are left alone, they must stay variables
+		for (AsmOperand& operand : dynamic_pointer_cast<AsmStatement>(statement)->inputs)
+			process_root(operand.expression, available, true);
+		invalidate(statement);
+		break;
+	default:
+		break;
+	}
+}
+
+void CommonSubexpressionEliminator::process_root(shared_ptr<Expression>& expression, ValueTable& available, bool hoist) {
+	if (!expression)
+		return;
+	may_hoist = hoist && hoist_target_valid;
+	statement_has_effects = false;
+	conditional_depth = 0;
+	process_expression(expression, available);
+}
+
+int CommonSubexpressionEliminator::process_expression(shared_ptr<Expression>& expression, ValueTable& available) {
+	int writes_before = version_counter;
+	std::string key;
+	switch (expression->type)
+	{
+	case CONSTANT_EXPR:
+		return value_number("#" + std::to_string(dynamic_pointer_cast<Constant>(expression)->value));
+	case NAME: {
+		const std::string& name = dynamic_pointer_cast<Name>(expression)->name;
+		if (vector_names.contains(name))										// Every expression using it gets a value of its own
+			return fresh_value();
+		auto temporary = temporary_values.find(name);
+		if (temporary != temporary_values.end())
+			return temporary->second;
+		return value_number(name + "@" + std::to_string(versions[name]));
+	}
+	case UNARY_EXPR: {
+		shared_ptr<UnaryExpression> unary = dynamic_pointer_cast<UnaryExpression>(expression);
+		int operand = process_expression(unary->expression, available);
+		if (version_counter != writes_before)
+			return fresh_value();
+		key = std::format("u{0}({1})", (int)unary->operator_type, operand);
+		if (unary->expression->type == NAME || unary->expression->type == CONSTANT_EXPR)
+			return value_number(key);											// Cheaper to recompute than to keep in a slot
+		break;
+	}
+	case BINARY_EXPR: {
+		shared_ptr<BinaryExpression> binary = dynamic_pointer_cast<BinaryExpression>(expression);
+		TokenType operator_type = binary->operator_type;
+		int a, b;
+		switch (operator_type)													// Operands are visited in the order CodeGenerator evaluates them
+		{
+		case TOKEN_AND:
+		case TOKEN_OR:
+			a = process_expression(binary->expression_a, available);
+			conditional_depth++;
+			b = process_expression(binary->expression_b, available);
+			conditional_depth--;
+			break;
+		case TOKEN_MINUS:
+		case TOKEN_SLASH:
+		case TOKEN_PERCENT:
+			b = process_expression(binary->expression_b, available);
+			a = process_expression(binary->expression_a, available);
+			break;
+		default:
+			a = process_expression(binary->expression_a, available);
+			b = process_expression(binary->expression_b, available);
+			break;
+		}
+		if (version_counter != writes_before)
+			return fresh_value();
+		switch (operator_type)													// Equal values get equal keys whatever the operand order
+		{
+		case TOKEN_PLUS:
+		case TOKEN_STAR:
+		case TOKEN_EQUAL_EQUAL:
+		case TOKEN_BANG_EQUAL:
+			if (a > b)
+				std::swap(a, b);
+			break;
+		case TOKEN_GREATER:
+			operator_type = TOKEN_LESS;
+			std::swap(a, b);
+			break;
+		case TOKEN_GREATER_EQUAL:
+			operator_type = TOKEN_LESS_EQUAL;
+			std::swap(a, b);
+			break;
+		default:
+			break;
+		}
+		key = std::format("b{0}({1},{2})", (int)operator_type, a, b);
+		break;
+	}
+	case VARIABLE_ASSIGN: {
+		shared_ptr<VariableAssignment> assignment = dynamic_pointer_cast<VariableAssignment>(expression);
+		if (assignment->index)
+			process_expression(assignment->index, available);
+		if (assignment->to_assign)
+			process_expression(assignment->to_assign, available);
+		write(assignment->variable_name);
+		return fresh_value();
+	}
+	case INDEX_EXPR:															// Elements aren't numbered, a store through any index may change them
+		process_expression(dynamic_pointer_cast<IndexExpression>(expression)->index, available);
+		return fresh_value();
+	case FIELD_EXPR: {															// Neither are fields, the object stays a name or an element
+		shared_ptr<Expression> object = dynamic_pointer_cast<FieldExpression>(expression)->object;
+		if (object->type == INDEX_EXPR)
+			process_expression(dynamic_pointer_cast<IndexExpression>(object)->index, available);
+		return fresh_value();
+	}
+	case CALL_EXPR: {
+		shared_ptr<Call> call = dynamic_pointer_cast<Call>(expression);
+		int size;
+		bool is_signed;
+		if (conversion_type(call, size, is_signed)) {								// Pure, numbered like a unary operator
+			int operand = process_expression(call->arguments[0], available);
+			if (version_counter != writes_before)
+				return fresh_value();
+			key = std::format("c{0}({1})", call->name, operand);
+			if (call->arguments[0]->type == NAME || call->arguments[0]->type == CONSTANT_EXPR)
+				return value_number(key);
+			break;
+		}
+		Intrinsic intrinsic = intrinsic_named(call->name);
+		if (intrinsic != INTRINSIC_NONE && (int)call->arguments.size() == intrinsic_arity(intrinsic)) {
+			std::vector<int> operands(call->arguments.size());
+			if (intrinsic == INTRINSIC_ROTL || intrinsic == INTRINSIC_ROTR) {		// The count is evaluated first
+				operands[1] = process_expression(call->arguments[1], available);
+				operands[0] = process_expression(call->arguments[0], available);
+			}
+			else {
+				for (size_t i = 0; i < call->arguments.size(); i++)
+					operands[i] = process_expression(call->arguments[i], available);
+			}
+			if (intrinsic == INTRINSIC_PREFETCH || version_counter != writes_before)
+				return fresh_value();
+			key = "i" + call->name + "(";
+			for (int operand : operands)
+				key += std::to_string(operand) + ",";
+			key += ")";
+			if (intrinsic == INTRINSIC_LIKELY || intrinsic == INTRINSIC_UNLIKELY)	// A temporary would hide the hint from the branch
+				return value_number(key);
+			break;
+		}
+		for (int i = call->arguments.size() - 1; i >= 0; i--)
+			process_expression(call->arguments[i], available);
+		write_globals();
+		return fresh_value();
+	}
+	case INLINED_CALL_EXPR: {
+		shared_ptr<InlinedCall> inlined = dynamic_pointer_cast<InlinedCall>(expression);
+		for (shared_ptr<Expression>& argument : inlined->arguments)
+			process_expression(argument, available);
+		invalidate(inlined->body);
+		write_globals();
+		return fresh_value();
+	}
+	default:
+		return fresh_value();
+	}
+
+	int number = value_number(key);
+	bool can_hoist = may_hoist && conditional_depth == 0 && !statement_has_effects;
+	auto found = available.find(number);
+	if (found != available.end()) {
+		shared_ptr<AvailableValue> value = found->second;
+		if (value->temporary.empty() && value->can_hoist)						// Second occurrence, the first one moves into a temporary
+			hoist(value, number);
+		if (!value->temporary.empty()) {
+			expression = make_shared<Name>(value->temporary);
+			return number;
+		}
+		if (!can_hoist)
+			return number;
+	}
+	shared_ptr<AvailableValue> value = make_shared<AvailableValue>();			// A new entry, so that blocks sharing the old one aren't affected
+	value->first_occurrence = &expression;
+	value->block = current_block;
+	value->statement = current_statement;
+	value->can_hoist = can_hoist;
+	available[number] = value;
+	return number;
+}
+
+void CommonSubexpressionEliminator::hoist(const shared_ptr<AvailableValue>& value, int value_number) {
+	std::string name = std::format("$cse{0}", temporary_counter++);			// Can't clash with a user name, the lexer doesn't accept '$'
+	shared_ptr<VariableDeclaration> decl = make_shared<VariableDeclaration>();
+	decl->variable_name = name;
+	decl->is_init = true;
+	decl->optional_to_assign = *value->first_occurrence;
+	*value->first_occurrence = make_shared<Name>(name);
+
+	std::vector<shared_ptr<Statement>>& statements = value->block->statements;
+	statements.insert(std::find(statements.begin(), statements.end(), value->statement), decl);
+	value->temporary = name;
+	temporary_values[name] = value_number;
+}
+
+void CommonSubexpressionEliminator::write(const std::string& name) {
+	versions[name] = ++version_counter;
+	statement_has_effects = true;
+}
+
+void CommonSubexpressionEliminator::write_globals() {
+	for (const std::string& global : globals)
+		versions[global] = ++version_counter;
+	version_counter++;															// A call is never pure, even without globals to write
+	statement_has_effects = true;
+}
+
+void CommonSubexpressionEliminator::invalidate(const shared_ptr<Statement>& statement) {
+	if (!statement)
+		return;
+	switch (statement->type)
+	{
+	case COMPOUND_STM:
+		for (shared_ptr<Statement>& stmt : dynamic_pointer_cast<Compound>(statement)->statements)
+			invalidate(stmt);
+		break;
+	case VARIABLE_DECL: {
+		shared_ptr<VariableDeclaration> decl = dynamic_pointer_cast<VariableDeclaration>(statement);
+		invalidate(decl->optional_to_assign);
+		write(decl->variable_name);
+		break;
+	}
+	case RETURN_STM:
+		invalidate(dynamic_pointer_cast<Return>(statement)->expression);
+		break;
+	case EXPR_STM:
+		invalidate(dynamic_pointer_cast<ExpressionStatement>(statement)->expression);
+		break;
+	case IF_STATEMENT: {
+		shared_ptr<IfStatement> if_stmt = dynamic_pointer_cast<IfStatement>(statement);
+		invalidate(if_stmt->condition);
+		invalidate(if_stmt->body);
+		invalidate(if_stmt->else_body);
+		break;
+	}
+	case WHILE_STM:
+	case DO_WHILE_STM: {
+		shared_ptr<WhileStatement> while_stmt = dynamic_pointer_cast<WhileStatement>(statement);
+		invalidate(while_stmt->condition);
+		invalidate(while_stmt->body);
+		break;
+	}
+	case FOR_STM: {
+		shared_ptr<ForStatement> for_stmt = dynamic_pointer_cast<ForStatement>(statement);
+		invalidate(for_stmt->initializer);
+		invalidate(for_stmt->condition);
+		invalidate(for_stmt->post);
+		invalidate(for_stmt->body);
+		break;
+	}
+	case MATCH_STM: {
+		shared_ptr<MatchStatement> match_stmt = dynamic_pointer_cast<MatchStatement>(statement);
+		invalidate(match_stmt->expression);
+		for (MatchArm& arm : match_stmt->arms)
+			invalidate(arm.body);
+		invalidate(match_stmt->default_body);
+		break;
+	}
+	case ASM_STM: {
+		shared_ptr<AsmStatement> asm_stmt = dynamic_pointer_cast<AsmStatement>(statement);
+		for (AsmOperand& operand : asm_stmt->outputs)
+			write(operand_variable(operand.expression));
+		if (std::find(asm_stmt->clobbers.begin(), asm_stmt->clobbers.end(), "memory") != asm_stmt->clobbers.end()) {
+			for (AsmOperand& operand : asm_stmt->inputs)						// Memory inputs may be stored through too
+				write(operand_variable(operand.expression));
+		}
+		write_globals();														// Like a call, the template may store to globals by their symbols
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+void CommonSubexpressionEliminator::invalidate(const shared_ptr<Expression>& expression) {
+	if (!expression)
+		return;
+	switch (expression->type)
+	{
+	case UNARY_EXPR:
+		invalidate(dynamic_pointer_cast<UnaryExpression>(expression)->expression);
+		break;
+	case BINARY_EXPR: {
+		shared_ptr<BinaryExpression> binary = dynamic_pointer_cast<BinaryExpression>(expression);
+		invalidate(binary->expression_a);
+		invalidate(binary->expression_b);
+		break;
+	}
+	case VARIABLE_ASSIGN: {
+		shared_ptr<VariableAssignment> assignment = dynamic_pointer_cast<VariableAssignment>(expression);
+		invalidate(assignment->index);
+		invalidate(assignment->to_assign);
+		write(assignment->variable_name);
+		break;
+	}
+	case INDEX_EXPR:
+		invalidate(dynamic_pointer_cast<IndexExpression>(expression)->index);
+		break;
+	case FIELD_EXPR:
+		invalidate(dynamic_pointer_cast<FieldExpression>(expression)->object);
+		break;
+	case CALL_EXPR:
+		for (shared_ptr<Expression>& argument : dynamic_pointer_cast<Call>(expression)->arguments)
+			invalidate(argument);
+		write_globals();
+		break;
+	case INLINED_CALL_EXPR: {
+		shared_ptr<InlinedCall> inlined = dynamic_pointer_cast<InlinedCall>(expression);
+		for (shared_ptr<Expression>& argument : inlined->arguments)
+			invalidate(argument);
+		invalidate(inlined->body);
+		write_globals();
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+int CommonSubexpressionEliminator::value_number(const std::string& key) {
+	auto found = value_numbers.find(key);
+	if (found != value_numbers.end())
+		return found->second;
+	return value_numbers[key] = value_counter++;
+}
+
+int CommonSubexpressionEliminator::fresh_value() {
+	return value_counter++;
+}
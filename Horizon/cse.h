@@ -0,0 +1,58 @@
+#pragma once
+#include <memory>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include "parser.h"
+#include "options.h"
+
+class CommonSubexpressionEliminator {
+public:
+	CommonSubexpressionEliminator(const std::shared_ptr<AST>& ast, const CompilerOptions& options) : ast(ast), options(options) {}
+
+	const std::shared_ptr<AST>& ast;
+	void run();																	// Computes repeated pure expressions once per function and reuses the result
+private:
+	const CompilerOptions& options;
+
+	class AvailableValue {														// A value computed earlier that later occurrences can reuse
+	public:
+		std::string temporary;													// Name of the let holding the value, empty until a second occurrence is found
+		std::shared_ptr<Expression>* first_occurrence = nullptr;				// Where the value is computed first, replaced by the temporary once hoisted
+		std::shared_ptr<Compound> block;										// Block and statement the temporary is declared before
+		std::shared_ptr<Statement> statement;
+		bool can_hoist = false;													// The first occurrence runs unconditionally at the start of its statement
+	};
+	using ValueTable = std::unordered_map<int, std::shared_ptr<AvailableValue>>;	// Value number and where it is available
+
+	std::unordered_set<std::string> globals;
+	std::unordered_map<std::string, int> versions;								// Current version of every name, bumped on each write
+	std::unordered_map<std::string, int> value_numbers;							// Expression key and its value number
+	std::unordered_map<std::string, int> temporary_values;						// Value numbers held by the temporaries
+	std::unordered_set<std::string> vector_names;								// Locals of SIMD types, their expressions can't be held in a scalar temporary
+	int version_counter = 0;
+	int value_counter = 0;
+	int temporary_counter = 0;
+
+	std::shared_ptr<Compound> current_block;									// Position of the statement being processed
+	std::shared_ptr<Statement> current_statement;
+	bool may_hoist = false;														// False in loop conditions and other expressions evaluated repeatedly
+	bool hoist_target_valid = true;												// False in bodies that are a single statement instead of a block
+	bool statement_has_effects = false;											// An assignment or call already ran in the current statement
+	int conditional_depth = 0;													// Inside the right side of 'and' or 'or'
+
+	void process_compound(const std::shared_ptr<Compound>& compound, ValueTable available);
+	void process_statement(const std::shared_ptr<Statement>& statement, ValueTable& available);
+	void process_nested(const std::shared_ptr<Statement>& statement, const ValueTable& available);	// A block dominated by the current statement
+	int process_expression(std::shared_ptr<Expression>& expression, ValueTable& available);		// Returns the value number of the expression
+	void process_root(std::shared_ptr<Expression>& expression, ValueTable& available, bool hoist);	// Top level expression of a statement
+
+	void hoist(const std::shared_ptr<AvailableValue>& value, int value_number);
+	void write(const std::string& name);										// A name gets a new value
+	void write_globals();														// A call may write any global
+	void invalidate(const std::shared_ptr<Statement>& statement);				// Every name the statement may write gets a new value
+	void invalidate(const std::shared_ptr<Expression>& expression);
+	int value_number(const std::string& key);
+	int fresh_value();
+};
@@ -0,0 +1,349 @@
+#include "pch.h"
+#include "dce.h"
+#include "ast_util.h"
+#include <unordered_map>
+
+using std::shared_ptr, std::make_shared, std::dynamic_pointer_cast;
+
+void DeadCodeEliminator::run() {
+	if (!options.eliminate_dead_code)
+		return;
+	for (shared_ptr<Statement>& stmt : ast->statements) {
+		if (stmt && stmt->type == FUNCTION_STM)
+			simplify_compound(dynamic_pointer_cast<Function>(stmt)->statement);
+	}
+	remove_unused_declarations();
+}
+
+shared_ptr<Statement> DeadCodeEliminator::as_block(const shared_ptr<Statement>& statement) {
+	if (statement && statement->type == VARIABLE_DECL) {
+		shared_ptr<Compound> block = make_shared<Compound>();
+		block->statements.push_back(statement);
+		return block;
+	}
+	return statement;
+}
+
+void DeadCodeEliminator::simplify_compound(const shared_ptr<Compound>& compound) {
+	if (!compound)
+		return;
+	std::vector<shared_ptr<Statement>>& statements = compound->statements;
+	for (size_t i = 0; i < statements.size(); i++) {
+		simplify_statement(statements[i]);
+		if (terminates(statements[i])) {										// Nothing after a return, break or continue can run
+			statements.erase(statements.begin() + i + 1, statements.end());
+			break;
+		}
+	}
+	std::erase_if(statements, [](const shared_ptr<Statement>& stmt) { return !stmt || stmt->type == EMPTY_STM; });
+}
+
+void DeadCodeEliminator::simplify_statement(shared_ptr<Statement>& statement) {
+	if (!statement)
+		return;
+	long long condition;
+	switch (statement->type)
+	{
+	case COMPOUND_STM:
+		simplify_compound(dynamic_pointer_cast<Compound>(statement));
+		break;
+	case RETURN_STM:
+		simplify_expression(dynamic_pointer_cast<Return>(statement)->expression);
+		break;
+	case EXPR_STM:
+		simplify_expression(dynamic_pointer_cast<ExpressionStatement>(statement)->expression);
+		break;
+	case VARIABLE_DECL:
+		simplify_expression(dynamic_pointer_cast<VariableDeclaration>(statement)->optional_to_assign);
+		break;
+	case IF_STATEMENT: {
+		shared_ptr<IfStatement> if_stmt = dynamic_pointer_cast<IfStatement>(statement);
+		simplify_expression(if_stmt->condition);
+		simplify_statement(if_stmt->body);
+		if (if_stmt->has_else)
+			simplify_statement(if_stmt->else_body);
+		if (evaluate_constant(if_stmt->condition, condition)) {					// Only the arm that is taken is kept
+			if (condition)
+				statement = as_block(if_stmt->body);
+			else if (if_stmt->has_else)
+				statement = as_block(if_stmt->else_body);
+			else
+				statement = make_shared<EmptyStatement>();
+		}
+		break;
+	}
+	case WHILE_STM: {
+		shared_ptr<WhileStatement> while_stmt = dynamic_pointer_cast<WhileStatement>(statement);
+		simplify_expression(while_stmt->condition);
+		simplify_statement(while_stmt->body);
+		if (evaluate_constant(while_stmt->condition, condition) && !condition)
+			statement = make_shared<EmptyStatement>();
+		break;
+	}
+	case DO_WHILE_STM: {
+		shared_ptr<WhileStatement> while_stmt = dynamic_pointer_cast<WhileStatement>(statement);
+		simplify_expression(while_stmt->condition);
+		simplify_statement(while_stmt->body);
+		if (evaluate_constant(while_stmt->condition, condition) && !condition && !exits_loop(while_stmt->body))
+			statement = as_block(while_stmt->body);								// The body runs exactly once
+		break;
+	}
+	case FOR_STM: {
+		shared_ptr<ForStatement> for_stmt = dynamic_pointer_cast<ForStatement>(statement);
+		simplify_statement(for_stmt->initializer);
+		simplify_expression(for_stmt->condition);
+		simplify_expression(for_stmt->post);
+		simplify_statement(for_stmt->body);
+		if (evaluate_constant(for_stmt->condition, condition) && !condition) {	// Only the initializer runs
+			shared_ptr<Compound> block = make_shared<Compound>();
+			block->statements.push_back(for_stmt->initializer);
+			statement = block;
+		}
+		break;
+	}
+	case MATCH_STM: {
+		shared_ptr<MatchStatement> match_stmt = dynamic_pointer_cast<MatchStatement>(statement);
+		simplify_expression(match_stmt->expression);
+		for (MatchArm& arm : match_stmt->arms)
+			simplify_statement(arm.body);
+		simplify_statement(match_stmt->default_body);
+		if (evaluate_constant(match_stmt->expression, condition)) {				// Only the arm that is selected is kept
+			statement = match_stmt->has_default ? as_block(match_stmt->default_body) : make_shared<EmptyStatement>();
+			for (MatchArm& arm : match_stmt->arms) {
+				if (std::any_of(arm.ranges.begin(), arm.ranges.end(),
+					[&](const std::pair<long long, long long>& range) { return range.first <= condition && condition <= range.second; }))
+					statement = as_block(arm.body);
+			}
+			if (!statement)
+				statement = make_shared<EmptyStatement>();
+		}
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+void DeadCodeEliminator::simplify_expression(const shared_ptr<Expression>& expression) {
+	if (!expression)
+		return;
+	switch (expression->type)
+	{
+	case UNARY_EXPR:
+		simplify_expression(dynamic_pointer_cast<UnaryExpression>(expression)->expression);
+		break;
+	case BINARY_EXPR: {
+		shared_ptr<BinaryExpression> binary = dynamic_pointer_cast<BinaryExpression>(expression);
+		simplify_expression(binary->expression_a);
+		simplify_expression(binary->expression_b);
+		break;
+	}
+	case VARIABLE_ASSIGN:
+		simplify_expression(dynamic_pointer_cast<VariableAssignment>(expression)->index);
+		simplify_expression(dynamic_pointer_cast<VariableAssignment>(expression)->to_assign);
+		break;
+	case INDEX_EXPR:
+		simplify_expression(dynamic_pointer_cast<IndexExpression>(expression)->index);
+		break;
+	case FIELD_EXPR:
+		simplify_expression(dynamic_pointer_cast<FieldExpression>(expression)->object);
+		break;
+	case CALL_EXPR:
+		for (shared_ptr<Expression>& argument : dynamic_pointer_cast<Call>(expression)->arguments)
+			simplify_expression(argument);
+		break;
+	case INLINED_CALL_EXPR: {
+		shared_ptr<InlinedCall> inlined = dynamic_pointer_cast<InlinedCall>(expression);
+		for (shared_ptr<Expression>& argument : inlined->arguments)
+			simplify_expression(argument);
+		simplify_compound(inlined->body);
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+bool DeadCodeEliminator::terminates(const shared_ptr<Statement>& statement) {
+	if (!statement)
+		return false;
+	switch (statement->type)
+	{
+	case RETURN_STM:
+	case BREAK_STM:
+	case CONTINUE_STM:
+		return true;
+	case COMPOUND_STM:
+		for (shared_ptr<Statement>& stmt : dynamic_pointer_cast<Compound>(statement)->statements) {
+			if (terminates(stmt))
+				return true;
+		}
+		return false;
+	case IF_STATEMENT: {
+		shared_ptr<IfStatement> if_stmt = dynamic_pointer_cast<IfStatement>(statement);
+		return if_stmt->has_else && terminates(if_stmt->body) && terminates(if_stmt->else_body);
+	}
+	case MATCH_STM: {
+		shared_ptr<MatchStatement> match_stmt = dynamic_pointer_cast<MatchStatement>(statement);
+		return match_stmt->has_default && terminates(match_stmt->default_body)
+			&& std::all_of(match_stmt->arms.begin(), match_stmt->arms.end(), [&](MatchArm& arm) { return terminates(arm.body); });
+	}
+	default:
+		break;
+	}
+	return false;
+}
+
+void DeadCodeEliminator::remove_unused_declarations() {
+	std::unordered_map<std::string, shared_ptr<Statement>> declarations;
+	for (shared_ptr<Statement>& stmt : ast->statements) {
+		if (!stmt)
+			continue;
+		if (stmt->type == FUNCTION_STM)
+			declarations[dynamic_pointer_cast<Function>(stmt)->name] = stmt;
+		else if (stmt->type == VARIABLE_DECL)
+			declarations[dynamic_pointer_cast<VariableDeclaration>(stmt)->variable_name] = stmt;
+	}
+	bool whole_program = (options.whole_program || options.run) && !options.incremental;	// Assembly and objects may be linked with C code that uses any symbol
+	if (declarations.find("main") == declarations.end() || !whole_program)	// Everything is part of the library interface
+		return;
+
+	std::unordered_set<std::string> reachable = { "main" };
+	std::vector<std::string> to_visit = { "main" };
+	while (!to_visit.empty()) {
+		std::string current = to_visit.back();
+		to_visit.pop_back();
+		shared_ptr<Statement> declaration = declarations[current];
+		if (!declaration || declaration->type != FUNCTION_STM)
+			continue;
+		std::unordered_set<std::string> references;
+		collect_references(dynamic_pointer_cast<Function>(declaration)->statement, references);
+		for (const std::string& reference : references) {
+			if (declarations.find(reference) != declarations.end() && reachable.insert(reference).second)
+				to_visit.push_back(reference);
+		}
+	}
+
+	std::erase_if(ast->statements, [&](const shared_ptr<Statement>& stmt) {
+		if (!stmt)
+			return false;
+		if (stmt->type == FUNCTION_STM)
+			return reachable.find(dynamic_pointer_cast<Function>(stmt)->name) == reachable.end();
+		if (stmt->type == VARIABLE_DECL)
+			return reachable.find(dynamic_pointer_cast<VariableDeclaration>(stmt)->variable_name) == reachable.end();
+		return false;
+	});
+}
+
+void DeadCodeEliminator::collect_references(const shared_ptr<Statement>& statement, std::unordered_set<std::string>& references) {
+	if (!statement)
+		return;
+	switch (statement->type)
+	{
+	case RETURN_STM:
+		collect_references(dynamic_pointer_cast<Return>(statement)->expression, references);
+		break;
+	case COMPOUND_STM:
+		for (shared_ptr<Statement>& stmt : dynamic_pointer_cast<Compound>(statement)->statements)
+			collect_references(stmt, references);
+		break;
+	case EXPR_STM:
+		collect_references(dynamic_pointer_cast<ExpressionStatement>(statement)->expression, references);
+		break;
+	case VARIABLE_DECL:
+		collect_references(dynamic_pointer_cast<VariableDeclaration>(statement)->optional_to_assign, references);
+		break;
+	case IF_STATEMENT: {
+		shared_ptr<IfStatement> if_stmt = dynamic_pointer_cast<IfStatement>(statement);
+		collect_references(if_stmt->condition, references);
+		collect_references(if_stmt->body, references);
+		collect_references(if_stmt->else_body, references);
+		break;
+	}
+	case WHILE_STM:
+	case DO_WHILE_STM: {
+		shared_ptr<WhileStatement> while_stmt = dynamic_pointer_cast<WhileStatement>(statement);
+		collect_references(while_stmt->condition, references);
+		collect_references(while_stmt->body, references);
+		break;
+	}
+	case FOR_STM: {
+		shared_ptr<ForStatement> for_stmt = dynamic_pointer_cast<ForStatement>(statement);
+		collect_references(for_stmt->initializer, references);
+		collect_references(for_stmt->condition, references);
+		collect_references(for_stmt->post, references);
+		collect_references(for_stmt->body, references);
+		break;
+	}
+	case MATCH_STM: {
+		shared_ptr<MatchStatement> match_stmt = dynamic_pointer_cast<MatchStatement>(statement);
+		collect_references(match_stmt->expression, references);
+		for (MatchArm& arm : match_stmt->arms)
+			collect_references(arm.body, references);
+		collect_references(match_stmt->default_body, references);
+		break;
+	}
+	case ASM_STM: {
+		shared_ptr<AsmStatement> asm_stmt = dynamic_pointer_cast<AsmStatement>(statement);
+		for (AsmOperand& operand : asm_stmt->outputs)
+			collect_references(operand.expression, references);
+		for (AsmOperand& operand : asm_stmt->inputs)
+			collect_references(operand.expression, references);
+		for (const std::string& symbol : assembly_symbols(asm_stmt->assembly))	// Globals and functions the template names by their symbols
+			references.insert(symbol);
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+void DeadCodeEliminator::collect_references(const shared_ptr<Expression>& expression, std::unordered_set<std::string>& references) {
+	if (!expression)
+		return;
+	switch (expression->type)
+	{
+	case NAME:																	// Locals shadowing a global keep it alive, which is harmless
+		references.insert(dynamic_pointer_cast<Name>(expression)->name);
+		break;
+	case UNARY_EXPR:
+		collect_references(dynamic_pointer_cast<UnaryExpression>(expression)->expression, references);
+		break;
+	case BINARY_EXPR: {
+		shared_ptr<BinaryExpression> binary = dynamic_pointer_cast<BinaryExpression>(expression);
+		collect_references(binary->expression_a, references);
+		collect_references(binary->expression_b, references);
+		break;
+	}
+	case VARIABLE_ASSIGN: {
+		shared_ptr<VariableAssignment> assignment = dynamic_pointer_cast<VariableAssignment>(expression);
+		references.insert(assignment->variable_name);
+		collect_references(assignment->index, references);
+		collect_references(assignment->to_assign, references);
+		break;
+	}
+	case INDEX_EXPR:
+		references.insert(dynamic_pointer_cast<IndexExpression>(expression)->array_name);
+		collect_references(dynamic_pointer_cast<IndexExpression>(expression)->index, references);
+		break;
+	case FIELD_EXPR:
+		collect_references(dynamic_pointer_cast<FieldExpression>(expression)->object, references);
+		break;
+	case CALL_EXPR: {
+		shared_ptr<Call> call = dynamic_pointer_cast<Call>(expression);
+		references.insert(call->name);
+		for (shared_ptr<Expression>& argument : call->arguments)
+			collect_references(argument, references);
+		break;
+	}
+	case INLINED_CALL_EXPR: {
+		shared_ptr<InlinedCall> inlined = dynamic_pointer_cast<InlinedCall>(expression);
+		for (shared_ptr<Expression>& argument : inlined->arguments)
+			collect_references(argument, references);
+		collect_references(inlined->body, references);
+		break;
+	}
+	default:
+		break;
+	}
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include <memory>
+#include <string>
+#include <unordered_set>
+#include "parser.h"
+#include "options.h"
+
+class DeadCodeEliminator {
+public:
+	DeadCodeEliminator(const std::shared_ptr<AST>& ast, const CompilerOptions& options) : ast(ast), options(options) {}
+
+	const std::shared_ptr<AST>& ast;
+	void run();																	// Removes unreachable code, constant branches and unused declarations
+private:
+	const CompilerOptions& options;
+
+	void simplify_statement(std::shared_ptr<Statement>& statement);
+	void simplify_compound(const std::shared_ptr<Compound>& compound);
+	void simplify_expression(const std::shared_ptr<Expression>& expression);	// Cleans up inlined bodies inside expressions
+	bool terminates(const std::shared_ptr<Statement>& statement);				// True if control never reaches the statement after this one
+	std::shared_ptr<Statement> as_block(const std::shared_ptr<Statement>& statement);	// Keeps declarations of a replaced branch in their own scope
+
+	void remove_unused_declarations();											// Drops functions and globals not reachable from main, in whole programs only
+	void collect_references(const std::shared_ptr<Statement>& statement, std::unordered_set<std::string>& references);
+	void collect_references(const std::shared_ptr<Expression>& expression, std::unordered_set<std::string>& references);
+};
@@ -0,0 +1,169 @@
+#include "pch.h"
+#include "elf.h"
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+
+static void put(std::string& out, uint64_t value, int size) {					// Little endian
+	for (int i = 0; i < size; i++)
+		out += (char)(uint8_t)(value >> (8 * i));
+}
+
+static void align(std::string& out, size_t alignment) {
+	while (out.size() % alignment)
+		out += '\0';
+}
+
+class SectionHeader {
+public:
+	uint32_t name = 0;															// Offset in .shstrtab
+	uint32_t type = 0;
+	uint64_t flags = 0;
+	uint64_t offset = 0;
+	uint64_t size = 0;
+	uint32_t link = 0;
+	uint32_t info = 0;
+	uint64_t alignment = 1;
+	uint64_t entry_size = 0;
+};
+
+static uint32_t add_string(std::string& table, const std::string& value) {
+	uint32_t offset = (uint32_t)table.size();
+	table += value;
+	table += '\0';
+	return offset;
+}
+
+std::string elf_object(const ObjectFile& object) {
+	std::string file(64, '\0');													// The header is filled in last
+	std::string section_names(1, '\0');
+	std::string names(1, '\0');
+	std::vector<SectionHeader> headers(1);										// Section 0 is null, section i of the object is i + 1
+
+	for (const ObjectSection& section : object.sections) {
+		SectionHeader header;
+		header.name = add_string(section_names, section.name);
+		header.type = section.type;
+		header.flags = section.flags;
+		header.alignment = section.alignment;
+		header.size = section.size;
+		align(file, section.alignment ? section.alignment : 1);
+		header.offset = file.size();
+		if (section.type != SECTION_NOBITS)
+			file.append(section.bytes.begin(), section.bytes.end());
+		headers.push_back(header);
+	}
+
+	std::vector<int> order;														// Locals, then globals
+	for (int pass = 0; pass < 2; pass++) {
+		for (size_t i = 0; i < object.symbols.size(); i++) {
+			if (object.symbols[i].global == (pass == 1))
+				order.push_back((int)i);
+		}
+	}
+	std::vector<uint32_t> symbol_index(object.symbols.size());
+	uint32_t first_global = 1;
+	std::string symbol_table(24, '\0');
+	for (size_t position = 0; position < order.size(); position++) {
+		const ObjectSymbol& symbol = object.symbols[order[position]];
+		symbol_index[order[position]] = (uint32_t)position + 1;
+		if (!symbol.global)
+			first_global = (uint32_t)position + 2;
+		bool thread_local_symbol = symbol.section >= 0 && (object.sections[symbol.section].flags & SECTION_TLS);
+		int type = symbol.section_symbol ? 3 : thread_local_symbol ? 6 : symbol.function ? 2 : 0;	// STT_SECTION, STT_TLS, STT_FUNC, STT_NOTYPE
+		put(symbol_table, symbol.section_symbol ? 0 : add_string(names, symbol.name), 4);
+		put(symbol_table, ((symbol.global ? 1 : 0) << 4) | type, 1);
+		put(symbol_table, 0, 1);
+		put(symbol_table, symbol.section < 0 ? 0 : symbol.section + 1, 2);
+		put(symbol_table, symbol.value, 8);
+		put(symbol_table, symbol.size, 8);
+	}
+	uint32_t symbol_table_section = (uint32_t)(headers.size() + std::count_if(object.sections.begin(), object.sections.end(),
+		[](const ObjectSection& section) { return !section.relocations.empty(); }));
+
+	for (size_t i = 0; i < object.sections.size(); i++) {
+		const ObjectSection& section = object.sections[i];
+		if (section.relocations.empty())
+			continue;
+		SectionHeader header;
+		header.name = add_string(section_names, ".rela" + section.name);
+		header.type = 4;														// SHT_RELA
+		header.flags = 0x40;													// SHF_INFO_LINK
+		header.link = symbol_table_section;
+		header.info = (uint32_t)i + 1;
+		header.alignment = 8;
+		header.entry_size = 24;
+		align(file, 8);
+		header.offset = file.size();
+		for (const Relocation& relocation : section.relocations) {
+			put(file, relocation.offset, 8);
+			put(file, ((uint64_t)symbol_index[relocation.symbol] << 32) | relocation.type, 8);
+			put(file, (uint64_t)relocation.addend, 8);
+		}
+		header.size = file.size() - header.offset;
+		headers.push_back(header);
+	}
+
+	SectionHeader symbols;
+	symbols.name = add_string(section_names, ".symtab");
+	symbols.type = 2;															// SHT_SYMTAB
+	symbols.link = symbol_table_section + 1;
+	symbols.info = first_global;
+	symbols.alignment = 8;
+	symbols.entry_size = 24;
+	align(file, 8);
+	symbols.offset = file.size();
+	symbols.size = symbol_table.size();
+	file += symbol_table;
+	headers.push_back(symbols);
+
+	SectionHeader strings;
+	strings.name = add_string(section_names, ".strtab");
+	strings.type = 3;															// SHT_STRTAB
+	strings.offset = file.size();
+	strings.size = names.size();
+	file += names;
+	headers.push_back(strings);
+
+	SectionHeader header_names;
+	header_names.name = add_string(section_names, ".shstrtab");
+	header_names.type = 3;
+	header_names.offset = file.size();
+	header_names.size = section_names.size();
+	file += section_names;
+	headers.push_back(header_names);
+
+	align(file, 8);
+	uint64_t section_headers = file.size();
+	for (const SectionHeader& header : headers) {
+		put(file, header.name, 4);
+		put(file, header.type, 4);
+		put(file, header.flags, 8);
+		put(file, 0, 8);														// Address
+		put(file, header.offset, 8);
+		put(file, header.size, 8);
+		put(file, header.link, 4);
+		put(file, header.info, 4);
+		put(file, header.alignment, 8);
+		put(file, header.entry_size, 8);
+	}
+
+	std::string elf_header = "\x7F" "ELF";
+	elf_header += { 2, 1, 1, 0 };												// 64 bit, little endian, version 1, System V
+	elf_header.append(8, '\0');
+	put(elf_header, 1, 2);														// ET_REL
+	put(elf_header, 62, 2);														// EM_X86_64
+	put(elf_header, 1, 4);
+	put(elf_header, 0, 8);														// No entry point
+	put(elf_header, 0, 8);														// No program headers
+	put(elf_header, section_headers, 8);
+	put(elf_header, 0, 4);
+	put(elf_header, 64, 2);
+	put(elf_header, 0, 2);
+	put(elf_header, 0, 2);
+	put(elf_header, 64, 2);
+	put(elf_header, headers.size(), 2);
+	put(elf_header, headers.size() - 1, 2);										// .shstrtab is last
+	file.replace(0, 64, elf_header);
+	return file;
+}
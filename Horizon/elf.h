@@ -0,0 +1,8 @@
+#pragma once
+#include <string>
+#include "object.h"
+
+// Writes an object as a relocatable ELF64 file for x86-64, the input of any system linker. Local symbols come
+// first in .symtab, as ELF requires, and every section with relocations gets a .rela section next to it.
+
+std::string elf_object(const ObjectFile& object);								// The bytes of the .o file
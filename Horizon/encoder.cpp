@@ -0,0 +1,772 @@
+#include "pch.h"
+#include "encoder.h"
+#include <unordered_map>
+#include <unordered_set>
+#include <format>
+
+static const char* const register_names[4][16] = {
+	{ "al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil", "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b" },
+	{ "ax", "cx", "dx", "bx", "sp", "bp", "si", "di", "r8w", "r9w", "r10w", "r11w", "r12w", "r13w", "r14w", "r15w" },
+	{ "eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi", "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d" },
+	{ "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi", "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15" } };
+
+bool parse_register(const std::string& name, MachineOperand& operand) {
+	operand = MachineOperand();
+	for (int width = 0; width < 4; width++) {
+		for (int reg = 0; reg < 16; reg++) {
+			if (name == register_names[width][reg]) {
+				operand.reg = reg;
+				operand.size = 1 << width;
+				return true;
+			}
+		}
+	}
+	if ((name.starts_with("xmm") || name.starts_with("ymm")) && name.size() > 3 && name.size() <= 5
+		&& name.find_first_not_of("0123456789", 3) == std::string::npos) {
+		operand.reg = std::stoi(name.substr(3));
+		operand.register_class = name[0] == 'x' ? REGISTER_XMM : REGISTER_YMM;
+		operand.size = name[0] == 'x' ? 16 : 32;
+		return operand.reg < 16;
+	}
+	return false;
+}
+
+int condition_code(const std::string& condition) {
+	static const std::unordered_map<std::string, int> codes = {
+		{ "o", 0 }, { "no", 1 }, { "b", 2 }, { "c", 2 }, { "nae", 2 }, { "ae", 3 }, { "nb", 3 }, { "nc", 3 },
+		{ "e", 4 }, { "z", 4 }, { "ne", 5 }, { "nz", 5 }, { "be", 6 }, { "na", 6 }, { "a", 7 }, { "nbe", 7 },
+		{ "s", 8 }, { "ns", 9 }, { "p", 10 }, { "pe", 10 }, { "np", 11 }, { "po", 11 },
+		{ "l", 12 }, { "nge", 12 }, { "ge", 13 }, { "nl", 13 }, { "le", 14 }, { "ng", 14 }, { "g", 15 }, { "nle", 15 } };
+	auto found = codes.find(condition);
+	return found == codes.end() ? -1 : found->second;
+}
+
+// OPERAND CHECKS
+
+static bool is_general(const MachineOperand& operand) { return operand.kind == OPERAND_REGISTER && operand.register_class == REGISTER_GENERAL; }
+static bool is_vector(const MachineOperand& operand) { return operand.kind == OPERAND_REGISTER && operand.register_class != REGISTER_GENERAL; }
+static bool is_memory(const MachineOperand& operand) { return operand.kind == OPERAND_MEMORY; }
+static bool is_immediate(const MachineOperand& operand) { return operand.kind == OPERAND_IMMEDIATE; }
+static bool is_general_or_memory(const MachineOperand& operand) { return is_general(operand) || is_memory(operand); }
+static bool is_vector_or_memory(const MachineOperand& operand) { return is_vector(operand) || is_memory(operand); }
+static bool is_constant(const MachineValue& value) { return value.symbol.empty() && value.minus.empty(); }
+static bool fits_byte(int64_t value) { return value >= -128 && value <= 127; }
+static bool fits_dword(int64_t value) { return value >= INT32_MIN && value <= INT32_MAX; }
+
+static bool needs_rex_for_byte(const MachineOperand& operand) {					// spl, bpl, sil and dil, without a REX prefix they mean ah to bh
+	return is_general(operand) && operand.size == 1 && operand.reg >= 4 && operand.reg < 8;
+}
+
+// FIELDS
+
+static void emit_value(Encoding& encoding, const MachineValue& value, int size, bool pc_relative = false) {
+	if (!is_constant(value) || pc_relative) {
+		Fixup fixup;
+		fixup.offset = encoding.bytes.size();
+		fixup.size = size;
+		fixup.value = value;
+		fixup.pc_relative = pc_relative;
+		encoding.fixups.push_back(fixup);
+		encoding.bytes.insert(encoding.bytes.end(), size, 0);
+		return;
+	}
+	for (int i = 0; i < size; i++)
+		encoding.bytes.push_back((uint8_t)((uint64_t)value.constant >> (8 * i)));
+}
+
+static void emit_segment(Encoding& encoding, const MachineOperand* rm) {
+	if (rm && is_memory(*rm) && rm->segment)
+		encoding.bytes.push_back(rm->segment);
+}
+
+static void emit_rex(Encoding& encoding, bool wide, int reg, const MachineOperand* rm, bool force) {
+	int rex = (wide ? 8 : 0) | (reg >= 8 ? 4 : 0);
+	if (rm && rm->kind == OPERAND_REGISTER)
+		rex |= rm->reg >= 8 ? 1 : 0;
+	else if (rm && is_memory(*rm))
+		rex |= (rm->index >= 8 ? 2 : 0) | (rm->base >= 8 ? 1 : 0);
+	if (rex || force)
+		encoding.bytes.push_back((uint8_t)(0x40 | rex));
+}
+
+static void emit_modrm(Encoding& encoding, int reg, const MachineOperand& rm) {	// reg is a register or the /digit of the opcode
+	int field = (reg & 7) << 3;
+	if (rm.kind == OPERAND_REGISTER) {
+		encoding.bytes.push_back((uint8_t)(0xC0 | field | (rm.reg & 7)));
+		return;
+	}
+	int scale_bits = rm.scale == 8 ? 3 : rm.scale == 4 ? 2 : rm.scale == 2 ? 1 : 0;
+	if (rm.rip_relative) {
+		encoding.bytes.push_back((uint8_t)(0x05 | field));
+		emit_value(encoding, rm.value, 4, true);
+		return;
+	}
+	if (rm.base < 0) {															// Absolute, or index * scale + displacement
+		encoding.bytes.push_back((uint8_t)(0x04 | field));
+		encoding.bytes.push_back((uint8_t)((scale_bits << 6) | ((rm.index < 0 ? 4 : rm.index & 7) << 3) | 5));
+		emit_value(encoding, rm.value, 4);
+		return;
+	}
+	int64_t displacement = rm.value.constant;
+	int mode = !is_constant(rm.value) ? 2 : displacement == 0 && (rm.base & 7) != 5 ? 0 : fits_byte(displacement) ? 1 : 2;
+	if (rm.index >= 0 || (rm.base & 7) == 4) {									// %rsp and %r12 as base need a SIB byte
+		encoding.bytes.push_back((uint8_t)((mode << 6) | field | 4));
+		encoding.bytes.push_back((uint8_t)((scale_bits << 6) | ((rm.index < 0 ? 4 : rm.index & 7) << 3) | (rm.base & 7)));
+	}
+	else
+		encoding.bytes.push_back((uint8_t)((mode << 6) | field | (rm.base & 7)));
+	if (mode == 1)
+		encoding.bytes.push_back((uint8_t)displacement);
+	else if (mode == 2)
+		emit_value(encoding, rm.value, 4);
+}
+
+static void emit_general(Encoding& encoding, int size, std::initializer_list<uint8_t> opcode, int reg, const MachineOperand& rm,
+	bool force_rex = false, uint8_t mandatory_prefix = 0) {						// Prefixes, REX, opcode and ModRM of a general purpose instruction
+	emit_segment(encoding, &rm);
+	if (size == 2)
+		encoding.bytes.push_back(0x66);
+	if (mandatory_prefix)
+		encoding.bytes.push_back(mandatory_prefix);
+	emit_rex(encoding, size == 8, reg, &rm, force_rex || needs_rex_for_byte(rm));
+	encoding.bytes.insert(encoding.bytes.end(), opcode);
+	emit_modrm(encoding, reg, rm);
+}
+
+static void emit_register_in_opcode(Encoding& encoding, int size, std::initializer_list<uint8_t> opcode, const MachineOperand& reg) {	// push, pop, bswap and mov $imm
+	if (size == 2)
+		encoding.bytes.push_back(0x66);
+	emit_rex(encoding, size == 8, 0, &reg, needs_rex_for_byte(reg));
+	encoding.bytes.insert(encoding.bytes.end(), opcode);
+	encoding.bytes.back() += (uint8_t)(reg.reg & 7);
+}
+
+void encode_branch(int condition, bool is_short, const MachineValue& target, Encoding& encoding) {
+	if (is_short)
+		encoding.bytes.push_back(condition < 0 ? 0xEB : (uint8_t)(0x70 + condition));
+	else if (condition < 0)
+		encoding.bytes.push_back(0xE9);
+	else
+		encoding.bytes.insert(encoding.bytes.end(), { 0x0F, (uint8_t)(0x80 + condition) });
+	emit_value(encoding, target, is_short ? 1 : 4, true);
+	encoding.fixups.back().plt = !is_short;
+}
+
+std::vector<uint8_t> nop_padding(size_t length) {
+	static const std::vector<uint8_t> nops[] = { {},
+		{ 0x90 },
+		{ 0x66, 0x90 },
+		{ 0x0F, 0x1F, 0x00 },
+		{ 0x0F, 0x1F, 0x40, 0x00 },
+		{ 0x0F, 0x1F, 0x44, 0x00, 0x00 },
+		{ 0x66, 0x0F, 0x1F, 0x44, 0x00, 0x00 },
+		{ 0x0F, 0x1F, 0x80, 0x00, 0x00, 0x00, 0x00 },
+		{ 0x0F, 0x1F, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 },
+		{ 0x66, 0x0F, 0x1F, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 },
+		{ 0x66, 0x2E, 0x0F, 0x1F, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 } };
+	std::vector<uint8_t> padding;
+	while (length > 0) {
+		size_t piece = length < 10 ? length : 10;
+		padding.insert(padding.end(), nops[piece].begin(), nops[piece].end());
+		length -= piece;
+	}
+	return padding;
+}
+
+// GENERAL PURPOSE INSTRUCTIONS
+
+static const std::unordered_map<std::string, std::vector<uint8_t>> fixed_instructions = {
+	{ "ret", { 0xC3 } }, { "leave", { 0xC9 } }, { "nop", { 0x90 } }, { "hlt", { 0xF4 } }, { "int3", { 0xCC } }, { "ud2", { 0x0F, 0x0B } },
+	{ "cqo", { 0x48, 0x99 } }, { "cqto", { 0x48, 0x99 } }, { "cdq", { 0x99 } }, { "cltd", { 0x99 } },
+	{ "cltq", { 0x48, 0x98 } }, { "cdqe", { 0x48, 0x98 } }, { "cld", { 0xFC } }, { "std", { 0xFD } },
+	{ "cpuid", { 0x0F, 0xA2 } }, { "rdtsc", { 0x0F, 0x31 } }, { "rdtscp", { 0x0F, 0x01, 0xF9 } }, { "xgetbv", { 0x0F, 0x01, 0xD0 } },
+	{ "pause", { 0xF3, 0x90 } }, { "lfence", { 0x0F, 0xAE, 0xE8 } }, { "sfence", { 0x0F, 0xAE, 0xF8 } }, { "mfence", { 0x0F, 0xAE, 0xF0 } },
+	{ "vzeroupper", { 0xC5, 0xF8, 0x77 } },
+	{ "stosb", { 0xAA } }, { "stosw", { 0x66, 0xAB } }, { "stosl", { 0xAB } }, { "stosq", { 0x48, 0xAB } },
+	{ "movsb", { 0xA4 } }, { "movsw", { 0x66, 0xA5 } }, { "movsl", { 0xA5 } }, { "movsq", { 0x48, 0xA5 } },
+	{ "lodsb", { 0xAC } }, { "lodsq", { 0x48, 0xAD } }, { "scasb", { 0xAE } }, { "cmpsb", { 0xA6 } } };
+
+static const std::unordered_map<std::string, int> arithmetic_operations = {		// The /digit of the immediate forms, the opcodes are digit * 8 + 0 to 3
+	{ "add", 0 }, { "or", 1 }, { "adc", 2 }, { "sbb", 3 }, { "and", 4 }, { "sub", 5 }, { "xor", 6 }, { "cmp", 7 } };
+static const std::unordered_map<std::string, int> unary_operations = {			// F6 and F7, or FE and FF for inc and dec
+	{ "not", 2 }, { "neg", 3 }, { "mul", 4 }, { "imul", 5 }, { "div", 6 }, { "idiv", 7 } };
+static const std::unordered_map<std::string, int> shift_operations = {
+	{ "rol", 0 }, { "ror", 1 }, { "rcl", 2 }, { "rcr", 3 }, { "shl", 4 }, { "sal", 4 }, { "shr", 5 }, { "sar", 7 } };
+static const std::unordered_map<std::string, std::vector<uint8_t>> bit_scans = {	// reg, r/m forms with an optional F3 prefix first
+	{ "bsf", { 0x0F, 0xBC } }, { "bsr", { 0x0F, 0xBD } }, { "popcnt", { 0xF3, 0x0F, 0xB8 } }, { "lzcnt", { 0xF3, 0x0F, 0xBD } },
+	{ "tzcnt", { 0xF3, 0x0F, 0xBC } } };
+static const std::unordered_map<std::string, int> bit_tests = { { "bt", 4 }, { "bts", 5 }, { "btr", 6 }, { "btc", 7 } };
+static const std::unordered_map<std::string, int> prefetches = { { "prefetchnta", 0 }, { "prefetcht0", 1 }, { "prefetcht1", 2 }, { "prefetcht2", 3 } };
+
+static bool is_general_mnemonic(const std::string& name) {
+	static const std::unordered_set<std::string> names = {
+		"mov", "movabs", "test", "lea", "push", "pop", "inc", "dec", "xchg", "bswap", "movnti", "crc32", "jmp", "call" };
+	return names.contains(name) || arithmetic_operations.contains(name) || unary_operations.contains(name)
+		|| shift_operations.contains(name) || bit_scans.contains(name) || bit_tests.contains(name);
+}
+
+static int suffix_size(char suffix) {
+	return suffix == 'b' ? 1 : suffix == 'w' ? 2 : suffix == 'l' ? 4 : suffix == 'q' ? 8 : 0;
+}
+
+static bool encode_general(const std::string& name, int size, const std::vector<MachineOperand>& operands, Encoding& encoding, std::string& error) {
+	size_t count = operands.size();
+	const MachineOperand* source = count >= 1 ? &operands[0] : nullptr;
+	const MachineOperand* destination = count >= 1 ? &operands[count - 1] : nullptr;
+	int byte_adjust = size == 1 ? 1 : 0;										// Byte forms are the opcode before the wider one
+
+	if (size == 8 && count >= 1 && is_immediate(*source) && is_constant(source->value) && !fits_dword(source->value.constant)
+		&& !(count == 2 && (name == "movabs" || (name == "mov" && is_general(*destination))))) {
+		error = "The immediate does not fit in the 32 bits this instruction sign extends";
+		return false;
+	}
+	if (count == 2 && arithmetic_operations.contains(name)) {
+		int digit = arithmetic_operations.at(name);
+		if (is_immediate(*source) && is_general_or_memory(*destination)) {
+			if (size == 1) {
+				emit_general(encoding, size, { 0x80 }, digit, *destination);
+				emit_value(encoding, source->value, 1);
+			}
+			else if (is_constant(source->value) && fits_byte(source->value.constant)) {
+				emit_general(encoding, size, { 0x83 }, digit, *destination);
+				emit_value(encoding, source->value, 1);
+			}
+			else if (is_general(*destination) && destination->reg == 0) {	// The accumulator has a form without ModRM
+				if (size == 2)
+					encoding.bytes.push_back(0x66);
+				if (size == 8)
+					encoding.bytes.push_back(0x48);
+				encoding.bytes.push_back((uint8_t)(digit * 8 + 5));
+				emit_value(encoding, source->value, size == 2 ? 2 : 4);
+			}
+			else {
+				emit_general(encoding, size, { 0x81 }, digit, *destination);
+				emit_value(encoding, source->value, size == 2 ? 2 : 4);
+			}
+			return true;
+		}
+		if (is_general(*source) && is_general_or_memory(*destination)) {
+			emit_general(encoding, size, { (uint8_t)(digit * 8 + 1 - byte_adjust) }, source->reg, *destination, needs_rex_for_byte(*source));
+			return true;
+		}
+		if (is_memory(*source) && is_general(*destination)) {
+			emit_general(encoding, size, { (uint8_t)(digit * 8 + 3 - byte_adjust) }, destination->reg, *source, needs_rex_for_byte(*destination));
+			return true;
+		}
+	}
+	else if (count == 2 && name == "test") {
+		if (is_immediate(*source) && is_general(*destination) && destination->reg == 0) {
+			if (size == 2)
+				encoding.bytes.push_back(0x66);
+			if (size == 8)
+				encoding.bytes.push_back(0x48);
+			encoding.bytes.push_back((uint8_t)(0xA9 - byte_adjust));
+			emit_value(encoding, source->value, size == 1 ? 1 : size == 2 ? 2 : 4);
+			return true;
+		}
+		if (is_immediate(*source) && is_general_or_memory(*destination)) {
+			emit_general(encoding, size, { (uint8_t)(0xF7 - byte_adjust) }, 0, *destination);
+			emit_value(encoding, source->value, size == 1 ? 1 : size == 2 ? 2 : 4);
+			return true;
+		}
+		const MachineOperand* reg = is_general(*source) ? source : destination;
+		const MachineOperand* rm = is_general(*source) ? destination : source;
+		if (is_general(*reg) && is_general_or_memory(*rm)) {
+			emit_general(encoding, size, { (uint8_t)(0x85 - byte_adjust) }, reg->reg, *rm, needs_rex_for_byte(*reg));
+			return true;
+		}
+	}
+	else if (count == 2 && (name == "mov" || name == "movabs")) {
+		if (is_immediate(*source) && is_general(*destination)) {
+			bool fits_sign_extended = !is_constant(source->value) || fits_dword(source->value.constant);
+			if (size == 8 && fits_sign_extended && name == "mov") {
+				emit_general(encoding, size, { 0xC7 }, 0, *destination);
+				emit_value(encoding, source->value, 4);
+			}
+			else {
+				emit_register_in_opcode(encoding, size, { (uint8_t)(size == 1 ? 0xB0 : 0xB8) }, *destination);
+				emit_value(encoding, source->value, size);
+			}
+			return true;
+		}
+		if (is_immediate(*source) && is_memory(*destination)) {
+			emit_general(encoding, size, { (uint8_t)(0xC7 - byte_adjust) }, 0, *destination);
+			emit_value(encoding, source->value, size == 1 ? 1 : size == 2 ? 2 : 4);
+			return true;
+		}
+		if (is_general(*source) && is_general_or_memory(*destination)) {
+			emit_general(encoding, size, { (uint8_t)(0x89 - byte_adjust) }, source->reg, *destination, needs_rex_for_byte(*source));
+			return true;
+		}
+		if (is_memory(*source) && is_general(*destination)) {
+			emit_general(encoding, size, { (uint8_t)(0x8B - byte_adjust) }, destination->reg, *source, needs_rex_for_byte(*destination));
+			return true;
+		}
+	}
+	else if (count == 2 && name == "lea" && is_memory(*source) && is_general(*destination)) {
+		emit_general(encoding, size, { 0x8D }, destination->reg, *source);
+		return true;
+	}
+	else if (count == 2 && name == "xchg" && is_general(*source) && is_general_or_memory(*destination)) {
+		emit_general(encoding, size, { (uint8_t)(0x87 - byte_adjust) }, source->reg, *destination, needs_rex_for_byte(*source));
+		return true;
+	}
+	else if (count == 1 && (name == "push" || name == "pop")) {
+		bool push = name == "push";
+		if (is_general(*source)) {
+			emit_register_in_opcode(encoding, size == 2 ? 2 : 4, { (uint8_t)(push ? 0x50 : 0x58) }, *source);
+			return true;
+		}
+		if (is_memory(*source)) {
+			emit_general(encoding, size == 2 ? 2 : 4, { (uint8_t)(push ? 0xFF : 0x8F) }, push ? 6 : 0, *source);
+			return true;
+		}
+		if (push && is_immediate(*source)) {
+			bool short_form = is_constant(source->value) && fits_byte(source->value.constant);
+			encoding.bytes.push_back(short_form ? 0x6A : 0x68);
+			emit_value(encoding, source->value, short_form ? 1 : 4);
+			return true;
+		}
+	}
+	else if (count == 1 && (name == "inc" || name == "dec") && is_general_or_memory(*source)) {
+		emit_general(encoding, size, { (uint8_t)(0xFF - byte_adjust) }, name == "inc" ? 0 : 1, *source);
+		return true;
+	}
+	else if (count == 1 && unary_operations.contains(name) && is_general_or_memory(*source)) {
+		emit_general(encoding, size, { (uint8_t)(0xF7 - byte_adjust) }, unary_operations.at(name), *source);
+		return true;
+	}
+	else if (name == "imul" && count >= 2 && is_general(*destination)) {
+		const MachineOperand& rm = count == 3 ? operands[1] : is_immediate(*source) ? *destination : *source;
+		if (!is_general_or_memory(rm)) {
+			error = "The source of imul has to be a register or memory";
+			return false;
+		}
+		if (is_immediate(*source)) {
+			bool short_form = is_constant(source->value) && fits_byte(source->value.constant);
+			emit_general(encoding, size, { (uint8_t)(short_form ? 0x6B : 0x69) }, destination->reg, rm);
+			emit_value(encoding, source->value, short_form ? 1 : size == 2 ? 2 : 4);
+			return true;
+		}
+		if (count == 2) {
+			emit_general(encoding, size, { 0x0F, 0xAF }, destination->reg, rm);
+			return true;
+		}
+	}
+	else if (shift_operations.contains(name) && count >= 1 && count <= 2 && is_general_or_memory(*destination)) {
+		int digit = shift_operations.at(name);
+		if (count == 1 || (is_immediate(*source) && is_constant(source->value) && source->value.constant == 1))
+			emit_general(encoding, size, { (uint8_t)(0xD1 - byte_adjust) }, digit, *destination);
+		else if (is_immediate(*source)) {
+			emit_general(encoding, size, { (uint8_t)(0xC1 - byte_adjust) }, digit, *destination);
+			emit_value(encoding, source->value, 1);
+		}
+		else if (is_general(*source) && source->reg == 1 && source->size == 1)
+			emit_general(encoding, size, { (uint8_t)(0xD3 - byte_adjust) }, digit, *destination);
+		else {
+			error = "The shift count has to be an immediate or %cl";
+			return false;
+		}
+		return true;
+	}
+	else if (count == 2 && bit_scans.contains(name) && is_general_or_memory(*source) && is_general(*destination)) {
+		const std::vector<uint8_t>& opcode = bit_scans.at(name);
+		bool prefixed = opcode[0] == 0xF3;
+		emit_general(encoding, size, { opcode[prefixed ? 1 : 0], opcode[prefixed ? 2 : 1] }, destination->reg, *source, false, prefixed ? 0xF3 : 0);
+		return true;
+	}
+	else if (count == 2 && bit_tests.contains(name) && is_general_or_memory(*destination)) {
+		if (is_immediate(*source)) {
+			emit_general(encoding, size, { 0x0F, 0xBA }, bit_tests.at(name), *destination);
+			emit_value(encoding, source->value, 1);
+			return true;
+		}
+		if (is_general(*source)) {
+			emit_general(encoding, size, { 0x0F, (uint8_t)(0xA3 + 8 * (bit_tests.at(name) - 4)) }, source->reg, *destination);
+			return true;
+		}
+	}
+	else if (count == 1 && name == "bswap" && is_general(*source)) {
+		if (size < 4) {
+			error = "bswap needs a 32 or 64 bit register";
+			return false;
+		}
+		emit_register_in_opcode(encoding, size, { 0x0F, 0xC8 }, *source);
+		return true;
+	}
+	else if (count == 2 && name == "movnti" && is_general(*source) && is_memory(*destination)) {
+		emit_general(encoding, size, { 0x0F, 0xC3 }, source->reg, *destination);
+		return true;
+	}
+	else if (count == 2 && name == "crc32" && is_general_or_memory(*source) && is_general(*destination)) {
+		int source_size = size;
+		if (is_general(*source))
+			source_size = source->size;
+		emit_segment(encoding, source);
+		if (source_size == 2)
+			encoding.bytes.push_back(0x66);
+		encoding.bytes.push_back(0xF2);
+		emit_rex(encoding, source_size == 8, destination->reg, source, needs_rex_for_byte(*source));
+		encoding.bytes.insert(encoding.bytes.end(), { 0x0F, 0x38, (uint8_t)(source_size == 1 ? 0xF0 : 0xF1) });
+		emit_modrm(encoding, destination->reg, *source);
+		return true;
+	}
+	else if (count == 1 && (name == "jmp" || name == "call") && source->indirect && is_general_or_memory(*source)) {
+		emit_general(encoding, 4, { 0xFF }, name == "jmp" ? 4 : 2, *source);
+		return true;
+	}
+	else if (count == 1 && name == "call" && is_memory(*source) && source->base < 0 && source->index < 0 && !source->rip_relative) {
+		encoding.bytes.push_back(0xE8);
+		emit_value(encoding, source->value, 4, true);
+		encoding.fixups.back().plt = true;
+		return true;
+	}
+	else if (count == 1 && (name == "jmp" || name == "call") && is_general(*source)) {
+		error = "An indirect " + name + " needs a * before its operand";
+		return false;
+	}
+	return false;
+}
+
+static bool encode_extension(const std::string& name, const std::vector<MachineOperand>& operands, Encoding& encoding) {	// movzbl, movsbq, movslq and the like
+	if (operands.size() != 2 || !is_general_or_memory(operands[0]) || !is_general(operands[1]))
+		return false;
+	bool sign = name[3] == 's';
+	int from = suffix_size(name[4]);
+	int to = suffix_size(name[5]);
+	if (is_general(operands[0]) && operands[0].size != from)
+		return false;
+	if (from == 4 && sign && to == 8)
+		emit_general(encoding, 8, { 0x63 }, operands[1].reg, operands[0]);
+	else if (from == 1 || from == 2)
+		emit_general(encoding, to, { 0x0F, (uint8_t)((sign ? 0xBE : 0xB6) + (from == 2 ? 1 : 0)) }, operands[1].reg, operands[0]);
+	else
+		return false;
+	return true;
+}
+
+// VECTOR INSTRUCTIONS
+
+enum VectorForm {
+	VECTOR_BINARY,																// op src, dst as dst = dst op src, or with VEX op src2, src1, dst
+	VECTOR_UNARY,																// op src, dst with no second source
+	VECTOR_SHUFFLE,																// op $imm, src, dst
+	VECTOR_SHIFT,																// op $imm, dst, with the operation in the /digit
+	VECTOR_INSERT,																// op $imm, r32, dst, or with VEX op $imm, r32, src, dst
+	VECTOR_EXTRACT,																// op $imm, xmm, r32
+};
+
+class VectorOpcode {
+public:
+	uint8_t prefix;																// 0x66, 0xF3, 0xF2 or 0
+	int map;																	// 1 for 0F, 2 for 0F 38 and 3 for 0F 3A
+	uint8_t opcode;
+	VectorForm form;
+	bool wide = false;															// REX.W or VEX.W
+	int digit = 0;																// Of the shifts
+	bool vex_only = false;
+};
+
+static const std::unordered_map<std::string, VectorOpcode> vector_opcodes = {
+	{ "paddb", { 0x66, 1, 0xFC, VECTOR_BINARY } }, { "paddw", { 0x66, 1, 0xFD, VECTOR_BINARY } },
+	{ "paddd", { 0x66, 1, 0xFE, VECTOR_BINARY } }, { "paddq", { 0x66, 1, 0xD4, VECTOR_BINARY } },
+	{ "psubb", { 0x66, 1, 0xF8, VECTOR_BINARY } }, { "psubw", { 0x66, 1, 0xF9, VECTOR_BINARY } },
+	{ "psubd", { 0x66, 1, 0xFA, VECTOR_BINARY } }, { "psubq", { 0x66, 1, 0xFB, VECTOR_BINARY } },
+	{ "pand", { 0x66, 1, 0xDB, VECTOR_BINARY } }, { "pandn", { 0x66, 1, 0xDF, VECTOR_BINARY } },
+	{ "por", { 0x66, 1, 0xEB, VECTOR_BINARY } }, { "pxor", { 0x66, 1, 0xEF, VECTOR_BINARY } },
+	{ "pcmpeqb", { 0x66, 1, 0x74, VECTOR_BINARY } }, { "pcmpeqw", { 0x66, 1, 0x75, VECTOR_BINARY } },
+	{ "pcmpeqd", { 0x66, 1, 0x76, VECTOR_BINARY } }, { "pcmpeqq", { 0x66, 2, 0x29, VECTOR_BINARY } },
+	{ "pcmpgtb", { 0x66, 1, 0x64, VECTOR_BINARY } }, { "pcmpgtw", { 0x66, 1, 0x65, VECTOR_BINARY } },
+	{ "pcmpgtd", { 0x66, 1, 0x66, VECTOR_BINARY } }, { "pcmpgtq", { 0x66, 2, 0x37, VECTOR_BINARY } },
+	{ "pmullw", { 0x66, 1, 0xD5, VECTOR_BINARY } }, { "pmulld", { 0x66, 2, 0x40, VECTOR_BINARY } },
+	{ "pmuludq", { 0x66, 1, 0xF4, VECTOR_BINARY } }, { "pmaddwd", { 0x66, 1, 0xF5, VECTOR_BINARY } },
+	{ "pmaxsd", { 0x66, 2, 0x3D, VECTOR_BINARY } }, { "pminsd", { 0x66, 2, 0x39, VECTOR_BINARY } },
+	{ "pmaxud", { 0x66, 2, 0x3F, VECTOR_BINARY } }, { "pminud", { 0x66, 2, 0x3B, VECTOR_BINARY } },
+	{ "pmaxsw", { 0x66, 1, 0xEE, VECTOR_BINARY } }, { "pminsw", { 0x66, 1, 0xEA, VECTOR_BINARY } },
+	{ "pmaxub", { 0x66, 1, 0xDE, VECTOR_BINARY } }, { "pminub", { 0x66, 1, 0xDA, VECTOR_BINARY } },
+	{ "punpcklbw", { 0x66, 1, 0x60, VECTOR_BINARY } }, { "punpcklwd", { 0x66, 1, 0x61, VECTOR_BINARY } },
+	{ "punpckldq", { 0x66, 1, 0x62, VECTOR_BINARY } }, { "punpcklqdq", { 0x66, 1, 0x6C, VECTOR_BINARY } },
+	{ "punpckhbw", { 0x66, 1, 0x68, VECTOR_BINARY } }, { "punpckhwd", { 0x66, 1, 0x69, VECTOR_BINARY } },
+	{ "punpckhdq", { 0x66, 1, 0x6A, VECTOR_BINARY } }, { "punpckhqdq", { 0x66, 1, 0x6D, VECTOR_BINARY } },
+	{ "packsswb", { 0x66, 1, 0x63, VECTOR_BINARY } }, { "packssdw", { 0x66, 1, 0x6B, VECTOR_BINARY } },
+	{ "packuswb", { 0x66, 1, 0x67, VECTOR_BINARY } }, { "packusdw", { 0x66, 2, 0x2B, VECTOR_BINARY } },
+	{ "pshufb", { 0x66, 2, 0x00, VECTOR_BINARY } }, { "pblendvb", { 0x66, 2, 0x10, VECTOR_BINARY } },
+	{ "psllw", { 0x66, 1, 0xF1, VECTOR_BINARY } }, { "pslld", { 0x66, 1, 0xF2, VECTOR_BINARY } },
+	{ "psllq", { 0x66, 1, 0xF3, VECTOR_BINARY } }, { "psrlw", { 0x66, 1, 0xD1, VECTOR_BINARY } },
+	{ "psrld", { 0x66, 1, 0xD2, VECTOR_BINARY } }, { "psrlq", { 0x66, 1, 0xD3, VECTOR_BINARY } },
+	{ "psraw", { 0x66, 1, 0xE1, VECTOR_BINARY } }, { "psrad", { 0x66, 1, 0xE2, VECTOR_BINARY } },
+	{ "vpermd", { 0x66, 2, 0x36, VECTOR_BINARY, false, 0, true } },
+	{ "vpsllvd", { 0x66, 2, 0x47, VECTOR_BINARY, false, 0, true } }, { "vpsllvq", { 0x66, 2, 0x47, VECTOR_BINARY, true, 0, true } },
+	{ "vpsrlvd", { 0x66, 2, 0x45, VECTOR_BINARY, false, 0, true } }, { "vpsrlvq", { 0x66, 2, 0x45, VECTOR_BINARY, true, 0, true } },
+	{ "vpsravd", { 0x66, 2, 0x46, VECTOR_BINARY, false, 0, true } },
+
+	{ "pmovsxbw", { 0x66, 2, 0x20, VECTOR_UNARY } }, { "pmovsxwd", { 0x66, 2, 0x23, VECTOR_UNARY } },
+	{ "pmovsxdq", { 0x66, 2, 0x25, VECTOR_UNARY } }, { "pmovzxbw", { 0x66, 2, 0x30, VECTOR_UNARY } },
+	{ "pmovzxwd", { 0x66, 2, 0x33, VECTOR_UNARY } }, { "pmovzxdq", { 0x66, 2, 0x35, VECTOR_UNARY } },
+	{ "pabsd", { 0x66, 2, 0x1E, VECTOR_UNARY } }, { "ptest", { 0x66, 2, 0x17, VECTOR_UNARY } },
+	{ "vpbroadcastb", { 0x66, 2, 0x78, VECTOR_UNARY, false, 0, true } }, { "vpbroadcastw", { 0x66, 2, 0x79, VECTOR_UNARY, false, 0, true } },
+	{ "vpbroadcastd", { 0x66, 2, 0x58, VECTOR_UNARY, false, 0, true } }, { "vpbroadcastq", { 0x66, 2, 0x59, VECTOR_UNARY, false, 0, true } },
+
+	{ "pshufd", { 0x66, 1, 0x70, VECTOR_SHUFFLE } }, { "pshufhw", { 0xF3, 1, 0x70, VECTOR_SHUFFLE } },
+	{ "pshuflw", { 0xF2, 1, 0x70, VECTOR_SHUFFLE } }, { "vpermq", { 0x66, 3, 0x00, VECTOR_SHUFFLE, true, 0, true } },
+
+	{ "psllw $", { 0x66, 1, 0x71, VECTOR_SHIFT, false, 6 } }, { "psrlw $", { 0x66, 1, 0x71, VECTOR_SHIFT, false, 2 } },
+	{ "psraw $", { 0x66, 1, 0x71, VECTOR_SHIFT, false, 4 } }, { "pslld $", { 0x66, 1, 0x72, VECTOR_SHIFT, false, 6 } },
+	{ "psrld $", { 0x66, 1, 0x72, VECTOR_SHIFT, false, 2 } }, { "psrad $", { 0x66, 1, 0x72, VECTOR_SHIFT, false, 4 } },
+	{ "psllq $", { 0x66, 1, 0x73, VECTOR_SHIFT, false, 6 } }, { "psrlq $", { 0x66, 1, 0x73, VECTOR_SHIFT, false, 2 } },
+	{ "pslldq $", { 0x66, 1, 0x73, VECTOR_SHIFT, false, 7 } }, { "psrldq $", { 0x66, 1, 0x73, VECTOR_SHIFT, false, 3 } },
+
+	{ "pinsrb", { 0x66, 3, 0x20, VECTOR_INSERT } }, { "pinsrw", { 0x66, 1, 0xC4, VECTOR_INSERT } },
+	{ "pinsrd", { 0x66, 3, 0x22, VECTOR_INSERT } }, { "pinsrq", { 0x66, 3, 0x22, VECTOR_INSERT, true } },
+	{ "pextrb", { 0x66, 3, 0x14, VECTOR_EXTRACT } }, { "pextrd", { 0x66, 3, 0x16, VECTOR_EXTRACT } },
+	{ "pextrq", { 0x66, 3, 0x16, VECTOR_EXTRACT, true } } };
+
+static void emit_legacy_vector(Encoding& encoding, uint8_t prefix, int map, uint8_t opcode, bool wide, int reg, const MachineOperand& rm) {
+	emit_segment(encoding, &rm);
+	if (prefix)
+		encoding.bytes.push_back(prefix);
+	emit_rex(encoding, wide, reg, &rm, false);
+	encoding.bytes.push_back(0x0F);
+	if (map == 2)
+		encoding.bytes.push_back(0x38);
+	else if (map == 3)
+		encoding.bytes.push_back(0x3A);
+	encoding.bytes.push_back(opcode);
+	emit_modrm(encoding, reg, rm);
+}
+
+static void emit_vex(Encoding& encoding, uint8_t prefix, int map, uint8_t opcode, bool wide, bool long_vector, int source, int reg, const MachineOperand& rm) {
+	emit_segment(encoding, &rm);												// source is the register in VEX.vvvv, 0 if unused
+	int pp = prefix == 0x66 ? 1 : prefix == 0xF3 ? 2 : prefix == 0xF2 ? 3 : 0;
+	bool r = reg >= 8;
+	bool x = is_memory(rm) && rm.index >= 8;
+	bool b = rm.kind == OPERAND_REGISTER ? rm.reg >= 8 : rm.base >= 8;
+	uint8_t last = (uint8_t)((wide ? 0x80 : 0) | ((~source & 15) << 3) | (long_vector ? 4 : 0) | pp);
+	if (!x && !b && !wide && map == 1)
+		encoding.bytes.insert(encoding.bytes.end(), { 0xC5, (uint8_t)((r ? 0 : 0x80) | last) });
+	else
+		encoding.bytes.insert(encoding.bytes.end(), { 0xC4, (uint8_t)((r ? 0 : 0x80) | (x ? 0 : 0x40) | (b ? 0 : 0x20) | map), last });
+	encoding.bytes.push_back(opcode);
+	emit_modrm(encoding, reg, rm);
+}
+
+static void emit_vector(Encoding& encoding, bool vex, const VectorOpcode& opcode, bool long_vector, int source, int reg, const MachineOperand& rm) {
+	if (vex)
+		emit_vex(encoding, opcode.prefix, opcode.map, opcode.opcode, opcode.wide, long_vector, source, reg, rm);
+	else
+		emit_legacy_vector(encoding, opcode.prefix, opcode.map, opcode.opcode, opcode.wide, reg, rm);
+}
+
+static bool encode_vector_move(const std::string& name, bool vex, const std::vector<MachineOperand>& operands, Encoding& encoding) {
+	if (operands.size() != 2)
+		return false;
+	const MachineOperand& source = operands[0];
+	const MachineOperand& destination = operands[1];
+	bool long_vector = source.register_class == REGISTER_YMM || destination.register_class == REGISTER_YMM;
+	auto emit = [&](uint8_t prefix, uint8_t opcode, bool wide, int reg, const MachineOperand& rm) {
+		emit_vector(encoding, vex, VectorOpcode{ prefix, 1, opcode, VECTOR_UNARY, wide }, long_vector, 0, reg, rm);
+	};
+	if (name == "movdqa" || name == "movdqu" || name == "movaps" || name == "movups" || name == "movntdq") {
+		uint8_t prefix = name == "movdqa" || name == "movntdq" ? 0x66 : name == "movdqu" ? 0xF3 : 0;
+		bool packed_single = prefix == 0;
+		if (is_vector(destination) && is_vector_or_memory(source) && name != "movntdq")
+			emit(prefix, packed_single ? 0x10 + (name == "movaps" ? 0x18 : 0) : 0x6F, false, destination.reg, source);
+		else if (is_vector(source) && is_memory(destination))
+			emit(prefix, name == "movntdq" ? 0xE7 : packed_single ? 0x11 + (name == "movaps" ? 0x18 : 0) : 0x7F, false, source.reg, destination);
+		else
+			return false;
+		return true;
+	}
+	if (name == "movd" || name == "movq") {
+		bool wide = name == "movq";
+		if (is_vector(destination) && (is_general(source) || (is_memory(source) && !wide)))
+			emit(0x66, 0x6E, wide, destination.reg, source);
+		else if (is_vector(source) && (is_general(destination) || (is_memory(destination) && !wide)))
+			emit(0x66, 0x7E, wide, source.reg, destination);
+		else if (wide && is_vector(destination) && is_vector_or_memory(source))
+			emit(0xF3, 0x7E, false, destination.reg, source);
+		else if (wide && is_vector(source) && is_memory(destination))
+			emit(0x66, 0xD6, false, source.reg, destination);
+		else
+			return false;
+		return true;
+	}
+	return false;
+}
+
+static bool encode_vector(const std::string& mnemonic, const std::vector<MachineOperand>& operands, Encoding& encoding) {
+	bool vex = mnemonic[0] == 'v';												// Every VEX form is the legacy name with a v in front
+	std::string name = vex ? mnemonic.substr(1) : mnemonic;
+	if (encode_vector_move(name, vex, operands, encoding))
+		return true;
+
+	size_t count = operands.size();
+	if (count >= 1 && is_immediate(operands[0]) && vector_opcodes.contains(name + " $"))
+		name += " $";
+	else if (name == "pblendvb" && count == 3 && !vex && is_vector(operands[0]) && operands[0].reg == 0)
+		return encode_vector("pblendvb", { operands[1], operands[2] }, encoding);	// xmm0 is implicit
+	if (vex && (name == "extracti128" || name == "inserti128" || name == "perm2i128" || name == "pblendd" || name == "pblendvb")) {
+		uint8_t opcode = name == "extracti128" ? 0x39 : name == "inserti128" ? 0x38 : name == "perm2i128" ? 0x46 : name == "pblendd" ? 0x02 : 0x4C;
+		if (name == "extracti128" && count == 3 && is_immediate(operands[0]) && is_vector(operands[1]) && is_vector_or_memory(operands[2])) {
+			emit_vex(encoding, 0x66, 3, opcode, false, true, 0, operands[1].reg, operands[2]);
+			emit_value(encoding, operands[0].value, 1);
+			return true;
+		}
+		if (name == "pblendvb" && count == 4 && is_vector(operands[0]) && is_vector_or_memory(operands[1]) && is_vector(operands[2]) && is_vector(operands[3])) {
+			emit_vex(encoding, 0x66, 3, opcode, false, operands[3].register_class == REGISTER_YMM, operands[2].reg, operands[3].reg, operands[1]);
+			encoding.bytes.push_back((uint8_t)(operands[0].reg << 4));
+			return true;
+		}
+		if (name != "extracti128" && name != "pblendvb" && count == 4 && is_immediate(operands[0]) && is_vector_or_memory(operands[1])
+			&& is_vector(operands[2]) && is_vector(operands[3])) {
+			emit_vex(encoding, 0x66, 3, opcode, false, operands[3].register_class == REGISTER_YMM, operands[2].reg, operands[3].reg, operands[1]);
+			emit_value(encoding, operands[0].value, 1);
+			return true;
+		}
+		return false;
+	}
+	auto found = vector_opcodes.find(vex && vector_opcodes.contains("v" + name) ? "v" + name : name);
+	if (found == vector_opcodes.end() || (found->second.vex_only && !vex))
+		return false;
+	const VectorOpcode& opcode = found->second;
+	const MachineOperand& destination = operands[count - 1];
+	bool long_vector = destination.register_class == REGISTER_YMM;
+	switch (opcode.form) {
+	case VECTOR_BINARY:
+		if (vex && count == 3 && is_vector_or_memory(operands[0]) && is_vector(operands[1]) && is_vector(destination)) {
+			emit_vector(encoding, true, opcode, long_vector, operands[1].reg, destination.reg, operands[0]);
+			return true;
+		}
+		if (!vex && count == 2 && is_vector_or_memory(operands[0]) && is_vector(destination)) {
+			emit_vector(encoding, false, opcode, false, 0, destination.reg, operands[0]);
+			return true;
+		}
+		return false;
+	case VECTOR_UNARY:
+		if (count == 2 && is_vector_or_memory(operands[0]) && is_vector(destination)) {
+			emit_vector(encoding, vex, opcode, long_vector, 0, destination.reg, operands[0]);
+			return true;
+		}
+		return false;
+	case VECTOR_SHUFFLE:
+		if (count == 3 && is_immediate(operands[0]) && is_vector_or_memory(operands[1]) && is_vector(destination)) {
+			emit_vector(encoding, vex, opcode, long_vector, 0, destination.reg, operands[1]);
+			emit_value(encoding, operands[0].value, 1);
+			return true;
+		}
+		return false;
+	case VECTOR_SHIFT:
+		if (!vex && count == 2 && is_vector(destination)) {
+			emit_vector(encoding, false, opcode, false, 0, opcode.digit, destination);
+			emit_value(encoding, operands[0].value, 1);
+			return true;
+		}
+		if (vex && count == 3 && is_vector(operands[1]) && is_vector(destination)) {
+			emit_vector(encoding, true, opcode, long_vector, destination.reg, opcode.digit, operands[1]);
+			emit_value(encoding, operands[0].value, 1);
+			return true;
+		}
+		return false;
+	case VECTOR_INSERT:
+		if (count == (vex ? 4u : 3u) && is_immediate(operands[0]) && is_general_or_memory(operands[1]) && is_vector(destination)) {
+			emit_vector(encoding, vex, opcode, false, vex ? operands[2].reg : 0, destination.reg, operands[1]);
+			emit_value(encoding, operands[0].value, 1);
+			return true;
+		}
+		return false;
+	case VECTOR_EXTRACT:
+		if (count == 3 && is_immediate(operands[0]) && is_vector(operands[1]) && is_general_or_memory(destination)) {
+			emit_vector(encoding, vex, opcode, false, 0, operands[1].reg, destination);
+			emit_value(encoding, operands[0].value, 1);
+			return true;
+		}
+		return false;
+	}
+	return false;
+}
+
+bool encode_instruction(const MachineInstruction& instruction, Encoding& encoding, std::string& error) {
+	const std::string& mnemonic = instruction.mnemonic;
+	const std::vector<MachineOperand>& operands = instruction.operands;
+	auto fixed = fixed_instructions.find(mnemonic);
+	if (fixed != fixed_instructions.end() && operands.empty()) {
+		encoding.bytes.insert(encoding.bytes.end(), fixed->second.begin(), fixed->second.end());
+		return true;
+	}
+	bool has_vector = false;
+	for (const MachineOperand& operand : operands)
+		has_vector = has_vector || is_vector(operand);
+	if (has_vector || vector_opcodes.contains(mnemonic)) {
+		if (encode_vector(mnemonic, operands, encoding))
+			return true;
+		error = "Unsupported vector instruction form";
+		return false;
+	}
+
+	if (mnemonic.size() == 6 && (mnemonic.starts_with("movz") || mnemonic.starts_with("movs")) && suffix_size(mnemonic[4]) && suffix_size(mnemonic[5])) {
+		if (encode_extension(mnemonic, operands, encoding))
+			return true;
+		error = "Unsupported operands";
+		return false;
+	}
+	std::string name = mnemonic;
+	int size = 0;
+	int condition = -1;
+	if (!is_general_mnemonic(name) && name.size() > 1 && suffix_size(name.back()) && is_general_mnemonic(name.substr(0, name.size() - 1))) {
+		size = suffix_size(name.back());
+		name.pop_back();
+	}
+	if (name.starts_with("set") && condition_code(name.substr(3)) >= 0) {
+		condition = condition_code(name.substr(3));
+		name = "set";
+		size = 1;
+	}
+	else if (name.starts_with("cmov") && condition_code(name.substr(4)) >= 0) {
+		condition = condition_code(name.substr(4));
+		name = "cmov";
+	}
+	else if (prefetches.contains(name) && operands.size() == 1 && is_memory(operands[0])) {
+		emit_general(encoding, 4, { 0x0F, 0x18 }, prefetches.at(name), operands[0]);
+		return true;
+	}
+	else if (!is_general_mnemonic(name)) {
+		error = "Unknown instruction";
+		return false;
+	}
+
+	if (size == 0) {															// The destination register gives the size, else any register but a shift count
+		for (size_t i = operands.size(); i-- > 0;) {
+			bool shift_count = shift_operations.contains(name) && i == 0 && operands.size() == 2;
+			if (is_general(operands[i]) && !shift_count && !operands[i].indirect) {
+				size = operands[i].size;
+				break;
+			}
+		}
+		if (name == "push" || name == "pop" || name == "jmp" || name == "call")
+			size = size == 0 ? 8 : size;
+		if (name == "crc32" && operands.size() == 2 && is_general(operands[1]))
+			size = operands[0].kind == OPERAND_REGISTER ? operands[0].size : 0;
+		if (size == 0) {
+			error = "Operand size is ambiguous, it needs a suffix";
+			return false;
+		}
+	}
+
+	if (name == "set") {
+		if (operands.size() == 1 && is_general_or_memory(operands[0])) {
+			emit_general(encoding, 1, { 0x0F, (uint8_t)(0x90 + condition) }, 0, operands[0]);
+			return true;
+		}
+	}
+	else if (name == "cmov") {
+		if (operands.size() == 2 && is_general_or_memory(operands[0]) && is_general(operands[1])) {
+			emit_general(encoding, operands[1].size, { 0x0F, (uint8_t)(0x40 + condition) }, operands[1].reg, operands[0]);
+			return true;
+		}
+	}
+	else if (encode_general(name, size, operands, encoding, error))
+		return true;
+	if (error.empty())
+		error = "Unsupported operands";
+	return false;
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <cstdint>
+
+// Machine code for single x86-64 instructions in AT&T syntax. It covers what the code generator, the intrinsics,
+// the vectorizer and usual asm statements emit: the general purpose instructions, SSE2 to SSE4.2 and the AVX2
+// integer instructions. Operands are in AT&T order, the destination last.
+
+class MachineValue {															// symbol - minus + constant, the shape of every expression in the assembly
+public:
+	std::string symbol = "";
+	std::string minus = "";
+	int64_t constant = 0;
+	bool thread_pointer_offset = false;											// symbol@tpoff
+};
+
+enum OperandKind { OPERAND_REGISTER, OPERAND_IMMEDIATE, OPERAND_MEMORY };
+enum RegisterClass { REGISTER_GENERAL, REGISTER_XMM, REGISTER_YMM };
+
+class MachineOperand {
+public:
+	OperandKind kind = OPERAND_REGISTER;
+	RegisterClass register_class = REGISTER_GENERAL;
+	int reg = -1;																// 0 to 15
+	int size = 0;																// Of a register, in bytes
+	bool indirect = false;														// *operand of jmp and call
+
+	int base = -1;																// Registers of a memory operand, -1 if absent
+	int index = -1;
+	int scale = 1;
+	bool rip_relative = false;
+	uint8_t segment = 0;														// Prefix of %fs: or %gs:, 0 if none
+	MachineValue value;															// The displacement or the immediate
+};
+
+class MachineInstruction {
+public:
+	std::string mnemonic;
+	std::vector<MachineOperand> operands;
+};
+
+class Fixup {																	// A field of an encoding that depends on a symbol
+public:
+	size_t offset = 0;															// In the encoding
+	int size = 4;																// 1, 4 or 8 bytes
+	MachineValue value;
+	bool pc_relative = false;													// Holds the value minus the address after the instruction
+	bool plt = false;															// Target of a call or a jump, it may be a function of a shared library
+	bool sign_extended = true;													// 4 byte fields of instructions are, the ones of .long are not
+};
+
+class Encoding {
+public:
+	std::vector<uint8_t> bytes;
+	std::vector<Fixup> fixups;
+};
+
+bool parse_register(const std::string& name, MachineOperand& operand);			// name without the %, false if it is not a register
+int condition_code(const std::string& condition);								// The cc of jcc, setcc and cmovcc, -1 if unknown
+bool encode_instruction(const MachineInstruction& instruction, Encoding& encoding, std::string& error);	// False with a message if the form is not supported
+void encode_branch(int condition, bool is_short, const MachineValue& target, Encoding& encoding);	// jmp if condition is -1, else jcc, with a rel8 or rel32 field
+std::vector<uint8_t> nop_padding(size_t length);								// As few long nops as fill length bytes
@@ -0,0 +1,387 @@
+#include "pch.h"
+#include "generics.h"
+#include "ast_util.h"
+#include <format>
+
+using std::shared_ptr, std::make_shared, std::dynamic_pointer_cast;
+
+static std::string canonical_type(const std::string& name) {					// i64 and isize are the same type, so are u64 and usize
+	if (name == "i64")
+		return "isize";
+	if (name == "u64")
+		return "usize";
+	return name;
+}
+
+static bool is_narrow(const std::string& name, int& size, bool& is_signed) {	// Values of narrow types are kept wrapped in 64 bit slots
+	return integer_type_named(name, size, is_signed) && size < 8;
+}
+
+static shared_ptr<Expression> convert(const std::string& type_name, const shared_ptr<Expression>& value) {
+	if (value->type == CALL_EXPR && dynamic_pointer_cast<Call>(value)->name == type_name)	// Already converted
+		return value;
+	shared_ptr<Call> conversion = make_shared<Call>(type_name);
+	conversion->arguments.push_back(value);
+	return conversion;
+}
+
+void Monomorphizer::run() {
+	for (shared_ptr<Statement>& stmt : ast->statements) {
+		if (!stmt)
+			continue;
+		if (stmt->type == FUNCTION_STM) {
+			shared_ptr<Function> function = dynamic_pointer_cast<Function>(stmt);
+			if (function->type_parameters.empty())
+				functions[function->name] = function;
+			else
+				generics[function->name] = function;
+		}
+		else if (stmt->type == VARIABLE_DECL) {
+			shared_ptr<VariableDeclaration> decl = dynamic_pointer_cast<VariableDeclaration>(stmt);
+			global_types[decl->variable_name] = canonical_type(decl->type_name);
+			int size;
+			bool is_signed;
+			long long value;
+			if (decl->is_init && is_narrow(decl->type_name, size, is_signed) && evaluate_constant(decl->optional_to_assign, value))
+				decl->optional_to_assign = make_shared<Constant>(convert_integer(value, size, is_signed));	// The data section holds the wrapped value
+		}
+	}
+	for (shared_ptr<Statement>& stmt : ast->statements) {
+		if (stmt && stmt->type == FUNCTION_STM && dynamic_pointer_cast<Function>(stmt)->type_parameters.empty())
+			specialize(dynamic_pointer_cast<Function>(stmt));
+	}
+	while (!pending.empty()) {													// Instantiations may call other generic functions
+		std::pair<shared_ptr<Function>, TypeBindings> instance = pending.back();
+		pending.pop_back();
+		bindings = &instance.second;
+		specialize(instance.first);
+		bindings = nullptr;
+	}
+
+	std::vector<shared_ptr<Statement>> statements;								// Templates make way for their instantiations
+	for (shared_ptr<Statement>& stmt : ast->statements) {
+		if (stmt && stmt->type == FUNCTION_STM && !dynamic_pointer_cast<Function>(stmt)->type_parameters.empty()) {
+			std::vector<shared_ptr<Function>>& copies = instances[dynamic_pointer_cast<Function>(stmt)->name];
+			statements.insert(statements.end(), copies.begin(), copies.end());
+		}
+		else
+			statements.push_back(stmt);
+	}
+	ast->statements = statements;
+}
+
+std::string Monomorphizer::instantiate(const shared_ptr<Function>& generic, const std::vector<std::string>& type_arguments) {
+	std::string name = generic->name;											// max<i32> is named max.i32, a name no source function can have
+	TypeBindings types;
+	for (size_t i = 0; i < type_arguments.size(); i++) {
+		int size;
+		bool is_signed;
+		if (type_arguments[i] != "string" && !integer_type_named(type_arguments[i], size, is_signed))
+			make_error(type_arguments[i] + " can't be a type argument of " + generic->name + ", only integer types and string can");
+		types[generic->type_parameters[i]] = canonical_type(type_arguments[i]);
+		name += "." + canonical_type(type_arguments[i]);
+	}
+	if (functions.find(name) != functions.end())								// Identical instantiations share one copy
+		return name;
+
+	auto bind = [&](const std::string& type_name) {
+		auto found = types.find(type_name);
+		return found != types.end() ? found->second : type_name;
+	};
+	shared_ptr<Function> instance = make_shared<Function>();
+	instance->name = name;
+	for (const shared_ptr<Name>& parameter : generic->parameters)
+		instance->parameters.push_back(make_shared<Name>(parameter->name));
+	for (const std::string& type_name : generic->parameter_types)
+		instance->parameter_types.push_back(bind(type_name));
+	instance->return_type_name = bind(generic->return_type_name);
+	instance->return_type = instance->return_type_name == "string" ? TYPE_STRING : generic->return_type;
+	instance->targets = generic->targets;
+	instance->statement = clone_compound(generic->statement);
+	functions[name] = instance;
+	instances[generic->name].push_back(instance);
+	pending.push_back({ instance, types });
+	return name;
+}
+
+bool Monomorphizer::infer_type_arguments(const shared_ptr<Function>& generic, const shared_ptr<Call>& call, const TypeBindings& scope,
+	std::vector<std::string>& type_arguments) {
+	TypeBindings inferred;
+	for (size_t i = 0; i < call->arguments.size() && i < generic->parameter_types.size(); i++) {
+		const std::string& parameter_type = generic->parameter_types[i];
+		if (std::find(generic->type_parameters.begin(), generic->type_parameters.end(), parameter_type) == generic->type_parameters.end())
+			continue;
+		std::string argument_type = expression_type(call->arguments[i], scope);
+		if (argument_type.empty())												// Constants and arithmetic fit any integer type
+			continue;
+		auto found = inferred.find(parameter_type);
+		if (found == inferred.end())
+			inferred[parameter_type] = argument_type;
+		else if (found->second != argument_type) {
+			make_error(std::format("{0} is both {1} and {2} in a call to {3}, give the type arguments explicitly", parameter_type,
+				found->second, argument_type, generic->name));
+			return false;
+		}
+	}
+	for (const std::string& type_parameter : generic->type_parameters) {
+		auto found = inferred.find(type_parameter);
+		type_arguments.push_back(found != inferred.end() ? found->second : "isize");	// Unconstrained parameters default to isize
+	}
+	return true;
+}
+
+std::string Monomorphizer::expression_type(const shared_ptr<Expression>& expression, const TypeBindings& scope) {
+	switch (expression->type)
+	{
+	case STRING_EXPR:
+		return "string";
+	case NAME: {
+		auto found = scope.find(dynamic_pointer_cast<Name>(expression)->name);
+		return found != scope.end() ? found->second : "";
+	}
+	case CALL_EXPR: {
+		shared_ptr<Call> call = dynamic_pointer_cast<Call>(expression);
+		int size;
+		bool is_signed;
+		if (conversion_type(call, size, is_signed))
+			return canonical_type(call->name);
+		auto found = functions.find(call->name);
+		if (found == functions.end())
+			return "";
+		const std::string& type_name = found->second->return_type_name;
+		return type_name == "string" || integer_type_named(type_name, size, is_signed) ? canonical_type(type_name) : "";
+	}
+	default:
+		break;
+	}
+	return "";
+}
+
+std::string Monomorphizer::substitute(const std::string& type_name) {
+	if (!bindings)
+		return type_name;
+	auto found = bindings->find(type_name);
+	return found != bindings->end() ? found->second : type_name;
+}
+
+void Monomorphizer::specialize(const shared_ptr<Function>& function) {
+	if (function->is_extern || !function->statement)
+		return;
+	TypeBindings scope = global_types;
+	return_type = function->return_type_name;
+	std::vector<shared_ptr<Statement>> prologue;
+	for (size_t i = 0; i < function->parameters.size(); i++) {
+		const std::string& name = function->parameters[i]->name;
+		std::string type_name = i < function->parameter_types.size() ? function->parameter_types[i] : "";
+		scope[name] = canonical_type(type_name);
+		int size;
+		bool is_signed;
+		if (is_narrow(type_name, size, is_signed)) {							// Callers pass all 64 bits, p = i8(p) drops the rest
+			shared_ptr<VariableAssignment> assignment = make_shared<VariableAssignment>();
+			assignment->variable_name = name;
+			assignment->to_assign = convert(type_name, make_shared<Name>(name));
+			shared_ptr<ExpressionStatement> stmt = make_shared<ExpressionStatement>();
+			stmt->expression = assignment;
+			prologue.push_back(stmt);
+		}
+	}
+	shared_ptr<Statement> body = function->statement;
+	process_statement(body, scope);
+	function->statement->statements.insert(function->statement->statements.begin(), prologue.begin(), prologue.end());
+}
+
+void Monomorphizer::process_statement(shared_ptr<Statement>& statement, TypeBindings& scope) {
+	if (!statement)
+		return;
+	int size;
+	bool is_signed;
+	switch (statement->type)
+	{
+	case COMPOUND_STM: {
+		TypeBindings inner = scope;
+		for (shared_ptr<Statement>& stmt : dynamic_pointer_cast<Compound>(statement)->statements)
+			process_statement(stmt, inner);
+		break;
+	}
+	case VARIABLE_DECL: {
+		shared_ptr<VariableDeclaration> decl = dynamic_pointer_cast<VariableDeclaration>(statement);
+		decl->type_name = substitute(decl->type_name);
+		if (decl->type_name == "string")
+			decl->holds_type = TYPE_STRING;
+		process_expression(decl->optional_to_assign, scope);
+		if (decl->is_init && decl->optional_to_assign && is_narrow(decl->type_name, size, is_signed))
+			decl->optional_to_assign = convert(decl->type_name, decl->optional_to_assign);
+		scope[decl->variable_name] = decl->array_length > 0 || decl->struct_type ? "" : canonical_type(decl->type_name);	// Shadows outer ones
+		break;
+	}
+	case EXPR_STM:
+		process_expression(dynamic_pointer_cast<ExpressionStatement>(statement)->expression, scope);
+		break;
+	case RETURN_STM: {
+		shared_ptr<Return> return_stm = dynamic_pointer_cast<Return>(statement);
+		if (!return_stm->expression)
+			break;
+		process_expression(return_stm->expression, scope);
+		if (is_narrow(return_type, size, is_signed))
+			return_stm->expression = convert(return_type, return_stm->expression);
+		break;
+	}
+	case IF_STATEMENT: {
+		shared_ptr<IfStatement> if_stmt = dynamic_pointer_cast<IfStatement>(statement);
+		process_expression(if_stmt->condition, scope);
+		TypeBindings body_scope = scope;
+		process_statement(if_stmt->body, body_scope);
+		TypeBindings else_scope = scope;
+		process_statement(if_stmt->else_body, else_scope);
+		break;
+	}
+	case WHILE_STM:
+	case DO_WHILE_STM: {
+		shared_ptr<WhileStatement> while_stmt = dynamic_pointer_cast<WhileStatement>(statement);
+		process_expression(while_stmt->condition, scope);
+		TypeBindings body_scope = scope;
+		process_statement(while_stmt->body, body_scope);
+		break;
+	}
+	case FOR_STM: {
+		shared_ptr<ForStatement> for_stmt = dynamic_pointer_cast<ForStatement>(statement);
+		TypeBindings loop_scope = scope;										// The initializer belongs to the loop
+		process_statement(for_stmt->initializer, loop_scope);
+		process_expression(for_stmt->condition, loop_scope);
+		process_expression(for_stmt->post, loop_scope);
+		process_statement(for_stmt->body, loop_scope);
+		break;
+	}
+	case MATCH_STM: {
+		shared_ptr<MatchStatement> match_stmt = dynamic_pointer_cast<MatchStatement>(statement);
+		process_expression(match_stmt->expression, scope);
+		for (MatchArm& arm : match_stmt->arms) {
+			TypeBindings arm_scope = scope;
+			process_statement(arm.body, arm_scope);
+		}
+		TypeBindings default_scope = scope;
+		process_statement(match_stmt->default_body, default_scope);
+		break;
+	}
+	case ASM_STM: {
+		shared_ptr<AsmStatement> asm_stmt = dynamic_pointer_cast<AsmStatement>(statement);
+		for (AsmOperand& operand : asm_stmt->outputs)
+			process_expression(operand.expression, scope);
+		for (AsmOperand& operand : asm_stmt->inputs)
+			process_expression(operand.expression, scope);
+		shared_ptr<Compound> block = make_shared<Compound>();
+		for (AsmOperand& operand : asm_stmt->outputs) {							// The template may leave any upper bits, x = i8(x) drops them
+			auto found = operand.expression && operand.expression->type == NAME ? scope.find(dynamic_pointer_cast<Name>(operand.expression)->name)
+				: scope.end();
+			if (found == scope.end() || !is_narrow(found->second, size, is_signed))
+				continue;
+			shared_ptr<VariableAssignment> assignment = make_shared<VariableAssignment>();
+			assignment->variable_name = found->first;
+			assignment->to_assign = convert(found->second, make_shared<Name>(found->first));
+			shared_ptr<ExpressionStatement> stmt = make_shared<ExpressionStatement>();
+			stmt->expression = assignment;
+			block->statements.push_back(stmt);
+		}
+		if (!block->statements.empty()) {
+			block->statements.insert(block->statements.begin(), statement);
+			statement = block;
+		}
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+void Monomorphizer::process_expression(shared_ptr<Expression>& expression, TypeBindings& scope) {
+	if (!expression)
+		return;
+	switch (expression->type)
+	{
+	case UNARY_EXPR:
+		process_expression(dynamic_pointer_cast<UnaryExpression>(expression)->expression, scope);
+		break;
+	case BINARY_EXPR: {
+		shared_ptr<BinaryExpression> binary = dynamic_pointer_cast<BinaryExpression>(expression);
+		process_expression(binary->expression_a, scope);
+		process_expression(binary->expression_b, scope);
+		break;
+	}
+	case INDEX_EXPR:
+		process_expression(dynamic_pointer_cast<IndexExpression>(expression)->index, scope);
+		break;
+	case FIELD_EXPR:
+		process_expression(dynamic_pointer_cast<FieldExpression>(expression)->object, scope);
+		break;
+	case VARIABLE_ASSIGN: {
+		shared_ptr<VariableAssignment> assignment = dynamic_pointer_cast<VariableAssignment>(expression);
+		process_expression(assignment->index, scope);
+		process_expression(assignment->to_assign, scope);
+		auto found = scope.find(assignment->variable_name);
+		int size;
+		bool is_signed;
+		if (assignment->index || !assignment->field.empty() || found == scope.end() || !is_narrow(found->second, size, is_signed))
+			break;																// Fields are stored with their own width
+		if (assignment->is_compound) {											// x += e becomes x = i8(x + e)
+			TokenType operator_type = TOKEN_PLUS;
+			shared_ptr<Expression> operand = assignment->to_assign;
+			switch (assignment->compound_type)
+			{
+			case ADDITION:			operator_type = TOKEN_PLUS; break;
+			case SUBTRACTION:		operator_type = TOKEN_MINUS; break;
+			case MULTIPLICATION:	operator_type = TOKEN_STAR; break;
+			case DIVISION:			operator_type = TOKEN_SLASH; break;
+			case MOD:				operator_type = TOKEN_PERCENT; break;
+			case INCREMENT:			operator_type = TOKEN_PLUS; operand = make_shared<Constant>(1); break;
+			case DECREMENT:			operator_type = TOKEN_MINUS; operand = make_shared<Constant>(1); break;
+			}
+			assignment->to_assign = make_shared<BinaryExpression>(make_shared<Name>(assignment->variable_name), operator_type, operand);
+			assignment->is_compound = false;
+		}
+		assignment->to_assign = convert(found->second, assignment->to_assign);
+		break;
+	}
+	case CALL_EXPR: {
+		shared_ptr<Call> call = dynamic_pointer_cast<Call>(expression);
+		for (shared_ptr<Expression>& argument : call->arguments)
+			process_expression(argument, scope);
+		call->name = substitute(call->name);									// T(x) converts to the type argument
+		if (call->name == "string" && call->arguments.size() == 1) {			// Strings are addresses already
+			expression = call->arguments[0];
+			break;
+		}
+		resolve_call(call, scope);
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+void Monomorphizer::resolve_call(const shared_ptr<Call>& call, TypeBindings& scope) {
+	for (std::string& type_argument : call->type_arguments)
+		type_argument = canonical_type(substitute(type_argument));
+	auto generic = generics.find(call->name);
+	if (generic == generics.end()) {
+		if (!call->type_arguments.empty())
+			make_error(call->name + " is not a generic function");
+		return;
+	}
+	std::vector<std::string> type_arguments = call->type_arguments;
+	if (type_arguments.empty()) {
+		if (!infer_type_arguments(generic->second, call, scope, type_arguments))
+			return;
+	}
+	else if (type_arguments.size() != generic->second->type_parameters.size()) {
+		make_error(std::format("{0} expects {1} type arguments, got {2}", call->name, generic->second->type_parameters.size(),
+			type_arguments.size()));
+		return;
+	}
+	call->name = instantiate(generic->second, type_arguments);
+	call->type_arguments.clear();
+}
+
+void Monomorphizer::make_error(const std::string& message) {
+	Token default_tok = Token();
+	error_handler->report_error(message, default_tok);
+}
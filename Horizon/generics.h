@@ -0,0 +1,44 @@
+#pragma once
+#include <memory>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "parser.h"
+#include "error.h"
+
+// Generic functions are templates. Every call of one is bound to a copy specialized for its type arguments, so the
+// later passes only ever see concrete functions and can inline and fold them like any other.
+
+class Monomorphizer {
+public:
+	Monomorphizer(const std::shared_ptr<AST>& ast, ErrorHandler* error_handler) : ast(ast), error_handler(error_handler) {}
+
+	const std::shared_ptr<AST>& ast;
+	void run();																	// Instantiates generic functions and wraps values of narrow integer types
+private:
+	ErrorHandler* error_handler;
+
+	using TypeBindings = std::unordered_map<std::string, std::string>;			// Type parameter or variable name to type name
+
+	std::unordered_map<std::string, std::shared_ptr<Function>> generics;		// Templates by name
+	std::unordered_map<std::string, std::shared_ptr<Function>> functions;		// Concrete functions, instantiations included
+	std::unordered_map<std::string, std::vector<std::shared_ptr<Function>>> instances;	// Instantiations of each template, in order
+	std::vector<std::pair<std::shared_ptr<Function>, TypeBindings>> pending;	// Instantiations whose bodies are still to be processed
+	TypeBindings global_types;
+
+	const TypeBindings* bindings = nullptr;										// Of the instantiation being processed
+	std::string return_type;													// Of the function being processed
+
+	std::string instantiate(const std::shared_ptr<Function>& generic, const std::vector<std::string>& type_arguments);	// Returns the name of the copy
+	bool infer_type_arguments(const std::shared_ptr<Function>& generic, const std::shared_ptr<Call>& call, const TypeBindings& scope,
+		std::vector<std::string>& type_arguments);
+	std::string expression_type(const std::shared_ptr<Expression>& expression, const TypeBindings& scope);	// Empty if not known
+	std::string substitute(const std::string& type_name);
+
+	void specialize(const std::shared_ptr<Function>& function);
+	void process_statement(std::shared_ptr<Statement>& statement, TypeBindings& scope);
+	void process_expression(std::shared_ptr<Expression>& expression, TypeBindings& scope);
+	void resolve_call(const std::shared_ptr<Call>& call, TypeBindings& scope);
+
+	void make_error(const std::string& message);
+};
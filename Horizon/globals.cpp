@@ -0,0 +1,238 @@
+#include "pch.h"
+#include "globals.h"
+#include "ast_util.h"
+#include "layout.h"
+#include <unordered_set>
+
+using std::shared_ptr, std::make_shared, std::dynamic_pointer_cast;
+
+static const int cache_line_size = 64;
+
+void GlobalOptimizer::run() {
+	bool has_main = false;
+	bool has_extern = false;
+	for (shared_ptr<Statement>& stmt : ast->statements) {
+		if (!stmt)
+			continue;
+		if (stmt->type == VARIABLE_DECL) {
+			shared_ptr<VariableDeclaration> decl = dynamic_pointer_cast<VariableDeclaration>(stmt);
+			decl->is_global = true;
+			globals[decl->variable_name] = decl;
+		}
+		else if (stmt->type == FUNCTION_STM && dynamic_pointer_cast<Function>(stmt)->name == "main")
+			has_main = !options.incremental;									// Later inputs of a REPL are part of the program too
+		else if (stmt->type == FUNCTION_STM && dynamic_pointer_cast<Function>(stmt)->is_extern)
+			has_extern = true;													// C code may write any global through its symbol
+	}
+	for (shared_ptr<Statement>& stmt : ast->statements) {
+		if (!stmt || stmt->type != VARIABLE_DECL)
+			continue;
+		shared_ptr<VariableDeclaration> decl = dynamic_pointer_cast<VariableDeclaration>(stmt);
+		if (decl->array_length > 0 || decl->vector_type.lanes > 0 || decl->struct_type)	// Code generation reports vectors declared globally
+			continue;
+		long long number = 0;
+		shared_ptr<Expression> value;
+		if (decl->is_init && decl->optional_to_assign && decl->optional_to_assign->type == STRING_EXPR)
+			value = decl->optional_to_assign;										// Reads become the address of the pooled string, and len can see it
+		else if (!decl->is_init || evaluate_constant(decl->optional_to_assign, number))
+			value = make_shared<Constant>(number);
+		else
+			continue;																// Code generation reports the non constant initializer
+		if (decl->is_const)
+			propagate(decl->variable_name, value);
+		else if (options.propagate_globals && has_main && !has_extern && !is_written(decl->variable_name))
+			propagate(decl->variable_name, value);								// Otherwise the global may be written by code this unit doesn't see
+	}
+	if (options.reorder_globals)
+		lay_out();
+}
+
+bool GlobalOptimizer::is_written(const std::string& name) {
+	for (shared_ptr<Statement>& stmt : ast->statements) {
+		if (stmt && stmt->type == FUNCTION_STM && writes_name(dynamic_pointer_cast<Function>(stmt)->statement, name))
+			return true;
+	}
+	return false;
+}
+
+void GlobalOptimizer::propagate(const std::string& name, const shared_ptr<Expression>& value) {
+	for (shared_ptr<Statement>& stmt : ast->statements) {
+		if (!stmt || stmt->type != FUNCTION_STM)
+			continue;
+		shared_ptr<Function> function = dynamic_pointer_cast<Function>(stmt);
+		if (!function->statement || writes_name(function->statement, name) || std::any_of(function->parameters.begin(),
+			function->parameters.end(), [&](const shared_ptr<Name>& parameter) { return parameter->name == name; }))
+			continue;																// A parameter or local hides the global, code generation reports writes to constants
+		shared_ptr<Statement> body = function->statement;
+		replace_name(body, name, value);
+	}
+}
+
+// Globals used by the same function are placed next to each other, hottest functions first. A group that fits
+// in a cache line but would straddle one starts a new line, so that groups used by different functions, and
+// possibly different threads, don't share lines.
+void GlobalOptimizer::lay_out() {
+	std::vector<std::vector<std::string>> groups;
+	for (shared_ptr<Statement>& stmt : ast->statements) {
+		if (!stmt || stmt->type != FUNCTION_STM || !dynamic_pointer_cast<Function>(stmt)->statement)
+			continue;
+		std::vector<std::string> used;
+		measure_heat(dynamic_pointer_cast<Function>(stmt)->statement, 0, used);
+		groups.push_back(used);
+	}
+	std::vector<std::string> unused;
+	for (shared_ptr<Statement>& stmt : ast->statements) {
+		if (stmt && stmt->type == VARIABLE_DECL)
+			unused.push_back(dynamic_pointer_cast<VariableDeclaration>(stmt)->variable_name);
+	}
+	for (std::vector<std::string>& group : groups) {
+		std::stable_sort(group.begin(), group.end(), [&](const std::string& a, const std::string& b) { return heat[a] > heat[b]; });
+	}
+	std::stable_sort(groups.begin(), groups.end(), [&](const std::vector<std::string>& a, const std::vector<std::string>& b) {
+		return (a.empty() ? 0 : heat[a[0]]) > (b.empty() ? 0 : heat[b[0]]);
+	});
+	groups.push_back(unused);
+
+	std::unordered_set<std::string> placed;
+	int rank = 0;
+	int section_offset[2] = { 0, 0 };											// Bytes laid out so far in .bss and .data
+	for (std::vector<std::string>& group : groups) {
+		std::vector<shared_ptr<VariableDeclaration>> members;
+		for (const std::string& name : group) {
+			if (!globals[name]->is_const && placed.insert(name).second)
+				members.push_back(globals[name]);
+		}
+		for (int section = 0; section < 2; section++) {
+			int size = 0;
+			for (shared_ptr<VariableDeclaration>& member : members)
+				size += member->is_init == (section == 1) ? variable_size(*member) : 0;
+			int used_in_line = section_offset[section] % cache_line_size;
+			if (size == 0 || size > cache_line_size || used_in_line == 0 || used_in_line + size <= cache_line_size)
+				continue;
+			for (shared_ptr<VariableDeclaration>& member : members) {
+				if (member->is_init == (section == 1)) {
+					member->starts_cache_line = true;
+					break;
+				}
+			}
+			section_offset[section] += cache_line_size - used_in_line;
+		}
+		for (shared_ptr<VariableDeclaration>& member : members) {
+			member->layout_rank = rank++;
+			int& offset = section_offset[member->is_init ? 1 : 0];
+			int alignment = variable_alignment(*member);							// Structs may be aligned to more than 8
+			offset = (offset + alignment - 1) / alignment * alignment + variable_size(*member);
+		}
+	}
+}
+
+void GlobalOptimizer::use(const std::string& name, int loop_depth, std::vector<std::string>& used) {
+	if (globals.find(name) == globals.end())
+		return;
+	heat[name] += 1LL << (3 * std::min(loop_depth, 6));							// Every loop level counts as eight iterations
+	if (std::find(used.begin(), used.end(), name) == used.end())
+		used.push_back(name);
+}
+
+void GlobalOptimizer::measure_heat(const shared_ptr<Statement>& statement, int loop_depth, std::vector<std::string>& used) {
+	if (!statement)
+		return;
+	switch (statement->type)
+	{
+	case RETURN_STM:
+		measure_heat(dynamic_pointer_cast<Return>(statement)->expression, loop_depth, used);
+		break;
+	case COMPOUND_STM:
+		for (shared_ptr<Statement>& stmt : dynamic_pointer_cast<Compound>(statement)->statements)
+			measure_heat(stmt, loop_depth, used);
+		break;
+	case EXPR_STM:
+		measure_heat(dynamic_pointer_cast<ExpressionStatement>(statement)->expression, loop_depth, used);
+		break;
+	case VARIABLE_DECL:
+		measure_heat(dynamic_pointer_cast<VariableDeclaration>(statement)->optional_to_assign, loop_depth, used);
+		break;
+	case IF_STATEMENT: {
+		shared_ptr<IfStatement> if_stmt = dynamic_pointer_cast<IfStatement>(statement);
+		measure_heat(if_stmt->condition, loop_depth, used);
+		measure_heat(if_stmt->body, loop_depth, used);
+		measure_heat(if_stmt->else_body, loop_depth, used);
+		break;
+	}
+	case WHILE_STM:
+	case DO_WHILE_STM: {
+		shared_ptr<WhileStatement> while_stmt = dynamic_pointer_cast<WhileStatement>(statement);
+		measure_heat(while_stmt->condition, loop_depth + 1, used);
+		measure_heat(while_stmt->body, loop_depth + 1, used);
+		break;
+	}
+	case FOR_STM: {
+		shared_ptr<ForStatement> for_stmt = dynamic_pointer_cast<ForStatement>(statement);
+		measure_heat(for_stmt->initializer, loop_depth, used);
+		measure_heat(for_stmt->condition, loop_depth + 1, used);
+		measure_heat(for_stmt->post, loop_depth + 1, used);
+		measure_heat(for_stmt->body, loop_depth + 1, used);
+		break;
+	}
+	case MATCH_STM: {
+		shared_ptr<MatchStatement> match_stmt = dynamic_pointer_cast<MatchStatement>(statement);
+		measure_heat(match_stmt->expression, loop_depth, used);
+		for (MatchArm& arm : match_stmt->arms)
+			measure_heat(arm.body, loop_depth, used);
+		measure_heat(match_stmt->default_body, loop_depth, used);
+		break;
+	}
+	case ASM_STM: {
+		shared_ptr<AsmStatement> asm_stmt = dynamic_pointer_cast<AsmStatement>(statement);
+		for (AsmOperand& operand : asm_stmt->outputs)
+			measure_heat(operand.expression, loop_depth, used);
+		for (AsmOperand& operand : asm_stmt->inputs)
+			measure_heat(operand.expression, loop_depth, used);
+		for (const std::string& symbol : assembly_symbols(asm_stmt->assembly))
+			use(symbol, loop_depth, used);
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+void GlobalOptimizer::measure_heat(const shared_ptr<Expression>& expression, int loop_depth, std::vector<std::string>& used) {
+	if (!expression)
+		return;
+	switch (expression->type)
+	{
+	case NAME:
+		use(dynamic_pointer_cast<Name>(expression)->name, loop_depth, used);
+		break;
+	case UNARY_EXPR:
+		measure_heat(dynamic_pointer_cast<UnaryExpression>(expression)->expression, loop_depth, used);
+		break;
+	case BINARY_EXPR: {
+		shared_ptr<BinaryExpression> binary = dynamic_pointer_cast<BinaryExpression>(expression);
+		measure_heat(binary->expression_a, loop_depth, used);
+		measure_heat(binary->expression_b, loop_depth, used);
+		break;
+	}
+	case VARIABLE_ASSIGN: {
+		shared_ptr<VariableAssignment> assignment = dynamic_pointer_cast<VariableAssignment>(expression);
+		use(assignment->variable_name, loop_depth, used);
+		measure_heat(assignment->index, loop_depth, used);
+		measure_heat(assignment->to_assign, loop_depth, used);
+		break;
+	}
+	case INDEX_EXPR:
+		use(dynamic_pointer_cast<IndexExpression>(expression)->array_name, loop_depth, used);
+		measure_heat(dynamic_pointer_cast<IndexExpression>(expression)->index, loop_depth, used);
+		break;
+	case FIELD_EXPR:
+		measure_heat(dynamic_pointer_cast<FieldExpression>(expression)->object, loop_depth, used);
+		break;
+	case CALL_EXPR:
+		for (shared_ptr<Expression>& argument : dynamic_pointer_cast<Call>(expression)->arguments)
+			measure_heat(argument, loop_depth, used);
+		break;
+	default:
+		break;
+	}
+}
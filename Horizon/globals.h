@@ -0,0 +1,27 @@
+#pragma once
+#include <memory>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "parser.h"
+#include "options.h"
+
+class GlobalOptimizer {
+public:
+	GlobalOptimizer(const std::shared_ptr<AST>& ast, const CompilerOptions& options) : ast(ast), options(options) {}
+
+	const std::shared_ptr<AST>& ast;
+	void run();																	// Propagates read only globals and lays out the rest
+private:
+	const CompilerOptions& options;
+
+	std::unordered_map<std::string, std::shared_ptr<VariableDeclaration>> globals;
+	std::unordered_map<std::string, long long> heat;							// Estimated accesses of each global, uses inside loops weigh more
+
+	bool is_written(const std::string& name);									// True if any function assigns the global or declares a local with its name
+	void propagate(const std::string& name, const std::shared_ptr<Expression>& value);	// Replaces every read of the global with its value
+	void lay_out();
+	void measure_heat(const std::shared_ptr<Statement>& statement, int loop_depth, std::vector<std::string>& used);
+	void measure_heat(const std::shared_ptr<Expression>& expression, int loop_depth, std::vector<std::string>& used);
+	void use(const std::string& name, int loop_depth, std::vector<std::string>& used);
+};
@@ -0,0 +1,667 @@
+#include "pch.h"
+#include "inliner.h"
+#include "ast_util.h"
+#include <format>
+
+using std::shared_ptr, std::make_shared, std::dynamic_pointer_cast;
+
+static bool contains_expression(const shared_ptr<Expression>& expression, const shared_ptr<Expression>& target) {
+	if (!expression)
+		return false;
+	if (expression == target)
+		return true;
+	switch (expression->type)
+	{
+	case UNARY_EXPR:
+		return contains_expression(dynamic_pointer_cast<UnaryExpression>(expression)->expression, target);
+	case BINARY_EXPR: {
+		shared_ptr<BinaryExpression> binary = dynamic_pointer_cast<BinaryExpression>(expression);
+		return contains_expression(binary->expression_a, target) || contains_expression(binary->expression_b, target);
+	}
+	case VARIABLE_ASSIGN: {
+		shared_ptr<VariableAssignment> assignment = dynamic_pointer_cast<VariableAssignment>(expression);
+		return contains_expression(assignment->index, target) || contains_expression(assignment->to_assign, target);
+	}
+	case INDEX_EXPR:
+		return contains_expression(dynamic_pointer_cast<IndexExpression>(expression)->index, target);
+	case FIELD_EXPR:
+		return contains_expression(dynamic_pointer_cast<FieldExpression>(expression)->object, target);
+	case CALL_EXPR:
+		for (shared_ptr<Expression>& argument : dynamic_pointer_cast<Call>(expression)->arguments) {
+			if (contains_expression(argument, target))
+				return true;
+		}
+		return false;
+	default:
+		break;
+	}
+	return false;
+}
+
+static bool contains_assignment(const shared_ptr<Expression>& expression) {
+	if (!expression)
+		return false;
+	switch (expression->type)
+	{
+	case VARIABLE_ASSIGN:
+		return true;
+	case UNARY_EXPR:
+		return contains_assignment(dynamic_pointer_cast<UnaryExpression>(expression)->expression);
+	case BINARY_EXPR: {
+		shared_ptr<BinaryExpression> binary = dynamic_pointer_cast<BinaryExpression>(expression);
+		return contains_assignment(binary->expression_a) || contains_assignment(binary->expression_b);
+	}
+	case INDEX_EXPR:
+		return contains_assignment(dynamic_pointer_cast<IndexExpression>(expression)->index);
+	case FIELD_EXPR:
+		return contains_assignment(dynamic_pointer_cast<FieldExpression>(expression)->object);
+	case CALL_EXPR:
+		for (shared_ptr<Expression>& argument : dynamic_pointer_cast<Call>(expression)->arguments) {
+			if (contains_assignment(argument))
+				return true;
+		}
+		return false;
+	default:
+		break;
+	}
+	return false;
+}
+
+void Inliner::run() {
+	if (!options.inline_functions)
+		return;
+	build_call_graph();
+	for (shared_ptr<Statement>& stmt : ast->statements) {						// Callees are processed before their callers (post order of the call graph)
+		if (stmt->type == FUNCTION_STM)
+			process(dynamic_pointer_cast<Function>(stmt)->name);
+	}
+}
+
+void Inliner::build_call_graph() {
+	for (shared_ptr<Statement>& stmt : ast->statements) {
+		if (stmt->type == FUNCTION_STM) {
+			shared_ptr<Function> function = dynamic_pointer_cast<Function>(stmt);
+			functions[function->name] = function;
+			callees[function->name];
+		}
+		else if (stmt->type == VARIABLE_DECL)
+			globals.insert(dynamic_pointer_cast<VariableDeclaration>(stmt)->variable_name);
+	}
+	for (auto& [name, function] : functions)
+		collect_calls(function->statement, name);
+}
+
+void Inliner::collect_calls(const shared_ptr<Statement>& statement, const std::string& caller) {
+	if (!statement)
+		return;
+	switch (statement->type)
+	{
+	case RETURN_STM:
+		collect_calls(dynamic_pointer_cast<Return>(statement)->expression, caller);
+		break;
+	case COMPOUND_STM:
+		for (shared_ptr<Statement>& stmt : dynamic_pointer_cast<Compound>(statement)->statements)
+			collect_calls(stmt, caller);
+		break;
+	case EXPR_STM:
+		collect_calls(dynamic_pointer_cast<ExpressionStatement>(statement)->expression, caller);
+		break;
+	case VARIABLE_DECL:
+		collect_calls(dynamic_pointer_cast<VariableDeclaration>(statement)->optional_to_assign, caller);
+		break;
+	case IF_STATEMENT: {
+		shared_ptr<IfStatement> if_stmt = dynamic_pointer_cast<IfStatement>(statement);
+		collect_calls(if_stmt->condition, caller);
+		collect_calls(if_stmt->body, caller);
+		collect_calls(if_stmt->else_body, caller);
+		break;
+	}
+	case WHILE_STM:
+	case DO_WHILE_STM: {
+		shared_ptr<WhileStatement> while_stmt = dynamic_pointer_cast<WhileStatement>(statement);
+		collect_calls(while_stmt->condition, caller);
+		collect_calls(while_stmt->body, caller);
+		break;
+	}
+	case FOR_STM: {
+		shared_ptr<ForStatement> for_stmt = dynamic_pointer_cast<ForStatement>(statement);
+		collect_calls(for_stmt->initializer, caller);
+		collect_calls(for_stmt->condition, caller);
+		collect_calls(for_stmt->post, caller);
+		collect_calls(for_stmt->body, caller);
+		break;
+	}
+	case MATCH_STM: {
+		shared_ptr<MatchStatement> match_stmt = dynamic_pointer_cast<MatchStatement>(statement);
+		collect_calls(match_stmt->expression, caller);
+		for (MatchArm& arm : match_stmt->arms)
+			collect_calls(arm.body, caller);
+		collect_calls(match_stmt->default_body, caller);
+		break;
+	}
+	case ASM_STM: {
+		shared_ptr<AsmStatement> asm_stmt = dynamic_pointer_cast<AsmStatement>(statement);
+		for (AsmOperand& operand : asm_stmt->outputs)
+			collect_calls(operand.expression, caller);
+		for (AsmOperand& operand : asm_stmt->inputs)
+			collect_calls(operand.expression, caller);
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+void Inliner::collect_calls(const shared_ptr<Expression>& expression, const std::string& caller) {
+	if (!expression)
+		return;
+	switch (expression->type)
+	{
+	case UNARY_EXPR:
+		collect_calls(dynamic_pointer_cast<UnaryExpression>(expression)->expression, caller);
+		break;
+	case BINARY_EXPR: {
+		shared_ptr<BinaryExpression> binary = dynamic_pointer_cast<BinaryExpression>(expression);
+		collect_calls(binary->expression_a, caller);
+		collect_calls(binary->expression_b, caller);
+		break;
+	}
+	case VARIABLE_ASSIGN:
+		collect_calls(dynamic_pointer_cast<VariableAssignment>(expression)->index, caller);
+		collect_calls(dynamic_pointer_cast<VariableAssignment>(expression)->to_assign, caller);
+		break;
+	case INDEX_EXPR:
+		collect_calls(dynamic_pointer_cast<IndexExpression>(expression)->index, caller);
+		break;
+	case FIELD_EXPR:
+		collect_calls(dynamic_pointer_cast<FieldExpression>(expression)->object, caller);
+		break;
+	case CALL_EXPR: {
+		shared_ptr<Call> call = dynamic_pointer_cast<Call>(expression);
+		callees[caller].push_back(call->name);
+		call_sites[call->name]++;
+		for (shared_ptr<Expression>& argument : call->arguments)
+			collect_calls(argument, caller);
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+bool Inliner::is_recursive(const std::string& name) {							// Checks if a function can reach itself through the call graph
+	std::vector<std::string> to_visit = callees[name];
+	std::unordered_set<std::string> visited;
+	while (!to_visit.empty()) {
+		std::string current = to_visit.back();
+		to_visit.pop_back();
+		if (current == name)
+			return true;
+		if (!visited.insert(current).second)
+			continue;
+		for (std::string& callee : callees[current])
+			to_visit.push_back(callee);
+	}
+	return false;
+}
+
+bool Inliner::should_inline(const shared_ptr<Call>& call, const std::string& caller) {
+	auto found = functions.find(call->name);
+	if (found == functions.end() || call->name == caller || call->name == "main")
+		return false;
+	shared_ptr<Function> callee = found->second;
+	if (!callee->statement || callee->parameters.size() != call->arguments.size() || is_recursive(call->name)
+		|| !callee->targets.empty())													// A copy would be stuck with the baseline variant
+		return false;
+
+	int size = statement_size(callee->statement);
+	long long count;
+	if (profile && profile->call_count(call->site, count)) {
+		if (count == 0)															// Never ran, a copy would only grow the code
+			return false;
+		if (profile->is_hot_call(count, options.profile_hot_percent) && size <= options.inline_hot_threshold)
+			return true;
+	}
+	if (!contains_call(callee->statement) && size <= options.inline_threshold)	// Small leaf functions
+		return true;
+	return call_sites[call->name] == 1 && size <= options.inline_single_site_threshold;	// Functions with a single call site
+}
+
+void Inliner::process(const std::string& name) {
+	if (!processed.insert(name).second)
+		return;
+	for (std::string& callee : callees[name]) {
+		if (functions.find(callee) != functions.end())
+			process(callee);
+	}
+
+	shared_ptr<Function> function = functions[name];
+	caller_locals.clear();
+	for (shared_ptr<Name>& param : function->parameters)
+		caller_locals.insert(param->name);
+	collect_locals(function->statement);
+
+	shared_ptr<Statement> body = function->statement;
+	inline_statement(body, name);
+}
+
+void Inliner::collect_locals(const shared_ptr<Statement>& statement) {
+	if (!statement)
+		return;
+	switch (statement->type)
+	{
+	case COMPOUND_STM:
+		for (shared_ptr<Statement>& stmt : dynamic_pointer_cast<Compound>(statement)->statements)
+			collect_locals(stmt);
+		break;
+	case VARIABLE_DECL:
+		caller_locals.insert(dynamic_pointer_cast<VariableDeclaration>(statement)->variable_name);
+		break;
+	case IF_STATEMENT: {
+		shared_ptr<IfStatement> if_stmt = dynamic_pointer_cast<IfStatement>(statement);
+		collect_locals(if_stmt->body);
+		collect_locals(if_stmt->else_body);
+		break;
+	}
+	case WHILE_STM:
+	case DO_WHILE_STM:
+		collect_locals(dynamic_pointer_cast<WhileStatement>(statement)->body);
+		break;
+	case FOR_STM: {
+		shared_ptr<ForStatement> for_stmt = dynamic_pointer_cast<ForStatement>(statement);
+		collect_locals(for_stmt->initializer);
+		collect_locals(for_stmt->body);
+		break;
+	}
+	case MATCH_STM: {
+		shared_ptr<MatchStatement> match_stmt = dynamic_pointer_cast<MatchStatement>(statement);
+		for (MatchArm& arm : match_stmt->arms)
+			collect_locals(arm.body);
+		collect_locals(match_stmt->default_body);
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+void Inliner::inline_statement(shared_ptr<Statement>& statement, const std::string& caller) {
+	if (!statement)
+		return;
+	switch (statement->type)													// Expressions directly under a statement are evaluated with nothing pushed on the stack,
+	{																			// so they can hold a full inlined body
+	case RETURN_STM:
+		inline_top(dynamic_pointer_cast<Return>(statement)->expression, caller);
+		break;
+	case COMPOUND_STM: {
+		std::vector<shared_ptr<Statement>>& statements = dynamic_pointer_cast<Compound>(statement)->statements;
+		for (size_t i = 0; i < statements.size(); i++) {
+			shared_ptr<Statement> temporary = hoist_call(statements[i], caller);	// Declared right before, the statement is seen again after it
+			if (temporary)
+				statements.insert(statements.begin() + i, temporary);
+			inline_statement(statements[i], caller);
+		}
+		break;
+	}
+	case EXPR_STM:
+		inline_top(dynamic_pointer_cast<ExpressionStatement>(statement)->expression, caller);
+		break;
+	case VARIABLE_DECL:
+		inline_top(dynamic_pointer_cast<VariableDeclaration>(statement)->optional_to_assign, caller);
+		break;
+	case IF_STATEMENT: {
+		shared_ptr<IfStatement> if_stmt = dynamic_pointer_cast<IfStatement>(statement);
+		inline_top(if_stmt->condition, caller);
+		inline_statement(if_stmt->body, caller);
+		inline_statement(if_stmt->else_body, caller);
+		break;
+	}
+	case WHILE_STM:
+	case DO_WHILE_STM: {
+		shared_ptr<WhileStatement> while_stmt = dynamic_pointer_cast<WhileStatement>(statement);
+		inline_top(while_stmt->condition, caller);
+		inline_statement(while_stmt->body, caller);
+		break;
+	}
+	case FOR_STM: {
+		shared_ptr<ForStatement> for_stmt = dynamic_pointer_cast<ForStatement>(statement);
+		inline_statement(for_stmt->initializer, caller);
+		inline_top(for_stmt->condition, caller);
+		inline_top(for_stmt->post, caller);
+		inline_statement(for_stmt->body, caller);
+		break;
+	}
+	case MATCH_STM: {
+		shared_ptr<MatchStatement> match_stmt = dynamic_pointer_cast<MatchStatement>(statement);
+		inline_top(match_stmt->expression, caller);
+		for (MatchArm& arm : match_stmt->arms)
+			inline_statement(arm.body, caller);
+		inline_statement(match_stmt->default_body, caller);
+		break;
+	}
+	case ASM_STM: {																// Operands are pushed one after another, like nested expressions
+		shared_ptr<AsmStatement> asm_stmt = dynamic_pointer_cast<AsmStatement>(statement);
+		for (AsmOperand& operand : asm_stmt->outputs)
+			inline_nested(operand.expression, caller);
+		for (AsmOperand& operand : asm_stmt->inputs)
+			inline_nested(operand.expression, caller);
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+void Inliner::inline_top(shared_ptr<Expression>& expression, const std::string& caller) {
+	if (!expression)
+		return;
+	if (expression->type == VARIABLE_ASSIGN) {									// The assigned value is computed before anything is pushed
+		inline_nested(dynamic_pointer_cast<VariableAssignment>(expression)->index, caller);
+		inline_top(dynamic_pointer_cast<VariableAssignment>(expression)->to_assign, caller);
+		return;
+	}
+	if (expression->type != CALL_EXPR) {
+		inline_nested(expression, caller);
+		return;
+	}
+
+	shared_ptr<Call> call = dynamic_pointer_cast<Call>(expression);
+	if (!should_inline(call, caller)) {
+		inline_nested(expression, caller);
+		return;
+	}
+	for (shared_ptr<Expression>& argument : call->arguments)					// Arguments of an inlined call are bound one after another,
+		inline_top(argument, caller);											// so each one is also evaluated at statement level
+
+	shared_ptr<Expression> substituted = substitute(call);
+	if (substituted) {
+		expression = substituted;
+		return;
+	}
+
+	shared_ptr<Function> callee = functions[call->name];
+	shared_ptr<InlinedCall> inlined = make_shared<InlinedCall>();
+	inlined->name = callee->name;
+	for (shared_ptr<Name>& param : callee->parameters)
+		inlined->parameters.push_back(param->name);
+	inlined->arguments = call->arguments;
+	inlined->body = clone_compound(callee->statement);
+	expression = inlined;
+}
+
+void Inliner::inline_nested(shared_ptr<Expression>& expression, const std::string& caller) {
+	if (!expression)
+		return;
+	switch (expression->type)
+	{
+	case UNARY_EXPR:
+		inline_nested(dynamic_pointer_cast<UnaryExpression>(expression)->expression, caller);
+		break;
+	case BINARY_EXPR: {
+		shared_ptr<BinaryExpression> binary = dynamic_pointer_cast<BinaryExpression>(expression);
+		inline_nested(binary->expression_a, caller);
+		inline_nested(binary->expression_b, caller);
+		break;
+	}
+	case VARIABLE_ASSIGN:
+		inline_nested(dynamic_pointer_cast<VariableAssignment>(expression)->index, caller);
+		inline_nested(dynamic_pointer_cast<VariableAssignment>(expression)->to_assign, caller);
+		break;
+	case INDEX_EXPR:
+		inline_nested(dynamic_pointer_cast<IndexExpression>(expression)->index, caller);
+		break;
+	case FIELD_EXPR:
+		inline_nested(dynamic_pointer_cast<FieldExpression>(expression)->object, caller);
+		break;
+	case CALL_EXPR: {
+		shared_ptr<Call> call = dynamic_pointer_cast<Call>(expression);
+		for (shared_ptr<Expression>& argument : call->arguments)
+			inline_nested(argument, caller);
+		if (should_inline(call, caller)) {										// Only single expression bodies can be placed inside another expression
+			shared_ptr<Expression> substituted = substitute(call);
+			if (substituted)
+				expression = substituted;
+		}
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+shared_ptr<Statement> Inliner::hoist_call(shared_ptr<Statement>& statement, const std::string& caller) {
+	if (!statement)
+		return nullptr;
+	shared_ptr<Expression>* root = nullptr;										// Only expressions evaluated once, when the statement starts
+	switch (statement->type)
+	{
+	case EXPR_STM:
+		root = &dynamic_pointer_cast<ExpressionStatement>(statement)->expression;
+		break;
+	case VARIABLE_DECL:
+		root = &dynamic_pointer_cast<VariableDeclaration>(statement)->optional_to_assign;
+		break;
+	case RETURN_STM:
+		root = &dynamic_pointer_cast<Return>(statement)->expression;
+		break;
+	case IF_STATEMENT:
+		root = &dynamic_pointer_cast<IfStatement>(statement)->condition;
+		break;
+	case MATCH_STM:
+		root = &dynamic_pointer_cast<MatchStatement>(statement)->expression;
+		break;
+	default:
+		return nullptr;
+	}
+	shared_ptr<Expression>* call = find_nested_call(*root, true, caller);
+	if (!call || !reads_only_locals(*root, *call))								// Evaluating the call first must not change what the rest computes
+		return nullptr;
+
+	shared_ptr<VariableDeclaration> decl = make_shared<VariableDeclaration>();
+	decl->variable_name = std::format("$inline{0}", temporary_counter++);			// Can't clash with a user name, the lexer doesn't accept '$'
+	decl->is_init = true;
+	decl->optional_to_assign = *call;
+	decl->line = statement->line;
+	decl->column = statement->column;
+	*call = make_shared<Name>(decl->variable_name);
+	caller_locals.insert(decl->variable_name);
+	return decl;
+}
+
+shared_ptr<Expression>* Inliner::find_nested_call(shared_ptr<Expression>& expression, bool top, const std::string& caller) {	// top is true where inline_top reaches
+	if (!expression)
+		return nullptr;
+	shared_ptr<Expression>* found = nullptr;
+	switch (expression->type)
+	{
+	case UNARY_EXPR:
+		return find_nested_call(dynamic_pointer_cast<UnaryExpression>(expression)->expression, false, caller);
+	case BINARY_EXPR: {
+		shared_ptr<BinaryExpression> binary = dynamic_pointer_cast<BinaryExpression>(expression);
+		found = find_nested_call(binary->expression_a, false, caller);
+		if (!found && binary->operator_type != TOKEN_AND && binary->operator_type != TOKEN_OR)	// The right side of && and || may not run
+			found = find_nested_call(binary->expression_b, false, caller);
+		return found;
+	}
+	case VARIABLE_ASSIGN: {
+		shared_ptr<VariableAssignment> assignment = dynamic_pointer_cast<VariableAssignment>(expression);
+		found = find_nested_call(assignment->index, false, caller);
+		return found ? found : find_nested_call(assignment->to_assign, top, caller);
+	}
+	case INDEX_EXPR:
+		return find_nested_call(dynamic_pointer_cast<IndexExpression>(expression)->index, false, caller);
+	case FIELD_EXPR:
+		return find_nested_call(dynamic_pointer_cast<FieldExpression>(expression)->object, false, caller);
+	case CALL_EXPR: {
+		shared_ptr<Call> call = dynamic_pointer_cast<Call>(expression);
+		bool inlined_whole = top && should_inline(call, caller);				// Its arguments are bound at statement level too
+		for (shared_ptr<Expression>& argument : call->arguments) {
+			found = find_nested_call(argument, inlined_whole, caller);
+			if (found)
+				return found;
+		}
+		if (top || !should_inline(call, caller) || substitute(call))
+			return nullptr;
+		shared_ptr<Function> callee = functions[call->name];
+		if (callee->return_type != TYPE_INTEGER && callee->return_type != TYPE_STRING)	// The temporary holds one quadword
+			return nullptr;
+		return &expression;
+	}
+	default:
+		return nullptr;
+	}
+}
+
+bool Inliner::reads_only_locals(const shared_ptr<Expression>& expression, const shared_ptr<Expression>& call) {
+	if (!expression || expression == call)
+		return true;
+	switch (expression->type)
+	{
+	case CONSTANT_EXPR:
+		return true;
+	case NAME: {																// The callee can't write the locals of its caller
+		const std::string& name = dynamic_pointer_cast<Name>(expression)->name;
+		return caller_locals.find(name) != caller_locals.end() && globals.find(name) == globals.end();
+	}
+	case UNARY_EXPR:
+		return reads_only_locals(dynamic_pointer_cast<UnaryExpression>(expression)->expression, call);
+	case BINARY_EXPR: {
+		shared_ptr<BinaryExpression> binary = dynamic_pointer_cast<BinaryExpression>(expression);
+		return reads_only_locals(binary->expression_a, call) && reads_only_locals(binary->expression_b, call);
+	}
+	case VARIABLE_ASSIGN: {														// Stores and calls that take the call's value happen after it
+		shared_ptr<VariableAssignment> assignment = dynamic_pointer_cast<VariableAssignment>(expression);
+		if (assignment->is_compound && !reads_only_locals(make_shared<Name>(assignment->variable_name), call))	// Reads the old value too
+			return false;
+		return contains_expression(assignment->to_assign, call) && reads_only_locals(assignment->index, call)
+			&& reads_only_locals(assignment->to_assign, call);
+	}
+	case CALL_EXPR: {
+		shared_ptr<Call> outer = dynamic_pointer_cast<Call>(expression);
+		if (!contains_expression(expression, call))
+			return false;
+		for (shared_ptr<Expression>& argument : outer->arguments) {
+			if (!reads_only_locals(argument, call))
+				return false;
+		}
+		return true;
+	}
+	default:
+		return false;
+	}
+}
+
+shared_ptr<Expression> Inliner::substitute(const shared_ptr<Call>& call) {
+	shared_ptr<Function> callee = functions[call->name];
+	if (callee->statement->statements.size() != 1 || !callee->statement->statements[0]
+		|| callee->statement->statements[0]->type != RETURN_STM)
+		return nullptr;
+	shared_ptr<Return> return_stmt = dynamic_pointer_cast<Return>(callee->statement->statements[0]);
+	if (return_stmt->is_empty || contains_assignment(return_stmt->expression))
+		return nullptr;
+
+	std::unordered_map<std::string, int> uses;
+	count_names(return_stmt->expression, uses);
+	std::unordered_map<std::string, shared_ptr<Expression>> bindings;
+	for (size_t i = 0; i < callee->parameters.size(); i++) {
+		const shared_ptr<Expression>& argument = call->arguments[i];
+		if (has_side_effects(argument))											// Arguments must be evaluated exactly once, in order
+			return nullptr;
+		bool is_trivial = argument->type == NAME || argument->type == CONSTANT_EXPR;
+		if (uses[callee->parameters[i]->name] > 1 && !is_trivial)				// Don't duplicate work
+			return nullptr;
+		bindings[callee->parameters[i]->name] = argument;
+	}
+	for (auto& [name, count] : uses) {											// A global used by the callee must not be shadowed by a caller local
+		if (bindings.find(name) == bindings.end() && caller_locals.find(name) != caller_locals.end())
+			return nullptr;
+	}
+	return substitute_parameters(return_stmt->expression, bindings);
+}
+
+shared_ptr<Expression> Inliner::substitute_parameters(const shared_ptr<Expression>& expression,
+	const std::unordered_map<std::string, shared_ptr<Expression>>& bindings) {
+	if (!expression)
+		return nullptr;
+	switch (expression->type)
+	{
+	case NAME: {
+		auto found = bindings.find(dynamic_pointer_cast<Name>(expression)->name);
+		if (found != bindings.end())
+			return clone_expression(found->second);
+		return clone_expression(expression);
+	}
+	case UNARY_EXPR: {
+		shared_ptr<UnaryExpression> unary = dynamic_pointer_cast<UnaryExpression>(expression);
+		return make_shared<UnaryExpression>(unary->operator_type, substitute_parameters(unary->expression, bindings));
+	}
+	case BINARY_EXPR: {
+		shared_ptr<BinaryExpression> binary = dynamic_pointer_cast<BinaryExpression>(expression);
+		return make_shared<BinaryExpression>(substitute_parameters(binary->expression_a, bindings), binary->operator_type,
+			substitute_parameters(binary->expression_b, bindings));
+	}
+	case INDEX_EXPR: {
+		shared_ptr<IndexExpression> element = dynamic_pointer_cast<IndexExpression>(expression);
+		return make_shared<IndexExpression>(element->array_name, substitute_parameters(element->index, bindings));
+	}
+	case FIELD_EXPR: {															// The struct is never a parameter, only an index can be
+		shared_ptr<FieldExpression> access = dynamic_pointer_cast<FieldExpression>(expression);
+		if (access->object->type != INDEX_EXPR)
+			break;
+		return make_shared<FieldExpression>(substitute_parameters(access->object, bindings), access->field);
+	}
+	case CALL_EXPR: {
+		shared_ptr<Call> call = make_shared<Call>(dynamic_pointer_cast<Call>(expression)->name);
+		for (shared_ptr<Expression>& argument : dynamic_pointer_cast<Call>(expression)->arguments)
+			call->arguments.push_back(substitute_parameters(argument, bindings));
+		return call;
+	}
+	case INLINED_CALL_EXPR: {													// The body only sees its own parameters, the arguments are in the caller scope
+		shared_ptr<InlinedCall> inlined = make_shared<InlinedCall>(*dynamic_pointer_cast<InlinedCall>(expression));
+		for (shared_ptr<Expression>& argument : inlined->arguments)
+			argument = substitute_parameters(argument, bindings);
+		inlined->body = clone_compound(inlined->body);
+		return inlined;
+	}
+	default:
+		break;
+	}
+	return clone_expression(expression);
+}
+
+void Inliner::count_names(const shared_ptr<Expression>& expression, std::unordered_map<std::string, int>& uses) {
+	if (!expression)
+		return;
+	switch (expression->type)
+	{
+	case NAME:
+		uses[dynamic_pointer_cast<Name>(expression)->name]++;
+		break;
+	case UNARY_EXPR:
+		count_names(dynamic_pointer_cast<UnaryExpression>(expression)->expression, uses);
+		break;
+	case BINARY_EXPR: {
+		shared_ptr<BinaryExpression> binary = dynamic_pointer_cast<BinaryExpression>(expression);
+		count_names(binary->expression_a, uses);
+		count_names(binary->expression_b, uses);
+		break;
+	}
+	case INDEX_EXPR:															// The array counts too, a caller local must not hide it
+		uses[dynamic_pointer_cast<IndexExpression>(expression)->array_name]++;
+		count_names(dynamic_pointer_cast<IndexExpression>(expression)->index, uses);
+		break;
+	case FIELD_EXPR:
+		count_names(dynamic_pointer_cast<FieldExpression>(expression)->object, uses);
+		break;
+	case CALL_EXPR:
+		for (shared_ptr<Expression>& argument : dynamic_pointer_cast<Call>(expression)->arguments)
+			count_names(argument, uses);
+		break;
+	case INLINED_CALL_EXPR:
+		for (shared_ptr<Expression>& argument : dynamic_pointer_cast<InlinedCall>(expression)->arguments)
+			count_names(argument, uses);
+		break;
+	default:
+		break;
+	}
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include <memory>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include "parser.h"
+#include "options.h"
+#include "profile.h"
+
+class Inliner {
+public:
+	Inliner(const std::shared_ptr<AST>& ast, const CompilerOptions& options, const Profile* profile = nullptr) :
+		ast(ast), options(options), profile(profile) {}
+
+	const std::shared_ptr<AST>& ast;
+	void run();																	// Inlines calls in every function of the AST
+private:
+	const CompilerOptions& options;
+	const Profile* profile;
+
+	std::unordered_map<std::string, std::shared_ptr<Function>> functions;		// Function name and declaration
+	std::unordered_map<std::string, std::vector<std::string>> callees;			// Call graph, function name and the functions it calls
+	std::unordered_map<std::string, int> call_sites;							// Number of call sites of every function in the file
+	std::unordered_set<std::string> processed;									// Functions whose body has already been inlined into
+	std::unordered_set<std::string> globals;
+
+	std::unordered_set<std::string> caller_locals;								// Names declared by the function being processed
+	int temporary_counter = 0;
+
+	void build_call_graph();
+	void collect_calls(const std::shared_ptr<Statement>& statement, const std::string& caller);
+	void collect_calls(const std::shared_ptr<Expression>& expression, const std::string& caller);
+	void collect_locals(const std::shared_ptr<Statement>& statement);
+	bool is_recursive(const std::string& name);
+	bool should_inline(const std::shared_ptr<Call>& call, const std::string& caller);
+
+	void process(const std::string& name);										// Inlines the callees of a function, after they are processed themselves
+	void inline_statement(std::shared_ptr<Statement>& statement, const std::string& caller);
+	void inline_top(std::shared_ptr<Expression>& expression, const std::string& caller);		// Expression evaluated with an empty temporary stack
+	void inline_nested(std::shared_ptr<Expression>& expression, const std::string& caller);		// Expression evaluated inside another expression
+
+	std::shared_ptr<Statement> hoist_call(std::shared_ptr<Statement>& statement, const std::string& caller);	// Moves a call only a full body would inline into a temporary
+	std::shared_ptr<Expression>* find_nested_call(std::shared_ptr<Expression>& expression, bool top, const std::string& caller);
+	bool reads_only_locals(const std::shared_ptr<Expression>& expression, const std::shared_ptr<Expression>& call);	// True if nothing but the call can see or change what the call does
+
+	std::shared_ptr<Expression> substitute(const std::shared_ptr<Call>& call);	// Replaces a call to a single expression function by that expression
+	std::shared_ptr<Expression> substitute_parameters(const std::shared_ptr<Expression>& expression,
+		const std::unordered_map<std::string, std::shared_ptr<Expression>>& bindings);
+	void count_names(const std::shared_ptr<Expression>& expression, std::unordered_map<std::string, int>& uses);
+};
@@ -0,0 +1,61 @@
+#include "pch.h"
+#include "intrinsics.h"
+#include <bit>
+#include <unordered_map>
+
+static const std::unordered_map<std::string, Intrinsic> intrinsics = {
+	{ "popcount", INTRINSIC_POPCOUNT }, { "clz", INTRINSIC_CLZ }, { "ctz", INTRINSIC_CTZ }, { "bswap", INTRINSIC_BSWAP },
+	{ "rotl", INTRINSIC_ROTL }, { "rotr", INTRINSIC_ROTR }, { "mulhi", INTRINSIC_MULHI }, { "prefetch", INTRINSIC_PREFETCH },
+	{ "likely", INTRINSIC_LIKELY }, { "unlikely", INTRINSIC_UNLIKELY }
+};
+
+Intrinsic intrinsic_named(const std::string& name) {
+	auto found = intrinsics.find(name);
+	return found != intrinsics.end() ? found->second : INTRINSIC_NONE;
+}
+
+int intrinsic_arity(Intrinsic intrinsic) {
+	switch (intrinsic)
+	{
+	case INTRINSIC_ROTL:
+	case INTRINSIC_ROTR:
+	case INTRINSIC_MULHI:
+		return 2;
+	default:
+		return 1;
+	}
+}
+
+static uint64_t multiply_high(uint64_t a, uint64_t b) {						// From 32 bit halves, there is no portable 128 bit type
+	uint64_t a_low = a & 0xFFFFFFFF, a_high = a >> 32;
+	uint64_t b_low = b & 0xFFFFFFFF, b_high = b >> 32;
+	uint64_t low = a_low * b_low;
+	uint64_t middle_a = a_high * b_low + (low >> 32);
+	uint64_t middle_b = a_low * b_high + (middle_a & 0xFFFFFFFF);
+	return a_high * b_high + (middle_a >> 32) + (middle_b >> 32);
+}
+
+static uint64_t swap_bytes(uint64_t value) {
+	uint64_t swapped = 0;
+	for (int i = 0; i < 8; i++)
+		swapped = (swapped << 8) | ((value >> (8 * i)) & 0xFF);
+	return swapped;
+}
+
+bool fold_intrinsic(Intrinsic intrinsic, const std::vector<long long>& arguments, long long& value) {
+	if (intrinsic == INTRINSIC_NONE || intrinsic == INTRINSIC_PREFETCH || (int)arguments.size() != intrinsic_arity(intrinsic))
+		return false;
+	uint64_t a = (uint64_t)arguments[0];
+	switch (intrinsic)
+	{
+	case INTRINSIC_POPCOUNT:	value = std::popcount(a); break;
+	case INTRINSIC_CLZ:			value = std::countl_zero(a); break;
+	case INTRINSIC_CTZ:			value = std::countr_zero(a); break;
+	case INTRINSIC_BSWAP:		value = (long long)swap_bytes(a); break;
+	case INTRINSIC_ROTL:		value = (long long)std::rotl(a, (int)(arguments[1] & 63)); break;
+	case INTRINSIC_ROTR:		value = (long long)std::rotr(a, (int)(arguments[1] & 63)); break;
+	case INTRINSIC_MULHI:		value = (long long)multiply_high(a, (uint64_t)arguments[1]); break;
+	default:					value = arguments[0]; break;					// likely and unlikely
+	}
+	return true;
+}
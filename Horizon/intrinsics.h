@@ -0,0 +1,27 @@
+#pragma once
+#include <memory>
+#include <string>
+#include <vector>
+#include "parser.h"
+
+// Built in functions that map to single instructions. Their names are reserved like len and every
+// call of one is lowered in place. Instructions that need a CPU feature which wasn't enabled are
+// replaced by a short sequence of baseline x86-64 instructions.
+
+enum Intrinsic {
+	INTRINSIC_NONE,
+	INTRINSIC_POPCOUNT,															// Set bits, popcnt with -mpopcnt
+	INTRINSIC_CLZ,																// Leading zero bits, 64 for 0, lzcnt with -mlzcnt
+	INTRINSIC_CTZ,																// Trailing zero bits, 64 for 0, tzcnt with -mbmi
+	INTRINSIC_BSWAP,															// Reverses the bytes
+	INTRINSIC_ROTL,																// Rotates by the second argument modulo 64
+	INTRINSIC_ROTR,
+	INTRINSIC_MULHI,															// High half of the unsigned 128 bit product
+	INTRINSIC_PREFETCH,															// Fetches the cache line of an element or a field, evaluates to 0
+	INTRINSIC_LIKELY,															// Evaluates to its argument, a branch on it is expected to be taken
+	INTRINSIC_UNLIKELY															// Same, expected not to be taken
+};
+
+Intrinsic intrinsic_named(const std::string& name);							// INTRINSIC_NONE for other names
+int intrinsic_arity(Intrinsic intrinsic);
+bool fold_intrinsic(Intrinsic intrinsic, const std::vector<long long>& arguments, long long& value);	// False if it has no constant value
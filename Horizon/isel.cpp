@@ -0,0 +1,100 @@
+#include "pch.h"
+#include "isel.h"
+#include <unordered_map>
+
+static const std::unordered_map<std::string, int> costs = {					// Latencies of recent x86-64 cores, rounded
+	{ "mov", 1 }, { "movabs", 1 }, { "movzbl", 1 }, { "xor", 0 },				// Zeroing idioms are removed at rename
+	{ "add", 1 }, { "sub", 1 }, { "and", 1 }, { "or", 1 }, { "neg", 1 }, { "not", 1 },
+	{ "inc", 1 }, { "dec", 1 }, { "lea", 1 }, { "shl", 1 }, { "shr", 1 }, { "sar", 1 },
+	{ "cmp", 1 }, { "test", 1 }, { "set", 1 }, { "cmov", 1 },
+	{ "imul", 3 }, { "cqo", 1 }, { "idiv", 40 },
+	{ "push", 1 }, { "pop", 1 }, { "call", 5 }, { "jmp", 1 }, { "j", 1 }
+};
+
+int instruction_cost(const std::string& instruction) {
+	std::string mnemonic = instruction.substr(0, instruction.find_first_of(" \t"));
+	int cost = 1;
+	auto found = costs.find(mnemonic);
+	while (found == costs.end() && mnemonic.size() > 1) {						// Drops size and condition suffixes, movq becomes mov
+		mnemonic.pop_back();
+		found = costs.find(mnemonic);
+	}
+	if (found != costs.end())
+		cost = found->second;
+	if (instruction.find('(') != std::string::npos && mnemonic != "lea")		// Memory operands pay for the load
+		cost += 4;
+	if (mnemonic == "lea") {													// Base, index and displacement together take the slow path
+		size_t open = instruction.find('(');
+		bool has_displacement = open > instruction.find(' ') + 1;
+		bool has_base = instruction[open + 1] != ',';
+		bool has_index = instruction.find(',', open) < instruction.find(')');
+		if (has_displacement && has_base && has_index)
+			cost += 2;
+	}
+	return cost;
+}
+
+int sequence_cost(const std::vector<std::string>& instructions) {
+	int total = 0;
+	for (const std::string& instruction : instructions)
+		total += instruction_cost(instruction);
+	return total;
+}
+
+bool fits_immediate(long long value) {
+	return value >= INT32_MIN && value <= INT32_MAX;
+}
+
+std::string load_constant(long long value, const std::string& reg) {
+	if (value == 0)																// Writing the 32 bit register clears the upper half
+		return "xor " + register_32(reg) + ", " + register_32(reg);
+	if (value > 0 && value <= (long long)UINT32_MAX)
+		return "mov $" + std::to_string(value) + ", " + register_32(reg);
+	if (fits_immediate(value))
+		return "mov $" + std::to_string(value) + ", " + reg;
+	return "movabs $" + std::to_string(value) + ", " + reg;
+}
+
+std::string register_32(const std::string& reg) {
+	if (std::isdigit(reg[2]))													// %r8 to %r15
+		return reg + "d";
+	return "%e" + reg.substr(2);
+}
+
+std::string register_8(const std::string& reg) {
+	if (std::isdigit(reg[2]))
+		return reg + "b";
+	if (reg == "%rsi" || reg == "%rdi")
+		return "%" + reg.substr(2) + "l";
+	return "%" + reg.substr(2, 1) + "l";
+}
+
+std::string condition_code(TokenType comparison) {
+	switch (comparison)
+	{
+	case TOKEN_LESS: return "l";
+	case TOKEN_LESS_EQUAL: return "le";
+	case TOKEN_GREATER: return "g";
+	case TOKEN_GREATER_EQUAL: return "ge";
+	case TOKEN_EQUAL_EQUAL: return "e";
+	case TOKEN_BANG_EQUAL: return "ne";
+	default: return "";
+	}
+}
+
+std::string swap_condition(const std::string& condition) {
+	if (condition == "l") return "g";
+	if (condition == "le") return "ge";
+	if (condition == "g") return "l";
+	if (condition == "ge") return "le";
+	return condition;
+}
+
+std::string negate_condition(const std::string& condition) {
+	if (condition == "l") return "ge";
+	if (condition == "le") return "g";
+	if (condition == "g") return "le";
+	if (condition == "ge") return "l";
+	if (condition == "e") return "ne";
+	return "e";
+}
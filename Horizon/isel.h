@@ -0,0 +1,19 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "token.h"
+
+// Instruction selection helpers for the x86-64 backend. Candidate sequences for an expression
+// are compared with a per instruction cost table and the cheapest one is emitted.
+
+int instruction_cost(const std::string& instruction);							// Estimated cycles of an instruction, memory operands included
+int sequence_cost(const std::vector<std::string>& instructions);
+bool fits_immediate(long long value);											// Immediates of most instructions are sign extended 32 bit values
+
+std::string load_constant(long long value, const std::string& reg);			// Cheapest instruction that puts a constant in a 64 bit register
+std::string register_32(const std::string& reg);								// 32 bit name of a 64 bit register, %rax becomes %eax
+std::string register_8(const std::string& reg);								// Low byte of a 64 bit register, %rax becomes %al
+
+std::string condition_code(TokenType comparison);								// Suffix of jcc and setcc that holds after cmp b, a for a <comparison> b
+std::string swap_condition(const std::string& condition);						// Condition with the operands of the cmp exchanged
+std::string negate_condition(const std::string& condition);
@@ -0,0 +1,247 @@
+#include "pch.h"
+#include "jit.h"
+#include <fstream>
+#include <format>
+#include <cstring>
+#include <algorithm>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <dlfcn.h>
+#include <unistd.h>
+
+extern "C" void __register_frame(void* begin);									// From libgcc, unwinders find the frames of JIT code through it
+extern "C" void __deregister_frame(void* begin);
+#endif
+
+static const size_t region_reserve = (size_t)1 << 30;							// Small enough that any two places in it are within rel32 reach
+static const size_t page_size = 4096;
+static const size_t stub_size = 16;												// jmp *0(%rip), the address and two bytes of padding
+
+static uint64_t align_up(uint64_t value, uint64_t alignment) {
+	return alignment > 1 ? (value + alignment - 1) / alignment * alignment : value;
+}
+
+void* JitSession::address(const std::string& name) {
+	auto symbol = symbols.find(name);
+	return symbol == symbols.end() ? nullptr : (void*)symbol->second;
+}
+
+#ifndef _WIN32
+
+JitSession::JitSession() {
+	void* reserved = mmap(nullptr, region_reserve, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (reserved != MAP_FAILED) {
+		region = (uint8_t*)reserved;
+		region_size = region_reserve;
+	}
+	perf_map_name = std::format("/tmp/perf-{0}.map", getpid());
+}
+
+JitSession::~JitSession() {
+	for (void* frame : frames)
+		__deregister_frame(frame);
+	if (region)
+		munmap(region, region_size);
+}
+
+uint8_t* JitSession::allocate(size_t size) {
+	size = align_up(size, page_size);
+	if (!region || used + size > region_size)
+		return nullptr;
+	uint8_t* block = region + used;
+	if (size > 0 && mprotect(block, size, PROT_READ | PROT_WRITE) != 0)
+		return nullptr;
+	used += size;																// Fresh pages are zero, which is all .bss needs
+	return block;
+}
+
+void JitSession::release(size_t start) {
+	if (used > start)															// A fresh mapping drops the pages, so .bss placed there later is zero again
+		mmap(region + start, used - start, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+	used = start;
+}
+
+bool JitSession::within_reach(uint64_t address) {
+	int64_t distance = (int64_t)(address - (uint64_t)region);
+	return distance > (int64_t)region_size - INT32_MAX && distance < INT32_MAX - (int64_t)region_size;
+}
+
+bool JitSession::load(const ObjectFile& object, std::string& error) {
+	if (!region) {
+		error = "Could not reserve memory for the JIT";
+		return false;
+	}
+	auto symbol_name = [&](int index) {
+		const ObjectSymbol& symbol = object.symbols[index];
+		return symbol.section_symbol ? object.sections[symbol.section].name : symbol.name;
+	};
+
+	std::vector<uint64_t> addresses(object.symbols.size(), 0);
+	for (size_t i = 0; i < object.symbols.size(); i++) {						// Undefined symbols come from earlier objects or the C library
+		const ObjectSymbol& symbol = object.symbols[i];
+		if (symbol.section != -1) {
+			if (symbol.global && symbols.contains(symbol.name)) {
+				error = "Already defined symbol " + symbol.name;
+				return false;
+			}
+			continue;
+		}
+		auto loaded = symbols.find(symbol.name);
+		void* native = loaded == symbols.end() ? dlsym(RTLD_DEFAULT, symbol.name.c_str()) : (void*)loaded->second;
+		if (!native) {
+			error = "Undefined symbol " + symbol.name;
+			return false;
+		}
+		addresses[i] = (uint64_t)native;
+	}
+
+	uint64_t sizes[GROUP_COUNT] = {};
+	std::vector<int> groups(object.sections.size(), -1);
+	std::vector<uint64_t> offsets(object.sections.size(), 0);
+	std::vector<int> new_stubs;													// Library functions that calls can only reach through a stub
+	for (size_t i = 0; i < object.sections.size(); i++) {
+		const ObjectSection& section = object.sections[i];
+		if (!(section.flags & SECTION_ALLOC))									// Debug information and notes stay out of memory
+			continue;
+		if (section.flags & SECTION_TLS) {
+			error = "Thread locals are not supported by the JIT";
+			return false;
+		}
+		Group group = section.flags & SECTION_EXECUTE ? GROUP_CODE : section.flags & SECTION_WRITE ? GROUP_WRITABLE : GROUP_READ_ONLY;
+		groups[i] = group;
+		offsets[i] = align_up(sizes[group], section.alignment);
+		sizes[group] = offsets[i] + section.size + (section.type == SECTION_UNWIND ? 4 : 0);	// A zero length entry ends .eh_frame
+		for (const Relocation& relocation : section.relocations) {
+			const ObjectSymbol& symbol = object.symbols[relocation.symbol];
+			if (relocation.type == RELOCATION_PLT32 && symbol.section == -1 && !symbols.contains(symbol.name) && !stubs.contains(symbol.name)
+				&& !within_reach(addresses[relocation.symbol]) && std::find(new_stubs.begin(), new_stubs.end(), relocation.symbol) == new_stubs.end())
+				new_stubs.push_back(relocation.symbol);
+		}
+	}
+	uint64_t stub_start = align_up(sizes[GROUP_CODE], stub_size);
+	if (!new_stubs.empty())
+		sizes[GROUP_CODE] = stub_start + stub_size * new_stubs.size();
+
+	size_t start = used;														// Nothing of the object stays if it fails to link
+	uint8_t* bases[GROUP_COUNT];
+	for (int group = 0; group < GROUP_COUNT; group++) {
+		bases[group] = allocate(sizes[group]);
+		if (!bases[group]) {
+			release(start);
+			error = "The JIT region is full";
+			return false;
+		}
+	}
+	std::vector<uint64_t> section_addresses(object.sections.size(), 0);
+	for (size_t i = 0; i < object.sections.size(); i++) {
+		if (groups[i] < 0)
+			continue;
+		section_addresses[i] = (uint64_t)(bases[groups[i]] + offsets[i]);
+		if (object.sections[i].type != SECTION_NOBITS)
+			memcpy((void*)section_addresses[i], object.sections[i].bytes.data(), object.sections[i].bytes.size());
+	}
+	for (size_t i = 0; i < object.symbols.size(); i++) {
+		if (object.symbols[i].section != -1)
+			addresses[i] = section_addresses[object.symbols[i].section] + object.symbols[i].value;
+	}
+	std::unordered_map<std::string, uint64_t> placed_stubs;					// Kept once every relocation is done
+	for (size_t i = 0; i < new_stubs.size(); i++) {
+		uint8_t* stub = bases[GROUP_CODE] + stub_start + i * stub_size;
+		const uint8_t jump[] = { 0xff, 0x25, 0, 0, 0, 0 };						// The address follows the instruction
+		memcpy(stub, jump, sizeof(jump));
+		memcpy(stub + sizeof(jump), &addresses[new_stubs[i]], 8);
+		stub[14] = stub[15] = 0xcc;
+		placed_stubs[object.symbols[new_stubs[i]].name] = (uint64_t)stub;
+	}
+
+	for (size_t i = 0; i < object.sections.size(); i++) {
+		if (groups[i] < 0)
+			continue;
+		for (const Relocation& relocation : object.sections[i].relocations) {
+			const ObjectSymbol& symbol = object.symbols[relocation.symbol];
+			uint64_t place = section_addresses[i] + relocation.offset;
+			uint64_t target = addresses[relocation.symbol];
+			if (relocation.type == RELOCATION_PLT32 && symbol.section == -1) {
+				if (placed_stubs.contains(symbol.name))
+					target = placed_stubs[symbol.name];
+				else if (stubs.contains(symbol.name))
+					target = stubs[symbol.name];
+			}
+			uint64_t value = target + relocation.addend;
+			switch (relocation.type)
+			{
+			case RELOCATION_64:
+				memcpy((void*)place, &value, 8);
+				break;
+			case RELOCATION_PC32:
+			case RELOCATION_PLT32: {
+				int64_t distance = (int64_t)(value - place);
+				if (distance != (int32_t)distance) {
+					release(start);
+					error = symbol_name(relocation.symbol) + " is out of reach of a rel32 field";
+					return false;
+				}
+				int32_t field = (int32_t)distance;
+				memcpy((void*)place, &field, 4);
+				break;
+			}
+			case RELOCATION_32:
+			case RELOCATION_32S: {
+				bool fits = relocation.type == RELOCATION_32 ? value <= UINT32_MAX : (int64_t)value == (int32_t)value;
+				if (!fits) {
+					release(start);
+					error = symbol_name(relocation.symbol) + " is above the 32 bit addresses an absolute field holds";
+					return false;
+				}
+				uint32_t field = (uint32_t)value;
+				memcpy((void*)place, &field, 4);
+				break;
+			}
+			default:
+				release(start);
+				error = std::format("Relocation type {0} of {1} is not supported by the JIT", (int)relocation.type, symbol_name(relocation.symbol));
+				return false;
+			}
+		}
+	}
+
+	stubs.insert(placed_stubs.begin(), placed_stubs.end());
+	if (sizes[GROUP_CODE] > 0)
+		mprotect(bases[GROUP_CODE], align_up(sizes[GROUP_CODE], page_size), PROT_READ | PROT_EXEC);
+	if (sizes[GROUP_READ_ONLY] > 0)
+		mprotect(bases[GROUP_READ_ONLY], align_up(sizes[GROUP_READ_ONLY], page_size), PROT_READ);
+	for (size_t i = 0; i < object.sections.size(); i++) {
+		if (groups[i] >= 0 && object.sections[i].type == SECTION_UNWIND && object.sections[i].size > 0) {
+			__register_frame((void*)section_addresses[i]);
+			frames.push_back((void*)section_addresses[i]);
+		}
+	}
+	for (size_t i = 0; i < object.symbols.size(); i++) {
+		if (object.symbols[i].global && object.symbols[i].section != -1)
+			symbols[object.symbols[i].name] = addresses[i];
+	}
+	write_perf_map(object, addresses);
+	return true;
+}
+
+void JitSession::write_perf_map(const ObjectFile& object, const std::vector<uint64_t>& addresses) {
+	std::ofstream map(perf_map_name, std::ios::app);
+	for (size_t i = 0; i < object.symbols.size(); i++) {						// perf reads start, size and name, in hex without 0x
+		const ObjectSymbol& symbol = object.symbols[i];
+		if (symbol.function && symbol.section != -1 && symbol.size > 0)
+			map << std::format("{0:x} {1:x} {2}\n", addresses[i], symbol.size, symbol.name);
+	}
+}
+
+#else
+
+JitSession::JitSession() {}
+
+JitSession::~JitSession() {}
+
+bool JitSession::load(const ObjectFile&, std::string& error) {					// The generated code follows the System V ABI
+	error = "The JIT needs a POSIX system";
+	return false;
+}
+
+#endif
@@ -0,0 +1,37 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+#include "object.h"
+
+// Runs compiled code inside this process, with no assembler, linker or file in between. Objects of the built-in
+// assembler are placed in one reserved region, so that the rel32 fields of later objects reach the code and data
+// of earlier ones, and linked against what was loaded before and the C library. Nothing is unloaded until the
+// session ends, a REPL calls the functions and reads the globals of every earlier input. Functions are listed in
+// /tmp/perf-PID.map, where perf looks up the names of code that belongs to no file.
+
+class JitSession {
+public:
+	JitSession();
+	~JitSession();
+
+	std::unordered_map<std::string, uint64_t> symbols;							// Addresses of the global symbols loaded so far
+
+	bool load(const ObjectFile& object, std::string& error);					// False with a message if the object can't be linked
+	void* address(const std::string& name);										// Of a loaded symbol, nullptr if there is none
+private:
+	enum Group { GROUP_CODE, GROUP_READ_ONLY, GROUP_WRITABLE, GROUP_COUNT };	// Sections sharing the same protection share pages
+
+	uint8_t* region = nullptr;													// Reserved inaccessible, pages are made usable as they are handed out
+	size_t region_size = 0;
+	size_t used = 0;
+	std::unordered_map<std::string, uint64_t> stubs;							// Jumps to library functions out of rel32 reach, by name
+	std::vector<void*> frames;													// Registered .eh_frame sections
+	std::string perf_map_name = "";
+
+	uint8_t* allocate(size_t size);												// Page aligned and writable, nullptr once the region is full
+	void release(size_t start);													// Gives back the pages handed out since used was start, zeroed and inaccessible again
+	bool within_reach(uint64_t address);										// True if every rel32 field of the region can hold the distance
+	void write_perf_map(const ObjectFile& object, const std::vector<uint64_t>& addresses);
+};
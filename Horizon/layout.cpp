@@ -0,0 +1,101 @@
+#include "pch.h"
+#include "layout.h"
+#include <algorithm>
+#include <format>
+
+static int align_up(int offset, int alignment) {
+	return (offset + alignment - 1) / alignment * alignment;
+}
+
+static int place_fields(std::vector<StructField>& fields, int alignment, int& padding) {	// Returns the size
+	int offset = 0;
+	padding = 0;
+	for (StructField& field : fields) {
+		field.offset = align_up(offset, field.alignment);
+		padding += field.offset - offset;
+		offset = field.offset + field.size;
+	}
+	int size = align_up(offset, alignment);										// Elements of arrays stay aligned
+	padding += size - offset;
+	return size;
+}
+
+void lay_out_struct(StructDeclaration& declaration) {
+	declaration.alignment = std::max(1, declaration.explicit_alignment);
+	for (StructField& field : declaration.fields) {
+		field.alignment = std::max(declaration.is_packed ? 1 : field.size, field.explicit_alignment);
+		declaration.alignment = std::max(declaration.alignment, field.alignment);
+	}
+	int padding;
+	declaration.declared_order_size = place_fields(declaration.fields, declaration.alignment, padding);
+	if (!declaration.is_packed && !declaration.keeps_order) {					// Stable, fields of equal alignment keep their order
+		std::stable_sort(declaration.fields.begin(), declaration.fields.end(), [](const StructField& a, const StructField& b) {
+			return a.alignment > b.alignment;
+		});
+	}
+	declaration.size = place_fields(declaration.fields, declaration.alignment, declaration.padding);
+}
+
+const StructField* find_field(const StructDeclaration& declaration, const std::string& name) {
+	for (const StructField& field : declaration.fields) {
+		if (field.name == name)
+			return &field;
+	}
+	return nullptr;
+}
+
+int soa_field_offset(const StructDeclaration& declaration, const StructField& field, int length) {
+	int offset = 0;
+	for (const StructField& other : declaration.fields) {						// In layout order, so the widest arrays come first
+		offset = align_up(offset, other.alignment);
+		if (other.name == field.name)
+			break;
+		offset += other.size * length;
+	}
+	return offset;
+}
+
+int soa_size(const StructDeclaration& declaration, int length) {
+	const StructField& last = declaration.fields.back();
+	return align_up(soa_field_offset(declaration, last, length) + last.size * length, declaration.alignment);
+}
+
+int variable_size(const VariableDeclaration& declaration) {
+	if (declaration.vector_type.lanes > 0)
+		return declaration.vector_type.bytes();
+	if (!declaration.struct_type)
+		return 8 * std::max(1, declaration.array_length);
+	int length = std::max(1, declaration.array_length);
+	int size = declaration.is_soa ? soa_size(*declaration.struct_type, length) : declaration.struct_type->size * length;
+	return align_up(size, 8);
+}
+
+int variable_alignment(const VariableDeclaration& declaration) {
+	if (declaration.vector_type.lanes > 0)
+		return 16;
+	if (declaration.struct_type)
+		return std::max(8, declaration.struct_type->alignment);
+	return 8;
+}
+
+std::string describe_layout(const StructDeclaration& declaration) {
+	std::string description = std::format("struct {0}: size {1}, alignment {2}, padding {3}", declaration.name, declaration.size,
+		declaration.alignment, declaration.padding);
+	if (declaration.is_packed)
+		description += ", packed";
+	else if (declaration.keeps_order)
+		description += ", ordered";
+	else if (declaration.declared_order_size != declaration.size)
+		description += std::format(" (source order would take {0})", declaration.declared_order_size);
+	description += "\n";
+	int end = 0;
+	for (const StructField& field : declaration.fields) {
+		if (field.offset > end)
+			description += std::format("\t{0}\t<padding {1}>\n", end, field.offset - end);
+		description += std::format("\t{0}\t{1} -> {2}\n", field.offset, field.name, field.type_name);
+		end = field.offset + field.size;
+	}
+	if (declaration.size > end)
+		description += std::format("\t{0}\t<padding {1}>\n", end, declaration.size - end);
+	return description;
+}
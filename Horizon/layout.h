@@ -0,0 +1,15 @@
+#pragma once
+#include <string>
+#include "parser.h"
+
+// Data layout of struct types. Unless a struct is packed or ordered its fields are sorted by
+// decreasing alignment, which leaves no padding between fields of power of two sizes. Arrays
+// of structs may instead be stored as one array per field, a structure of arrays.
+
+void lay_out_struct(StructDeclaration& declaration);							// Sets the field offsets, alignment, size and padding
+const StructField* find_field(const StructDeclaration& declaration, const std::string& name);	// Null if there is no such field
+int soa_field_offset(const StructDeclaration& declaration, const StructField& field, int length);	// Start of the array of a field
+int soa_size(const StructDeclaration& declaration, int length);
+int variable_size(const VariableDeclaration& declaration);						// Bytes of storage, a multiple of 8
+int variable_alignment(const VariableDeclaration& declaration);
+std::string describe_layout(const StructDeclaration& declaration);				// Offsets, sizes and padding for -fdump-record-layouts
@@ -2,6 +2,7 @@
 #include "lexer.h"
 #include <string>
 #include <iostream>
+#include <cctype>
 
 Token Lexer::lex() {
     next();
@@ -50,7 +51,9 @@ Token Lexer::lex() {
     case ']': return (Token(TOKEN_R_BRACK, "", line, old_index, index));
     case ';': return (Token(TOKEN_SEMICOLON, "", line, old_index, index));
     case ',': return (Token(TOKEN_COMMA, "", line, old_index, index));
-    case '.': return (Token(TOKEN_DOT, "", line, old_index, index));
+    case ':': return (Token(TOKEN_COLON, "", line, old_index, index));
+    case '.': return (Token(
+        match('.') ? TOKEN_DOT_DOT : TOKEN_DOT, "", line, old_index, index));
     case '^': return (Token(TOKEN_CAP, "", line, old_index, index));
     case '&': return (Token(TOKEN_AMPERSAND, "", line, old_index, index));
     case '~': return (Token(TOKEN_TILDE, "", line, old_index, index));
@@ -89,6 +92,9 @@ Token Lexer::lex() {
 std::vector<Token> Lexer::analyze() {
     do {  
         out.push_back(lex());
+        Token& tok = out.back();
+        size_t line_start = tok.start_idx > 0 ? source.rfind('\n', tok.start_idx - 1) : std::string::npos;
+        tok.column = tok.start_idx - (line_start == std::string::npos ? -1 : (int)line_start);
     } while (current_char != '\0');
     return out;
 }
@@ -101,6 +107,33 @@ Token Lexer::string() {
     while (current_char != '"' && current_char != '\0') {               // Make the string body
         if (current_char == '\n')
             line++;
+        if (current_char == '\\') {                                         // Escape sequences are replaced by the byte they stand for
+            next();
+            switch (current_char) {
+            case 'n':   string += '\n'; break;
+            case 't':   string += '\t'; break;
+            case 'r':   string += '\r'; break;
+            case '0':   string += '\0'; break;
+            case '\\':  string += '\\'; break;
+            case '"':   string += '"'; break;
+            case '\'':  string += '\''; break;
+            case 'x':
+                if (index + 2 < (int)source.size() && std::isxdigit(source[index + 1]) && std::isxdigit(source[index + 2])) {
+                    string += (char)std::stoi(source.substr(index + 1, 2), nullptr, 16);
+                    next();
+                    next();
+                    break;
+                }
+                [[fallthrough]];
+            default:
+                error_handler->report_error("Unknown escape sequence", Token(TOKEN_ERROR, "", line, old_index, index));
+                if (current_char == '\0')
+                    continue;
+                break;
+            }
+            next();
+            continue;
+        }
         string += current_char;
         next();
     }
@@ -121,6 +154,8 @@ Token Lexer::number() {
     
     while (is_digit(current_char) || current_char == '.' || current_char == '_') {          // Make number string
         if (current_char == '.') {
+            if ((size_t)index + 1 < source.size() && source[index + 1] == '.')              // A range like 1..5, not a float
+                break;
             if (is_float) {
                 has_error = true;                                                           // If there already was a dot, report error
                 dot_index = index;
@@ -0,0 +1,73 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <cstdint>
+
+// A relocatable object in memory, what the built-in assembler makes of the generated assembly. The ELF writer
+// stores it as a .o file. Types, flags and relocation kinds use the values of ELF and the x86-64 psABI.
+
+enum SectionType {
+	SECTION_PROGBITS = 1,
+	SECTION_NOBITS = 8,															// .bss and .tbss, they only have a size
+	SECTION_UNWIND = 0x70000001,												// .eh_frame
+};
+
+enum SectionFlags {
+	SECTION_WRITE = 1,
+	SECTION_ALLOC = 2,
+	SECTION_EXECUTE = 4,
+	SECTION_TLS = 0x400,
+};
+
+enum RelocationType {
+	RELOCATION_64 = 1,															// S + A
+	RELOCATION_PC32 = 2,														// S + A - P
+	RELOCATION_PLT32 = 4,														// L + A - P, a call or jump that may go through the PLT
+	RELOCATION_32 = 10,															// S + A, zero extended
+	RELOCATION_32S = 11,														// S + A, sign extended
+	RELOCATION_TPOFF32 = 23,													// Offset of a thread local from the thread pointer
+};
+
+class Relocation {
+public:
+	uint64_t offset = 0;														// Of the field in its section
+	int symbol = 0;																// Index in ObjectFile::symbols
+	RelocationType type = RELOCATION_64;
+	int64_t addend = 0;
+};
+
+class ObjectSection {
+public:
+	std::string name;
+	SectionType type = SECTION_PROGBITS;
+	uint64_t flags = 0;
+	uint64_t alignment = 1;
+	uint64_t size = 0;															// Equals bytes.size() unless the section is SECTION_NOBITS
+	std::vector<uint8_t> bytes;
+	std::vector<Relocation> relocations;
+};
+
+class ObjectSymbol {
+public:
+	std::string name;
+	int section = -1;															// -1 if the symbol is undefined and has to come from elsewhere
+	uint64_t value = 0;															// Offset in the section
+	uint64_t size = 0;
+	bool global = false;
+	bool function = false;
+	bool section_symbol = false;												// Stands for the start of its section, local relocations refer to these
+};
+
+class ObjectFile {
+public:
+	std::vector<ObjectSection> sections;
+	std::vector<ObjectSymbol> symbols;
+
+	int find_symbol(const std::string& name) const {							// -1 if there is none
+		for (size_t i = 0; i < symbols.size(); i++) {
+			if (!symbols[i].section_symbol && symbols[i].name == name)
+				return (int)i;
+		}
+		return -1;
+	}
+};
@@ -0,0 +1,238 @@
+#pragma once
+#include <string>
+#include <charconv>
+
+class CompilerOptions {															// Holds the switches that control optimization passes and code generation
+public:
+	// INLINING
+	bool inline_functions = true;												// Substitute small and single call site functions into their callers
+	int inline_threshold = 40;													// Maximum callee size (in AST nodes) for leaf functions to be inlined
+	int inline_single_site_threshold = 400;										// Maximum callee size for functions that are called from one place only
+	int inline_hot_threshold = 160;												// Maximum callee size for call sites the profile shows are hot
+
+	// CODE LAYOUT
+	bool reorder_blocks = true;													// Make the likelier arm of a branch the fall through path
+	bool split_cold_code = true;												// Move unlikely blocks into .text.unlikely
+	int cold_branch_percent = 10;												// Arms taken at most this often are cold
+	bool align_loops = true;													// Align loop headers to 16 bytes
+	std::string profile_use = "";												// Profile with branch, loop, call and function counts, from an instrumented run
+	std::string profile_generate = "";											// Where an instrumented build adds its counts when the program exits
+	int profile_hot_percent = 10;												// Call sites and loops run at least this percent as often as the hottest one are hot
+
+	// TAIL CALLS
+	bool tail_calls = true;														// Turn calls in tail position into jumps
+
+	// LOOP UNROLLING
+	bool unroll_loops = true;													// Unroll for loops with a constant step
+	int unroll_full_max_trips = 16;												// Loops with up to this many iterations are replaced by copies of the body
+	int unroll_full_size = 160;													// Maximum size (in AST nodes) of a fully unrolled loop
+	int unroll_factor = 4;														// Copies of the body per iteration of a partially unrolled loop
+	int unroll_size = 120;														// Maximum size of the body of a partially unrolled loop
+	int unroll_hot_size = 240;													// Maximum size of the body of a partially unrolled loop the profile shows is hot
+
+	bool eliminate_dead_code = true;											// Remove unreachable statements, constant branches and unused declarations
+	bool eliminate_common_subexpressions = true;								// Compute repeated pure expressions once and reuse the value
+	bool global_value_numbering = true;											// Also reuse values computed in blocks that dominate the current one
+	bool omit_leaf_frame_pointer = false;										// Functions without calls address their locals from %rsp and keep %rbp untouched
+
+	// VECTORIZATION
+	bool vectorize = true;														// Run counted loops over arrays several iterations at a time in vector registers
+	bool avx2 = false;															// Use 256 bit AVX2 registers instead of the SSE2 baseline, also enables min and max
+
+	// GLOBALS
+	bool propagate_globals = true;												// Replace reads of globals that are never written with their initial value, in programs that call no C code
+	bool reorder_globals = true;												// Group globals used together and keep each group within a cache line
+
+	// MATCH DISPATCH
+	bool jump_tables = true;													// Dispatch dense match statements through a table of arm addresses
+	int jump_table_min_cases = 4;												// Fewer case values are left to compares
+	int jump_table_density = 40;												// Minimum percent of the table entries that select an arm
+	bool bit_tests = true;														// Test small sets with up to three arms against a bit mask
+
+	// STRUCTS
+	bool dump_record_layouts = false;											// Print the size, field offsets and padding of every struct
+
+	// DEBUGGING
+	bool debug_info = false;													// Emit a line table that maps instructions to the statements they came from
+	bool unwind_tables = true;													// Describe every frame with CFI directives, for unwinders and profilers
+
+	// TRACING
+	std::string trace = "";														// Where a build with entry and exit hooks writes its trace when the program exits
+	int trace_buffer_entries = 65536;											// Records kept per thread, a power of two, the oldest are overwritten
+
+	// OUTPUT
+	bool emit_object = false;													// Encode with the built-in assembler and write a relocatable ELF object, file.o
+	bool run = false;															// Compile into memory and call main, with no file written
+	bool whole_program = false;													// The compiled unit is the entire program, no other object links against it
+	bool incremental = false;													// Part of a REPL session, later inputs may call every function and write every global
+
+	// INTRINSICS
+	bool popcnt = false;														// popcount is one popcnt instead of a bit counting sequence
+	bool lzcnt = false;															// clz is one lzcnt instead of bsr and a fixup for zero
+	bool bmi = false;															// ctz is one tzcnt instead of bsf and a fixup for zero
+
+	std::string invalid_option = "";											// A switch parse_argument knows but whose value is not a count
+
+	bool read_count(const std::string& argument, size_t prefix, int& value) {	// The value after prefix, it has to be a non negative int
+		int count = 0;
+		const char* last = argument.data() + argument.size();
+		std::from_chars_result result = std::from_chars(argument.data() + prefix, last, count);
+		if (result.ec != std::errc() || result.ptr != last || count < 0) {
+			invalid_option = argument;
+			return false;
+		}
+		value = count;
+		return true;
+	}
+
+	void instrument_for_profile() {												// Counters of an instrumented build belong to the program as written
+		inline_functions = false;
+		unroll_loops = false;
+		vectorize = false;
+		reorder_blocks = false;
+	}
+
+	bool parse_argument(const std::string& argument) {							// Parses a command line switch, returns false if it is not an option
+		if (argument == "-fno-inline")
+			inline_functions = false;
+		else if (argument == "-finline")
+			inline_functions = true;
+		else if (argument.starts_with("-finline-threshold="))
+			read_count(argument, 19, inline_threshold);
+		else if (argument.starts_with("-finline-single-site-threshold="))
+			read_count(argument, 31, inline_single_site_threshold);
+		else if (argument.starts_with("-finline-hot-threshold="))
+			read_count(argument, 23, inline_hot_threshold);
+		else if (argument == "-fno-reorder-blocks")
+			reorder_blocks = false;
+		else if (argument == "-freorder-blocks")
+			reorder_blocks = true;
+		else if (argument == "-fno-reorder-blocks-and-partition")
+			split_cold_code = false;
+		else if (argument == "-freorder-blocks-and-partition")
+			split_cold_code = true;
+		else if (argument.starts_with("-fcold-branch-percent="))
+			read_count(argument, 22, cold_branch_percent);
+		else if (argument == "-fno-align-loops")
+			align_loops = false;
+		else if (argument == "-falign-loops")
+			align_loops = true;
+		else if (argument.starts_with("-fprofile-use="))
+			profile_use = argument.substr(14);
+		else if (argument == "-fprofile-generate")
+			profile_generate = "default.profile";
+		else if (argument.starts_with("-fprofile-generate="))
+			profile_generate = argument.substr(19);
+		else if (argument.starts_with("-fprofile-hot-percent="))
+			read_count(argument, 22, profile_hot_percent);
+		else if (argument == "-fno-optimize-sibling-calls")
+			tail_calls = false;
+		else if (argument == "-foptimize-sibling-calls")
+			tail_calls = true;
+		else if (argument == "-fno-unroll-loops")
+			unroll_loops = false;
+		else if (argument == "-funroll-loops")
+			unroll_loops = true;
+		else if (argument.starts_with("-funroll-factor="))
+			read_count(argument, 16, unroll_factor);
+		else if (argument.starts_with("-funroll-full-max-trips="))
+			read_count(argument, 24, unroll_full_max_trips);
+		else if (argument.starts_with("-funroll-full-size="))
+			read_count(argument, 19, unroll_full_size);
+		else if (argument.starts_with("-funroll-size="))
+			read_count(argument, 14, unroll_size);
+		else if (argument.starts_with("-funroll-hot-size="))
+			read_count(argument, 18, unroll_hot_size);
+		else if (argument == "-fno-dce")
+			eliminate_dead_code = false;
+		else if (argument == "-fdce")
+			eliminate_dead_code = true;
+		else if (argument == "-fno-cse")
+			eliminate_common_subexpressions = false;
+		else if (argument == "-fcse")
+			eliminate_common_subexpressions = true;
+		else if (argument == "-fno-gcse")
+			global_value_numbering = false;
+		else if (argument == "-fgcse")
+			global_value_numbering = true;
+		else if (argument == "-fomit-leaf-frame-pointer")
+			omit_leaf_frame_pointer = true;
+		else if (argument == "-fno-omit-leaf-frame-pointer")
+			omit_leaf_frame_pointer = false;
+		else if (argument == "-fno-tree-vectorize")
+			vectorize = false;
+		else if (argument == "-ftree-vectorize")
+			vectorize = true;
+		else if (argument == "-mavx2")
+			avx2 = true;
+		else if (argument == "-mno-avx2" || argument == "-msse2")
+			avx2 = false;
+		else if (argument == "-fno-propagate-globals")
+			propagate_globals = false;
+		else if (argument == "-fpropagate-globals")
+			propagate_globals = true;
+		else if (argument == "-fno-toplevel-reorder")
+			reorder_globals = false;
+		else if (argument == "-ftoplevel-reorder")
+			reorder_globals = true;
+		else if (argument == "-fno-jump-tables")
+			jump_tables = false;
+		else if (argument == "-fjump-tables")
+			jump_tables = true;
+		else if (argument.starts_with("-fjump-table-min-cases="))
+			read_count(argument, 23, jump_table_min_cases);
+		else if (argument.starts_with("-fjump-table-density="))
+			read_count(argument, 21, jump_table_density);
+		else if (argument == "-fno-bit-tests")
+			bit_tests = false;
+		else if (argument == "-fbit-tests")
+			bit_tests = true;
+		else if (argument == "-fdump-record-layouts")
+			dump_record_layouts = true;
+		else if (argument == "-g")
+			debug_info = true;
+		else if (argument == "-g0")
+			debug_info = false;
+		else if (argument == "-fasynchronous-unwind-tables")
+			unwind_tables = true;
+		else if (argument == "-fno-asynchronous-unwind-tables")
+			unwind_tables = false;
+		else if (argument == "-ftrace")
+			trace = "trace.bin";
+		else if (argument.starts_with("-ftrace="))
+			trace = argument.substr(8);
+		else if (argument.starts_with("-ftrace-buffer=")) {
+			int entries = 0;
+			if (read_count(argument, 15, entries)) {
+				trace_buffer_entries = 1;
+				while (trace_buffer_entries < entries && trace_buffer_entries < (1 << 24))
+					trace_buffer_entries *= 2;
+			}
+		}
+		else if (argument == "-c")
+			emit_object = true;
+		else if (argument == "-S")
+			emit_object = false;
+		else if (argument == "--run")
+			run = true;
+		else if (argument == "-fwhole-program")
+			whole_program = true;
+		else if (argument == "-fno-whole-program")
+			whole_program = false;
+		else if (argument == "-mpopcnt")
+			popcnt = true;
+		else if (argument == "-mno-popcnt")
+			popcnt = false;
+		else if (argument == "-mlzcnt")
+			lzcnt = true;
+		else if (argument == "-mno-lzcnt")
+			lzcnt = false;
+		else if (argument == "-mbmi")
+			bmi = true;
+		else if (argument == "-mno-bmi")
+			bmi = false;
+		else
+			return false;
+		return true;
+	}
+};
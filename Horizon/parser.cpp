@@ -1,6 +1,10 @@
 #include "pch.h"
 #include "parser.h"
+#include "layout.h"
+#include "intrinsics.h"
+#include "targets.h"
 #include <memory>
+#include <bit>
 
 using std::shared_ptr, std::make_shared, std::dynamic_pointer_cast;
 
@@ -14,11 +18,31 @@ shared_ptr<AST> Parser::parse() {
 }
 
 shared_ptr<Statement> Parser::statement() {
+	Token start = current_token;
+	shared_ptr<Statement> stmt = unlocated_statement();
+	if (stmt) {
+		stmt->line = start.line;
+		stmt->column = start.column;
+	}
+	return stmt;
+}
+
+shared_ptr<Statement> Parser::unlocated_statement() {
 	if (current_token.type == TOKEN_KEYWORD) {						// Handle statement depending on keyword
 		if (current_token.value == "fn")
 			return function();
+		else if (current_token.value == "extern") {
+			next();
+			if (current_token.type != TOKEN_KEYWORD || current_token.value != "fn") {
+				make_error("Expected 'fn' after 'extern'");
+				return nullptr;
+			}
+			return function(true);
+		}
 		else if (current_token.value == "let")
 			return variable_declaration();
+		else if (current_token.value == "const")
+			return variable_declaration(true);
 		else if (current_token.value == "return")
 			return return_statement();
 		else if (current_token.value == "if")
@@ -29,6 +53,12 @@ shared_ptr<Statement> Parser::statement() {
 			return while_statement(DO_WHILE_STM);
 		else if (current_token.value == "for")
 			return for_statement();
+		else if (current_token.value == "match")
+			return match_statement();
+		else if (current_token.value == "struct")
+			return struct_declaration();
+		else if (current_token.value == "asm")
+			return asm_statement();
 		else if (current_token.value == "break") {
 			next();
 			return make_shared<BreakStatement>();
@@ -101,7 +131,7 @@ void Parser::make_error(std::string message) {
 	panic_mode = true;
 }
 
-shared_ptr<Function> Parser::function() {
+shared_ptr<Function> Parser::function(bool is_extern) {
 	shared_ptr<Function> new_function = std::make_shared<Function>();
 
 	next();
@@ -111,13 +141,32 @@ shared_ptr<Function> Parser::function() {
 		make_error("Expected function identifier");
 	}
 	new_function->name = tok.value;									// Get function name
+	if (intrinsic_named(tok.value) != INTRINSIC_NONE)
+		make_error(tok.value + " is an intrinsic and can't be redefined");
+	type_parameters.clear();
+	if (match(TOKEN_LESS)) {										// Type parameters of a generic function
+		while (current_token.type == TOKEN_ID) {
+			if (std::find(type_parameters.begin(), type_parameters.end(), current_token.value) != type_parameters.end())
+				make_error("Type parameter " + current_token.value + " is already declared");
+			type_parameters.push_back(current_token.value);
+			next();
+			if (!match(TOKEN_COMMA))
+				break;
+		}
+		if (type_parameters.empty())
+			make_error("Expected type parameter");
+		if (!match(TOKEN_GREATER))
+			make_error("Expected '>'");
+		if (is_extern)
+			make_error("Extern functions can't be generic");
+		new_function->type_parameters = type_parameters;
+	}
 	if (!match(TOKEN_L_PAR)) {										// Function parameters
 		make_error("Expected '('");
 		
 	}
 	bool had_error = false;
 	while (current_token.type != TOKEN_R_PAR && current_token.type != TOKEN_EOF) {
-		std::cout << "HERE";
 		Token tok = current_token;
 		if (!match(TOKEN_ID)) {
 			make_error("Expected identifier");
@@ -127,12 +176,18 @@ shared_ptr<Function> Parser::function() {
 			make_error("Expected '->'");
 			return new_function;
 		}
-		if (!match(TOKEN_TYPE)) {
+		Token type_tok = current_token;
+		if (is_type_parameter(type_tok))
+			next();
+		else if (!match(TOKEN_TYPE)) {
 			make_error("Expected type after '->'");
-			std::cout << "Here";
 			return new_function;
 		}
+		VectorType vector_type;
+		if (vector_type_named(type_tok.value, vector_type))					// Vectors stay in the function that declares them
+			make_error("Vector types can only be used for local variables");
 		new_function->parameters.push_back(make_shared<Name>(tok.value));
+		new_function->parameter_types.push_back(type_tok.value);
 		match(TOKEN_COMMA);
 	}
 	
@@ -142,11 +197,20 @@ shared_ptr<Function> Parser::function() {
 	
 	if (match(TOKEN_ARROW)) {										// Handle function type
 		tok = current_token;
-		if (!match(TOKEN_TYPE)) {
+		int size;
+		bool is_signed;
+		new_function->return_type_name = tok.value;
+		if (is_type_parameter(tok)) {								// Decided by the instantiation
+			next();
+			new_function->return_type = TYPE_INTEGER;
+		}
+		else if (!match(TOKEN_TYPE)) {
 			make_error("Expected type after '->'");
 		}
-		else if (tok.value == "isize")
+		else if (integer_type_named(tok.value, size, is_signed))
 			new_function->return_type = TYPE_INTEGER;
+		else if (tok.value == "string")
+			new_function->return_type = TYPE_STRING;
 		else if (tok.value == "void")
 			new_function->return_type = TYPE_VOID;
 		else {
@@ -156,10 +220,39 @@ shared_ptr<Function> Parser::function() {
 	else {
 		new_function->return_type = TYPE_VOID;
 	}
+	if (current_token.type == TOKEN_ID && current_token.value == "targets") {	// targets("sse4.2", "avx2") adds variants to the baseline one
+		next();
+		if (!match(TOKEN_L_PAR))
+			make_error("Expected '('");
+		do {
+			tok = current_token;
+			if (!match(TOKEN_STR)) {
+				make_error("Expected target name");
+				break;
+			}
+			if (target_rank(tok.value) == 0)
+				error_handler->report_error("Unknown target " + tok.value + ", expected sse4.2 or avx2", tok);
+			else if (std::find(new_function->targets.begin(), new_function->targets.end(), tok.value) != new_function->targets.end())
+				error_handler->report_error("Target " + tok.value + " is already given", tok);
+			else
+				new_function->targets.push_back(tok.value);
+		} while (match(TOKEN_COMMA));
+		if (!match(TOKEN_R_PAR))
+			make_error("Expected ')'");
+		if (is_extern)
+			make_error("Extern functions can't have targets");
+	}
+	if (is_extern) {												// Only the signature of native functions is declared
+		new_function->is_extern = true;
+		if (!match(TOKEN_SEMICOLON))
+			make_error("Expected ';'");
+		return new_function;
+	}
 	if (!match(TOKEN_L_BRACE)) {									
 		make_error("Expected '{'");
 	}
 	new_function->statement = compound_statement();					// Make function body
+	type_parameters.clear();
 	
 	return new_function;
 }
@@ -187,6 +280,18 @@ std::shared_ptr<Expression> Parser::assignment_helper(bool is_compound, Compound
 		make_error("Invalid assignment target");
 	}
 	assignment->variable_name = tok.value;
+	if (match(TOKEN_L_BRACK)) {										// Store to an array element
+		assignment->index = expression();
+		if (!match(TOKEN_R_BRACK)) {
+			make_error("Expected ']'");
+		}
+	}
+	if (match(TOKEN_DOT)) {											// Store to a field
+		tok = current_token;
+		if (!match(TOKEN_ID))
+			make_error("Expected field name after '.'");
+		assignment->field = tok.value;
+	}
 	next();
 	if(compound != INCREMENT && compound != DECREMENT)
 		assignment->to_assign = expression();
@@ -195,8 +300,22 @@ std::shared_ptr<Expression> Parser::assignment_helper(bool is_compound, Compound
 }
 
 shared_ptr<Expression> Parser::expression() {
-	if (index + 1 < tokens.size()) {								// ASSIGNMENT
-		switch (tokens[index + 1].type)
+	size_t operator_index = index + 1;
+	if (current_token.type == TOKEN_ID && operator_index < tokens.size() && tokens[operator_index].type == TOKEN_L_BRACK) {	// The assignment operator follows the index
+		int depth = 0;
+		for (; operator_index < tokens.size() && tokens[operator_index].type != TOKEN_EOF; operator_index++) {
+			if (tokens[operator_index].type == TOKEN_L_BRACK)
+				depth++;
+			else if (tokens[operator_index].type == TOKEN_R_BRACK && --depth == 0)
+				break;
+		}
+		operator_index++;
+	}
+	if (current_token.type == TOKEN_ID && operator_index + 1 < tokens.size() && tokens[operator_index].type == TOKEN_DOT
+		&& tokens[operator_index + 1].type == TOKEN_ID)				// And the field
+		operator_index += 2;
+	if (operator_index < tokens.size()) {							// ASSIGNMENT
+		switch (tokens[operator_index].type)
 		{
 		case TOKEN_EQUAL:
 			return assignment_helper(false, ADDITION);
@@ -420,8 +539,16 @@ std::shared_ptr<Expression> Parser::parse_factor() {
 	shared_ptr<Expression> expr;
 	Token tok = current_token;
 	if (match(TOKEN_INT)) {											// If token is a value make constant
-		expr = make_shared<Constant>(stoi(tok.value));
+		try {
+			expr = make_shared<Constant>((long long)std::stoull(tok.value));		// Up to 2^64 - 1, so that -9223372036854775808 can be written
+		}
+		catch (const std::out_of_range&) {
+			make_error("Integer literal does not fit in 64 bits");
+			expr = make_shared<Constant>(0);
+		}
 	}
+	else if (match(TOKEN_STR))
+		expr = make_shared<StringLiteral>(tok.value);
 	else if (match(TOKEN_TILDE) || match(TOKEN_BANG) || match(TOKEN_MINUS)) {	// If token is a unary operator make unary expression
 		TokenType op = tok.type;
 		shared_ptr<Expression> new_expr = expression();
@@ -433,9 +560,27 @@ std::shared_ptr<Expression> Parser::parse_factor() {
 			make_error("Expected ')'");
 		}
 	}
+	else if (match(TOKEN_TYPE)) {									// Conversion to an integer type, i32(x) wraps x to 32 bits
+		int size;
+		bool is_signed;
+		if (!integer_type_named(tok.value, size, is_signed))
+			make_error("Only integer types can be converted to");
+		shared_ptr<Call> conversion = make_shared<Call>(tok.value);
+		if (!match(TOKEN_L_PAR))
+			make_error("Expected '('");
+		conversion->arguments.push_back(expression());
+		if (!match(TOKEN_R_PAR))
+			make_error("Expected ')'");
+		expr = conversion;
+	}
 	else if (match(TOKEN_ID)) {
+		std::vector<std::string> arguments;
+		if (current_token.type == TOKEN_LESS && index + 1 < tokens.size()
+			&& (tokens[index + 1].type == TOKEN_TYPE || is_type_parameter(tokens[index + 1])) && !type_arguments(arguments))	// Not a comparison, a type can't be compared
+			make_error("Expected '(' after type arguments");
 		if (match(TOKEN_L_PAR)) {
 			shared_ptr<Call> call = make_shared<Call>(tok.value);
+			call->type_arguments = arguments;
 			while (current_token.type != TOKEN_R_PAR && current_token.type != TOKEN_EOF) {
 				call->arguments.push_back(expression());
 				match(TOKEN_COMMA);
@@ -445,8 +590,25 @@ std::shared_ptr<Expression> Parser::parse_factor() {
 			}
 			expr = call;
 		}
+		else if (match(TOKEN_L_BRACK)) {
+			expr = make_shared<IndexExpression>(tok.value, expression());
+			if (!match(TOKEN_R_BRACK)) {
+				make_error("Expected ']'");
+			}
+		}
 		else
 			expr = make_shared<Name>(tok.value);
+		if (expr->type != CALL_EXPR && match(TOKEN_DOT)) {			// Field of a struct or of an element of an array of structs
+			Token field = current_token;
+			if (!match(TOKEN_ID))
+				make_error("Expected field name after '.'");
+			expr = make_shared<FieldExpression>(expr, field.value);
+		}
+	}
+	else {															// Such as a stray '..', skipped so that the caller can't loop on it
+		make_error("Unexpected token");
+		if (current_token.type != TOKEN_EOF)
+			next();
 	}
 
 	return expr;
@@ -476,8 +638,18 @@ std::shared_ptr<Compound> Parser::compound_statement() {
 	return block;
 }
 
-std::shared_ptr<Statement> Parser::variable_declaration() {
+bool vector_type_named(const std::string& name, VectorType& type) {
+	if (name == "i32x4")		type = { 32, 4 };
+	else if (name == "i32x8")	type = { 32, 8 };
+	else if (name == "i64x2")	type = { 64, 2 };
+	else if (name == "i64x4")	type = { 64, 4 };
+	else						return false;								// f32x8 and f64x4 wait for floating point scalars
+	return true;
+}
+
+std::shared_ptr<Statement> Parser::variable_declaration(bool is_const) {
 	shared_ptr<VariableDeclaration> variable_decl = make_shared<VariableDeclaration>();
+	variable_decl->is_const = is_const;
 	bool has_type = false;
 	next();
 	Token tok = current_token;
@@ -488,13 +660,66 @@ std::shared_ptr<Statement> Parser::variable_declaration() {
 	
 	if (match(TOKEN_ARROW)) {
 		Token tok = current_token;
-		if (!match(TOKEN_TYPE)) {
+		if (match(TOKEN_L_BRACK)) {											// Array type, [isize; N] or [Struct; N]
+			tok = current_token;
+			if (match(TOKEN_ID)) {
+				if (structs.find(tok.value) == structs.end())
+					make_error("Unknown type " + tok.value);
+				else
+					variable_decl->struct_type = structs[tok.value];
+			}
+			else if (!match(TOKEN_TYPE) || tok.value != "isize")
+				make_error("Expected array element type");
+			if (!match(TOKEN_SEMICOLON))
+				make_error("Expected ';'");
+			tok = current_token;
+			if (!match(TOKEN_INT) || std::stoll(tok.value) <= 0)
+				make_error("Expected array length");
+			else
+				variable_decl->array_length = std::stoi(tok.value);
+			if (!match(TOKEN_R_BRACK))
+				make_error("Expected ']'");
+			if (current_token.type == TOKEN_ID && current_token.value == "soa") {	// One array per field instead of an array of whole structs
+				if (!variable_decl->struct_type)
+					make_error("Only arrays of structs can be stored as structures of arrays");
+				variable_decl->is_soa = true;
+				next();
+			}
+			if (current_token.type == TOKEN_EQUAL)
+				make_error("Arrays can't be initialized, their elements start at zero");
+			has_type = true;
+		}
+		else if (is_type_parameter(tok)) {									// Takes the width of the instantiation
+			next();
+			variable_decl->type_name = tok.value;
+			has_type = true;
+		}
+		else if (match(TOKEN_ID)) {
+			if (structs.find(tok.value) == structs.end())
+				make_error("Unknown type " + tok.value);
+			else
+				variable_decl->struct_type = structs[tok.value];
+			if (current_token.type == TOKEN_EQUAL)
+				make_error("Structs can't be initialized, their fields start at zero");
+			has_type = true;
+		}
+		else if (!match(TOKEN_TYPE)) {
 			make_error("Expected variable type");
 			
 		}
 		else {
-			if (tok.value == "isize")
+			int size;
+			bool is_signed;
+			if (integer_type_named(tok.value, size, is_signed)) {
 				variable_decl->holds_type = TYPE_INTEGER;
+				variable_decl->type_name = tok.value;
+			}
+			else if (tok.value == "string") {								// Held as the address of the characters
+				variable_decl->holds_type = TYPE_STRING;
+				variable_decl->type_name = tok.value;
+			}
+			else if (vector_type_named(tok.value, variable_decl->vector_type))
+				variable_decl->holds_type = TYPE_VECTOR;
 			else {
 				make_error("Expected variable type");
 			}
@@ -502,7 +727,9 @@ std::shared_ptr<Statement> Parser::variable_declaration() {
 		}
 	}
 	if (!match(TOKEN_EQUAL)) {
-		if (!has_type) {
+		if (is_const)
+			make_error("Constant must be initialized");
+		else if (!has_type) {
 			make_error("Type must be annotated for an uninitialized variable");
 		}
 	}
@@ -518,6 +745,169 @@ std::shared_ptr<Statement> Parser::variable_declaration() {
 	return variable_decl;
 }
 
+bool integer_type_named(const std::string& name, int& size, bool& is_signed) {
+	is_signed = !name.empty() && name[0] == 'i';
+	if (name == "isize" || name == "i64" || name == "usize" || name == "u64")	size = 8;
+	else if (name == "i32" || name == "u32")									size = 4;
+	else if (name == "i16" || name == "u16")									size = 2;
+	else if (name == "i8" || name == "u8")										size = 1;
+	else																		return false;
+	return true;
+}
+
+static bool parse_alignment(const Token& tok, int& alignment) {				// A power of two up to 4096
+	if (tok.type != TOKEN_INT || tok.value.size() > 4)
+		return false;
+	alignment = std::stoi(tok.value);
+	return alignment > 0 && alignment <= 4096 && std::has_single_bit((unsigned)alignment);
+}
+
+bool Parser::is_type_parameter(const Token& tok) {
+	return tok.type == TOKEN_ID && std::find(type_parameters.begin(), type_parameters.end(), tok.value) != type_parameters.end();
+}
+
+bool Parser::type_arguments(std::vector<std::string>& arguments) {		// Returns false unless a '(' follows
+	next();
+	while (current_token.type == TOKEN_TYPE || is_type_parameter(current_token)) {
+		arguments.push_back(current_token.value);
+		next();
+		if (!match(TOKEN_COMMA))
+			break;
+	}
+	if (!match(TOKEN_GREATER))
+		make_error("Expected '>'");
+	return current_token.type == TOKEN_L_PAR;
+}
+
+std::shared_ptr<Statement> Parser::struct_declaration() {				// struct Name [packed] [ordered] [align N] { field -> type [align N]; ... }
+	next();
+	shared_ptr<StructDeclaration> decl = make_shared<StructDeclaration>();
+	Token tok = current_token;
+	if (!match(TOKEN_ID))
+		make_error("Expected struct name");
+	decl->name = tok.value;
+	while (current_token.type == TOKEN_ID) {
+		if (current_token.value == "packed")
+			decl->is_packed = true;
+		else if (current_token.value == "ordered")
+			decl->keeps_order = true;
+		else if (current_token.value == "align") {
+			next();
+			if (!parse_alignment(current_token, decl->explicit_alignment))
+				make_error("Expected a power of two alignment");
+		}
+		else
+			break;
+		next();
+	}
+	if (!match(TOKEN_L_BRACE))
+		make_error("Expected '{'");
+	while (current_token.type != TOKEN_R_BRACE && current_token.type != TOKEN_EOF && !panic_mode) {
+		StructField field;
+		tok = current_token;
+		if (!match(TOKEN_ID))
+			make_error("Expected field name");
+		field.name = tok.value;
+		if (std::any_of(decl->fields.begin(), decl->fields.end(), [&](const StructField& other) { return other.name == field.name; }))
+			make_error("Field " + field.name + " is already declared in struct " + decl->name);
+		if (!match(TOKEN_ARROW))
+			make_error("Expected '->'");
+		tok = current_token;
+		if (!match(TOKEN_TYPE) || !integer_type_named(tok.value, field.size, field.is_signed))
+			make_error("Expected an integer field type");
+		field.type_name = tok.value;
+		if (current_token.type == TOKEN_ID && current_token.value == "align") {
+			next();
+			if (!parse_alignment(current_token, field.explicit_alignment))
+				make_error("Expected a power of two alignment");
+			next();
+		}
+		if (!match(TOKEN_SEMICOLON))
+			make_error("Expected ';'");
+		decl->fields.push_back(field);
+	}
+	if (!match(TOKEN_R_BRACE))
+		make_error("Expected '}'");
+	if (decl->fields.empty())
+		make_error("Struct " + decl->name + " has no fields");
+	if (structs.find(decl->name) != structs.end())
+		make_error("Struct " + decl->name + " is already declared");
+	lay_out_struct(*decl);
+	structs[decl->name] = decl;
+	return decl;
+}
+
+std::shared_ptr<Statement> Parser::asm_statement() {						// asm("rdtsc" : "=a"(low), "=d"(high) : : "cc");
+	next();
+	shared_ptr<AsmStatement> stmt = make_shared<AsmStatement>();
+	if (!match(TOKEN_L_PAR)) {
+		make_error("Expected '('");
+		return stmt;
+	}
+	Token tok = current_token;
+	if (!match(TOKEN_STR)) {
+		make_error("Expected assembly template");
+		return stmt;
+	}
+	stmt->assembly = tok.value;
+	while (current_token.type == TOKEN_STR) {									// Adjacent strings are joined, one per line reads best
+		stmt->assembly += current_token.value;
+		next();
+	}
+	if (match(TOKEN_COLON) && asm_operands(stmt->outputs, true) && match(TOKEN_COLON) && asm_operands(stmt->inputs, false)
+		&& match(TOKEN_COLON) && current_token.type != TOKEN_R_PAR) {
+		do {
+			tok = current_token;
+			if (!match(TOKEN_STR)) {
+				make_error("Expected clobbered register");
+				break;
+			}
+			stmt->clobbers.push_back(tok.value);
+		} while (match(TOKEN_COMMA));
+	}
+	if (!match(TOKEN_R_PAR))
+		make_error("Expected ')'");
+	if (!match(TOKEN_SEMICOLON))
+		make_error("Expected ';'");
+	return stmt;
+}
+
+bool Parser::asm_operands(std::vector<AsmOperand>& operands, bool are_outputs) {
+	if (current_token.type == TOKEN_COLON || current_token.type == TOKEN_R_PAR)	// The list may be empty
+		return true;
+	do {
+		AsmOperand operand;
+		Token tok = current_token;
+		if (!match(TOKEN_STR)) {
+			make_error("Expected operand constraint");
+			return false;
+		}
+		operand.constraint = tok.value;
+		std::string letters = operand.constraint;
+		bool is_output = !letters.empty() && (letters[0] == '=' || letters[0] == '+');
+		if (is_output)
+			letters.erase(0, 1);
+		if (is_output != are_outputs)
+			error_handler->report_error(are_outputs ? "Expected '=' or '+' before an output constraint" : "Input constraints can't start with '=' or '+'", tok);
+		else if (letters.empty() || letters.find_first_not_of(are_outputs ? "rmgabcdSD" : "rmigabcdSD") != std::string::npos)
+			error_handler->report_error("Unknown constraint " + operand.constraint, tok);
+		if (!match(TOKEN_L_PAR)) {
+			make_error("Expected '('");
+			return false;
+		}
+		operand.expression = expression();
+		if (!match(TOKEN_R_PAR)) {
+			make_error("Expected ')'");
+			return false;
+		}
+		if (are_outputs && operand.expression && operand.expression->type != NAME && operand.expression->type != INDEX_EXPR
+			&& operand.expression->type != FIELD_EXPR)
+			error_handler->report_error("Output of asm must be a variable, an element or a field", tok);
+		operands.push_back(operand);
+	} while (match(TOKEN_COMMA));
+	return true;
+}
+
 std::shared_ptr<Statement> Parser::if_statement() {
 	next();
 	shared_ptr<IfStatement> if_stmt = make_shared<IfStatement>();
@@ -533,4 +923,84 @@ std::shared_ptr<Statement> Parser::if_statement() {
 	}
 
 	return if_stmt;
-}
\ No newline at end of file
+}
+
+std::shared_ptr<Statement> Parser::match_statement() {				// match x { 1, 2 -> ... 3..7 -> ... else -> ... }
+	next();
+	shared_ptr<MatchStatement> match_stmt = make_shared<MatchStatement>();
+	match_stmt->expression = expression();
+	if (!match(TOKEN_L_BRACE)) {
+		make_error("Expected '{'");
+		return match_stmt;
+	}
+	while (current_token.type != TOKEN_R_BRACE && current_token.type != TOKEN_EOF) {
+		if (match(TOKEN_SEMICOLON))												// Left after arms like 3 -> break;
+			continue;
+		if (current_token.type == TOKEN_KEYWORD && current_token.value == "else") {	// Default arm
+			next();
+			if (match_stmt->has_default)
+				make_error("Match already has an else arm");
+			if (!match(TOKEN_ARROW))
+				make_error("Expected '->'");
+			match_stmt->has_default = true;
+			match_stmt->default_body = statement();
+			continue;
+		}
+		MatchArm arm;
+		do {
+			Token tok = current_token;
+			long long low, high;
+			if (!match_pattern(low)) {
+				make_error("Expected integer in match arm");
+				return match_stmt;
+			}
+			high = low;
+			if (match(TOKEN_DOT_DOT) && !match_pattern(high)) {
+				make_error("Expected integer after '..'");
+				return match_stmt;
+			}
+			if (low > high) {
+				error_handler->report_error("Empty range in match arm", tok);
+				continue;
+			}
+			for (MatchArm& other : match_stmt->arms) {								// Every value selects at most one arm
+				for (std::pair<long long, long long>& range : other.ranges) {
+					if (low <= range.second && range.first <= high)
+						error_handler->report_error("Overlapping match arms", tok);
+				}
+			}
+			for (std::pair<long long, long long>& range : arm.ranges) {
+				if (low <= range.second && range.first <= high)
+					error_handler->report_error("Overlapping match arms", tok);
+			}
+			arm.ranges.push_back({ low, high });
+		} while (match(TOKEN_COMMA));
+		if (!match(TOKEN_ARROW)) {
+			make_error("Expected '->'");
+			return match_stmt;
+		}
+		arm.body = statement();
+		match_stmt->arms.push_back(arm);
+	}
+	if (!match(TOKEN_R_BRACE)) {
+		make_error("Expected '}'");
+	}
+	return match_stmt;
+}
+
+bool Parser::match_pattern(long long& value) {
+	bool negative = match(TOKEN_MINUS);
+	Token tok = current_token;
+	if (!match(TOKEN_INT))
+		return false;
+	try {
+		value = (long long)std::stoull(tok.value);
+	}
+	catch (const std::out_of_range&) {
+		make_error("Integer literal does not fit in 64 bits");
+		value = 0;
+	}
+	if (negative)
+		value = (long long)(0 - (unsigned long long)value);
+	return true;
+}
@@ -1,6 +1,8 @@
 #pragma once
 #include <vector>
 #include <string>
+#include <utility>
+#include <unordered_map>
 #include "lexer.h"
 #include "error.h"
 
@@ -9,9 +11,22 @@ enum ValueType {
 	TYPE_FLOAT,
 	TYPE_STRING,
 	TYPE_VOID,
-	TYPE_BOOL
+	TYPE_BOOL,
+	TYPE_VECTOR
 };
 
+class VectorType {															// A SIMD type such as i32x4, held in an XMM or YMM register
+public:
+	int lane_bits = 0;															// 32 or 64, 0 for scalars
+	int lanes = 0;
+	int bytes() const { return lane_bits * lanes / 8; }
+	std::string name() const { return "i" + std::to_string(lane_bits) + "x" + std::to_string(lanes); }
+	bool operator==(const VectorType& other) const = default;
+};
+
+bool vector_type_named(const std::string& name, VectorType& type);			// False for scalar types and unsupported lane types
+bool integer_type_named(const std::string& name, int& size, bool& is_signed);	// i8 to u64, isize and usize, size in bytes
+
 enum NodeType {
 	NODE,
 	EXPRESSION,
@@ -33,7 +48,14 @@ enum NodeType {
 	CONTINUE_STM,
 	BREAK_STM,
 	FOR_STM,
-	CALL_EXPR
+	CALL_EXPR,
+	INLINED_CALL_EXPR,
+	MATCH_STM,
+	STRING_EXPR,
+	INDEX_EXPR,
+	STRUCT_DECL,
+	FIELD_EXPR,
+	ASM_STM
 };
 
 class Node {
@@ -47,6 +69,8 @@ public:
 	Statement() {
 		type = STATEMENT;
 	}
+	int line = 0;																// Where the statement starts, 0 for statements made by the passes
+	int column = 0;
 };
 
 
@@ -68,6 +92,33 @@ public:
 	}
 };
 
+class StructField {
+public:
+	std::string name;
+	std::string type_name;														// i8 to u64, isize and usize
+	int size = 8;																// Bytes, 1, 2, 4 or 8
+	bool is_signed = true;
+	int alignment = 8;															// Natural alignment of the size unless packed, at least the explicit one
+	int explicit_alignment = 0;													// From align N after the type, 0 if not given
+	int offset = 0;																// Set by the layout engine
+};
+
+class StructDeclaration : public Statement {
+public:
+	StructDeclaration() {
+		type = STRUCT_DECL;
+	}
+	std::string name;
+	std::vector<StructField> fields;											// In layout order once laid out
+	bool is_packed = false;														// No padding, fields are aligned to one byte
+	bool keeps_order = false;													// Declared ordered, the fields stay in source order
+	int explicit_alignment = 0;
+	int alignment = 1;
+	int size = 0;
+	int padding = 0;															// Bytes between and after the fields
+	int declared_order_size = 0;												// Size the fields would take in source order
+};
+
 class VariableDeclaration : public Statement {
 public:
 	VariableDeclaration() {
@@ -79,6 +130,14 @@ public:
 	std::shared_ptr<Expression> optional_to_assign;
 	bool is_global = false;
 	int global_value;
+	bool is_const = false;														// Declared with const, never assigned and placed in .rodata
+	int layout_rank = 0;														// Position of a global in its data section, set by the global optimizer
+	bool starts_cache_line = false;												// Padded so that its group of globals doesn't straddle a cache line
+	int array_length = 0;														// Elements of an array declared as [isize; N], 0 for scalars
+	VectorType vector_type;														// Lanes of a variable of a SIMD type
+	std::string type_name = "";													// Declared scalar type such as i32, or a type parameter, empty if not given
+	std::shared_ptr<StructDeclaration> struct_type;								// Type of a struct variable, or of the elements of an array of structs
+	bool is_soa = false;														// Array of structs stored as one array per field
 };
 
 class Name : public Expression {
@@ -92,6 +151,12 @@ public:
 	std::string name = "";
 };
 
+class ProfileSite {															// Identifies a branch, loop or call in profiles, numbered before any transformation
+public:
+	std::string function;														// Function the statement was written in, copies made by inlining keep it
+	int index = -1;
+};
+
 class Call : public Expression {
 public:
 	Call() {
@@ -101,7 +166,9 @@ public:
 		type = CALL_EXPR;
 	}
 	std::string name = "";
+	std::vector<std::string> type_arguments;									// Given explicitly to a generic function, as in max<i32>(a, b)
 	std::vector<std::shared_ptr<Expression>> arguments;
+	ProfileSite site;
 };
 
 enum CompoundAssignment {
@@ -121,6 +188,8 @@ public:
 		type = VARIABLE_ASSIGN;
 	}
 	std::string variable_name = "";
+	std::shared_ptr<Expression> index;											// Element of an array to store to, null for scalars
+	std::string field = "";														// Field of a struct to store to, empty for other variables
 	std::shared_ptr<Expression> to_assign;
 	bool is_compound = false;
 	CompoundAssignment compound_type = ADDITION;
@@ -131,6 +200,7 @@ public:
 	IfStatement() {
 		type = IF_STATEMENT;
 	}
+	ProfileSite site;
 	std::shared_ptr<Expression> condition;
 	std::shared_ptr<Statement> body;
 	bool has_else = false;
@@ -142,6 +212,7 @@ public:
 	WhileStatement(NodeType node_type = WHILE_STM) {
 		type = node_type;
 	}
+	ProfileSite site;
 	std::shared_ptr<Expression> condition;
 	std::shared_ptr<Statement> body;
 };
@@ -151,12 +222,30 @@ public:
 	ForStatement() {
 		type = FOR_STM;
 	}
+	ProfileSite site;
 	std::shared_ptr<Expression> condition;
 	std::shared_ptr<Expression> post;
 	std::shared_ptr<Statement> body;
 	std::shared_ptr<Statement> initializer;
 };
 
+class MatchArm {
+public:
+	std::vector<std::pair<long long, long long>> ranges;						// Inclusive bounds, a single value has equal bounds
+	std::shared_ptr<Statement> body;
+};
+
+class MatchStatement : public Statement {
+public:
+	MatchStatement() {
+		type = MATCH_STM;
+	}
+	std::shared_ptr<Expression> expression;
+	std::vector<MatchArm> arms;
+	bool has_default = false;
+	std::shared_ptr<Statement> default_body;
+};
+
 class ContinueStatement : public Statement {
 public:
 	ContinueStatement() {
@@ -188,10 +277,36 @@ public:
 
 class Constant : public Expression {
 public:
-	Constant(int value) : value(value) {
+	Constant(long long value) : value(value) {
 		type = CONSTANT_EXPR;
 	}
-	int value = 0;
+	long long value = 0;
+};
+
+class IndexExpression : public Expression {									// Loads an element of an array
+public:
+	IndexExpression(const std::string& array_name, std::shared_ptr<Expression> index) : array_name(array_name), index(index) {
+		type = INDEX_EXPR;
+	}
+	std::string array_name;
+	std::shared_ptr<Expression> index;
+};
+
+class FieldExpression : public Expression {									// Loads a field of a struct variable or of an element of an array of structs
+public:
+	FieldExpression(std::shared_ptr<Expression> object, const std::string& field) : object(object), field(field) {
+		type = FIELD_EXPR;
+	}
+	std::shared_ptr<Expression> object;											// A Name or an IndexExpression
+	std::string field;
+};
+
+class StringLiteral : public Expression {									// Evaluates to the address of a NUL terminated copy in .rodata
+public:
+	StringLiteral(const std::string& value) : value(value) {
+		type = STRING_EXPR;
+	}
+	std::string value;															// Bytes after escape processing, without the terminator
 };
 
 class UnaryExpression : public Expression {
@@ -214,6 +329,23 @@ public:
 	std::shared_ptr<Expression> expression_b;
 };
 
+class AsmOperand {
+public:
+	std::string constraint;														// As written, such as =r, +m or i
+	std::shared_ptr<Expression> expression;										// An output is a variable, an element or a field
+};
+
+class AsmStatement : public Statement {										// asm("template" : outputs : inputs : clobbers);
+public:
+	AsmStatement() {
+		type = ASM_STM;
+	}
+	std::string assembly;														// Template, %0 names the first operand, outputs come first
+	std::vector<AsmOperand> outputs;
+	std::vector<AsmOperand> inputs;
+	std::vector<std::string> clobbers;											// Registers, cc and memory
+};
+
 class Function : public Statement {
 public:
 	Function() {
@@ -221,8 +353,24 @@ public:
 	}
 	std::string name;
 	ValueType return_type = TYPE_VOID;
+	std::string return_type_name = "";											// As written, such as i32 or a type parameter
+	bool is_extern = false;														// Declared with extern fn, defined in another object file and has no body
 	std::shared_ptr<Compound> statement;
 	std::vector<std::shared_ptr<Name>> parameters;
+	std::vector<std::string> parameter_types;									// As written, in the order of the parameters
+	std::vector<std::string> type_parameters;									// Of a generic function, which is only a template for its instantiations
+	std::vector<std::string> targets;											// Instruction set levels compiled as extra variants, picked at run time
+};
+
+class InlinedCall : public Expression {										// A call whose callee body has been substituted in place by the inliner
+public:
+	InlinedCall() {
+		type = INLINED_CALL_EXPR;
+	}
+	std::string name = "";													// Name of the inlined callee
+	std::vector<std::string> parameters;									// Callee parameter names, bound to the arguments in order
+	std::vector<std::shared_ptr<Expression>> arguments;
+	std::shared_ptr<Compound> body;											// Private copy of the callee body
 };
 
 class Return : public Statement {
@@ -256,15 +404,25 @@ private:
 	void print_expression(std::shared_ptr<Expression>& expression);
 
 	std::shared_ptr<Statement> statement();									// General statement handling
-	std::shared_ptr<Function> function();									// Function declaration handling
+	std::shared_ptr<Statement> unlocated_statement();						// Parses a statement without recording where it starts
+	std::shared_ptr<Function> function(bool is_extern = false);			// Function declaration handling, extern ones have no body
 	std::shared_ptr<Return> return_statement();								// Return statement handling
 	std::shared_ptr<Compound> compound_statement();							// Block {} handling
 	std::shared_ptr<ExpressionStatement> expression_statement();			// Simple expression handling
-	std::shared_ptr<Statement> variable_declaration();						// Variable declaration and instansiation handling
+	std::shared_ptr<Statement> variable_declaration(bool is_const = false);	// Variable declaration and instansiation handling
 
 	std::shared_ptr<Statement> if_statement();
 	std::shared_ptr<Statement> while_statement(NodeType node_type = WHILE_STM);
 	std::shared_ptr<Statement> for_statement();
+	std::shared_ptr<Statement> match_statement();
+	std::shared_ptr<Statement> struct_declaration();						// struct Name packed { field -> i32; ... }
+	std::shared_ptr<Statement> asm_statement();
+	bool asm_operands(std::vector<AsmOperand>& operands, bool are_outputs);	// Up to the next ':' or ')'
+	std::vector<std::string> type_parameters;								// Of the generic function being parsed
+	bool is_type_parameter(const Token& tok);
+	bool type_arguments(std::vector<std::string>& arguments);				// <i32, T> after the name of a generic function in a call
+	std::unordered_map<std::string, std::shared_ptr<StructDeclaration>> structs;	// Declared so far, a struct is declared before its uses
+	bool match_pattern(long long& value);									// Integer literal of a match arm, optionally negated
 
 	// EXPRESSIONS
 	std::shared_ptr<Expression> expression();								// Expression handling (Lowest precedence, OR operator)
@@ -0,0 +1,277 @@
+#include "pch.h"
+#include "profile.h"
+#include "intrinsics.h"
+#include <fstream>
+#include <sstream>
+
+using std::shared_ptr, std::make_shared, std::dynamic_pointer_cast;
+
+bool Profile::load(const std::string& path) {
+	std::ifstream file(path);
+	if (!file)
+		return false;
+	std::string line;
+	while (std::getline(file, line)) {
+		std::istringstream record(line);
+		std::string kind, function;
+		int index;
+		long long first, second;
+		if (!(record >> kind >> function))
+			continue;
+		if (kind == "function") {
+			if (record >> first)
+				functions[function] += first;
+			continue;
+		}
+		if (!(record >> index >> first))
+			continue;
+		std::string key = site_key({ function, index });						// Copies of a site made by inlining share its counts
+		if (kind == "call")
+			calls[key] += first;
+		else if (kind == "branch" && record >> second) {
+			branches[key].first += first;
+			branches[key].second += second;
+		}
+		else if (kind == "loop" && record >> second) {
+			loops[key].first += first;
+			loops[key].second += second;
+		}																		// Unknown records are skipped
+	}
+	for (auto& [key, counts] : loops)
+		hottest_loop = std::max(hottest_loop, counts.second);
+	for (auto& [key, count] : calls)
+		hottest_call = std::max(hottest_call, count);
+	return true;
+}
+
+bool Profile::branch_weights(const ProfileSite& site, long long& taken, long long& not_taken) const {
+	auto found = branches.find(site_key(site));
+	if (found == branches.end() || found->second.first + found->second.second == 0)
+		return false;
+	taken = found->second.first;
+	not_taken = found->second.second;
+	return true;
+}
+
+bool Profile::loop_counts(const ProfileSite& site, long long& entries, long long& iterations) const {
+	auto found = loops.find(site_key(site));
+	if (found == loops.end())
+		return false;
+	entries = found->second.first;
+	iterations = found->second.second;
+	return true;
+}
+
+bool Profile::call_count(const ProfileSite& site, long long& count) const {
+	auto found = calls.find(site_key(site));
+	if (found == calls.end())
+		return false;
+	count = found->second;
+	return true;
+}
+
+bool Profile::function_entries(const std::string& name, long long& entries) const {
+	auto found = functions.find(name);
+	if (found == functions.end())
+		return false;
+	entries = found->second;
+	return true;
+}
+
+bool Profile::is_hot_loop(long long iterations, int percent) const {
+	return iterations > 0 && iterations * 100 >= hottest_loop * percent;
+}
+
+bool Profile::is_hot_call(long long count, int percent) const {
+	return count > 0 && count * 100 >= hottest_call * percent;
+}
+
+std::string site_key(const ProfileSite& site) {
+	return site.function + ":" + std::to_string(site.index);
+}
+
+std::string site_record(const std::string& kind, const ProfileSite& site) {
+	return kind + " " + site.function + " " + std::to_string(site.index);
+}
+
+static void number_calls(const shared_ptr<Expression>& expression, const std::string& function, int& calls) {
+	if (!expression)
+		return;
+	switch (expression->type)
+	{
+	case UNARY_EXPR:
+		number_calls(dynamic_pointer_cast<UnaryExpression>(expression)->expression, function, calls);
+		break;
+	case BINARY_EXPR: {
+		shared_ptr<BinaryExpression> binary = dynamic_pointer_cast<BinaryExpression>(expression);
+		number_calls(binary->expression_a, function, calls);
+		number_calls(binary->expression_b, function, calls);
+		break;
+	}
+	case VARIABLE_ASSIGN: {
+		shared_ptr<VariableAssignment> assignment = dynamic_pointer_cast<VariableAssignment>(expression);
+		number_calls(assignment->index, function, calls);
+		number_calls(assignment->to_assign, function, calls);
+		break;
+	}
+	case INDEX_EXPR:
+		number_calls(dynamic_pointer_cast<IndexExpression>(expression)->index, function, calls);
+		break;
+	case FIELD_EXPR:
+		number_calls(dynamic_pointer_cast<FieldExpression>(expression)->object, function, calls);
+		break;
+	case CALL_EXPR: {
+		shared_ptr<Call> call = dynamic_pointer_cast<Call>(expression);
+		call->site = { function, calls++ };
+		for (shared_ptr<Expression>& argument : call->arguments)
+			number_calls(argument, function, calls);
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+static void number_sites(const shared_ptr<Statement>& statement, const std::string& function, int& counter, int& calls) {	// Calls are numbered apart
+	if (!statement)
+		return;
+	switch (statement->type)
+	{
+	case COMPOUND_STM:
+		for (shared_ptr<Statement>& stmt : dynamic_pointer_cast<Compound>(statement)->statements)
+			number_sites(stmt, function, counter, calls);
+		break;
+	case RETURN_STM:
+		number_calls(dynamic_pointer_cast<Return>(statement)->expression, function, calls);
+		break;
+	case EXPR_STM:
+		number_calls(dynamic_pointer_cast<ExpressionStatement>(statement)->expression, function, calls);
+		break;
+	case VARIABLE_DECL:
+		number_calls(dynamic_pointer_cast<VariableDeclaration>(statement)->optional_to_assign, function, calls);
+		break;
+	case IF_STATEMENT: {
+		shared_ptr<IfStatement> if_stmt = dynamic_pointer_cast<IfStatement>(statement);
+		if_stmt->site = { function, counter++ };
+		number_calls(if_stmt->condition, function, calls);
+		number_sites(if_stmt->body, function, counter, calls);
+		number_sites(if_stmt->else_body, function, counter, calls);
+		break;
+	}
+	case WHILE_STM:
+	case DO_WHILE_STM: {
+		shared_ptr<WhileStatement> while_stmt = dynamic_pointer_cast<WhileStatement>(statement);
+		while_stmt->site = { function, counter++ };
+		number_calls(while_stmt->condition, function, calls);
+		number_sites(while_stmt->body, function, counter, calls);
+		break;
+	}
+	case FOR_STM: {
+		shared_ptr<ForStatement> for_stmt = dynamic_pointer_cast<ForStatement>(statement);
+		for_stmt->site = { function, counter++ };
+		number_sites(for_stmt->initializer, function, counter, calls);
+		number_calls(for_stmt->condition, function, calls);
+		number_calls(for_stmt->post, function, calls);
+		number_sites(for_stmt->body, function, counter, calls);
+		break;
+	}
+	case MATCH_STM: {
+		shared_ptr<MatchStatement> match_stmt = dynamic_pointer_cast<MatchStatement>(statement);
+		number_calls(match_stmt->expression, function, calls);
+		for (MatchArm& arm : match_stmt->arms)
+			number_sites(arm.body, function, counter, calls);
+		number_sites(match_stmt->default_body, function, counter, calls);
+		break;
+	}
+	case ASM_STM: {
+		shared_ptr<AsmStatement> asm_stmt = dynamic_pointer_cast<AsmStatement>(statement);
+		for (AsmOperand& operand : asm_stmt->outputs)
+			number_calls(operand.expression, function, calls);
+		for (AsmOperand& operand : asm_stmt->inputs)
+			number_calls(operand.expression, function, calls);
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+void number_profile_sites(const shared_ptr<AST>& ast) {
+	for (shared_ptr<Statement>& stmt : ast->statements) {
+		if (!stmt || stmt->type != FUNCTION_STM)
+			continue;
+		shared_ptr<Function> function = dynamic_pointer_cast<Function>(stmt);
+		int counter = 0;
+		int calls = 0;
+		number_sites(function->statement, function->name, counter, calls);
+	}
+}
+
+static bool is_error_path(const shared_ptr<Statement>& statement) {			// Aborts, or returns a negative error code
+	if (!statement)
+		return false;
+	switch (statement->type)
+	{
+	case COMPOUND_STM: {
+		std::vector<shared_ptr<Statement>>& statements = dynamic_pointer_cast<Compound>(statement)->statements;
+		return std::any_of(statements.begin(), statements.end(), is_error_path);
+	}
+	case RETURN_STM: {
+		shared_ptr<Expression> value = dynamic_pointer_cast<Return>(statement)->expression;
+		if (value && value->type == CONSTANT_EXPR)
+			return dynamic_pointer_cast<Constant>(value)->value < 0;
+		return value && value->type == UNARY_EXPR && dynamic_pointer_cast<UnaryExpression>(value)->operator_type == TOKEN_MINUS
+			&& dynamic_pointer_cast<UnaryExpression>(value)->expression->type == CONSTANT_EXPR;
+	}
+	case EXPR_STM: {
+		shared_ptr<Expression> expression = dynamic_pointer_cast<ExpressionStatement>(statement)->expression;
+		if (!expression || expression->type != CALL_EXPR)
+			return false;
+		const std::string& name = dynamic_pointer_cast<Call>(expression)->name;
+		return name == "abort" || name == "exit" || name == "_exit" || name == "panic";
+	}
+	default:
+		break;
+	}
+	return false;
+}
+
+static bool returns(const shared_ptr<Statement>& statement) {
+	if (!statement)
+		return false;
+	if (statement->type == RETURN_STM)
+		return true;
+	if (statement->type == COMPOUND_STM) {
+		std::vector<shared_ptr<Statement>>& statements = dynamic_pointer_cast<Compound>(statement)->statements;
+		return std::any_of(statements.begin(), statements.end(), returns);
+	}
+	return false;
+}
+
+int estimate_branch_probability(const shared_ptr<IfStatement>& if_statement) {	// Heuristics in the spirit of Ball and Larus, strongest first
+	if (if_statement->condition->type == CALL_EXPR) {							// likely and unlikely state what the programmer expects
+		Intrinsic hint = intrinsic_named(dynamic_pointer_cast<Call>(if_statement->condition)->name);
+		if (hint == INTRINSIC_LIKELY)
+			return 90;
+		if (hint == INTRINSIC_UNLIKELY)
+			return 10;
+	}
+	if (is_error_path(if_statement->body))
+		return 5;
+	if (if_statement->has_else && is_error_path(if_statement->else_body))
+		return 95;
+	if (if_statement->condition->type == BINARY_EXPR) {							// Equality rarely holds
+		TokenType comparison = dynamic_pointer_cast<BinaryExpression>(if_statement->condition)->operator_type;
+		if (comparison == TOKEN_EQUAL_EQUAL)
+			return 30;
+		if (comparison == TOKEN_BANG_EQUAL)
+			return 70;
+	}
+	bool body_returns = returns(if_statement->body);							// Early returns are usually the unusual case
+	bool else_returns = if_statement->has_else && returns(if_statement->else_body);
+	if (body_returns && !else_returns)
+		return 30;
+	if (else_returns && !body_returns)
+		return 70;
+	return 50;
+}
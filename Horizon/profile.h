@@ -0,0 +1,38 @@
+#pragma once
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include "parser.h"
+
+// Execution counts that guide block layout, inlining and unrolling, loaded from a profile or estimated from the source
+//
+// Profile files are text, one record per line. -fprofile-generate builds append theirs when the program exits,
+// so the counts of several runs add up:
+//	branch <function> <index> <taken> <not taken>
+//	loop <function> <index> <entries> <iterations>
+//	call <function> <index> <count>
+//	function <name> <entries>
+
+class Profile {
+public:
+	bool load(const std::string& path);											// False if the file can't be read
+	bool branch_weights(const ProfileSite& site, long long& taken, long long& not_taken) const;	// False if the branch never ran
+	bool loop_counts(const ProfileSite& site, long long& entries, long long& iterations) const;	// False if the loop isn't in the profile
+	bool call_count(const ProfileSite& site, long long& count) const;			// False if the call isn't in the profile
+	bool function_entries(const std::string& name, long long& entries) const;
+	bool is_hot_loop(long long iterations, int percent) const;					// Compared with the loop that iterates the most
+	bool is_hot_call(long long count, int percent) const;						// Compared with the most frequent call site
+private:
+	std::unordered_map<std::string, std::pair<long long, long long>> branches;	// Site key and taken, not taken counts
+	std::unordered_map<std::string, std::pair<long long, long long>> loops;		// Site key and entries, iterations
+	std::unordered_map<std::string, long long> calls;							// Site key and count
+	std::unordered_map<std::string, long long> functions;						// Name and entries
+	long long hottest_loop = 0;
+	long long hottest_call = 0;
+};
+
+std::string site_key(const ProfileSite& site);
+std::string site_record(const std::string& kind, const ProfileSite& site);	// Start of the profile line of a site, as in branch main 3
+void number_profile_sites(const std::shared_ptr<AST>& ast);					// Gives every branch, loop and call its site, run right after parsing
+int estimate_branch_probability(const std::shared_ptr<IfStatement>& if_statement);	// Percent chance that the body of the if runs
@@ -0,0 +1,51 @@
+#include "pch.h"
+#include "string_pool.h"
+#include <algorithm>
+#include <format>
+
+std::string StringPool::label(const std::string& value) {
+	auto found = labels.find(value);
+	if (found != labels.end())
+		return found->second;
+	std::string name = std::format("_str{0}", values.size());
+	labels[value] = name;
+	values.push_back(value);
+	return name;
+}
+
+static std::string escape(const std::string& value) {							// Quoted for the assembler, bytes outside printable ASCII in octal
+	std::string escaped;
+	for (unsigned char character : value) {
+		if (character == '"' || character == '\\')
+			escaped += std::string("\\") + (char)character;
+		else if (character >= ' ' && character <= '~')
+			escaped += character;
+		else
+			escaped += { '\\', (char)('0' + (character >> 6)), (char)('0' + ((character >> 3) & 7)), (char)('0' + (character & 7)) };
+	}
+	return escaped;
+}
+
+std::string StringPool::emit() const {
+	std::vector<std::string> reversed;											// A suffix of a string is a prefix of the reversed string,
+	for (const std::string& value : values)										// so in descending order every string follows the ones it ends
+		reversed.push_back(std::string(value.rbegin(), value.rend()));
+	std::sort(reversed.begin(), reversed.end(), std::greater<std::string>());
+
+	std::string data;
+	std::string aliases;
+	std::string owner;
+	bool has_owner = false;
+	for (const std::string& key : reversed) {
+		std::string value(key.rbegin(), key.rend());
+		if (has_owner && owner.starts_with(key)) {								// Shares the terminator and the last bytes of the owner
+			std::string owner_value(owner.rbegin(), owner.rend());
+			aliases += std::format(".set {0}, {1} + {2}\n", labels.at(value), labels.at(owner_value), owner.size() - key.size());
+			continue;
+		}
+		owner = key;
+		has_owner = true;
+		data += std::format("{0}:\n\t.string \"{1}\"\n", labels.at(value), escape(value));
+	}
+	return data + aliases;
+}
@@ -0,0 +1,16 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+// Read only storage for string literals. Equal strings share one copy and a string that ends
+// another one points into it, so "world" is stored as the tail of "hello world".
+
+class StringPool {
+public:
+	std::string label(const std::string& value);								// Label of the pooled copy of value, added on first use
+	std::string emit() const;													// Data directives for .rodata, labels of shared tails are set to an offset
+private:
+	std::unordered_map<std::string, std::string> labels;
+	std::vector<std::string> values;											// In the order they were first used
+};
@@ -0,0 +1,69 @@
+#include "pch.h"
+#include "targets.h"
+#include <format>
+
+int target_rank(const std::string& name) {
+	if (name == "sse4.2")														// x86-64-v2, also has popcnt
+		return 1;
+	if (name == "avx2")															// x86-64-v3, also has lzcnt, bmi1 and bmi2
+		return 2;
+	return 0;
+}
+
+std::string target_symbol(const std::string& function, const std::string& target) {
+	return function + "." + (target.empty() ? "default" : target);
+}
+
+void enable_target(const std::string& name, CompilerOptions& options) {
+	int rank = target_rank(name);
+	if (rank >= 1)
+		options.popcnt = true;
+	if (rank >= 2) {
+		options.avx2 = true;
+		options.lzcnt = true;
+		options.bmi = true;
+	}
+}
+
+// Each level also needs everything below it, so the checks stop at the first missing feature. AVX2 also needs the
+// operating system to save the upper halves of the vector registers, which XCR0 bits 1 and 2 tell.
+std::string cpu_features_routine() {
+	std::string routine = "_cpu_features:\n";
+	for (const char* instruction : {
+		"push %rbx",															// cpuid writes %rbx, which callers keep
+		"xor %r8d, %r8d",
+		"xor %eax, %eax",
+		"cpuid",
+		"mov %eax, %r9d",														// Highest basic leaf
+		"mov $1, %eax",
+		"cpuid",
+		"mov %ecx, %r10d",
+		"and $0x900000, %ecx",													// SSE4.2 and POPCNT
+		"cmp $0x900000, %ecx",
+		"jne _cpu_features_done",
+		"or $1, %r8d",
+		"and $0x18000000, %r10d",												// OSXSAVE and AVX
+		"cmp $0x18000000, %r10d",
+		"jne _cpu_features_done",
+		"cmp $7, %r9d",
+		"jb _cpu_features_done",
+		"xor %ecx, %ecx",
+		"xgetbv",
+		"and $6, %eax",
+		"cmp $6, %eax",
+		"jne _cpu_features_done",
+		"mov $7, %eax",
+		"xor %ecx, %ecx",
+		"cpuid",
+		"and $0x128, %ebx",														// AVX2, BMI1 and BMI2
+		"cmp $0x128, %ebx",
+		"jne _cpu_features_done",
+		"mov $0x80000001, %eax",
+		"cpuid",
+		"test $0x20, %ecx",														// LZCNT
+		"jz _cpu_features_done",
+		"or $2, %r8d" })
+		routine += std::format("\t{0}\n", instruction);
+	routine += "_cpu_features_done:\n\tmov %r8d, %eax\n\tpop %rbx\n\tret\n";
+	return routine;
+}
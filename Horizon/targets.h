@@ -0,0 +1,12 @@
+#pragma once
+#include <string>
+#include "options.h"
+
+// Instruction set levels a function can be compiled for next to the SSE2 baseline, as in
+// fn sum(n -> isize) -> isize targets("sse4.2", "avx2") { ... }. Every level is a variant of its own,
+// and the one a CPU runs is picked the first time the function is called.
+
+int target_rank(const std::string& name);										// Higher ranks need more of the CPU and are preferred, 0 if not a target
+std::string target_symbol(const std::string& function, const std::string& target);	// Label of the variant, the baseline is function.default
+void enable_target(const std::string& name, CompilerOptions& options);			// Turns on the instruction sets the level guarantees
+std::string cpu_features_routine();												// Assembly of _cpu_features, which sets bit rank - 1 of %rax for every level the CPU runs
@@ -4,12 +4,12 @@
 enum TokenType {
 	TOKEN_L_PAR, TOKEN_R_PAR, TOKEN_L_BRACE, TOKEN_R_BRACE, TOKEN_L_BRACK, TOKEN_R_BRACK, TOKEN_COMMA,		// SINGLE CHARACTER TOKENS
 	TOKEN_DOT, TOKEN_MINUS, TOKEN_PLUS, TOKEN_SEMICOLON, TOKEN_SLASH, TOKEN_STAR, TOKEN_CAP, TOKEN_TILDE,	//
-	TOKEN_PERCENT, TOKEN_AMPERSAND, TOKEN_PIPE,																//
+	TOKEN_PERCENT, TOKEN_AMPERSAND, TOKEN_PIPE, TOKEN_COLON,												//
 
 	TOKEN_BANG, TOKEN_BANG_EQUAL, TOKEN_EQUAL, TOKEN_EQUAL_EQUAL, TOKEN_GREATER, TOKEN_OR,					//
 	TOKEN_GREATER_EQUAL, TOKEN_LESS, TOKEN_LESS_EQUAL, TOKEN_PLUS_EQUAL, TOKEN_MINUS_EQUAL,					// DOUBLE CHARACTER TOKENS
 	TOKEN_STAR_EQUAL, TOKEN_SLASH_EQUAL, TOKEN_PLUS_PLUS, TOKEN_MINUS_MINUS, TOKEN_AND,						//
-	TOKEN_R_SHIFT, TOKEN_L_SHIFT, TOKEN_ARROW, TOKEN_PERCENT_EQUAL,
+	TOKEN_R_SHIFT, TOKEN_L_SHIFT, TOKEN_ARROW, TOKEN_PERCENT_EQUAL, TOKEN_DOT_DOT,
 
 	TOKEN_ID, TOKEN_STR, TOKEN_BOOL, TOKEN_KEYWORD, TOKEN_TYPE,												// TYPE TOKENS
 	TOKEN_INT, TOKEN_FLOAT,
@@ -31,5 +31,6 @@ public:
 	int line = 0;
 	int start_idx = 0;
 	int end_idx = 0;
+	int column = 0;															// Of the first character, counted from 1
 
 };
\ No newline at end of file
@@ -0,0 +1,183 @@
+#include "pch.h"
+#include "trace.h"
+#include <format>
+#include <fstream>
+#include <cstdint>
+
+std::vector<std::string> trace_hook(int function, bool is_exit, int capacity) {
+	std::vector<std::string> hook;
+	if (is_exit)
+		hook.push_back("mov %rax, %r11");										// The return value
+	for (const std::string& instruction : {
+		std::string("rdtsc"),
+		std::string("shl $32, %rdx"),
+		std::string("or %rdx, %rax"),
+		std::string("mov %fs:_trace_head@tpoff, %rcx"),							// Events written by this thread so far
+		std::string("mov %rcx, %rdx"),
+		std::format("and ${0}, %edx", capacity - 1),
+		std::string("shl $4, %rdx"),
+		std::string("add %fs:0, %rdx"),											// The thread pointer, thread local blocks lie below it
+		std::string("mov %rax, _trace_buffer@tpoff(%rdx)"),
+		std::format("movl ${0}, _trace_buffer@tpoff+8(%rdx)", function),
+		std::format("movl ${0}, _trace_buffer@tpoff+12(%rdx)", is_exit ? 1 : 0),
+		std::string("inc %rcx"),
+		std::string("mov %rcx, %fs:_trace_head@tpoff") })
+		hook.push_back(instruction);
+	if (is_exit)
+		hook.push_back("mov %r11, %rax");
+	return hook;
+}
+
+static std::string quote(const std::string& value) {
+	std::string quoted;
+	for (char character : value) {
+		if (character == '"' || character == '\\')
+			quoted += '\\';
+		quoted += character;
+	}
+	return "\"" + quoted + "\"";
+}
+
+std::string trace_data(const std::vector<std::string>& functions, const std::string& path, int capacity) {
+	std::string data = std::format(".section .tbss,\"awT\",@nobits\n.align 16\n_trace_buffer:\n\t.zero {0}\n"
+		"_trace_head:\n\t.zero 8\n", 16 * (long long)capacity);
+	data += std::format(".data\n.align 8\n_trace_header:\n\t.ascii \"HZTRACE1\"\n\t.quad {0}\n\t.zero 48\n"
+		"_trace_clock:\n\t.zero 16\n", functions.size());
+	data += ".section .rodata\n_trace_names:\n";
+	for (const std::string& function : functions)
+		data += "\t.string " + quote(function) + "\n";
+	data += "_trace_names_end:\n_trace_path:\n\t.string " + quote(path) + "\n_trace_mode:\n\t.string \"wb\"\n";
+	return data;
+}
+
+std::string trace_routines(int capacity) {
+	std::string routines;
+	auto emit = [&](const std::string& instruction) {
+		routines += instruction.ends_with(":") ? instruction + "\n" : "\t" + instruction + "\n";
+	};
+	for (const char* line : {
+		"_trace_now:",															// CLOCK_MONOTONIC nanoseconds in %rax and the timestamp counter in %rdx
+		"sub $8, %rsp",
+		"mov $1, %edi",
+		"lea _trace_clock(%rip), %rsi",
+		"call clock_gettime",
+		"imul $1000000000, _trace_clock(%rip), %rcx",
+		"add _trace_clock+8(%rip), %rcx",
+		"rdtsc",
+		"shl $32, %rdx",
+		"or %rax, %rdx",
+		"mov %rcx, %rax",
+		"add $8, %rsp",
+		"ret",
+		"_trace_start:",														// Both clocks are read at the start and the end, so timestamps convert to time
+		"sub $8, %rsp",
+		"call _trace_now",
+		"mov %rdx, _trace_header+32(%rip)",
+		"mov %rax, _trace_header+40(%rip)",
+		"lea _trace_dump(%rip), %rdi",
+		"call atexit",
+		"add $8, %rsp",
+		"ret",
+		"_trace_dump:",
+		"push %rbx",
+		"push %r12",
+		"push %r13",
+		"call _trace_now",
+		"mov %rdx, _trace_header+48(%rip)",
+		"mov %rax, _trace_header+56(%rip)",
+		"mov %fs:_trace_head@tpoff, %rax" })
+		emit(line);
+	emit(std::format("mov ${0}, %ecx", capacity));
+	for (const char* line : {
+		"mov %rax, %rdx",
+		"cmp %rcx, %rax",
+		"cmovae %rcx, %rdx",													// Records still in the buffer
+		"mov %rdx, _trace_header+16(%rip)",
+		"mov %rax, %r12",
+		"sub %rdx, %r12",
+		"mov %r12, _trace_header+24(%rip)" })
+		emit(line);
+	emit(std::format("and ${0}, %r12", capacity - 1));							// Slot of the oldest record
+	for (const char* line : {
+		"mov %rdx, %r13",
+		"lea _trace_path(%rip), %rdi",
+		"lea _trace_mode(%rip), %rsi",
+		"call fopen",
+		"test %rax, %rax",
+		"jz _trace_dump_done",
+		"mov %rax, %rbx",
+		"lea _trace_header(%rip), %rdi",
+		"mov $64, %esi",
+		"mov $1, %edx",
+		"mov %rbx, %rcx",
+		"call fwrite",
+		"lea _trace_names(%rip), %rdi",
+		"mov $_trace_names_end - _trace_names, %esi",
+		"mov $1, %edx",
+		"mov %rbx, %rcx",
+		"call fwrite" })
+		emit(line);
+	emit(std::format("mov ${0}, %edx", capacity));								// From the oldest record to the end of the buffer, then the rest
+	for (const char* line : {
+		"sub %r12, %rdx",
+		"cmp %r13, %rdx",
+		"cmova %r13, %rdx",
+		"sub %rdx, %r13",
+		"shl $4, %r12",
+		"mov %fs:0, %rax",
+		"lea _trace_buffer@tpoff(%rax, %r12), %rdi",
+		"mov $16, %esi",
+		"mov %rbx, %rcx",
+		"call fwrite",
+		"mov %fs:0, %rax",
+		"lea _trace_buffer@tpoff(%rax), %rdi",
+		"mov $16, %esi",
+		"mov %r13, %rdx",
+		"mov %rbx, %rcx",
+		"call fwrite",
+		"mov %rbx, %rdi",
+		"call fclose",
+		"_trace_dump_done:",
+		"pop %r13",
+		"pop %r12",
+		"pop %rbx",
+		"ret" })
+		emit(line);
+	return routines;
+}
+
+template <typename T>
+static bool read_value(std::ifstream& file, T& value) {
+	return (bool)file.read(reinterpret_cast<char*>(&value), sizeof(value));
+}
+
+bool trace_to_json(const std::string& path, std::ostream& json) {
+	std::ifstream file(path, std::ios::binary);
+	char magic[8];
+	if (!file || !file.read(magic, 8) || std::string(magic, 8) != "HZTRACE1")
+		return false;
+	uint64_t function_count, record_count, dropped, tsc_start, ns_start, tsc_end, ns_end;
+	if (!read_value(file, function_count) || !read_value(file, record_count) || !read_value(file, dropped) || !read_value(file, tsc_start)
+		|| !read_value(file, ns_start) || !read_value(file, tsc_end) || !read_value(file, ns_end))
+		return false;
+	std::vector<std::string> functions(function_count);
+	for (std::string& function : functions) {
+		if (!std::getline(file, function, '\0'))
+			return false;
+	}
+	double ns_per_tick = tsc_end > tsc_start ? (double)(ns_end - ns_start) / (double)(tsc_end - tsc_start) : 1.0;
+
+	json << "{\"traceEvents\":[";
+	for (uint64_t i = 0; i < record_count; i++) {
+		uint64_t tsc;
+		uint32_t function, event;
+		if (!read_value(file, tsc) || !read_value(file, function) || !read_value(file, event))
+			return false;
+		std::string name = function < functions.size() ? functions[function] : std::to_string(function);
+		double microseconds = (double)(int64_t)(tsc - tsc_start) * ns_per_tick / 1000.0;
+		json << (i > 0 ? ",\n" : "\n") << std::format("{{\"name\":\"{0}\",\"ph\":\"{1}\",\"ts\":{2:.3f},\"pid\":1,\"tid\":1}}",
+			name, event ? 'E' : 'B', microseconds);
+	}
+	json << std::format("\n],\"displayTimeUnit\":\"ns\",\"otherData\":{{\"dropped\":{0}}}}}\n", dropped);	// Events the ring overwrote
+	return true;
+}
@@ -0,0 +1,19 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <ostream>
+
+// Function entry and exit tracing. With -ftrace every function stores a record of 16 bytes, the rdtsc
+// timestamp, its id and 0 on entry or 1 on exit, into a ring buffer in thread local storage. Each thread only
+// writes its own buffer, so the hooks need no locks or atomics. Without -ftrace nothing at all is emitted.
+//
+// When the program exits the buffer of the main thread is written out:
+//	"HZTRACE1", function count, record count, dropped records					8 bytes each
+//	rdtsc and CLOCK_MONOTONIC nanoseconds at the start, then at the end			8 bytes each
+//	function names, each ending with a 0 byte, in the order of their ids
+//	records, oldest first
+
+std::vector<std::string> trace_hook(int function, bool is_exit, int capacity);	// Instructions that record an event, they keep %rax
+std::string trace_data(const std::vector<std::string>& functions, const std::string& path, int capacity);	// The buffer, the header and the names
+std::string trace_routines(int capacity);										// Assembly of _trace_start, which main calls first, and _trace_dump
+bool trace_to_json(const std::string& path, std::ostream& json);				// Converts a trace to Chrome trace event JSON, false if it can't be read
@@ -0,0 +1,263 @@
+#include "pch.h"
+#include "unroll.h"
+#include "ast_util.h"
+#include "vectorize.h"
+
+using std::shared_ptr, std::make_shared, std::dynamic_pointer_cast;
+
+void LoopUnroller::run() {
+	if (!options.unroll_loops)
+		return;
+	for (shared_ptr<Statement>& stmt : ast->statements) {
+		if (stmt && stmt->type == VARIABLE_DECL)
+			globals.insert(dynamic_pointer_cast<VariableDeclaration>(stmt)->variable_name);
+	}
+	for (shared_ptr<Statement>& stmt : ast->statements) {
+		if (stmt && stmt->type == FUNCTION_STM) {
+			shared_ptr<Statement> body = dynamic_pointer_cast<Function>(stmt)->statement;
+			unroll_statement(body);
+		}
+	}
+}
+
+static shared_ptr<Compound> as_compound(const shared_ptr<Statement>& statement) {	// Every copy of a body gets its own scope
+	if (statement && statement->type == COMPOUND_STM)
+		return dynamic_pointer_cast<Compound>(statement);
+	shared_ptr<Compound> block = make_shared<Compound>();
+	if (statement)
+		block->statements.push_back(statement);
+	return block;
+}
+
+void LoopUnroller::unroll_statement(shared_ptr<Statement>& statement) {
+	if (!statement)
+		return;
+	switch (statement->type)
+	{
+	case COMPOUND_STM:
+		for (shared_ptr<Statement>& stmt : dynamic_pointer_cast<Compound>(statement)->statements)
+			unroll_statement(stmt);
+		break;
+	case IF_STATEMENT: {
+		shared_ptr<IfStatement> if_stmt = dynamic_pointer_cast<IfStatement>(statement);
+		unroll_statement(if_stmt->body);
+		unroll_statement(if_stmt->else_body);
+		break;
+	}
+	case MATCH_STM: {
+		shared_ptr<MatchStatement> match_stmt = dynamic_pointer_cast<MatchStatement>(statement);
+		for (MatchArm& arm : match_stmt->arms)
+			unroll_statement(arm.body);
+		unroll_statement(match_stmt->default_body);
+		break;
+	}
+	case WHILE_STM:
+	case DO_WHILE_STM:
+		unroll_statement(dynamic_pointer_cast<WhileStatement>(statement)->body);
+		break;
+	case FOR_STM: {
+		shared_ptr<ForStatement> loop = dynamic_pointer_cast<ForStatement>(statement);
+		unroll_statement(loop->body);											// Inner loops first, the outer one then sees their final size
+		CountedLoop counted;
+		VectorLoop vector_loop;
+		if (!match_counted_loop(loop, counted) || plan_vector_loop(loop, options, vector_loop))	// Vector lanes already do several iterations at once
+			break;
+		long long entries, iterations;
+		bool profiled = profile && profile->loop_counts(loop->site, entries, iterations);
+		if (profiled && iterations == 0)										// Never iterated, copies would only grow the code
+			break;
+		int body_size = std::max(1, statement_size(loop->body));
+		int trips;
+		bool known_trips = trip_count(counted, trips);
+		if (known_trips && trips * body_size <= options.unroll_full_size) {
+			statement = unroll_fully(loop, counted, trips);
+			break;
+		}
+		bool counts_up = (counted.comparison == TOKEN_LESS || counted.comparison == TOKEN_LESS_EQUAL) && counted.step > 0;
+		bool counts_down = (counted.comparison == TOKEN_GREATER || counted.comparison == TOKEN_GREATER_EQUAL) && counted.step < 0;
+		if (!(counts_up || counts_down) || !is_invariant(counted.bound, loop))
+			break;
+		int factor = options.unroll_factor;
+		if (known_trips)
+			factor = std::min(factor, trips);
+		else if (profiled)														// More copies than the usual trip count only run the remainder loop
+			factor = (int)std::min<long long>(factor, iterations / entries);
+		int size = profiled && profile->is_hot_loop(iterations, options.profile_hot_percent) ? options.unroll_hot_size : options.unroll_size;
+		while (factor > 1 && factor * body_size > size)							// Stay inside the code size budget
+			factor--;
+		if (factor > 1)
+			statement = unroll_partially(loop, counted, factor);
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+bool LoopUnroller::match_counted_loop(const shared_ptr<ForStatement>& loop, CountedLoop& counted) {
+	if (!loop->initializer || loop->initializer->type != VARIABLE_DECL || !loop->condition || loop->condition->type != BINARY_EXPR
+		|| !loop->post || loop->post->type != VARIABLE_ASSIGN)
+		return false;
+	shared_ptr<VariableDeclaration> init = dynamic_pointer_cast<VariableDeclaration>(loop->initializer);
+	if (!init->is_init)
+		return false;
+	counted.induction = init->variable_name;
+	counted.start = init->optional_to_assign;
+
+	auto is_induction = [&](const shared_ptr<Expression>& expression) {
+		return expression && expression->type == NAME && dynamic_pointer_cast<Name>(expression)->name == counted.induction;
+	};
+
+	shared_ptr<BinaryExpression> condition = dynamic_pointer_cast<BinaryExpression>(loop->condition);
+	counted.comparison = condition->operator_type;
+	if (is_induction(condition->expression_a))
+		counted.bound = condition->expression_b;
+	else if (is_induction(condition->expression_b)) {							// bound > i is i < bound
+		counted.bound = condition->expression_a;
+		switch (condition->operator_type)
+		{
+		case TOKEN_LESS:			counted.comparison = TOKEN_GREATER; break;
+		case TOKEN_LESS_EQUAL:		counted.comparison = TOKEN_GREATER_EQUAL; break;
+		case TOKEN_GREATER:			counted.comparison = TOKEN_LESS; break;
+		case TOKEN_GREATER_EQUAL:	counted.comparison = TOKEN_LESS_EQUAL; break;
+		default:					break;
+		}
+	}
+	else
+		return false;
+	if (counted.comparison != TOKEN_LESS && counted.comparison != TOKEN_LESS_EQUAL && counted.comparison != TOKEN_GREATER
+		&& counted.comparison != TOKEN_GREATER_EQUAL && counted.comparison != TOKEN_BANG_EQUAL)
+		return false;
+
+	shared_ptr<VariableAssignment> post = dynamic_pointer_cast<VariableAssignment>(loop->post);
+	if (post->variable_name != counted.induction)
+		return false;
+	long long step = 0;
+	if (post->is_compound) {
+		switch (post->compound_type)
+		{
+		case INCREMENT:		step = 1; break;
+		case DECREMENT:		step = -1; break;
+		case ADDITION:		if (!evaluate_constant(post->to_assign, step)) return false; break;
+		case SUBTRACTION:	if (!evaluate_constant(post->to_assign, step)) return false; step = -step; break;
+		default:			return false;
+		}
+	}
+	else {																		// i = i + c, i = c + i or i = i - c
+		if (!post->to_assign || post->to_assign->type != BINARY_EXPR)
+			return false;
+		shared_ptr<BinaryExpression> update = dynamic_pointer_cast<BinaryExpression>(post->to_assign);
+		bool matched = false;
+		if (update->operator_type == TOKEN_PLUS && is_induction(update->expression_a))
+			matched = evaluate_constant(update->expression_b, step);
+		else if (update->operator_type == TOKEN_PLUS && is_induction(update->expression_b))
+			matched = evaluate_constant(update->expression_a, step);
+		else if (update->operator_type == TOKEN_MINUS && is_induction(update->expression_a)) {
+			matched = evaluate_constant(update->expression_b, step);
+			step = -step;
+		}
+		if (!matched)
+			return false;
+	}
+	if (step == 0)
+		return false;
+	counted.step = step;
+
+	return !exits_loop(loop->body) && !writes_name(loop->body, counted.induction)	// Copies must run back to back with known values of i
+		&& !writes_name(counted.bound, counted.induction);
+}
+
+bool LoopUnroller::trip_count(const CountedLoop& counted, int& trips) {
+	long long value, bound;
+	if (!evaluate_constant(counted.start, value) || !evaluate_constant(counted.bound, bound))
+		return false;
+	trips = 0;
+	while (true) {
+		bool runs;
+		switch (counted.comparison)
+		{
+		case TOKEN_LESS:			runs = value < bound; break;
+		case TOKEN_LESS_EQUAL:		runs = value <= bound; break;
+		case TOKEN_GREATER:			runs = value > bound; break;
+		case TOKEN_GREATER_EQUAL:	runs = value >= bound; break;
+		default:					runs = value != bound; break;
+		}
+		if (!runs)
+			return true;
+		if (++trips > options.unroll_full_max_trips)
+			return false;
+		value += counted.step;
+	}
+}
+
+shared_ptr<Statement> LoopUnroller::unroll_fully(const shared_ptr<ForStatement>& loop, const CountedLoop& counted, int trips) {
+	long long start;
+	evaluate_constant(counted.start, start);
+	shared_ptr<Compound> unrolled = make_shared<Compound>();
+	for (int i = 0; i < trips; i++) {
+		shared_ptr<Statement> copy = as_compound(clone_statement(loop->body));
+		replace_name(copy, counted.induction, make_shared<Constant>(start + i * counted.step));
+		unrolled->statements.push_back(copy);
+	}
+	return unrolled;
+}
+
+shared_ptr<Statement> LoopUnroller::unroll_partially(const shared_ptr<ForStatement>& loop, const CountedLoop& counted, int factor) {
+	shared_ptr<Compound> unrolled = make_shared<Compound>();					// The induction variable outlives both loops
+	unrolled->statements.push_back(loop->initializer);
+
+	shared_ptr<ForStatement> main_loop = make_shared<ForStatement>();			// Runs while a whole group of iterations fits
+	main_loop->initializer = make_shared<EmptyStatement>();
+	shared_ptr<Expression> last = make_shared<BinaryExpression>(make_shared<Name>(counted.induction), TOKEN_PLUS,
+		make_shared<Constant>((factor - 1) * counted.step));
+	main_loop->condition = make_shared<BinaryExpression>(last, counted.comparison, clone_expression(counted.bound));
+	shared_ptr<VariableAssignment> post = make_shared<VariableAssignment>();
+	post->variable_name = counted.induction;
+	post->is_compound = true;
+	post->compound_type = ADDITION;
+	post->to_assign = make_shared<Constant>(factor * counted.step);
+	main_loop->post = post;
+	shared_ptr<Compound> body = make_shared<Compound>();
+	for (int i = 0; i < factor; i++) {
+		shared_ptr<Statement> copy = as_compound(clone_statement(loop->body));
+		if (i > 0)
+			replace_name(copy, counted.induction, make_shared<BinaryExpression>(make_shared<Name>(counted.induction), TOKEN_PLUS,
+				make_shared<Constant>(i * counted.step)));
+		body->statements.push_back(copy);
+	}
+	main_loop->body = body;
+	unrolled->statements.push_back(main_loop);
+
+	shared_ptr<ForStatement> remainder = make_shared<ForStatement>();			// The original loop finishes the last iterations
+	remainder->initializer = make_shared<EmptyStatement>();
+	remainder->condition = loop->condition;
+	remainder->post = loop->post;
+	remainder->body = loop->body;
+	unrolled->statements.push_back(remainder);
+	return unrolled;
+}
+
+bool LoopUnroller::is_invariant(const shared_ptr<Expression>& expression, const shared_ptr<ForStatement>& loop) {
+	if (!expression)
+		return false;
+	switch (expression->type)
+	{
+	case CONSTANT_EXPR:
+		return true;
+	case NAME: {
+		const std::string& name = dynamic_pointer_cast<Name>(expression)->name;
+		if (writes_name(loop->body, name) || writes_name(loop->post, name))
+			return false;
+		return globals.find(name) == globals.end() || !contains_call(loop->body);	// Calls may write any global
+	}
+	case UNARY_EXPR:
+		return is_invariant(dynamic_pointer_cast<UnaryExpression>(expression)->expression, loop);
+	case BINARY_EXPR: {
+		shared_ptr<BinaryExpression> binary = dynamic_pointer_cast<BinaryExpression>(expression);
+		return is_invariant(binary->expression_a, loop) && is_invariant(binary->expression_b, loop);
+	}
+	default:
+		break;
+	}
+	return false;
+}
@@ -0,0 +1,37 @@
+#pragma once
+#include <memory>
+#include <string>
+#include <unordered_set>
+#include "parser.h"
+#include "options.h"
+#include "profile.h"
+
+class LoopUnroller {
+public:
+	LoopUnroller(const std::shared_ptr<AST>& ast, const CompilerOptions& options, const Profile* profile = nullptr) :
+		ast(ast), options(options), profile(profile) {}
+
+	const std::shared_ptr<AST>& ast;
+	void run();																	// Unrolls counted for loops in every function
+private:
+	const CompilerOptions& options;
+	const Profile* profile;
+
+	std::unordered_set<std::string> globals;
+
+	class CountedLoop {															// for let i = start; i <op> bound; i += step
+	public:
+		std::string induction;
+		std::shared_ptr<Expression> start;
+		std::shared_ptr<Expression> bound;
+		TokenType comparison;													// Comparison with the induction variable on the left side
+		long long step = 0;
+	};
+
+	void unroll_statement(std::shared_ptr<Statement>& statement);
+	bool match_counted_loop(const std::shared_ptr<ForStatement>& loop, CountedLoop& counted);
+	bool trip_count(const CountedLoop& counted, int& trips);					// False if the bounds aren't constant or there are too many iterations
+	std::shared_ptr<Statement> unroll_fully(const std::shared_ptr<ForStatement>& loop, const CountedLoop& counted, int trips);
+	std::shared_ptr<Statement> unroll_partially(const std::shared_ptr<ForStatement>& loop, const CountedLoop& counted, int factor);
+	bool is_invariant(const std::shared_ptr<Expression>& expression, const std::shared_ptr<ForStatement>& loop);	// True if the loop can't change the value
+};
@@ -0,0 +1,301 @@
+#include "pch.h"
+#include "vectorize.h"
+#include "ast_util.h"
+#include <unordered_set>
+
+using std::shared_ptr, std::make_shared, std::dynamic_pointer_cast;
+
+static bool is_name(const shared_ptr<Expression>& expression, const std::string& name) {
+	return expression && expression->type == NAME && dynamic_pointer_cast<Name>(expression)->name == name;
+}
+
+bool element_offset(const shared_ptr<Expression>& index, const std::string& induction, long long& offset) {
+	offset = 0;
+	if (is_name(index, induction))
+		return true;
+	if (!index || index->type != BINARY_EXPR)
+		return false;
+	shared_ptr<BinaryExpression> binary = dynamic_pointer_cast<BinaryExpression>(index);
+	if (binary->operator_type == TOKEN_PLUS && is_name(binary->expression_a, induction))
+		return evaluate_constant(binary->expression_b, offset);
+	if (binary->operator_type == TOKEN_PLUS && is_name(binary->expression_b, induction))
+		return evaluate_constant(binary->expression_a, offset);
+	if (binary->operator_type == TOKEN_MINUS && is_name(binary->expression_a, induction) && evaluate_constant(binary->expression_b, offset)) {
+		offset = -offset;
+		return true;
+	}
+	return false;
+}
+
+static bool same_expression(const shared_ptr<Expression>& a, const shared_ptr<Expression>& b) {	// Structural equality of lane expressions
+	if (!a || !b || a->type != b->type)
+		return false;
+	switch (a->type)
+	{
+	case CONSTANT_EXPR:
+		return dynamic_pointer_cast<Constant>(a)->value == dynamic_pointer_cast<Constant>(b)->value;
+	case NAME:
+		return dynamic_pointer_cast<Name>(a)->name == dynamic_pointer_cast<Name>(b)->name;
+	case INDEX_EXPR:
+		return dynamic_pointer_cast<IndexExpression>(a)->array_name == dynamic_pointer_cast<IndexExpression>(b)->array_name
+			&& same_expression(dynamic_pointer_cast<IndexExpression>(a)->index, dynamic_pointer_cast<IndexExpression>(b)->index);
+	case UNARY_EXPR:
+		return dynamic_pointer_cast<UnaryExpression>(a)->operator_type == dynamic_pointer_cast<UnaryExpression>(b)->operator_type
+			&& same_expression(dynamic_pointer_cast<UnaryExpression>(a)->expression, dynamic_pointer_cast<UnaryExpression>(b)->expression);
+	case BINARY_EXPR: {
+		shared_ptr<BinaryExpression> binary_a = dynamic_pointer_cast<BinaryExpression>(a);
+		shared_ptr<BinaryExpression> binary_b = dynamic_pointer_cast<BinaryExpression>(b);
+		return binary_a->operator_type == binary_b->operator_type && same_expression(binary_a->expression_a, binary_b->expression_a)
+			&& same_expression(binary_a->expression_b, binary_b->expression_b);
+	}
+	default:
+		break;
+	}
+	return false;
+}
+
+class LaneAccesses {															// What the lane expressions of a loop read
+public:
+	std::unordered_set<std::string> names;
+	std::vector<std::pair<std::string, long long>> elements;					// Array and offset from i
+};
+
+static bool lane_expression(const shared_ptr<Expression>& expression, const std::string& induction, LaneAccesses& accesses) {	// Has the same meaning in every lane
+	if (!expression)
+		return false;
+	switch (expression->type)
+	{
+	case CONSTANT_EXPR:
+		return true;
+	case NAME:
+		if (is_name(expression, induction))
+			return false;														// Would need a vector of consecutive values
+		accesses.names.insert(dynamic_pointer_cast<Name>(expression)->name);
+		return true;
+	case INDEX_EXPR: {
+		shared_ptr<IndexExpression> element = dynamic_pointer_cast<IndexExpression>(expression);
+		long long offset;
+		if (!element_offset(element->index, induction, offset))
+			return false;
+		accesses.elements.push_back({ element->array_name, offset });
+		return true;
+	}
+	case UNARY_EXPR: {
+		shared_ptr<UnaryExpression> unary = dynamic_pointer_cast<UnaryExpression>(expression);
+		return unary->operator_type == TOKEN_MINUS && lane_expression(unary->expression, induction, accesses);
+	}
+	case BINARY_EXPR: {
+		shared_ptr<BinaryExpression> binary = dynamic_pointer_cast<BinaryExpression>(expression);
+		if (binary->operator_type != TOKEN_PLUS && binary->operator_type != TOKEN_MINUS && binary->operator_type != TOKEN_STAR)
+			return false;
+		return lane_expression(binary->expression_a, induction, accesses) && lane_expression(binary->expression_b, induction, accesses);
+	}
+	default:
+		break;
+	}
+	return false;
+}
+
+static bool match_reduction(const shared_ptr<VariableAssignment>& assignment, VectorOperation& operation) {	// s += e, s -= e, s = s + e, s = e + s and s = s - e
+	operation.kind = VECTOR_SUM;
+	operation.target = assignment->variable_name;
+	if (assignment->is_compound) {
+		if (assignment->compound_type != ADDITION && assignment->compound_type != SUBTRACTION)
+			return false;
+		operation.subtract = assignment->compound_type == SUBTRACTION;
+		operation.value = assignment->to_assign;
+		return true;
+	}
+	if (!assignment->to_assign || assignment->to_assign->type != BINARY_EXPR)
+		return false;
+	shared_ptr<BinaryExpression> update = dynamic_pointer_cast<BinaryExpression>(assignment->to_assign);
+	if (update->operator_type == TOKEN_PLUS && is_name(update->expression_b, operation.target))
+		operation.value = update->expression_a;
+	else if ((update->operator_type == TOKEN_PLUS || update->operator_type == TOKEN_MINUS) && is_name(update->expression_a, operation.target)) {
+		operation.value = update->expression_b;
+		operation.subtract = update->operator_type == TOKEN_MINUS;
+	}
+	else
+		return false;
+	return true;
+}
+
+static bool match_min_max(const shared_ptr<IfStatement>& if_stmt, VectorOperation& operation) {	// if e < s -> { s = e; } and its variants
+	if (if_stmt->has_else || !if_stmt->condition || if_stmt->condition->type != BINARY_EXPR)
+		return false;
+	shared_ptr<Statement> body = if_stmt->body;
+	if (body && body->type == COMPOUND_STM && dynamic_pointer_cast<Compound>(body)->statements.size() == 1)
+		body = dynamic_pointer_cast<Compound>(body)->statements[0];
+	if (!body || body->type != EXPR_STM)
+		return false;
+	shared_ptr<Expression> store = dynamic_pointer_cast<ExpressionStatement>(body)->expression;
+	if (!store || store->type != VARIABLE_ASSIGN)
+		return false;
+	shared_ptr<VariableAssignment> assignment = dynamic_pointer_cast<VariableAssignment>(store);
+	if (assignment->index || !assignment->field.empty() || assignment->is_compound)
+		return false;
+	operation.target = assignment->variable_name;
+	operation.value = assignment->to_assign;
+
+	shared_ptr<BinaryExpression> condition = dynamic_pointer_cast<BinaryExpression>(if_stmt->condition);
+	bool value_first;															// e < s or s < e
+	if (is_name(condition->expression_b, operation.target) && same_expression(condition->expression_a, operation.value))
+		value_first = true;
+	else if (is_name(condition->expression_a, operation.target) && same_expression(condition->expression_b, operation.value))
+		value_first = false;
+	else
+		return false;
+	switch (condition->operator_type)
+	{
+	case TOKEN_LESS:
+	case TOKEN_LESS_EQUAL:
+		operation.kind = value_first ? VECTOR_MIN : VECTOR_MAX;
+		return true;
+	case TOKEN_GREATER:
+	case TOKEN_GREATER_EQUAL:
+		operation.kind = value_first ? VECTOR_MAX : VECTOR_MIN;
+		return true;
+	default:
+		break;
+	}
+	return false;
+}
+
+static bool collect_operations(const shared_ptr<Statement>& statement, const std::string& induction, const CompilerOptions& options,
+	std::vector<VectorOperation>& operations) {
+	if (!statement)
+		return true;
+	switch (statement->type)
+	{
+	case EMPTY_STM:
+		return true;
+	case COMPOUND_STM:
+		for (shared_ptr<Statement>& stmt : dynamic_pointer_cast<Compound>(statement)->statements) {
+			if (!collect_operations(stmt, induction, options, operations))
+				return false;
+		}
+		return true;
+	case IF_STATEMENT: {
+		VectorOperation operation;
+		if (!options.avx2 || !match_min_max(dynamic_pointer_cast<IfStatement>(statement), operation))	// SSE2 has no 64 bit compare
+			return false;
+		operations.push_back(operation);
+		return true;
+	}
+	case EXPR_STM: {
+		shared_ptr<Expression> expression = dynamic_pointer_cast<ExpressionStatement>(statement)->expression;
+		if (!expression || expression->type != VARIABLE_ASSIGN)
+			return false;
+		shared_ptr<VariableAssignment> assignment = dynamic_pointer_cast<VariableAssignment>(expression);
+		VectorOperation operation;
+		if (!assignment->field.empty())											// Fields of structs stay scalar
+			return false;
+		if (!assignment->index) {
+			if (!match_reduction(assignment, operation))
+				return false;
+			operations.push_back(operation);
+			return true;
+		}
+		if (!is_name(assignment->index, induction))
+			return false;
+		operation.kind = VECTOR_STORE;
+		operation.target = assignment->variable_name;
+		shared_ptr<Expression> element = make_shared<IndexExpression>(operation.target, make_shared<Name>(induction));
+		if (!assignment->is_compound)
+			operation.value = assignment->to_assign;
+		else {
+			switch (assignment->compound_type)
+			{
+			case ADDITION:			operation.value = make_shared<BinaryExpression>(element, TOKEN_PLUS, assignment->to_assign); break;
+			case SUBTRACTION:		operation.value = make_shared<BinaryExpression>(element, TOKEN_MINUS, assignment->to_assign); break;
+			case MULTIPLICATION:	operation.value = make_shared<BinaryExpression>(element, TOKEN_STAR, assignment->to_assign); break;
+			case INCREMENT:			operation.value = make_shared<BinaryExpression>(element, TOKEN_PLUS, make_shared<Constant>(1)); break;
+			case DECREMENT:			operation.value = make_shared<BinaryExpression>(element, TOKEN_MINUS, make_shared<Constant>(1)); break;
+			default:				return false;
+			}
+		}
+		operations.push_back(operation);
+		return true;
+	}
+	default:
+		break;
+	}
+	return false;
+}
+
+bool plan_vector_loop(const shared_ptr<ForStatement>& loop, const CompilerOptions& options, VectorLoop& plan) {
+	if (!options.vectorize || !loop->condition || loop->condition->type != BINARY_EXPR || !loop->post || loop->post->type != VARIABLE_ASSIGN)
+		return false;
+	shared_ptr<BinaryExpression> condition = dynamic_pointer_cast<BinaryExpression>(loop->condition);
+	shared_ptr<VariableAssignment> post = dynamic_pointer_cast<VariableAssignment>(loop->post);
+	plan.induction = post->variable_name;
+	if (post->index || !post->field.empty())
+		return false;
+	if (is_name(condition->expression_a, plan.induction) && (condition->operator_type == TOKEN_LESS || condition->operator_type == TOKEN_LESS_EQUAL)) {
+		plan.bound = condition->expression_b;
+		plan.comparison = condition->operator_type;
+	}
+	else if (is_name(condition->expression_b, plan.induction) && (condition->operator_type == TOKEN_GREATER || condition->operator_type == TOKEN_GREATER_EQUAL)) {
+		plan.bound = condition->expression_a;
+		plan.comparison = condition->operator_type == TOKEN_GREATER ? TOKEN_LESS : TOKEN_LESS_EQUAL;
+	}
+	else
+		return false;
+
+	long long step = 0;															// i += 1, i++ or i = i + 1
+	if (post->is_compound && post->compound_type == INCREMENT)
+		step = 1;
+	else if (post->is_compound && post->compound_type == ADDITION)
+		evaluate_constant(post->to_assign, step);
+	else if (!post->is_compound)
+		element_offset(post->to_assign, plan.induction, step);
+	if (step != 1)
+		return false;
+
+	plan.operations.clear();
+	if (!collect_operations(loop->body, plan.induction, options, plan.operations) || plan.operations.empty())
+		return false;
+
+	LaneAccesses accesses;
+	std::unordered_set<std::string> stored, reduced;
+	for (VectorOperation& operation : plan.operations) {
+		if (!lane_expression(operation.value, plan.induction, accesses))
+			return false;
+		if (operation.kind == VECTOR_STORE)
+			stored.insert(operation.target);
+		else if (operation.target == plan.induction || !reduced.insert(operation.target).second)
+			return false;														// One reduction per variable, each lane keeps its own partial result
+	}
+	for (const std::string& name : accesses.names) {							// Values broadcast once must not change in the loop
+		if (reduced.contains(name) || stored.contains(name))
+			return false;
+	}
+	for (auto& [array, offset] : accesses.elements) {							// Lanes of one iteration must not read what another one stores
+		if (reduced.contains(array) || (stored.contains(array) && offset != 0))
+			return false;
+	}
+	if (has_side_effects(plan.bound) || writes_name(loop->body, plan.induction))
+		return false;
+	for (const std::string& name : stored) {
+		if (reduced.contains(name))
+			return false;
+	}
+	std::vector<shared_ptr<Expression>> pending = { plan.bound };				// The bound must not depend on anything the loop writes
+	while (!pending.empty()) {
+		shared_ptr<Expression> expression = pending.back();
+		pending.pop_back();
+		if (!expression)
+			continue;
+		if (expression->type == NAME && (reduced.contains(dynamic_pointer_cast<Name>(expression)->name) || stored.contains(dynamic_pointer_cast<Name>(expression)->name)))
+			return false;
+		if (expression->type == INDEX_EXPR || expression->type == CALL_EXPR || expression->type == INLINED_CALL_EXPR)
+			return false;
+		if (expression->type == UNARY_EXPR)
+			pending.push_back(dynamic_pointer_cast<UnaryExpression>(expression)->expression);
+		else if (expression->type == BINARY_EXPR) {
+			pending.push_back(dynamic_pointer_cast<BinaryExpression>(expression)->expression_a);
+			pending.push_back(dynamic_pointer_cast<BinaryExpression>(expression)->expression_b);
+		}
+	}
+	return true;
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include <memory>
+#include <string>
+#include <vector>
+#include "parser.h"
+#include "options.h"
+
+// Recognizes counted for loops whose iterations only touch element i of arrays, so that
+// consecutive iterations can run in the lanes of one SSE2 or AVX2 register. The code generator
+// emits the vector loop and leaves the remaining iterations to the original scalar loop.
+
+enum VectorOperationKind {
+	VECTOR_STORE,																// a[i] = value
+	VECTOR_SUM,																	// s += value, or s -= value if subtract is set
+	VECTOR_MIN,																	// if value < s -> { s = value; }
+	VECTOR_MAX
+};
+
+class VectorOperation {
+public:
+	VectorOperationKind kind;
+	std::string target;															// Stored array or reduction variable
+	std::shared_ptr<Expression> value;											// Computed in every lane, see lane_expression in vectorize.cpp
+	bool subtract = false;
+};
+
+class VectorLoop {
+public:
+	std::string induction;
+	std::shared_ptr<Expression> bound;
+	TokenType comparison;														// TOKEN_LESS or TOKEN_LESS_EQUAL, induction on the left side
+	std::vector<VectorOperation> operations;									// In program order
+};
+
+bool plan_vector_loop(const std::shared_ptr<ForStatement>& loop, const CompilerOptions& options, VectorLoop& plan);	// False if the loop must stay scalar
+bool element_offset(const std::shared_ptr<Expression>& index, const std::string& induction, long long& offset);	// Matches i, i + c, c + i and i - c